@@ -0,0 +1,62 @@
+// Concurrent object creation from worker threads, each bound to an arena of
+// its own. Prints the throughput for 1, 2, 4, ... threads.
+//
+//   node alloc-benchmark.js /path/to/pmem/file [objects per thread] [threads]
+const os = require('os');
+const {Worker, isMainThread, parentPort, workerData} =
+    require('worker_threads');
+const jspmdk = require('../src/jspmdk');
+
+if (isMainThread) {
+  var args = process.argv.slice(2);
+  var path = args[0] || '/home/ssg-test/tmp/jspmdk-bench';
+  var count = parseInt(args[1] || '20000');
+  var max_threads = parseInt(args[2] || os.cpus().length);
+
+  var pool = jspmdk.new_pool(path, 1 << 30);
+  if (pool.check() == -1)
+    pool.create();
+  else
+    pool.open();
+
+  var run = function(threads) {
+    return Promise.all(Array.from({length: threads}, () => {
+      return new Promise((resolve, reject) => {
+        var worker = new Worker(__filename, {workerData: {path, count}});
+        worker.on('message', resolve);
+        worker.on('error', reject);
+      });
+    }));
+  };
+
+  (async function() {
+    var base = 0;
+    for (var threads = 1; threads <= max_threads; threads *= 2) {
+      var results = await run(threads);
+      var seconds = Math.max(...results.map((r) => r.seconds));
+      var rate = threads * count / seconds;
+      if (threads == 1) base = rate;
+      var arenas = new Set(results.map((r) => r.arena));
+      console.log(
+          threads + ' threads: ' + Math.round(rate) + ' objects/s, ' +
+          (rate / base).toFixed(2) + 'x, ' + arenas.size + ' arenas');
+      // the objects are not linked from the root
+      pool.gc();
+    }
+    var stats = pool.arena_stats();
+    console.log('arenas in use: ' +
+                stats.arenas.filter((a) => a.size > 0).length);
+    pool.close();
+  })();
+} else {
+  var pool = jspmdk.new_pool(workerData.path, 0);
+  pool.open();
+  var start = process.hrtime.bigint();
+  for (var i = 0; i < workerData.count; ++i) {
+    pool.create_object({id: i, name: 'object', tags: [i, i + 1]});
+  }
+  var seconds = Number(process.hrtime.bigint() - start) / 1e9;
+  var arena = pool.arena_stats().arena;
+  pool.close();
+  parentPort.postMessage({seconds, arena});
+}
@@ -0,0 +1,37 @@
+// The bytes of the pool taken by an empty object, with the internal structs
+// allocated from the default allocation classes of libpmemobj and from the
+// classes of their exact size.
+//
+//   node object-size-benchmark.js /path/to/pmem/file [objects]
+const jspmdk = require('../src/jspmdk');
+
+var args = process.argv.slice(2);
+var path = args[0] || '/home/ssg-test/tmp/jspmdk-size-bench';
+var count = parseInt(args[1] || '100000');
+
+var pool = jspmdk.new_pool(path, 1 << 30);
+if (pool.check() == -1) {
+  pool.create();
+  pool.close();
+}
+
+var measure = function(alloc_classes) {
+  pool.open({stats: true, alloc_classes: alloc_classes});
+  var before = pool.ctl_get('stats.heap.curr_allocated');
+  var objects = [];
+  pool.transaction(() => {
+    for (var i = 0; i < count; ++i) objects.push(pool.create_object({}));
+  });
+  var bytes = pool.ctl_get('stats.heap.curr_allocated') - before;
+  // the objects are not linked from the root, gc() frees them so that the
+  // next measure starts from the same heap
+  pool.gc();
+  pool.close();
+  return bytes / count;
+};
+
+var before = measure(false);
+var after = measure(true);
+console.log('default classes: ' + before.toFixed(1) + ' bytes per object');
+console.log('exact classes:   ' + after.toFixed(1) + ' bytes per object, ' +
+            (100 * (1 - after / before)).toFixed(1) + '% less');
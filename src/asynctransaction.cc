@@ -0,0 +1,211 @@
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "asynctransaction.h"
+#include "persistentarraybuffer.h"
+#include "persistentdeque.h"
+#include "persistentindex.h"
+#include "persistentmap.h"
+#include "persistentobject.h"
+#include "persistentorderedmap.h"
+#include "util.h"
+
+AsyncTransaction::AsyncTransaction(Napi::Env env, PersistentObjectPool* pool)
+    : Napi::AsyncWorker(env),
+      _pool(pool),
+      _mm(pool->getMemoryManager()),
+      _generation(pool->generation()),
+      _deferred(Napi::Promise::Deferred::New(env)) {
+  _refs.push_back(Napi::Persistent(pool->Value()));
+}
+
+Napi::Promise AsyncTransaction::queue(Napi::Env env,
+                                      PersistentObjectPool* pool,
+                                      Napi::Array mutations) {
+  AsyncTransaction* worker = new AsyncTransaction(env, pool);
+  try {
+    for (uint32_t i = 0; i < mutations.Length(); ++i) {
+      worker->addMutation(env, mutations.Get(i).As<Napi::Object>());
+    }
+  } catch (const Napi::Error& error) {
+    delete worker;
+    throw;
+  }
+  worker->_seen.clear();
+  worker->_built.assign(worker->_nodes.size(), PPTR_NULL);
+  Napi::Promise promise = worker->_deferred.Promise();
+  pool->_async_transactions += 1;
+  worker->Queue();
+  return promise;
+}
+
+void AsyncTransaction::addMutation(Napi::Env env, Napi::Object mutation) {
+  std::string op = mutation.Get("op").As<Napi::String>().Utf8Value();
+  Napi::Value target = mutation.Get("target");
+  if (!PersistentObject::isInstance(target)) {
+    throw Napi::Error::New(env, "invalid mutation target");
+  }
+  PersistentObject* wrapper =
+      Napi::ObjectWrap<PersistentObject>::Unwrap(target.As<Napi::Object>());
+  if (wrapper->_generation != _generation) {
+    throw Napi::Error::New(env, "stale handle, read it again");
+  }
+  _refs.push_back(Napi::Persistent(target.As<Napi::Object>()));
+  Mutation m = {kPush, nullptr, false, 0, "", 0};
+  m.target = wrapper->_impl;
+  if (op == "push") {
+    m.node = addNode(env, mutation.Get("arg"));
+  } else if (op == "set" || op == "del") {
+    // arg is {key: value} like for _set_property()
+    Napi::Object arg = mutation.Get("arg").As<Napi::Object>();
+    Napi::Value key = arg.GetPropertyNames().Get((uint32_t)0);
+    if (key.IsString()) {
+      m.key = key.As<Napi::String>().Utf8Value();
+    } else {
+      m.indexed = true;
+      m.index = key.As<Napi::Number>().Uint32Value();
+    }
+    if (op == "set") {
+      m.kind = kSet;
+      m.node = addNode(env, arg.Get(key));
+    } else {
+      m.kind = kDel;
+    }
+  } else {
+    throw Napi::Error::New(env, "invalid mutation");
+  }
+  _mutations.push_back(m);
+}
+
+size_t AsyncTransaction::addNode(Napi::Env env, Napi::Value value) {
+  Node node = {kInline, PPTR_NULL, "", 0, {}, false, {}};
+  if (value.IsString()) {
+    node.str = value.As<Napi::String>().Utf8Value();
+    if (node.str.empty()) {
+      node.pptr = PPTR_EMPTY_STRING;
+    } else {
+      node.kind = kString;
+    }
+  } else if (value.IsBigInt()) {
+    Napi::BigInt bigint = value.As<Napi::BigInt>();
+    size_t word_count = bigint.WordCount();
+    node.kind = kBigInt;
+    node.words.resize(word_count);
+    bigint.ToWords(&node.sign, &word_count, node.words.data());
+  } else if (value.IsArrayBuffer() || value.IsTypedArray() ||
+             value.IsDataView() || value.IsFunction() || value.IsPromise() ||
+             PersistentMap::isJSMapOrSet(env, value)) {
+    throw Napi::Error::New(env, "unsupported type");
+  } else if (value.IsObject() && !value.IsDate() &&
+             !PersistentObject::isInstance(value) &&
+             !PersistentArrayBuffer::isInstance(value) &&
+             !PersistentMap::isInstance(value) &&
+             !PersistentDeque::isInstance(value) &&
+             !PersistentOrderedMap::isInstance(value) &&
+             !PersistentIndex::isInstance(value)) {
+    for (auto it = _seen.begin(); it != _seen.end(); ++it) {
+      if (it->first == value) return it->second;
+    }
+    node.kind = kObject;
+    node.is_array = value.IsArray();
+    size_t index = _nodes.size();
+    _nodes.push_back(node);
+    _seen.emplace_back(value, index);
+    Napi::Object obj = value.As<Napi::Object>();
+    Napi::Array names = obj.GetPropertyNames();
+    for (uint32_t i = 0; i < names.Length(); ++i) {
+      Napi::Value key = names.Get(i);
+      Prop prop = {false, 0, "", 0};
+      if (key.IsString()) {
+        prop.key = key.As<Napi::String>().Utf8Value();
+      } else {
+        prop.indexed = true;
+        prop.index = key.As<Napi::Number>().Uint32Value();
+      }
+      prop.node = addNode(env, obj.Get(key));
+      _nodes[index].props.push_back(prop);
+    }
+    return index;
+  } else {
+    // inline values and existing persistent objects, nothing is allocated
+    node.pptr = *((PPtr*)_pool->persist(env, value).get());
+  }
+  _nodes.push_back(node);
+  return _nodes.size() - 1;
+}
+
+// runs inside the transaction, on the worker thread
+PPtr AsyncTransaction::build(size_t index) {
+  const Node& node = _nodes[index];
+  if (node.kind == kInline) {
+    return node.pptr;
+  } else if (node.kind == kString) {
+    return _mm->persistString(node.str);
+  } else if (node.kind == kBigInt) {
+    return *((PPtr*)_pool->_impl
+                 ->persistBigInt(node.sign, node.words.data(),
+                                 node.words.size())
+                 .get());
+  }
+  if (!PPTR_EQUALS(_built[index], PPTR_NULL)) return _built[index];
+  internal::PMObject obj(_mm, node.is_array);
+  _built[index] = *((PPtr*)obj.getPPtr().get());
+  for (auto it = node.props.begin(); it != node.props.end(); ++it) {
+    std::shared_ptr<const void> value = std::make_shared<PPtr>(build(it->node));
+    if (it->indexed) {
+      obj.setProperty(it->index, value, kNotSnapshot);
+    } else {
+      obj.setProperty(it->key, value, kNotSnapshot);
+    }
+  }
+  return _built[index];
+}
+
+void AsyncTransaction::Execute() {
+  // the threads of libuv allocate from arenas of their own too
+  _mm->bindArena();
+  // waits for the other threads to leave the pool
+  if (_mm->tx_begin() != 0) {
+    SetError("failed to begin transaction");
+    return;
+  }
+  try {
+    // a defrag() on another thread moved the objects since they were read
+    if (_mm->defragGeneration() != _generation) {
+      throw "stale handle, read it again";
+    }
+    for (auto it = _mutations.begin(); it != _mutations.end(); ++it) {
+      if (it->kind == kPush) {
+        it->target->push(std::make_shared<PPtr>(build(it->node)));
+      } else if (it->kind == kSet && it->indexed) {
+        it->target->setProperty(it->index,
+                                std::make_shared<PPtr>(build(it->node)));
+      } else if (it->kind == kSet) {
+        it->target->setProperty(it->key,
+                                std::make_shared<PPtr>(build(it->node)));
+      } else if (it->indexed) {
+        it->target->delProperty(it->index);
+      } else {
+        it->target->delProperty(it->key);
+      }
+    }
+    _mm->tx_commit();
+  } catch (const char* errmsg) {
+    _mm->tx_abort_context();
+    _mm->tx_end();
+    SetError(errmsg);
+    return;
+  }
+  if (_mm->tx_end() != 0) SetError("transaction aborted");
+}
+
+void AsyncTransaction::OnOK() {
+  _pool->_async_transactions -= 1;
+  _deferred.Resolve(Env().Undefined());
+}
+
+void AsyncTransaction::OnError(const Napi::Error& error) {
+  _pool->_async_transactions -= 1;
+  _deferred.Reject(error.Value());
+}
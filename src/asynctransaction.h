@@ -0,0 +1,80 @@
+#ifndef ASYNCTRANSACTION_H
+#define ASYNCTRANSACTION_H
+
+#include <napi.h>
+#include <string>
+#include <vector>
+
+#include "internal/pmobject.h"
+#include "persistentobjectpool.h"
+
+// Applies a batch of set/del/push mutations to persistent objects in one
+// transaction on a libuv worker thread. The values are converted on the main
+// thread, the objects and strings they need are allocated on the worker
+// inside the transaction.
+class AsyncTransaction : public Napi::AsyncWorker {
+ public:
+  // mutations is an Array of {op, target, arg}, see transaction_async() in
+  // jspmdk.js
+  static Napi::Promise queue(Napi::Env env, PersistentObjectPool* pool,
+                             Napi::Array mutations);
+
+ protected:
+  void Execute() override;
+  void OnOK() override;
+  void OnError(const Napi::Error& error) override;
+
+ private:
+  enum NodeKind { kInline, kString, kBigInt, kObject };
+  enum MutationKind { kSet, kDel, kPush };
+
+  // a property of an object node, keyed like PMObject::setProperty()
+  struct Prop {
+    bool indexed;
+    uint32_t index;
+    std::string key;
+    size_t node;
+  };
+
+  // A value to persist. Inline values and existing persistent objects are
+  // kInline and need no allocation; a JS object met twice is one node.
+  struct Node {
+    NodeKind kind;
+    PPtr pptr;
+    std::string str;
+    int sign;
+    std::vector<uint64_t> words;
+    bool is_array;
+    std::vector<Prop> props;
+  };
+
+  struct Mutation {
+    MutationKind kind;
+    internal::PMObject* target;
+    bool indexed;
+    uint32_t index;
+    std::string key;
+    size_t node;
+  };
+
+  AsyncTransaction(Napi::Env env, PersistentObjectPool* pool);
+  void addMutation(Napi::Env env, Napi::Object mutation);
+  size_t addNode(Napi::Env env, Napi::Value value);
+  PPtr build(size_t node);
+
+  PersistentObjectPool* _pool;
+  internal::MemoryManager* _mm;
+  // the defrag generation the targets and the nodes were read in
+  uint64_t _generation;
+  Napi::Promise::Deferred _deferred;
+  // the pool and the targets stay alive until the promise settles
+  std::vector<Napi::ObjectReference> _refs;
+  std::vector<Mutation> _mutations;
+  std::vector<Node> _nodes;
+  // the JS objects converted so far, and their nodes
+  std::vector<std::pair<Napi::Value, size_t>> _seen;
+  // the PPtr of each node once built, PPTR_NULL before
+  std::vector<PPtr> _built;
+};
+
+#endif
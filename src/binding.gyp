@@ -8,12 +8,21 @@
 								"persistentobjectpool.cc",
 								"persistentobject.cc",
 								"persistentarraybuffer.cc",
+								"persistentmap.cc",
+								"persistentdeque.cc",
+								"persistentorderedmap.cc",
+								"persistentindex.cc",
+								"asynctransaction.cc",
 								"internal/memorymanager.cc",
 								"internal/pmdict.cc",
 								"internal/pmarray.cc",
 								"internal/pmobjectpool.cc",
 								"internal/pmobject.cc",
 								"internal/pmarraybuffer.cc",
+								"internal/pmmap.cc",
+								"internal/pmbtree.cc",
+								"internal/pmdeque.cc",
+								"internal/pmindex.cc",
 						],
 						
 						"include_dirs": [
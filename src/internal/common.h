@@ -3,6 +3,7 @@
 
 #include <libpmemobj.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 
 typedef PMEMoid PPtr;
@@ -14,6 +15,10 @@ typedef PMEMoid PPtr;
 #define ARRAY_ITEMS_TYPE_NUM 30
 #define PDICTKEYSOBJECT_TYPE_NUM 40
 #define PNUMDICTKEYSOBJECT_TYPE_NUM 50
+#define ARRAY_CHUNKS_TYPE_NUM 60
+#define PMAPKEYSOBJECT_TYPE_NUM 70
+#define DEQUE_BLOCKS_TYPE_NUM 80
+#define BTREE_NODES_TYPE_NUM 90
 #define INTERNAL_ABORT_ERRNO 99999
 
 enum TYPE_CODE {
@@ -29,6 +34,19 @@ enum TYPE_CODE {
   TYPE_CODE_DICT,
   TYPE_CODE_ARRAY,
   TYPE_CODE_NUMDICT,
+  TYPE_CODE_MAP,
+  TYPE_CODE_SET,
+  // Pointer, a Date keeps its time value in off like TYPE_CODE_NUMBER. A
+  // BigInt keeps its value in off if it fits an int64_t, otherwise it is a
+  // PBigIntObject with this ob_type.
+  TYPE_CODE_DATE,
+  TYPE_CODE_BIGINT,
+  // Container type
+  TYPE_CODE_DEQUE,
+  TYPE_CODE_BTREE,
+  TYPE_CODE_INDEX,
+  // a PArrayObject whose slots are the doubles of its numbers
+  TYPE_CODE_DOUBLE_ARRAY,
   TYPE_CODE_INTERNAL_MAX,
 };
 
@@ -64,22 +82,68 @@ struct PStringObject {
   PObject ob_base;
 };
 
+// a BigInt beyond int64_t, its magnitude in ob_words little endian words
+struct PBigIntObject {
+  PObject ob_base;
+  uint32_t ob_sign;
+  uint32_t ob_words;
+  uint64_t ob_digits[1];
+};
+
+// Element type of a typed array, in the order of napi_typedarray_type.
+enum ELEMENT_KIND {
+  ELEMENT_KIND_NONE,
+  ELEMENT_KIND_INT8,
+  ELEMENT_KIND_UINT8,
+  ELEMENT_KIND_UINT8_CLAMPED,
+  ELEMENT_KIND_INT16,
+  ELEMENT_KIND_UINT16,
+  ELEMENT_KIND_INT32,
+  ELEMENT_KIND_UINT32,
+  ELEMENT_KIND_FLOAT32,
+  ELEMENT_KIND_FLOAT64,
+  ELEMENT_KIND_MAX,
+};
+
 struct PArrayBufferObject {
   PObject ob_base;
   uint32_t ob_length;
+  // ELEMENT_KIND_NONE for a plain ArrayBuffer
+  uint32_t ob_kind;
+};
+
+// The first OBJECT_INLINE_PROPS named properties of an object live in
+// ob_props, the others in extra_props. A free slot has a PPTR_NULL key. An
+// array has no ob_props, it is allocated with OBJECT_ARRAY_SIZE bytes.
+#define OBJECT_INLINE_PROPS 4
+
+struct PInlineProp {
+  PPtr key; /* PStringObject */
+  PPtr value;
 };
 
 struct PObjectObject {
   PObject ob_base;
+  // PPTR_NULL until the first element is stored
   PPtr elements;
+  // PPTR_NULL until a named property does not fit in ob_props
   PPtr extra_props;
   uint64_t is_array;
+  // PPTR_NULL, or a PArrayObject of the PIndexObject of an array
+  PPtr indexes;
+  PInlineProp ob_props[OBJECT_INLINE_PROPS];
 };
 
+#define OBJECT_ARRAY_SIZE offsetof(PObjectObject, ob_props)
+
 struct PDictObject {
   PObject ob_base;
   uint64_t ma_used;
   PPtr ma_keys; /* PDictKeysObject */
+  // While a resize is in progress, the key table being drained into ma_keys
+  // and the number of its slots already migrated. ma_used counts both.
+  PPtr ma_oldkeys; /* PDictKeysObject */
+  uint64_t ma_migrated;
 };
 
 struct PDictKeyEntry {
@@ -88,22 +152,61 @@ struct PDictKeyEntry {
   PPtr me_value;
 };
 
+// PDictKeysObject keeps one control byte per slot in front of the entries,
+// so that a probe can test DK_GROUP_WIDTH slots at once without touching the
+// entries. A control byte is either CTRL_EMPTY, CTRL_DELETED, or the lowest 7
+// bits of the hash of the key in that slot.
+#define DK_GROUP_WIDTH 16
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+
 struct PDictKeysObject {
   uint64_t dk_size;
   int64_t dk_usable;
-  PDictKeyEntry dk_entries[1];
+  // dk_size control bytes rounded up to DK_GROUP_WIDTH (the padding stays
+  // CTRL_EMPTY), followed by dk_size PDictKeyEntry, see DK_ENTRIES()
+  int8_t dk_ctrl[DK_GROUP_WIDTH];
 };
 
+#define DK_CTRL_SIZE(size) \
+  (((size) + DK_GROUP_WIDTH - 1) & ~((uint64_t)DK_GROUP_WIDTH - 1))
+// the bytes of a PDictKeysObject of size slots
+#define DK_OBJECT_SIZE(size)                                  \
+  (offsetof(PDictKeysObject, dk_ctrl) + DK_CTRL_SIZE(size) + \
+   sizeof(PDictKeyEntry) * (size))
+// the size of the key table of a new PDictObject
+#define DK_MIN_SIZE 8
+#define DK_ENTRIES(keys) \
+  ((PDictKeyEntry *)((keys)->dk_ctrl + DK_CTRL_SIZE((keys)->dk_size)))
+
+// The items of a PArrayObject are kept in chunks of ARRAY_CHUNK_SIZE slots,
+// ob_items points to the directory of the chunks. Only the first chunk may be
+// smaller, it grows geometrically until it is full so that small arrays stay
+// small. Slots from ob_size onward are always PPTR_NULL.
+//
+// While every item is a number and there is no hole, the array is a
+// TYPE_CODE_DOUBLE_ARRAY and its slots are 8-byte doubles instead of PPtrs,
+// the first other write moves the items to PPtr slots.
+#define ARRAY_CHUNK_SHIFT 9
+#define ARRAY_CHUNK_SIZE ((uint64_t)1 << ARRAY_CHUNK_SHIFT)
+#define ARRAY_CHUNK_MASK (ARRAY_CHUNK_SIZE - 1)
+#define ARRAY_CHUNK_COUNT(allocated) \
+  (((allocated) + ARRAY_CHUNK_SIZE - 1) >> ARRAY_CHUNK_SHIFT)
+
 struct PArrayObject{
   PVarObject ob_base;
-  PPtr ob_items;
-  uint64_t allocated;
+  PPtr ob_items; /* PPtr[ob_chunks], one per chunk */
+  uint64_t allocated; /* slots in all chunks */
+  uint64_t ob_chunks; /* capacity of the directory */
 };
 
 struct PNumDictObject {
   PVarObject ob_base;
   uint64_t ma_used;
   PPtr ma_keys;
+  // same as PDictObject::ma_oldkeys and PDictObject::ma_migrated
+  PPtr ma_oldkeys;
+  uint64_t ma_migrated;
 };
 
 struct PNumDictKeyEntry {
@@ -120,16 +223,114 @@ struct PNumDictKeysObject {
   PNumDictKeyEntry dk_entries[1];
 };
 
+// PMapObject backs both Map and Set (a Set stores PPTR_TRUE as values). Keys
+// may be any primitive, compared like SameValueZero. Entries are appended in
+// insertion order and located through dk_indices, an open addressing table of
+// dk_size entry indexes. A deleted entry keeps its place with a PPTR_NULL
+// key until the next resize compacts the entries.
+struct PMapObject {
+  PObject ob_base;
+  uint64_t ma_used;
+  PPtr ma_keys; /* PMapKeysObject */
+};
+
+struct PMapEntry {
+  uint64_t me_hash;
+  PPtr me_key;
+  PPtr me_value;
+};
+
+#define MK_IX_EMPTY (-1)
+#define MK_IX_DUMMY (-2)
+
+struct PMapKeysObject {
+  uint64_t dk_size;
+  int64_t dk_usable;
+  uint64_t dk_nentries;
+  // dk_size indexes, followed by the entries, see MK_ENTRIES()
+  int64_t dk_indices[1];
+};
+
+#define MK_ENTRIES(keys) ((PMapEntry *)((keys)->dk_indices + (keys)->dk_size))
+
+// PDequeObject is a ring of dq_capacity slots split into blocks of
+// DEQUE_BLOCK_SIZE slots, dq_blocks points to the directory of the blocks.
+// The items are at the positions [dq_head, dq_tail), position p lives in
+// slot p & (dq_capacity - 1). A push, pop, shift or unshift moves only one of
+// dq_head and dq_tail, so it is failure-atomic with a single 8-byte store.
+// Growing doubles the directory and moves no more than one block of items.
+#define DEQUE_BLOCK_SHIFT 6
+#define DEQUE_BLOCK_SIZE ((uint64_t)1 << DEQUE_BLOCK_SHIFT)
+#define DEQUE_BLOCK_MASK (DEQUE_BLOCK_SIZE - 1)
+
+struct PDequeObject {
+  PObject ob_base;
+  uint64_t dq_head;
+  uint64_t dq_tail;
+  uint64_t dq_capacity; /* power of two, at least DEQUE_BLOCK_SIZE */
+  PPtr dq_blocks;       /* PPtr[dq_capacity >> DEQUE_BLOCK_SHIFT] */
+};
+
+// PBTreeObject is a B+tree ordered by key, numbers first by value and then
+// strings by code point. bt_root is a leaf while bt_height is 1. A leaf keeps
+// bn_count keys with their values in bn_slots and links to the next leaf in
+// bn_next. An inner node keeps bn_count keys and bn_count + 1 children in
+// bn_slots, child i holds the keys in [bn_keys[i - 1], bn_keys[i]).
+// A node is 1000 bytes, so along with its 16-byte allocation header it fits
+// in 1KiB, four 256-byte XPLines. Its keys come first so that a search reads
+// few cache lines.
+#define BTREE_NODE_KEYS 30
+
+struct PBTreeNode {
+  uint32_t bn_leaf;
+  uint32_t bn_count;
+  PPtr bn_next;
+  PPtr bn_keys[BTREE_NODE_KEYS];
+  PPtr bn_slots[BTREE_NODE_KEYS + 1];
+};
+
+struct PBTreeObject {
+  PObject ob_base;
+  uint64_t bt_size;
+  uint64_t bt_height;
+  PPtr bt_root; /* PBTreeNode */
+};
+
+// PIndexObject is a secondary index of the records in the array ix_collection
+// by their property named ix_field. ix_table maps a value of the property to
+// the record, or to a PArrayObject of the records unless INDEX_FLAG_UNIQUE. It
+// is a PMapObject, or a PBTreeObject if INDEX_FLAG_ORDERED. ix_records maps
+// each record, by its PPtr, to the value it is indexed by.
+#define INDEX_FLAG_UNIQUE 1
+#define INDEX_FLAG_ORDERED 2
+
+struct PIndexObject {
+  PObject ob_base;
+  uint64_t ix_flags;
+  PPtr ix_collection; /* PObjectObject */
+  PPtr ix_field;      /* PStringObject */
+  PPtr ix_table;
+  PPtr ix_records; /* PMapObject */
+};
+
 #define PPTR_EQUALS(lhs, rhs) \
   ((lhs).off == (rhs).off && (lhs).pool_uuid_lo == (rhs).pool_uuid_lo)
 
 #define PPTR_IS_NUMBER(pptr) (pptr.pool_uuid_lo == TYPE_CODE_NUMBER)
 
-#define TYPE_CODE_IS_CONTAINER(type_code) \
-  (type_code > TYPE_CODE_NUMBER && type_code < TYPE_CODE_INTERNAL_MAX)
+// whether pptr holds its value rather than points to an object
+#define PPTR_IS_INLINE(pptr)                     \
+  ((pptr).pool_uuid_lo == TYPE_CODE_SINGLETON || \
+   (pptr).pool_uuid_lo == TYPE_CODE_NUMBER ||    \
+   (pptr).pool_uuid_lo == TYPE_CODE_DATE ||      \
+   (pptr).pool_uuid_lo == TYPE_CODE_BIGINT)
+
+#define TYPE_CODE_IS_CONTAINER(type_code)                                  \
+  (type_code > TYPE_CODE_NUMBER && type_code < TYPE_CODE_INTERNAL_MAX && \
+   type_code != TYPE_CODE_DATE && type_code != TYPE_CODE_BIGINT)
 
-// TODO: validate that pool_uuid_lo must not be equal to TYPE_CODE_SINGLETON and
-// TYPE_CODE_NUMBER
+// TODO: validate that pool_uuid_lo must not be equal to any of the pointer
+// type codes
 const PPtr PPTR_NULL = {pool_uuid_lo : 0, off : 0};
 const PPtr PPTR_DUMMY = {pool_uuid_lo : 0, off : 1};
 const PPtr PPTR_TRUE = {
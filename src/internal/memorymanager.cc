@@ -1,38 +1,309 @@
 #include <assert.h>
+#include <ctype.h>
 #include <libpmemobj.h>
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
 #include <list>
 #include <map>
+#include <mutex>
 #include <set>
 #include <string>
+#include <vector>
 
 using namespace std;
 
 #include "memorymanager.h"
 #include "pmarray.h"
+#include "pmbtree.h"
+#include "pmdeque.h"
 #include "pmdict.h"
+#include "pmindex.h"
+#include "pmmap.h"
 #include "pmobject.h"
 
+// the objects moved by one pmemobj_defrag() call, in one redo log
+#define DEFRAG_SLICE_OBJECTS 4096
+
 bool operator<(const PPtr& a, const PPtr& b) {
   return (a.pool_uuid_lo < b.pool_uuid_lo ||
           (a.pool_uuid_lo == b.pool_uuid_lo && a.off < b.off));
 }
 
 namespace internal {
+static std::atomic<uint64_t> next_id(1);
+// the open pools by their real path
+static std::mutex registry_mutex;
+static map<string, MemoryManager*> registry;
+
+static string realPath(const string& path) {
+  char* resolved = realpath(path.c_str(), NULL);
+  if (resolved == NULL) return path;
+  string result(resolved);
+  ::free(resolved);
+  return result;
+}
+
+enum CtlType { kCtlInt, kCtlLongLong, kCtlUint64, kCtlUnsigned };
+
+struct CtlEntry {
+  const char* name;
+  CtlType type;
+};
+
+// the ctl entries of libpmemobj that hold a number, by the type of their
+// argument
+static const CtlEntry ctl_entries[] = {
+    {"prefault.at_create", kCtlInt},
+    {"prefault.at_open", kCtlInt},
+    {"sds.at_create", kCtlInt},
+    {"copy_on_write.at_open", kCtlInt},
+    {"tx.cache.size", kCtlLongLong},
+    {"tx.cache.threshold", kCtlLongLong},
+    {"tx.post_commit.queue_depth", kCtlInt},
+    {"tx.debug.skip_expensive_checks", kCtlInt},
+    {"tx.debug.verify_user_buffers", kCtlInt},
+    {"stats.enabled", kCtlInt},
+    {"stats.heap.curr_allocated", kCtlUint64},
+    {"stats.heap.run_allocated", kCtlUint64},
+    {"stats.heap.run_active", kCtlUint64},
+    {"heap.size.granularity", kCtlUint64},
+    {"heap.narenas.total", kCtlUnsigned},
+    {"heap.narenas.max", kCtlUnsigned},
+    {"heap.narenas.automatic", kCtlUnsigned},
+    {"heap.thread.arena_id", kCtlUnsigned},
+    {"heap.arena.*.size", kCtlUint64},
+    {"heap.arena.*.automatic", kCtlInt},
+};
+
+// whether name matches pattern, where a * stands for a decimal index
+static bool ctlMatch(const char* pattern, const char* name) {
+  while (*pattern != '\0') {
+    if (*pattern == '*') {
+      if (!isdigit(*name)) return false;
+      while (isdigit(*name)) ++name;
+      ++pattern;
+    } else if (*pattern++ != *name++) {
+      return false;
+    }
+  }
+  return *name == '\0';
+}
+
+static const CtlEntry* ctlFind(const string& name) {
+  for (size_t i = 0; i < sizeof(ctl_entries) / sizeof(ctl_entries[0]); ++i) {
+    if (ctlMatch(ctl_entries[i].name, name.c_str())) return &ctl_entries[i];
+  }
+  throw "unsupported ctl";
+}
+
+// Sets a global ctl entry, like prefault.at_open, for its scope and restores
+// it at the end, so that it only applies to the pool opened meanwhile.
+class GlobalCtl {
+ public:
+  GlobalCtl(const char* name, int value) : _name(name), _set(false) {
+    if (value < 0) return;
+    if (pmemobj_ctl_get(NULL, name, &_old) != 0 ||
+        pmemobj_ctl_set(NULL, name, &value) != 0) {
+      throw "failed to set ctl";
+    }
+    _set = true;
+  }
+  ~GlobalCtl() {
+    if (_set) pmemobj_ctl_set(NULL, _name, &_old);
+  }
+
+ private:
+  const char* _name;
+  int _old;
+  bool _set;
+};
+
+// The structs of fixed size that every object, array and dict allocates, by
+// their type number. PNumDictObject shares the class of arrays.
+static const struct {
+  int type_num;
+  size_t size;
+} class_structs[] = {
+    {POBJ_TYPE_NUM, sizeof(PObjectObject)},
+    {POBJ_TYPE_NUM, OBJECT_ARRAY_SIZE},
+    {POBJ_TYPE_NUM, sizeof(PDictObject)},
+    {POBJ_TYPE_NUM, sizeof(PArrayObject)},
+    {PDICTKEYSOBJECT_TYPE_NUM, DK_OBJECT_SIZE(DK_MIN_SIZE)},
+};
+static_assert(sizeof(PNumDictObject) == OBJECT_ARRAY_SIZE,
+              "PNumDictObject needs a class of its own");
+
+// the header of an allocation with POBJ_HEADER_COMPACT
+#define COMPACT_HEADER_SIZE 16
+// allocations per run of a class, a run of the largest class above is 60KiB
+#define CLASS_UNITS_PER_BLOCK 256
+
 int MemoryManager::check(std::string path, std::string layout) {
   return pmemobj_check(path.c_str(), layout.c_str());
 }
 
-MemoryManager::MemoryManager(std::string path, std::string layout) {
-  _pool = pmemobj_open(path.c_str(), layout.c_str());
-  if (_pool == NULL) throw "failed to open pool";
+MemoryManager* MemoryManager::acquire(std::string path, std::string layout,
+                                      const PoolOptions& options) {
+  lock_guard<mutex> guard(registry_mutex);
+  string key = realPath(path);
+  map<string, MemoryManager*>::iterator it = registry.find(key);
+  if (it != registry.end()) {
+    if (it->second->_layout != layout) throw "failed to open pool";
+    it->second->applyOptions(options);
+    it->second->_refs += 1;
+    it->second->attachThread();
+    return it->second;
+  }
+  MemoryManager* mm = new MemoryManager(path, layout, options);
+  mm->_key = key;
+  registry[key] = mm;
+  mm->attachThread();
+  return mm;
+}
+
+MemoryManager* MemoryManager::acquire(std::string path, std::string layout,
+                                      uint32_t poolsize, mode_t mode,
+                                      const PoolOptions& options) {
+  lock_guard<mutex> guard(registry_mutex);
+  // fails if the pool exists, open or not
+  MemoryManager* mm = new MemoryManager(path, layout, poolsize, mode, options);
+  mm->_key = realPath(path);
+  registry[mm->_key] = mm;
+  mm->attachThread();
+  return mm;
+}
+
+void MemoryManager::release(MemoryManager* mm) {
+  mm->group_end();
+  // the objects the thread has reserved are linked from nowhere
+  mm->cancelReserved();
+  mm->detachThread();
+  lock_guard<mutex> guard(registry_mutex);
+  if (--mm->_refs > 0) return;
+  registry.erase(mm->_key);
+  mm->close();
+  delete mm;
 }
 
 MemoryManager::MemoryManager(std::string path, std::string layout,
-                             uint32_t poolsize, mode_t mode) {
-  _pool = pmemobj_create(path.c_str(), layout.c_str(), poolsize, mode);
+                             const PoolOptions& options)
+    : _id(next_id++), _layout(layout), _refs(1) {
+  {
+    GlobalCtl prefault("prefault.at_open", options.prefault);
+    _pool = pmemobj_open(path.c_str(), layout.c_str());
+  }
+  if (_pool == NULL) throw "failed to open pool";
+  try {
+    if (options.alloc_classes) registerAllocClasses();
+    applyOptions(options);
+  } catch (const char* errmsg) {
+    pmemobj_close(_pool);
+    throw;
+  }
+  initLock();
+}
 
+MemoryManager::MemoryManager(std::string path, std::string layout,
+                             uint32_t poolsize, mode_t mode,
+                             const PoolOptions& options)
+    : _id(next_id++), _layout(layout), _refs(1) {
+  {
+    GlobalCtl prefault("prefault.at_create", options.prefault);
+    _pool = pmemobj_create(path.c_str(), layout.c_str(), poolsize, mode);
+  }
   if (_pool == NULL) throw "failed to create pool";
+  try {
+    if (options.alloc_classes) registerAllocClasses();
+    applyOptions(options);
+  } catch (const char* errmsg) {
+    pmemobj_close(_pool);
+    throw;
+  }
+  initLock();
+}
+
+// the options that apply to an open pool
+void MemoryManager::applyOptions(const PoolOptions& options) {
+  if (options.tx_cache_size >= 0) {
+    long long size = options.tx_cache_size;
+    if (pmemobj_ctl_set(_pool, "tx.cache.size", &size) != 0) {
+      throw "failed to set ctl";
+    }
+  }
+  if (options.stats_enabled >= 0) {
+    int enabled = options.stats_enabled;
+    if (pmemobj_ctl_set(_pool, "stats.enabled", &enabled) != 0) {
+      throw "failed to set ctl";
+    }
+  }
+  if (options.post_commit_worker && !_post_commit.joinable()) {
+    // the worker has nothing to do without a queue
+    int depth = 0;
+    if (pmemobj_ctl_get(_pool, "tx.post_commit.queue_depth", &depth) != 0) {
+      throw "failed to set ctl";
+    }
+    if (depth == 0) {
+      depth = 256;
+      if (pmemobj_ctl_set(_pool, "tx.post_commit.queue_depth", &depth) != 0) {
+        throw "failed to set ctl";
+      }
+    }
+    PMEMobjpool* pool = _pool;
+    // returns once tx.post_commit.stop is read in close()
+    _post_commit = std::thread(
+        [pool]() { pmemobj_ctl_get(pool, "tx.post_commit.worker", NULL); });
+  }
+}
+
+// The default classes of libpmemobj round the sizes up to their steps, the
+// structs above get classes of their exact size. The classes keep the
+// compact header: gc() and pmemobj_type_num() need the type numbers, which
+// objects without a header lose. Allocation classes are not stored in the
+// pool, so they are registered on every open, the objects allocated with
+// them are freed the same way as the others.
+void MemoryManager::registerAllocClasses() {
+  for (size_t i = 0; i < sizeof(class_structs) / sizeof(class_structs[0]);
+       ++i) {
+    pobj_alloc_class_desc desc;
+    desc.unit_size = class_structs[i].size + COMPACT_HEADER_SIZE;
+    desc.alignment = 0;
+    desc.units_per_block = CLASS_UNITS_PER_BLOCK;
+    desc.header_type = POBJ_HEADER_COMPACT;
+    desc.class_id = 0;
+    // e.g. no class left, the default ones serve the struct then
+    if (pmemobj_ctl_set(_pool, "heap.alloc_class.new.desc", &desc) != 0) {
+      continue;
+    }
+    AllocClass alloc_class = {class_structs[i].type_num, class_structs[i].size,
+                              desc.class_id};
+    _alloc_classes.push_back(alloc_class);
+  }
+}
+
+uint64_t MemoryManager::allocFlags(size_t size, int type_num) {
+  for (size_t i = 0; i < _alloc_classes.size(); ++i) {
+    if (_alloc_classes[i].size == size &&
+        _alloc_classes[i].type_num == type_num) {
+      return POBJ_CLASS_ID(_alloc_classes[i].id);
+    }
+  }
+  return 0;
+}
+
+MemoryManager::~MemoryManager() { pthread_rwlock_destroy(&_lock); }
+
+void MemoryManager::initLock() {
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  // the lock is never taken recursively, see lock()
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&_lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
 }
 
 PPtr MemoryManager::root(size_t size) {
@@ -46,28 +317,50 @@ void* MemoryManager::direct(PPtr pptr) { return pmemobj_direct(pptr); }
 PPtr MemoryManager::pptr(const void* addr) { return pmemobj_oid(addr); }
 
 int MemoryManager::snapshotRange(const void* ptr, size_t size) {
+  TxState& s = state();
   Logger::Debug(
       "MemoryManager::snapshotRange: taking snapshot at (%llu, %llu) with size "
       "= %llu\n",
       pptr(ptr).pool_uuid_lo, pptr(ptr).off, size);
+  // a range of an object allocated in this transaction has nothing to roll
+  // back
+  map<uintptr_t, uintptr_t>::iterator it =
+      s.tx_fresh.upper_bound((uintptr_t)ptr);
+  if (it != s.tx_fresh.begin()) {
+    --it;
+    if ((uintptr_t)ptr + size <= it->second) return 0;
+  }
+  // a construction scope has no undo log to add the range to
+  if (s.reserving) throw "failed to take snapshot";
   return pmemobj_tx_add_range_direct(ptr, size);
 }
 
 bool MemoryManager::inTransaction() {
+  TxState& s = state();
   pobj_tx_stage tx_stage = pmemobj_tx_stage();
-  return (tx_stage == TX_STAGE_WORK);
+  return s.reserving || tx_stage == TX_STAGE_WORK;
 }
 
 void* MemoryManager::tx_zalloc(size_t size, int type_num) {
+  TxState& s = state();
   if (size == 0) return nullptr;
-  PPtr pptr = pmemobj_tx_zalloc(size, type_num);
+  if (s.reserving) {
+    void* addr = reserve(size, type_num);
+    memset(addr, 0, size);
+    return addr;
+  }
+  PPtr pptr = pmemobj_tx_xalloc(size, type_num,
+                                POBJ_XALLOC_ZERO | allocFlags(size, type_num));
   if (PPTR_EQUALS(pptr, PPTR_NULL)) {
     throw "failed allocate memory";
   }
-  return direct(pptr);
+  void* addr = direct(pptr);
+  addFresh(addr, size);
+  return addr;
 }
 
 void* MemoryManager::tz_zrealloc(PPtr pptr, size_t size, int type_num) {
+  TxState& s = state();
   if (size == 0) {
     free(pptr);
     return nullptr;
@@ -75,27 +368,87 @@ void* MemoryManager::tz_zrealloc(PPtr pptr, size_t size, int type_num) {
   if (type_num == NONE_TYPE_NUM) {
     type_num = pmemobj_type_num(pptr);
   }
+  void* old_addr = direct(pptr);
+  if (s.reserving) {
+    void* addr = reserve(size, type_num);
+    size_t copied = pmemobj_alloc_usable_size(pptr);
+    if (copied > size) copied = size;
+    memcpy(addr, old_addr, copied);
+    memset((char*)addr + copied, 0, size - copied);
+    free(pptr);
+    return addr;
+  }
   PPtr pptr_new = pmemobj_tx_zrealloc(pptr, size, type_num);
   if (PPTR_EQUALS(pptr_new, PPTR_NULL)) {
     throw "failed to allocate memory";
   }
-  return direct(pptr_new);
+  // the old object is fresh no more, the new one is fresh if it moved
+  s.tx_fresh.erase((uintptr_t)old_addr);
+  void* addr = direct(pptr_new);
+  if (addr != old_addr) addFresh(addr, size);
+  return addr;
 }
 
 void* MemoryManager::zalloc(size_t size, int type_num) {
   if (size == 0) return nullptr;
   PPtr pptr;
-  pmemobj_zalloc(_pool, &pptr, size, type_num);
+  pmemobj_xalloc(_pool, &pptr, size, type_num,
+                 POBJ_XALLOC_ZERO | allocFlags(size, type_num), NULL, NULL);
   if (PPTR_EQUALS(pptr, PPTR_NULL)) {
     throw "failed allocate memory";
   }
   return direct(pptr);
 }
 
+void* MemoryManager::tx_alloc(size_t size, int type_num) {
+  TxState& s = state();
+  if (size == 0) return nullptr;
+  if (s.reserving) return reserve(size, type_num);
+  PPtr pptr = pmemobj_tx_xalloc(size, type_num, allocFlags(size, type_num));
+  if (PPTR_EQUALS(pptr, PPTR_NULL)) {
+    throw "failed allocate memory";
+  }
+  void* addr = direct(pptr);
+  addFresh(addr, size);
+  return addr;
+}
+
+PPtr MemoryManager::tx_copy(PPtr pptr, size_t size) {
+  void* addr = tx_alloc(size, pmemobj_type_num(pptr));
+  memcpy(addr, direct(pptr), size);
+  return this->pptr(addr);
+}
+
+void* MemoryManager::alloc(size_t size, int type_num,
+                           pmemobj_constr constructor, void* arg) {
+  if (size == 0) return nullptr;
+  PPtr pptr;
+  if (pmemobj_xalloc(_pool, &pptr, size, type_num, allocFlags(size, type_num),
+                     constructor, arg)) {
+    throw "failed allocate memory";
+  }
+  return direct(pptr);
+}
+
 void MemoryManager::persist(const void* addr, size_t length) {
   pmemobj_persist(_pool, addr, length);
 }
 
+// flush() without drain(), so that many ranges share a single fence
+void MemoryManager::flush(const void* addr, size_t length) {
+  pmemobj_flush(_pool, addr, length);
+}
+
+void MemoryManager::drain() { pmemobj_drain(_pool); }
+
+// Copies with non-temporal stores, bypassing the cache for large ranges.
+// The data is durable after the next drain().
+void MemoryManager::memcpyNoDrain(void* dest, const void* src,
+                                  size_t length) {
+  pmemobj_memcpy(_pool, dest, src, length,
+                 PMEMOBJ_F_MEM_NONTEMPORAL | PMEMOBJ_F_MEM_NODRAIN);
+}
+
 PPtr MemoryManager::persistString(std::string str) {
   PStringObject* psobj = nullptr;
   size_t length = sizeof(PStringObject) + str.length() + 1;
@@ -112,46 +465,413 @@ PPtr MemoryManager::persistString(std::string str) {
   return pptr(psobj);
 }
 
-void MemoryManager::tx_enter_context() {
-  int errnum = pmemobj_tx_begin(_pool, NULL, NULL);
-  if (errnum) {
+MemoryManager::TxState& MemoryManager::state() {
+  thread_local map<uint64_t, TxState> states;
+  // most threads use a single pool
+  thread_local uint64_t last_id = 0;
+  thread_local TxState* last = nullptr;
+  if (last_id != _id) {
+    last = &(states[_id]);
+    last_id = _id;
+  }
+  return *last;
+}
+
+void MemoryManager::addFresh(const void* addr, size_t size) {
+  TxState& s = state();
+  s.tx_fresh[(uintptr_t)addr] = (uintptr_t)addr + size;
+}
+
+void* MemoryManager::reserve(size_t size, int type_num) {
+  TxState& s = state();
+  pobj_action action;
+  PPtr pptr = pmemobj_xreserve(_pool, &action, size, type_num,
+                               allocFlags(size, type_num));
+  if (PPTR_EQUALS(pptr, PPTR_NULL)) {
+    throw "failed allocate memory";
+  }
+  void* addr = direct(pptr);
+  s.reserved[(uintptr_t)addr] = action;
+  addFresh(addr, size);
+  return addr;
+}
+
+std::vector<pobj_action> MemoryManager::takeReserved() {
+  TxState& s = state();
+  vector<pobj_action> actions;
+  actions.reserve(s.reserved.size());
+  map<uintptr_t, pobj_action>::iterator it;
+  for (it = s.reserved.begin(); it != s.reserved.end(); ++it) {
+    actions.push_back(it->second);
+  }
+  s.reserved.clear();
+  return actions;
+}
+
+void MemoryManager::cancelReserved() {
+  TxState& s = state();
+  if (s.reserved.empty()) return;
+  vector<pobj_action> actions = takeReserved();
+  pmemobj_cancel(_pool, actions.data(), actions.size());
+}
+
+// Only the outermost scope calls into libpmemobj, which saves a jmp_buf setup
+// and a lane lookup per nested scope.
+void MemoryManager::txEnter() {
+  TxState& s = state();
+  if (s.tx_depth == 0) {
+    if (pmemobj_tx_begin(_pool, NULL, NULL)) {
+      throw "failed to switch transaction state";
+    }
+    _writes += 1;
+    s.tx_fresh.clear();
+    if (!s.reserved.empty()) {
+      vector<pobj_action> actions = takeReserved();
+      // on failure the transaction is aborted, cancelling the actions
+      if (pmemobj_tx_publish(actions.data(), actions.size())) {
+        pmemobj_tx_end();
+        throw "failed to switch transaction state";
+      }
+    }
+  } else if (!s.reserving && pmemobj_tx_stage() != TX_STAGE_WORK) {
     throw "failed to switch transaction state";
   }
+  ++s.tx_depth;
 }
 
-void MemoryManager::tx_exit_context() {
+// the error number of the transaction if it was aborted, 0 otherwise
+int MemoryManager::txLeave() {
+  TxState& s = state();
+  assert(s.tx_depth > 0);
+  if (--s.tx_depth > 0) {
+    if (s.reserving) return 0;
+    return pmemobj_tx_stage() == TX_STAGE_WORK ? 0 : pmemobj_tx_errno();
+  }
+  s.tx_fresh.clear();
   if (pmemobj_tx_stage() == TX_STAGE_WORK) {
     pmemobj_tx_commit();
   }
-  int errnum = pmemobj_tx_end();
-  if (errnum) {
-    throw "ailed to switch transaction state";
+  return pmemobj_tx_end();
+}
+
+void MemoryManager::tx_enter_context() { txEnter(); }
+
+void MemoryManager::tx_exit_context() {
+  if (txLeave()) {
+    throw "failed to switch transaction state";
   }
 }
 
-int MemoryManager::tx_begin() { return pmemobj_tx_begin(_pool, NULL, NULL); }
+void MemoryManager::tx_abort_context() {
+  TxState& s = state();
+  if (s.tx_depth == 0) return;
+  if (s.reserving) {
+    cancelReserved();
+    s.tx_fresh.clear();
+    s.reserving = false;
+    s.tx_depth = 0;
+    return;
+  }
+  if (pmemobj_tx_stage() == TX_STAGE_WORK) tx_abort();
+  while (s.tx_depth > s.tx_user_depth) txLeave();
+  // the writes grouped with the failed one are lost with it
+  if (s.group) {
+    s.group = false;
+    s.group_ops = 0;
+    tx_end();
+  }
+}
+
+int MemoryManager::tx_begin() {
+  TxState& s = state();
+  if (s.group && group_end() != 0) return -1;
+  if (!lock(true)) return -1;
+  try {
+    txEnter();
+  } catch (const char* errmsg) {
+    unlock();
+    return -1;
+  }
+  ++s.tx_user_depth;
+  return 0;
+}
+
+// a nested scope commits with the outermost one
+void MemoryManager::tx_commit() {
+  TxState& s = state();
+  if (s.tx_depth == 1) pmemobj_tx_commit();
+}
+
+void MemoryManager::tx_abort() {
+  TxState& s = state();
+  if (pmemobj_tx_stage() == TX_STAGE_WORK) {
+    pmemobj_tx_abort(INTERNAL_ABORT_ERRNO);
+  }
+  s.tx_fresh.clear();
+}
 
-void MemoryManager::tx_commit() { pmemobj_tx_commit(); }
+int MemoryManager::tx_end() {
+  TxState& s = state();
+  if (s.tx_user_depth == 0) return -1;
+  --s.tx_user_depth;
+  int errnum = txLeave();
+  unlock();
+  return errnum;
+}
 
-void MemoryManager::tx_abort() { pmemobj_tx_abort(INTERNAL_ABORT_ERRNO); }
+int MemoryManager::group_begin() {
+  TxState& s = state();
+  if (s.group) {
+    ++s.group_ops;
+    return 0;
+  }
+  if (s.tx_user_depth > 0) return 0;
+  if (tx_begin() != 0) return -1;
+  s.group = true;
+  s.group_ops = 1;
+  return 0;
+}
 
-int MemoryManager::tx_end() { return pmemobj_tx_end(); }
+int MemoryManager::group_end() {
+  TxState& s = state();
+  if (!s.group) return 0;
+  s.group = false;
+  s.group_ops = 0;
+  tx_commit();
+  return tx_end();
+}
+
+uint32_t MemoryManager::group_ops() { return state().group_ops; }
+
+double MemoryManager::ctlGet(const std::string& name) {
+  const CtlEntry* entry = ctlFind(name);
+  union {
+    int i;
+    long long ll;
+    uint64_t u64;
+    unsigned u;
+  } value;
+  memset(&value, 0, sizeof(value));
+  if (pmemobj_ctl_get(_pool, name.c_str(), &value) != 0) {
+    throw "failed to get ctl";
+  }
+  if (entry->type == kCtlInt) return value.i;
+  if (entry->type == kCtlLongLong) return (double)value.ll;
+  if (entry->type == kCtlUint64) return (double)value.u64;
+  return value.u;
+}
+
+void MemoryManager::ctlSet(const std::string& name, double value) {
+  const CtlEntry* entry = ctlFind(name);
+  int ret;
+  if (entry->type == kCtlInt) {
+    int arg = (int)value;
+    ret = pmemobj_ctl_set(_pool, name.c_str(), &arg);
+  } else if (entry->type == kCtlLongLong) {
+    long long arg = (long long)value;
+    ret = pmemobj_ctl_set(_pool, name.c_str(), &arg);
+  } else if (entry->type == kCtlUint64) {
+    uint64_t arg = (uint64_t)value;
+    ret = pmemobj_ctl_set(_pool, name.c_str(), &arg);
+  } else {
+    unsigned arg = (unsigned)value;
+    ret = pmemobj_ctl_set(_pool, name.c_str(), &arg);
+  }
+  // e.g. a read-only entry
+  if (ret != 0) throw "failed to set ctl";
+}
+
+// Arenas live as long as the pool is open, a thread opening it twice keeps
+// its first one.
+bool MemoryManager::bindArena() {
+  TxState& s = state();
+  if (s.arena_id != 0) return true;
+  unsigned arena_id = 0;
+  {
+    lock_guard<mutex> guard(_arenas_mutex);
+    if (!_free_arenas.empty()) {
+      arena_id = _free_arenas.back();
+      _free_arenas.pop_back();
+    }
+  }
+  if (arena_id == 0 &&
+      pmemobj_ctl_exec(_pool, "heap.arena.create", &arena_id) != 0) {
+    return false;
+  }
+  if (pmemobj_ctl_set(_pool, "heap.thread.arena_id", &arena_id) != 0) {
+    lock_guard<mutex> guard(_arenas_mutex);
+    _free_arenas.push_back(arena_id);
+    return false;
+  }
+  s.arena_id = arena_id;
+  return true;
+}
+
+void MemoryManager::attachThread() {
+  state().handles += 1;
+  bindArena();
+}
+
+void MemoryManager::detachThread() {
+  TxState& s = state();
+  if (s.handles == 0 || --s.handles > 0 || s.arena_id == 0) return;
+  lock_guard<mutex> guard(_arenas_mutex);
+  _free_arenas.push_back(s.arena_id);
+  s.arena_id = 0;
+}
+
+unsigned MemoryManager::getArena() {
+  unsigned arena_id = 0;
+  if (pmemobj_ctl_get(_pool, "heap.thread.arena_id", &arena_id) != 0) {
+    return 0;
+  }
+  return arena_id;
+}
+
+std::vector<size_t> MemoryManager::getArenaSizes() {
+  vector<size_t> sizes;
+  unsigned narenas = 0;
+  if (pmemobj_ctl_get(_pool, "heap.narenas.total", &narenas) != 0) {
+    return sizes;
+  }
+  char name[64];
+  for (unsigned id = 1; id <= narenas; ++id) {
+    size_t size = 0;
+    snprintf(name, sizeof(name), "heap.arena.%u.size", id);
+    pmemobj_ctl_get(_pool, name, &size);
+    sizes.push_back(size);
+  }
+  return sizes;
+}
+
+bool MemoryManager::lock(bool exclusive) {
+  TxState& s = state();
+  if (s.lock_depth > 0) {
+    // the other readers may have seen what a writer would change
+    if (exclusive && !s.lock_exclusive) return false;
+    ++s.lock_depth;
+    return true;
+  }
+  if (exclusive) {
+    pthread_rwlock_wrlock(&_lock);
+    _writes += 1;
+    s.lock_writes = _writes;
+  } else {
+    pthread_rwlock_rdlock(&_lock);
+  }
+  s.lock_exclusive = exclusive;
+  s.lock_depth = 1;
+  return true;
+}
+
+void MemoryManager::unlock() {
+  TxState& s = state();
+  assert(s.lock_depth > 0);
+  if (--s.lock_depth > 0) return;
+  pthread_rwlock_unlock(&_lock);
+}
 
 int MemoryManager::tx_stage() { return pmemobj_tx_stage(); }
 
+void MemoryManager::reserve_enter_context() {
+  TxState& s = state();
+  if (s.tx_depth > 0) {
+    txEnter();
+    return;
+  }
+  s.reserving = true;
+  s.tx_fresh.clear();
+  ++s.tx_depth;
+}
+
+void MemoryManager::reserve_exit_context() {
+  TxState& s = state();
+  if (!s.reserving || s.tx_depth > 1) {
+    tx_exit_context();
+    return;
+  }
+  // every range written is in a reserved object, one fence covers them all
+  map<uintptr_t, uintptr_t>::iterator it;
+  for (it = s.tx_fresh.begin(); it != s.tx_fresh.end(); ++it) {
+    flush((const void*)it->first, it->second - it->first);
+  }
+  drain();
+  s.tx_fresh.clear();
+  s.reserving = false;
+  s.tx_depth = 0;
+}
+
+// For the stores that link new objects outside a transaction, and for the
+// objects handed to the user unlinked.
+void MemoryManager::publish() {
+  TxState& s = state();
+  if (s.reserving || s.reserved.empty()) return;
+  vector<pobj_action> actions = takeReserved();
+  _writes += 1;
+  if (pmemobj_publish(_pool, actions.data(), actions.size())) {
+    throw "failed allocate memory";
+  }
+}
+
 void MemoryManager::free(PPtr pptr) {
+  TxState& s = state();
   Logger::Debug("MemoryManager::free: trying to free (%llu, %llu)\n",
                 pptr.pool_uuid_lo, pptr.off);
   if (direct(pptr) != NULL) {
+    uintptr_t addr = (uintptr_t)direct(pptr);
+    s.tx_fresh.erase(addr);
+    map<uintptr_t, pobj_action>::iterator it = s.reserved.find(addr);
+    if (it != s.reserved.end()) {
+      pmemobj_cancel(_pool, &(it->second), 1);
+      s.reserved.erase(it);
+      return;
+    }
+    if (s.reserving) {
+      pmemobj_defer_free(_pool, pptr, &(s.reserved[addr]));
+      return;
+    }
     int errnum = pmemobj_tx_free(pptr);
     if (errnum) {
-      pmemobj_tx_end();
       throw "failed to free memory";
     };
   }
 }
 
-void MemoryManager::close() { pmemobj_close(_pool); }
+void MemoryManager::freeUnshared(PPtr pptr) {
+  PObject* pobj = (PObject*)direct(pptr);
+  if (pobj == NULL || PPTR_IS_INLINE(pptr)) return;
+  if (pobj->ob_type == TYPE_CODE_STRING || pobj->ob_type == TYPE_CODE_BIGINT) {
+    free(pptr);
+  }
+}
+
+bool MemoryManager::keyEquals(PPtr stored, const PMKey& key) {
+  if (key.str != nullptr) {
+    if (PPTR_IS_INLINE(stored) || PPTR_EQUALS(stored, PPTR_NULL)) return false;
+    PObject* pobj = (PObject*)direct(stored);
+    if (pobj->ob_type != TYPE_CODE_STRING) return false;
+    const char* str = (const char*)pobj + sizeof(PStringObject);
+    return memcmp(str, key.str, key.len) == 0 && str[key.len] == '\0';
+  }
+  if (key.pptr.pool_uuid_lo == TYPE_CODE_NUMBER &&
+      stored.pool_uuid_lo == TYPE_CODE_NUMBER) {
+    double a, b;
+    memcpy(&a, &(stored.off), sizeof(double));
+    memcpy(&b, &(key.pptr.off), sizeof(double));
+    return a == b || (a != a && b != b);
+  }
+  return PPTR_EQUALS(stored, key.pptr);
+}
+
+// objects still reserved are linked from nowhere
+void MemoryManager::close() {
+  cancelReserved();
+  if (_post_commit.joinable()) {
+    pmemobj_ctl_get(_pool, "tx.post_commit.stop", NULL);
+    _post_commit.join();
+  }
+  pmemobj_close(_pool);
+}
 
 void MemoryManager::gc() {
   set<PPtr> containers, other;
@@ -196,15 +916,19 @@ void MemoryManager::gc() {
   PPtr root_pptr = pmemobj_root(_pool, 0);
   PPtr root_obj_pptr = ((PRoot*)direct(root_pptr))->root_object;
   list<PPtr> live;
-  if (root_obj_pptr.pool_uuid_lo == 0 ||
-      root_obj_pptr.pool_uuid_lo == TYPE_CODE_SINGLETON ||
-      root_obj_pptr.pool_uuid_lo == TYPE_CODE_NUMBER) {
-    // singleton / number
+  if (root_obj_pptr.pool_uuid_lo == 0 || PPTR_IS_INLINE(root_obj_pptr)) {
+    // singleton / number / date / bigint
   } else {
     PObject* root_obj = (PObject*)direct(root_obj_pptr);
     assert(root_obj->ob_type < TYPE_CODE_INTERNAL_MAX);
-    // root object must be Object or non-container
-    if (root_obj->ob_type == TYPE_CODE_OBJECT) {
+    // root object must be Object, Map, Set, Deque, BTree, Index or
+    // non-container
+    if (root_obj->ob_type == TYPE_CODE_OBJECT ||
+        root_obj->ob_type == TYPE_CODE_MAP ||
+        root_obj->ob_type == TYPE_CODE_SET ||
+        root_obj->ob_type == TYPE_CODE_DEQUE ||
+        root_obj->ob_type == TYPE_CODE_BTREE ||
+        root_obj->ob_type == TYPE_CODE_INDEX) {
       containers.erase(root_obj_pptr);
       live.push_back(root_obj_pptr);
     } else {
@@ -220,24 +944,46 @@ void MemoryManager::gc() {
     PObject* pobj = (PObject*)direct(to_trace);
 
     if (pobj->ob_type == TYPE_CODE_OBJECT) {
-      PPtr elements_pptr = ((PObjectObject*)pobj)->elements;
-      PPtr props_pptr = ((PObjectObject*)pobj)->extra_props;
-      // append elements to live
-      assert(containers.find(elements_pptr) != containers.end());
-      live.push_back(elements_pptr);
-      containers.erase(elements_pptr);
-      // append props to live
-      assert(containers.find(props_pptr) != containers.end());
-      live.push_back(props_pptr);
-      containers.erase(props_pptr);
+      PObjectObject* pobjobj = (PObjectObject*)pobj;
+      // elements and props are PPTR_NULL until they are first needed
+      PPtr parts[2] = {pobjobj->elements, pobjobj->extra_props};
+      for (int i = 0; i < 2; ++i) {
+        if (PPTR_EQUALS(parts[i], PPTR_NULL)) continue;
+        assert(containers.find(parts[i]) != containers.end());
+        live.push_back(parts[i]);
+        containers.erase(parts[i]);
+      }
+      for (int i = 0; !pobjobj->is_array && i < OBJECT_INLINE_PROPS; ++i) {
+        PInlineProp* prop = &(pobjobj->ob_props[i]);
+        if (PPTR_EQUALS(prop->key, PPTR_NULL)) continue;
+        if (other.find(prop->key) != other.end()) {
+          other.erase(prop->key);
+          gc_count[string("other-live")] += 1;
+        }
+        if (containers.find(prop->value) != containers.end()) {
+          live.push_back(prop->value);
+          containers.erase(prop->value);
+        } else if (other.find(prop->value) != other.end()) {
+          other.erase(prop->value);
+          gc_count[string("other-live")] += 1;
+        }
+      }
+      // the indexes keep the object alive as their collection
+      PPtr indexes_pptr = pobjobj->indexes;
+      if (containers.find(indexes_pptr) != containers.end()) {
+        live.push_back(indexes_pptr);
+        containers.erase(indexes_pptr);
+      }
+    } else if (pobj->ob_type == TYPE_CODE_DOUBLE_ARRAY) {
+      // its slots are doubles, there is nothing to trace
     } else if (pobj->ob_type == TYPE_CODE_ARRAY) {
       PArrayObject* parr = (PArrayObject*)pobj;
-      PPtr items_pptr = parr->ob_items;
-      PPtr* items = (PPtr*)direct(items_pptr);
+      PPtr* chunks = (PPtr*)direct(parr->ob_items);
       size_t items_size = parr->allocated;
 
       for (size_t i = 0; i < items_size; ++i) {
-        PPtr item_pptr = *(items + i);
+        PPtr* items = (PPtr*)direct(chunks[i >> ARRAY_CHUNK_SHIFT]);
+        PPtr item_pptr = *(items + (i & ARRAY_CHUNK_MASK));
         if (containers.find(item_pptr) != containers.end()) {
           live.push_back(item_pptr);
           containers.erase(item_pptr);
@@ -248,18 +994,71 @@ void MemoryManager::gc() {
       }
     } else if (pobj->ob_type == TYPE_CODE_DICT) {
       PDictObject* pdict = (PDictObject*)pobj;
-      PDictKeysObject* pkeys = (PDictKeysObject*)direct(pdict->ma_keys);
-      size_t pkeys_size = pkeys->dk_size;
-      PDictKeyEntry* ep0 = pkeys->dk_entries;
+      // while a resize is in progress, the old key table holds the entries
+      // from ma_migrated onward
+      PPtr tables[2] = {pdict->ma_keys, pdict->ma_oldkeys};
+      for (int t = 0; t < 2; ++t) {
+        if (PPTR_EQUALS(tables[t], PPTR_NULL)) continue;
+        PDictKeysObject* pkeys = (PDictKeysObject*)direct(tables[t]);
+        size_t pkeys_size = pkeys->dk_size;
+        PDictKeyEntry* ep0 = DK_ENTRIES(pkeys);
+
+        for (size_t i = (t == 0) ? 0 : pdict->ma_migrated; i < pkeys_size;
+             ++i) {
+          PPtr key_pptr = (ep0 + i)->me_key;
+          PPtr value_pptr = (ep0 + i)->me_value;
+          // key must be a string (that is, in the set "other")
+          if (other.find(key_pptr) != other.end()) {
+            other.erase(key_pptr);
+            gc_count[string("other-live")] += 1;
+          }
+          // value could be container or non-container
+          if (containers.find(value_pptr) != containers.end()) {
+            live.push_back(value_pptr);
+            containers.erase(value_pptr);
+          } else if (other.find(value_pptr) != other.end()) {
+            other.erase(value_pptr);
+            gc_count[string("other-live")] += 1;
+          }
+        }
+      }
+    } else if (pobj->ob_type == TYPE_CODE_NUMDICT) {
+      PNumDictObject* pdict = (PNumDictObject*)pobj;
+      PPtr tables[2] = {pdict->ma_keys, pdict->ma_oldkeys};
+      for (int t = 0; t < 2; ++t) {
+        if (PPTR_EQUALS(tables[t], PPTR_NULL)) continue;
+        PNumDictKeysObject* pkeys = (PNumDictKeysObject*)direct(tables[t]);
+        size_t pkeys_size = pkeys->dk_size;
+        PNumDictKeyEntry* ep0 = pkeys->dk_entries;
 
-      for (size_t i = 0; i < pkeys_size; ++i) {
+        for (size_t i = (t == 0) ? 0 : pdict->ma_migrated; i < pkeys_size;
+             ++i) {
+          PPtr value_pptr = (ep0 + i)->me_value;
+          // value could be container or non-container
+          if (containers.find(value_pptr) != containers.end()) {
+            live.push_back(value_pptr);
+            containers.erase(value_pptr);
+          } else if (other.find(value_pptr) != other.end()) {
+            other.erase(value_pptr);
+            gc_count[string("other-live")] += 1;
+          }
+        }
+      }
+    } else if (pobj->ob_type == TYPE_CODE_MAP ||
+               pobj->ob_type == TYPE_CODE_SET) {
+      PMapObject* pmap = (PMapObject*)pobj;
+      PMapKeysObject* pkeys = (PMapKeysObject*)direct(pmap->ma_keys);
+      size_t nentries = pkeys->dk_nentries;
+      PMapEntry* ep0 = MK_ENTRIES(pkeys);
+
+      for (size_t i = 0; i < nentries; ++i) {
         PPtr key_pptr = (ep0 + i)->me_key;
         PPtr value_pptr = (ep0 + i)->me_value;
-        // key must be a string (that is, in the set "other")
+        // key is a string or an inline primitive
         if (other.find(key_pptr) != other.end()) {
+          other.erase(key_pptr);
           gc_count[string("other-live")] += 1;
         }
-        // value could be container or non-container
         if (containers.find(value_pptr) != containers.end()) {
           live.push_back(value_pptr);
           containers.erase(value_pptr);
@@ -268,24 +1067,67 @@ void MemoryManager::gc() {
           gc_count[string("other-live")] += 1;
         }
       }
-    } else if (pobj->ob_type == TYPE_CODE_NUMDICT) {
-      PNumDictObject* pdict = (PNumDictObject*)pobj;
-      PNumDictKeysObject* pkeys = (PNumDictKeysObject*)direct(pdict->ma_keys);
-      size_t pkeys_size = pkeys->dk_size;
-      PNumDictKeyEntry* ep0 = pkeys->dk_entries;
+    } else if (pobj->ob_type == TYPE_CODE_DEQUE) {
+      PDequeObject* pdq = (PDequeObject*)pobj;
+      PPtr* blocks = (PPtr*)direct(pdq->dq_blocks);
+      uint64_t mask = pdq->dq_capacity - 1;
 
-      for (size_t i = 0; i < pkeys_size; ++i) {
-        PPtr value_pptr = (ep0 + i)->me_value;
-        // value could be container or non-container
-        if (containers.find(value_pptr) != containers.end()) {
-          live.push_back(value_pptr);
-          containers.erase(value_pptr);
-        } else if (other.find(value_pptr) != other.end()) {
-          ;
-          other.erase(value_pptr);
+      // only [dq_head, dq_tail) is live, other slots may hold stale items
+      for (uint64_t pos = pdq->dq_head; pos != pdq->dq_tail; ++pos) {
+        uint64_t slot = pos & mask;
+        PPtr* block = (PPtr*)direct(blocks[slot >> DEQUE_BLOCK_SHIFT]);
+        PPtr item_pptr = block[slot & DEQUE_BLOCK_MASK];
+        if (containers.find(item_pptr) != containers.end()) {
+          live.push_back(item_pptr);
+          containers.erase(item_pptr);
+        } else if (other.find(item_pptr) != other.end()) {
+          other.erase(item_pptr);
           gc_count[string("other-live")] += 1;
         }
       }
+    } else if (pobj->ob_type == TYPE_CODE_BTREE) {
+      PBTreeObject* pbt = (PBTreeObject*)pobj;
+      list<pair<PPtr, uint64_t>> nodes;
+      nodes.push_back(make_pair(pbt->bt_root, pbt->bt_height));
+
+      // the keys of inner nodes may be strings no longer in any leaf
+      while (!nodes.empty()) {
+        PBTreeNode* node = (PBTreeNode*)direct(nodes.front().first);
+        uint64_t height = nodes.front().second;
+        nodes.pop_front();
+        for (uint32_t i = 0; i < node->bn_count; ++i) {
+          other.erase(node->bn_keys[i]);
+        }
+        if (height > 1) {
+          for (uint32_t i = 0; i <= node->bn_count; ++i) {
+            nodes.push_back(make_pair(node->bn_slots[i], height - 1));
+          }
+          continue;
+        }
+        for (uint32_t i = 0; i < node->bn_count; ++i) {
+          PPtr value_pptr = node->bn_slots[i];
+          if (containers.find(value_pptr) != containers.end()) {
+            live.push_back(value_pptr);
+            containers.erase(value_pptr);
+          } else if (other.find(value_pptr) != other.end()) {
+            other.erase(value_pptr);
+            gc_count[string("other-live")] += 1;
+          }
+        }
+      }
+    } else if (pobj->ob_type == TYPE_CODE_INDEX) {
+      PIndexObject* pix = (PIndexObject*)pobj;
+      PPtr parts[3] = {pix->ix_collection, pix->ix_table, pix->ix_records};
+      for (int i = 0; i < 3; ++i) {
+        if (containers.find(parts[i]) != containers.end()) {
+          live.push_back(parts[i]);
+          containers.erase(parts[i]);
+        }
+      }
+      if (other.find(pix->ix_field) != other.end()) {
+        other.erase(pix->ix_field);
+        gc_count[string("other-live")] += 1;
+      }
     }
   }
   gc_count[string("containers-live")] = live.size();
@@ -303,7 +1145,8 @@ void MemoryManager::gc() {
       PMObject* obj = new PMObject(this, &container_pptr);
       obj->_deallocate();
       delete obj;
-    } else if (pobj->ob_type == TYPE_CODE_ARRAY) {
+    } else if (pobj->ob_type == TYPE_CODE_ARRAY ||
+               pobj->ob_type == TYPE_CODE_DOUBLE_ARRAY) {
       impl::PMSimpleArray* arr = new impl::PMSimpleArray(this, container_pptr);
       arr->_deallocate();
       delete arr;
@@ -317,6 +1160,27 @@ void MemoryManager::gc() {
       impl::PMNumDict* numdict = new impl::PMNumDict(this, container_pptr);
       numdict->_deallocate();
       delete numdict;
+
+    } else if (pobj->ob_type == TYPE_CODE_MAP ||
+               pobj->ob_type == TYPE_CODE_SET) {
+      PMMap* map = new PMMap(this, &container_pptr);
+      map->_deallocate();
+      delete map;
+
+    } else if (pobj->ob_type == TYPE_CODE_DEQUE) {
+      PMDeque* deque = new PMDeque(this, &container_pptr);
+      deque->_deallocate();
+      delete deque;
+
+    } else if (pobj->ob_type == TYPE_CODE_BTREE) {
+      PMBTree* btree = new PMBTree(this, &container_pptr);
+      btree->_deallocate();
+      delete btree;
+
+    } else if (pobj->ob_type == TYPE_CODE_INDEX) {
+      PMIndex* index = new PMIndex(this, &container_pptr);
+      index->_deallocate();
+      delete index;
     }
   }
 
@@ -332,4 +1196,341 @@ void MemoryManager::gc() {
   MM_TX_END(this)
 }
 
-}  // namespace internal
\ No newline at end of file
+DefragReport MemoryManager::defrag(double budget_ms) {
+  if (pmemobj_tx_stage() != TX_STAGE_NONE) {
+    throw "cannot defrag inside a transaction";
+  }
+  _defrag_generation += 1;
+  DefragReport report;
+  report.fragmentation_before = fragmentation();
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  // The fields collected by an earlier call may have moved since. Only the
+  // exclusive lock the caller took for this call, if nothing was written
+  // under it, is known to leave them in place.
+  TxState& s = state();
+  uint64_t writes = _writes;
+  if (s.lock_depth > 0 && s.lock_exclusive && writes == s.lock_writes) {
+    writes -= 1;
+  }
+  if (_defrag_pass != nullptr && _defrag_pass->writes != writes) {
+    _defrag_pass.reset();
+  }
+
+  // Each round takes one step of the pass, the gc(), the collection or a
+  // slice, so that the budget bounds the work to one step past it.
+  bool stepped = false;
+  while (true) {
+    if (stepped && budget_ms > 0 &&
+        chrono::duration<double, milli>(chrono::steady_clock::now() - start)
+                .count() >= budget_ms) {
+      break;
+    }
+    stepped = true;
+    if (!_defrag_started) {
+      // the garbage could still point to the objects about to move
+      gc();
+      _defrag_started = true;
+      continue;
+    }
+    if (_defrag_pass == nullptr) {
+      _defrag_pass.reset(new DefragPass());
+      collectRefs(_defrag_pass.get());
+      continue;
+    }
+    map<uint64_t, vector<DefragRef>>& refs = _defrag_pass->refs;
+    map<uint64_t, vector<DefragRef>>::iterator first =
+        refs.upper_bound(_defrag_cursor);
+    if (first == refs.end()) {
+      _defrag_cursor = 0;
+      _defrag_started = false;
+      _defrag_pass.reset();
+      report.done = true;
+      break;
+    }
+    map<uint64_t, vector<DefragRef>>::iterator last = first;
+    for (int i = 0; i < DEFRAG_SLICE_OBJECTS && last != refs.end(); ++i) {
+      _defrag_cursor = last->first;
+      ++last;
+    }
+    defragSlice(_defrag_pass.get(), first, last, &report);
+  }
+  // the writes of this call, by the gc() or a rehash, left the fields known
+  if (_defrag_pass != nullptr) _defrag_pass->writes = _writes;
+  report.fragmentation_after = fragmentation();
+  return report;
+}
+
+double MemoryManager::fragmentation() {
+  int enabled = POBJ_STATS_DISABLED;
+  pmemobj_ctl_get(_pool, "stats.enabled", &enabled);
+  if (enabled != POBJ_STATS_ENABLED_TRANSIENT &&
+      enabled != POBJ_STATS_ENABLED_BOTH) {
+    return NAN;
+  }
+  uint64_t allocated = 0, active = 0;
+  if (pmemobj_ctl_get(_pool, "stats.heap.run_allocated", &allocated) != 0 ||
+      pmemobj_ctl_get(_pool, "stats.heap.run_active", &active) != 0) {
+    return NAN;
+  }
+  if (active == 0) return 0;
+  return 1 - (double)allocated / active;
+}
+
+// Adds every PPtr field of the objects reachable from the root that points
+// to an allocation to the refs of pass, by the offset of the allocation, and
+// indexes them by their holder. Only the live slots are read: the stale ones
+// past the length of an array or deque, or in the migrated part of an old
+// key table, may point to freed objects.
+void MemoryManager::collectRefs(DefragPass* pass) {
+  map<uint64_t, vector<DefragRef>>* refs = &(pass->refs);
+  set<uint64_t> traced;
+  list<PPtr> pending;
+  // holder is the start of the allocation holding field
+  auto add = [&](PPtr* field, const void* holder) -> bool {
+    PPtr target = *field;
+    if (target.pool_uuid_lo == 0 || PPTR_IS_INLINE(target)) return false;
+    DefragRef ref = {field, pptr(holder),
+                     (size_t)((char*)field - (char*)holder)};
+    (*refs)[target.off].push_back(ref);
+    return true;
+  };
+  // the same for a field pointing to a PObject, which is traced in turn. An
+  // ArrayBuffer holds no PPtr and is left in place, as the isolates of other
+  // threads may hold external buffers over its data.
+  auto trace = [&](PPtr* field, const void* holder) {
+    PPtr target = *field;
+    if (target.pool_uuid_lo != 0 && !PPTR_IS_INLINE(target) &&
+        ((PObject*)direct(target))->ob_type == TYPE_CODE_ARRAYBUFFER) {
+      return;
+    }
+    if (add(field, holder) && traced.insert(field->off).second) {
+      pending.push_back(*field);
+    }
+  };
+
+  PRoot* proot = (PRoot*)direct(pmemobj_root(_pool, 0));
+  trace(&(proot->root_object), proot);
+  while (!pending.empty()) {
+    PPtr current = pending.front();
+    pending.pop_front();
+    PObject* pobj = (PObject*)direct(current);
+
+    if (pobj->ob_type == TYPE_CODE_OBJECT) {
+      PObjectObject* pobjobj = (PObjectObject*)pobj;
+      trace(&(pobjobj->elements), pobj);
+      trace(&(pobjobj->extra_props), pobj);
+      trace(&(pobjobj->indexes), pobj);
+      for (int i = 0; !pobjobj->is_array && i < OBJECT_INLINE_PROPS; ++i) {
+        PInlineProp* prop = &(pobjobj->ob_props[i]);
+        if (PPTR_EQUALS(prop->key, PPTR_NULL)) continue;
+        trace(&(prop->key), pobj);
+        trace(&(prop->value), pobj);
+      }
+    } else if (pobj->ob_type == TYPE_CODE_ARRAY ||
+               pobj->ob_type == TYPE_CODE_DOUBLE_ARRAY) {
+      PArrayObject* parr = (PArrayObject*)pobj;
+      if (!add(&(parr->ob_items), pobj)) continue;
+      PPtr* chunks = (PPtr*)direct(parr->ob_items);
+      uint64_t length = parr->ob_base.ob_size;
+      for (uint64_t c = 0; c < ARRAY_CHUNK_COUNT(parr->allocated); ++c) {
+        add(chunks + c, chunks);
+        if (pobj->ob_type == TYPE_CODE_DOUBLE_ARRAY) continue;
+        PPtr* items = (PPtr*)direct(chunks[c]);
+        uint64_t end = (c + 1) << ARRAY_CHUNK_SHIFT;
+        if (end > length) end = length;
+        for (uint64_t i = c << ARRAY_CHUNK_SHIFT; i < end; ++i) {
+          trace(items + (i & ARRAY_CHUNK_MASK), items);
+        }
+      }
+    } else if (pobj->ob_type == TYPE_CODE_DICT) {
+      PDictObject* pdict = (PDictObject*)pobj;
+      PPtr* tables[2] = {&(pdict->ma_keys), &(pdict->ma_oldkeys)};
+      for (int t = 0; t < 2; ++t) {
+        if (!add(tables[t], pobj)) continue;
+        PDictKeysObject* pkeys = (PDictKeysObject*)direct(*tables[t]);
+        PDictKeyEntry* ep0 = DK_ENTRIES(pkeys);
+        for (size_t i = (t == 0) ? 0 : pdict->ma_migrated; i < pkeys->dk_size;
+             ++i) {
+          // PPTR_DUMMY marks a deleted entry
+          if ((ep0 + i)->me_key.pool_uuid_lo == 0) continue;
+          trace(&((ep0 + i)->me_key), pkeys);
+          trace(&((ep0 + i)->me_value), pkeys);
+        }
+      }
+    } else if (pobj->ob_type == TYPE_CODE_NUMDICT) {
+      PNumDictObject* pdict = (PNumDictObject*)pobj;
+      PPtr* tables[2] = {&(pdict->ma_keys), &(pdict->ma_oldkeys)};
+      for (int t = 0; t < 2; ++t) {
+        if (!add(tables[t], pobj)) continue;
+        PNumDictKeysObject* pkeys = (PNumDictKeysObject*)direct(*tables[t]);
+        for (size_t i = (t == 0) ? 0 : pdict->ma_migrated; i < pkeys->dk_size;
+             ++i) {
+          // a deleted entry has a PPTR_NULL value
+          trace(&(pkeys->dk_entries[i].me_value), pkeys);
+        }
+      }
+    } else if (pobj->ob_type == TYPE_CODE_MAP ||
+               pobj->ob_type == TYPE_CODE_SET) {
+      PMapObject* pmap = (PMapObject*)pobj;
+      if (!add(&(pmap->ma_keys), pobj)) continue;
+      PMapKeysObject* pkeys = (PMapKeysObject*)direct(pmap->ma_keys);
+      PMapEntry* ep0 = MK_ENTRIES(pkeys);
+      for (size_t i = 0; i < pkeys->dk_nentries; ++i) {
+        PPtr key = (ep0 + i)->me_key;
+        if (PPTR_EQUALS(key, PPTR_NULL)) continue;
+        trace(&((ep0 + i)->me_key), pkeys);
+        trace(&((ep0 + i)->me_value), pkeys);
+        // a key other than a string is hashed by its offset
+        if (!PPTR_IS_INLINE(key) &&
+            ((PObject*)direct(key))->ob_type != TYPE_CODE_STRING) {
+          pass->keyed[key.off].push_back(current.off);
+        }
+      }
+    } else if (pobj->ob_type == TYPE_CODE_DEQUE) {
+      PDequeObject* pdq = (PDequeObject*)pobj;
+      if (!add(&(pdq->dq_blocks), pobj)) continue;
+      PPtr* blocks = (PPtr*)direct(pdq->dq_blocks);
+      for (uint64_t b = 0; b < (pdq->dq_capacity >> DEQUE_BLOCK_SHIFT); ++b) {
+        add(blocks + b, blocks);
+      }
+      uint64_t mask = pdq->dq_capacity - 1;
+      for (uint64_t pos = pdq->dq_head; pos != pdq->dq_tail; ++pos) {
+        uint64_t slot = pos & mask;
+        PPtr* block = (PPtr*)direct(blocks[slot >> DEQUE_BLOCK_SHIFT]);
+        trace(block + (slot & DEQUE_BLOCK_MASK), block);
+      }
+    } else if (pobj->ob_type == TYPE_CODE_BTREE) {
+      PBTreeObject* pbt = (PBTreeObject*)pobj;
+      if (!add(&(pbt->bt_root), pobj)) continue;
+      list<pair<PBTreeNode*, uint64_t>> nodes;
+      nodes.push_back(make_pair((PBTreeNode*)direct(pbt->bt_root),
+                                pbt->bt_height));
+      while (!nodes.empty()) {
+        PBTreeNode* node = nodes.front().first;
+        uint64_t height = nodes.front().second;
+        nodes.pop_front();
+        for (uint32_t i = 0; i < node->bn_count; ++i) {
+          trace(node->bn_keys + i, node);
+        }
+        if (height > 1) {
+          for (uint32_t i = 0; i <= node->bn_count; ++i) {
+            add(node->bn_slots + i, node);
+            nodes.push_back(
+                make_pair((PBTreeNode*)direct(node->bn_slots[i]), height - 1));
+          }
+          continue;
+        }
+        for (uint32_t i = 0; i < node->bn_count; ++i) {
+          trace(node->bn_slots + i, node);
+        }
+        // a leaf is also linked from the one before it
+        add(&(node->bn_next), node);
+      }
+    } else if (pobj->ob_type == TYPE_CODE_INDEX) {
+      PIndexObject* pix = (PIndexObject*)pobj;
+      trace(&(pix->ix_collection), pobj);
+      trace(&(pix->ix_field), pobj);
+      trace(&(pix->ix_table), pobj);
+      // its keys are records, rehashed when they move
+      trace(&(pix->ix_records), pobj);
+    }
+  }
+
+  // the vectors are complete, so the addresses of their refs hold
+  map<uint64_t, vector<DefragRef>>::iterator it;
+  for (it = refs->begin(); it != refs->end(); ++it) {
+    for (size_t i = 0; i < it->second.size(); ++i) {
+      pass->held[it->second[i].holder.off].push_back(&(it->second[i]));
+    }
+  }
+}
+
+// Hands the objects of [first, last) to pmemobj_defrag() with every field
+// pointing to them, and counts the bytes of those it moved. The fields held
+// by the moved objects are then found at their new places, and the maps keyed
+// by them rehashed, so that the refs of pass stay valid.
+void MemoryManager::defragSlice(
+    DefragPass* pass, map<uint64_t, vector<DefragRef>>::iterator first,
+    map<uint64_t, vector<DefragRef>>::iterator last, DefragReport* report) {
+  vector<PPtr*> oidv;
+  // the new offset of each object, 0 until it is known
+  map<uint64_t, uint64_t> moved;
+  map<uint64_t, vector<DefragRef>>::iterator it;
+  for (it = first; it != last; ++it) {
+    moved[it->first] = 0;
+    for (size_t i = 0; i < it->second.size(); ++i) {
+      oidv.push_back(it->second[i].field);
+    }
+  }
+  pobj_defrag_result result = {0, 0};
+  if (pmemobj_defrag(_pool, oidv.data(), oidv.size(), &result) != 0) {
+    throw "failed to defrag";
+  }
+  report->objects += result.total;
+  report->relocated += result.relocated;
+  if (result.relocated == 0) return;
+
+  // A field inside a moved object was updated in its new copy, so the new
+  // offset of an object is read from a field whose holder did not move, or
+  // whose holder's new offset is known already. Every object is reachable
+  // from the root, which does not move, so each round resolves some more.
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    for (it = first; it != last; ++it) {
+      if (moved[it->first] != 0) continue;
+      for (size_t i = 0; i < it->second.size(); ++i) {
+        DefragRef& ref = it->second[i];
+        map<uint64_t, uint64_t>::iterator holder = moved.find(ref.holder.off);
+        PPtr* field = ref.field;
+        if (holder != moved.end()) {
+          if (holder->second == 0) continue;
+          PPtr new_holder = {ref.holder.pool_uuid_lo, holder->second};
+          field = (PPtr*)((char*)direct(new_holder) + ref.at);
+        }
+        moved[it->first] = field->off;
+        progress = true;
+        break;
+      }
+    }
+  }
+  // taken out before any is put back, as an object may take the old place of
+  // another one
+  map<uint64_t, vector<DefragRef*>> rehomed;
+  set<uint64_t> rekeyed;
+  for (it = first; it != last; ++it) {
+    uint64_t new_off = moved[it->first];
+    if (new_off == 0 || new_off == it->first) continue;
+    PPtr new_pptr = {it->second[0].holder.pool_uuid_lo, new_off};
+    report->bytes_moved += pmemobj_alloc_usable_size(new_pptr);
+    map<uint64_t, vector<DefragRef*>>::iterator held =
+        pass->held.find(it->first);
+    if (held != pass->held.end()) {
+      for (size_t i = 0; i < held->second.size(); ++i) {
+        DefragRef* ref = held->second[i];
+        ref->holder = new_pptr;
+        ref->field = (PPtr*)((char*)direct(new_pptr) + ref->at);
+      }
+      rehomed[new_off].swap(held->second);
+      pass->held.erase(held);
+    }
+    map<uint64_t, vector<uint64_t>>::iterator keyed =
+        pass->keyed.find(it->first);
+    if (keyed != pass->keyed.end()) {
+      rekeyed.insert(keyed->second.begin(), keyed->second.end());
+    }
+  }
+  map<uint64_t, vector<DefragRef*>>::iterator held;
+  for (held = rehomed.begin(); held != rehomed.end(); ++held) {
+    pass->held[held->first].swap(held->second);
+  }
+  // a map is found through a field pointing to it, which is now in place, and
+  // rehashed in place, so that the fields of its key table do not move
+  set<uint64_t>::iterator map_off;
+  for (map_off = rekeyed.begin(); map_off != rekeyed.end(); ++map_off) {
+    PPtr pmap = *(pass->refs[*map_off][0].field);
+    PMMap(this, &pmap).rehash();
+  }
+}
+
+}  // namespace internal
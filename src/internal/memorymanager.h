@@ -2,8 +2,16 @@
 #define INTERNAL_MM_H
 
 #include <libpmemobj.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <sys/stat.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "common.h"
 
@@ -17,14 +25,67 @@ typedef pobj_tx_stage POOL_TX_STAGE;
 enum snapshotFlag { kNotSnapshot, kSnapshot };
 
 namespace internal {
+// A primitive to look up without persisting it. A non-empty string is given
+// by its content (str, len), every other value by its PPtr in pptr.
+struct PMKey {
+  PPtr pptr;
+  const char* str;
+  size_t len;
+};
+
+// Settings of libpmemobj applied when a pool is opened or created, -1 keeps
+// the default of libpmemobj or of its configuration (PMEMOBJ_CONF).
+struct PoolOptions {
+  // prefault.at_open or prefault.at_create, whether to touch every page of
+  // the pool up front
+  int prefault = -1;
+  // tx.cache.size, the bytes of the undo log kept for small snapshots
+  int64_t tx_cache_size = -1;
+  // stats.enabled
+  int stats_enabled = -1;
+  // runs tx.post_commit.worker on a thread of its own while the pool is open,
+  // which does the cleanup after each commit
+  bool post_commit_worker = false;
+  // registers the allocation classes of the structs allocated most, see
+  // registerAllocClasses()
+  bool alloc_classes = true;
+};
+
+// What a call of MemoryManager::defrag() did. The fragmentation is the share
+// of the bytes of the runs of the heap that are free, NaN unless the pool
+// keeps transient statistics (stats.enabled).
+struct DefragReport {
+  // the objects handed to pmemobj_defrag(), and those of them it moved
+  uint64_t objects = 0;
+  uint64_t relocated = 0;
+  uint64_t bytes_moved = 0;
+  double fragmentation_before = 0;
+  double fragmentation_after = 0;
+  // whether the pass over the heap is over, otherwise the next call resumes
+  // it
+  bool done = false;
+};
+
 class MemoryManager {
  public:
   static int check(std::string path, std::string layout);
+  // A pool is opened once per process. The threads opening it after the
+  // first one share its MemoryManager, which is closed when the last of
+  // them releases it. The options that only apply when the pool is mapped,
+  // like prefault, are ignored for those threads.
+  static MemoryManager* acquire(std::string path, std::string layout,
+                                const PoolOptions& options = PoolOptions());
+  static MemoryManager* acquire(std::string path, std::string layout,
+                                uint32_t poolsize, mode_t mode,
+                                const PoolOptions& options = PoolOptions());
+  static void release(MemoryManager* mm);
 
  public:
-  MemoryManager(std::string path, std::string layout);
+  MemoryManager(std::string path, std::string layout,
+                const PoolOptions& options = PoolOptions());
   MemoryManager(std::string path, std::string layout, uint32_t poolsize,
-                mode_t mode);
+                mode_t mode, const PoolOptions& options = PoolOptions());
+  ~MemoryManager();
 
   PPtr root(size_t size);
   void *direct(PPtr pptr);
@@ -36,23 +97,212 @@ class MemoryManager {
   void *tx_zalloc(size_t size, int type_num = POBJ_TYPE_NUM);
   void *tz_zrealloc(PPtr pptr, size_t size, int type_num = POBJ_TYPE_NUM);
   void *zalloc(size_t size, int type_num = POBJ_TYPE_NUM);
+  // not zeroed, for objects that are fully overwritten right away
+  void *tx_alloc(size_t size, int type_num = POBJ_TYPE_NUM);
+  // a new object with the type number and the first size bytes of pptr
+  PPtr tx_copy(PPtr pptr, size_t size);
+  // not zeroed either, constructor fills and persists the object before
+  // libpmemobj publishes it, so that a crash never leaves it half written
+  void *alloc(size_t size, int type_num, pmemobj_constr constructor, void *arg);
   void persist(const void* addr, size_t length);
+  void flush(const void* addr, size_t length);
+  void drain();
+  void memcpyNoDrain(void* dest, const void* src, size_t length);
   PPtr persistString(std::string str);
+  // whether stored holds key, compared like SameValueZero
+  bool keyEquals(PPtr stored, const PMKey& key);
 
+  // All transaction scopes share one libpmemobj transaction: the outermost
+  // scope begins and ends it, a scope entered while it runs only counts the
+  // depth. tx_begin() and tx_end() are the scopes of the user, the
+  // *_context() ones those of the internal code. tx_abort_context() aborts
+  // and leaves the internal scopes left open by an exception.
   void tx_enter_context();
   void tx_exit_context();
+  void tx_abort_context();
   int tx_begin();
   void tx_commit();
   void tx_abort();
   int tx_end();
   int tx_stage();
 
+  // A group is a transaction of the user left open across the writes made
+  // outside of one, so that they are committed together. group_begin() opens
+  // it, or counts one more write if it is open already; inside a transaction
+  // of the user it does nothing. group_end() commits it. tx_begin() commits
+  // the open group first, tx_abort_context() aborts it.
+  int group_begin();
+  int group_end();
+  uint32_t group_ops();
+
+  // A construction scope entered outside a transaction builds new objects
+  // with pmemobj_reserve() and plain stores instead of an undo log, they
+  // only need to be durable when it is left. The objects stay reserved until
+  // the next outermost transaction, which publishes them atomically with the
+  // stores that link them, or until publish(). Entered inside a transaction,
+  // it is a transaction scope.
+  void reserve_enter_context();
+  void reserve_exit_context();
+  void publish();
+
+  // The pool is guarded by one reader/writer lock, shared by the threads
+  // using it. A thread holding it may enter it again, but not upgrade a
+  // shared hold. A user transaction holds it exclusively until its end.
+  bool lock(bool exclusive);
+  void unlock();
+
+  // Gives the calling thread an arena of its own, so that threads allocating
+  // at once do not contend for the same one. The arena of a thread that
+  // released the pool is reused before a new one is created. Returns false
+  // if libpmemobj has no such control.
+  bool bindArena();
+  // the arena of the calling thread, 0 if unknown
+  unsigned getArena();
+  // the bytes allocated in each arena, the first one has id 1
+  std::vector<size_t> getArenaSizes();
+
+  // Reads or writes the ctl entry name of libpmemobj as a number. Only the
+  // entries of the table in memorymanager.cc, whose types are known, are
+  // supported; a * in them stands for an index, e.g. heap.arena.1.size.
+  double ctlGet(const std::string& name);
+  void ctlSet(const std::string& name, double value);
+
   void free(PPtr pptr);
+  // Frees a string or a BigInt removed from its field, which no other field
+  // shares. An object, array, ArrayBuffer or map may be shared, by a shallow
+  // clone for instance, and is left to gc().
+  void freeUnshared(PPtr pptr);
   void close();
   void gc();
+  // Moves the objects reachable from the root into the holes of the heap
+  // with pmemobj_defrag(), a slice of them at a time. A pass runs a gc(),
+  // collects the fields pointing to each object once, then moves the slices.
+  // Once budget_ms milliseconds are spent, if not 0, it returns after the
+  // step it is in, and the next call carries on from there; the collected
+  // fields are kept until the pool is written or locked exclusively by
+  // another caller. Every PPtr to a moved object is updated in the pool, but
+  // none held in DRAM. Must be called outside a transaction.
+  DefragReport defrag(double budget_ms);
+  // bumped by every defrag(), a handle made in an older generation may hold
+  // pointers to the old places of the objects
+  uint64_t defragGeneration() { return _defrag_generation; }
 
  private:
+  // Transactions are per thread, like those of libpmemobj
+  struct TxState {
+    uint32_t tx_depth = 0;
+    uint32_t tx_user_depth = 0;
+    // [start, end) of the objects allocated by the running transaction,
+    // which need no snapshot as an abort frees them
+    std::map<uintptr_t, uintptr_t> tx_fresh;
+    // whether a construction scope runs outside a transaction
+    bool reserving = false;
+    // the actions not published yet, by the address of their object
+    std::map<uintptr_t, pobj_action> reserved;
+    // how many times the thread holds the lock, whether exclusively, and
+    // _writes once it took it
+    uint32_t lock_depth = 0;
+    bool lock_exclusive = false;
+    uint64_t lock_writes = 0;
+    // the arena bound by bindArena(), 0 if none, and how many handles of the
+    // pool the thread holds; the arena is freed for reuse once none is left
+    unsigned arena_id = 0;
+    uint32_t handles = 0;
+    // whether a group is open, and how many writes joined it
+    bool group = false;
+    uint32_t group_ops = 0;
+  };
+
+  // an allocation class of libpmemobj for the objects of type_num and size
+  struct AllocClass {
+    int type_num;
+    size_t size;
+    unsigned id;
+  };
+
+  // a PPtr field of the pool, at offset at in the allocation holder
+  struct DefragRef {
+    PPtr* field;
+    PPtr holder;
+    size_t at;
+  };
+
+  // what a pass of defrag() knows of the reachable objects
+  struct DefragPass {
+    // the fields pointing to each object, by its offset when collected
+    std::map<uint64_t, std::vector<DefragRef>> refs;
+    // the fields held by each allocation, by its current offset
+    std::map<uint64_t, std::vector<DefragRef*>> held;
+    // the maps and sets keyed by each object, by their offsets in refs
+    std::map<uint64_t, std::vector<uint64_t>> keyed;
+    // _writes when the fields were last known to be in place
+    uint64_t writes = 0;
+  };
+
+  TxState& state();
+  // count a handle of the calling thread, and give back its arena with the
+  // last one
+  void attachThread();
+  void detachThread();
+  void initLock();
+  void applyOptions(const PoolOptions& options);
+  void registerAllocClasses();
+  // the flags selecting the allocation class of an object, 0 for the default
+  uint64_t allocFlags(size_t size, int type_num);
+  void txEnter();
+  int txLeave();
+  void addFresh(const void* addr, size_t size);
+  void* reserve(size_t size, int type_num);
+  std::vector<pobj_action> takeReserved();
+  void cancelReserved();
+  double fragmentation();
+  void collectRefs(DefragPass* pass);
+  void defragSlice(DefragPass* pass,
+                   std::map<uint64_t, std::vector<DefragRef>>::iterator first,
+                   std::map<uint64_t, std::vector<DefragRef>>::iterator last,
+                   DefragReport* report);
+
   PMEMobjpool *_pool;
+  // tells the pools apart in the per-thread states, unlike an address
+  uint64_t _id;
+  // prefers writers, so that a stream of readers cannot starve them
+  pthread_rwlock_t _lock;
+  std::string _key;
+  std::string _layout;
+  uint32_t _refs;
+  std::thread _post_commit;
+  std::vector<AllocClass> _alloc_classes;
+  // the arenas of the threads that released the pool
+  std::mutex _arenas_mutex;
+  std::vector<unsigned> _free_arenas;
+  // bumped by every exclusive lock, transaction and publish, which may move
+  // the fields collected by defrag(); a store outside a transaction only
+  // holds the exclusive lock
+  std::atomic<uint64_t> _writes{0};
+  // whether the gc() of the running pass is done, its collected fields, null
+  // until collected or once stale, and the offset of the last object it
+  // handed to pmemobj_defrag(), 0 between two passes
+  bool _defrag_started = false;
+  std::unique_ptr<DefragPass> _defrag_pass;
+  uint64_t _defrag_cursor = 0;
+  uint64_t _defrag_generation = 0;
+};
+
+// Holds the lock of a pool for its scope, if it could be taken
+class PoolLock {
+ public:
+  PoolLock(MemoryManager* mm, bool exclusive)
+      : _mm(mm), _held(mm != nullptr && mm->lock(exclusive)) {}
+  ~PoolLock() {
+    if (_held) _mm->unlock();
+  }
+  PoolLock(const PoolLock& other) = delete;
+  PoolLock& operator=(const PoolLock& other) = delete;
+  bool held() { return _held; }
+
+ private:
+  MemoryManager* _mm;
+  bool _held;
 };
 };
 #endif
\ No newline at end of file
@@ -1,12 +1,22 @@
 #include <assert.h>
+#include <math.h>
+#include <string.h>
 #include <list>
 
 #include "memorymanager.h"
 #include "pmarray.h"
+#include "pmarraybuffer.h"
 
 #define MIN_SIZE_COMBINED 8
 #define MIN_SIZE_SPLIT 4
 #define PERTURB_SHIFT 5
+// Shrink once fewer than 1/SHRINK_FACTOR of the slots are in use, and size
+// the new table so that it is about 1/SHRINK_TARGET full afterwards.
+#define SHRINK_FACTOR 8
+#define SHRINK_TARGET 4
+// number of slots of the old key table migrated by every set/del while a
+// resize is in progress
+#define MIGRATE_STEP 16
 
 #define ENTRY_NULL 0
 #define ENTRY_DUMMY 1
@@ -21,13 +31,44 @@ namespace internal {
 namespace impl {
 PMArray::~PMArray(){};
 
+double reductionStart(NumberReduction op) {
+  switch (op) {
+    case kReduceMin:
+      return INFINITY;
+    case kReduceMax:
+      return -INFINITY;
+    default:
+      return 0;
+  }
+}
+
+void reduceDoubles(NumberReduction op, const double *values, uint64_t n,
+                   double *acc) {
+  if (n == 0) return;
+  if (op == kReduceSum) {
+    *acc += sumFloat64(values, n);
+    return;
+  }
+  double v = op == kReduceMin ? minFloat64(values, n) : maxFloat64(values, n);
+  // NaN sticks once it is in *acc
+  if (v != v || (op == kReduceMin ? v < *acc : v > *acc)) *acc = v;
+}
+
 // SimpleArray
-PMSimpleArray::PMSimpleArray(MemoryManager *mm) {
+static bool allNumbers(const std::vector<PPtr> &items) {
+  for (const PPtr &item : items) {
+    if (!PPTR_IS_NUMBER(item)) return false;
+  }
+  return true;
+}
+
+PMSimpleArray::PMSimpleArray(MemoryManager *mm, bool doubles) {
   _mm = mm;
   Logger::Debug("PMSimpleArray::PMSimpleArray: creating empty array\n");
   MM_TX_BEGIN(_mm) {
     _parr = (PArrayObject *)_mm->tx_zalloc(sizeof(PArrayObject), POBJ_TYPE_NUM);
-    ((PObject *)_parr)->ob_type = TYPE_CODE_ARRAY;
+    ((PObject *)_parr)->ob_type =
+        doubles ? TYPE_CODE_DOUBLE_ARRAY : TYPE_CODE_ARRAY;
     _pptr = _mm->pptr(_parr);
   }
   MM_TX_END(_mm)
@@ -43,21 +84,28 @@ PMSimpleArray::PMSimpleArray(MemoryManager *mm, PPtr pptr) {
 
 PPtr PMSimpleArray::getPPtr() { return _pptr; }
 
+// A double array stays one while the value is a number and no hole is made.
 void PMSimpleArray::setProperty(uint32_t index, PPtr value_pptr,
                                 snapshotFlag flag) {
   uint32_t idx = formatIndex(index);
-  // If index exceed the maximum array size, reallocate new space.
+  // If index exceed the maximum array size, allocate more chunks.
   assert(idx < UINT32_MAX);
+  if (isDoubles()) {
+    if (PPTR_IS_NUMBER(value_pptr) && idx <= getLength()) {
+      setDouble(idx, value_pptr.off, flag);
+      return;
+    }
+    toPPtrSlots();
+  }
   uint64_t allocated = getAllocated();
   if ((idx + 1) > allocated) {
-    resize(idx + 1);
+    reserve(idx + 1);
   }
-  PPtr *items = getItems();
-  // _mm->snapshotRange(items+idx, sizeof(PPtr));
+  PPtr *item = getItem(idx);
   if (_mm->inTransaction()) {
     MM_TX_BEGIN(_mm) {
-      if (flag) _mm->snapshotRange(items + idx, sizeof(PPtr));
-      *(items + idx) = value_pptr;
+      if (flag) _mm->snapshotRange(item, sizeof(PPtr));
+      *item = value_pptr;
       if (idx + 1 > getLength()) {
         PVarObject *ob = (PVarObject *)_parr;
         if (flag)
@@ -67,16 +115,18 @@ void PMSimpleArray::setProperty(uint32_t index, PPtr value_pptr,
     }
     MM_TX_END(_mm)
   } else {
-    if ((items + idx)->pool_uuid_lo != value_pptr.pool_uuid_lo) {
+    // the value may be a new object that is only reserved yet
+    _mm->publish();
+    if (item->pool_uuid_lo != value_pptr.pool_uuid_lo) {
       MM_TX_BEGIN(_mm) {
-        _mm->snapshotRange(items + idx, sizeof(PPtr));
-        *(items + idx) = value_pptr;
+        _mm->snapshotRange(item, sizeof(PPtr));
+        *item = value_pptr;
       }
       MM_TX_END(_mm)
 
     } else {
-      (items + idx)->off = value_pptr.off;
-      _mm->persist(items + idx + offsetof(PPtr, off), sizeof(PPtr::off));
+      item->off = value_pptr.off;
+      _mm->persist(&(item->off), sizeof(PPtr::off));
     }
     if (idx + 1 > getLength()) {
       PVarObject *ob = (PVarObject *)_parr;
@@ -92,9 +142,13 @@ PPtr PMSimpleArray::getProperty(uint32_t index) {
   if (idx >= getLength()) {
     return PPTR_UNDEFINED;
   }
+  if (isDoubles()) {
+    PPtr pptr = PPTR_ZERO;
+    memcpy(&(pptr.off), getSlots(idx), sizeof(double));
+    return pptr;
+  }
 
-  PPtr *items = getItems();
-  return *(items + idx);
+  return *getItem(idx);
 }
 
 void PMSimpleArray::delProperty(uint32_t index, snapshotFlag flag) {
@@ -106,9 +160,16 @@ void PMSimpleArray::delProperty(uint32_t index, snapshotFlag flag) {
 std::list<uint32_t> PMSimpleArray::getValidIndex() {
   std::list<uint32_t> indexes;
   uint32_t length = getLength();
-  PPtr *items = getItems();
+  if (isDoubles()) {
+    for (uint32_t i = 0; i < length; ++i) indexes.push_back(i);
+    return indexes;
+  }
+  PPtr *items = nullptr;
   for (uint32_t i = 0; i < length; ++i) {
-    if (!PPTR_EQUALS(*(items + i), PPTR_NULL)) {
+    if ((i & ARRAY_CHUNK_MASK) == 0) {
+      items = getChunk(i >> ARRAY_CHUNK_SHIFT);
+    }
+    if (!PPTR_EQUALS(*(items + (i & ARRAY_CHUNK_MASK)), PPTR_NULL)) {
       indexes.push_back(i);
     }
   }
@@ -121,16 +182,18 @@ void PMSimpleArray::push(PPtr value_pptr, snapshotFlag flag) {
 }
 
 std::shared_ptr<const void> PMSimpleArray::pop(snapshotFlag flag) {
-  PPtr *items = getItems();
   uint32_t length = getLength();
+  if (length == 0) {
+    return std::make_shared<PPtr>(PPTR_UNDEFINED);
+  }
   uint32_t new_length = length - 1;
 
-  PPtr pptr = *(items + (length - 1));
+  PPtr pptr = getProperty(new_length);
   MM_TX_BEGIN(_mm) {
     _mm->snapshotRange(&(((PVarObject *)_parr)->ob_size),
                        sizeof(PVarObject::ob_size));
     ((PVarObject *)_parr)->ob_size = new_length;
-    resize(new_length);
+    truncate(length, new_length);
   }
   MM_TX_END(_mm)
   return std::make_shared<PPtr>(pptr);
@@ -138,16 +201,139 @@ std::shared_ptr<const void> PMSimpleArray::pop(snapshotFlag flag) {
 
 uint32_t PMSimpleArray::getLength() { return ((PVarObject *)_parr)->ob_size; }
 
-void PMSimpleArray::setLength(uint32_t new_length) { resize(new_length); }
+void PMSimpleArray::setLength(uint32_t new_length) {
+  uint32_t length = getLength();
+  if (length == new_length) return;
+  MM_TX_BEGIN(_mm) {
+    if (new_length > length) {
+      // the new slots are holes
+      if (isDoubles()) toPPtrSlots();
+      reserve(new_length);
+    }
+    _mm->snapshotRange(&(((PVarObject *)_parr)->ob_size),
+                       sizeof(PVarObject::ob_size));
+    ((PVarObject *)_parr)->ob_size = new_length;
+    if (new_length < length) {
+      truncate(length, new_length);
+    }
+  }
+  MM_TX_END(_mm)
+}
+
+void PMSimpleArray::getRange(uint32_t start, uint32_t end,
+                             std::vector<PPtr> *items) {
+  uint32_t length = getLength();
+  if (end > length) end = length;
+  bool doubles = isDoubles();
+  for (uint32_t i = start; i < end;) {
+    uint32_t offset = i & ARRAY_CHUNK_MASK;
+    uint32_t count = ARRAY_CHUNK_SIZE - offset;
+    if (count > end - i) count = end - i;
+    if (doubles) {
+      const char *slots = getSlots(i);
+      PPtr pptr = PPTR_ZERO;
+      for (uint32_t j = 0; j < count; ++j) {
+        memcpy(&(pptr.off), slots + j * sizeof(double), sizeof(double));
+        items->push_back(pptr);
+      }
+    } else {
+      PPtr *chunk = getChunk(i >> ARRAY_CHUNK_SHIFT) + offset;
+      items->insert(items->end(), chunk, chunk + count);
+    }
+    i += count;
+  }
+}
+
+// Copies a chunk at a time, with one snapshot for each.
+void PMSimpleArray::setRange(uint32_t start, const std::vector<PPtr> &items) {
+  uint32_t end = start + items.size();
+  assert(start <= getLength());
+  if (isDoubles() && !allNumbers(items)) toPPtrSlots();
+  MM_TX_BEGIN(_mm) {
+    reserve(end);
+    bool doubles = isDoubles();
+    uint64_t slot_size = slotSize();
+    for (uint32_t i = start; i < end;) {
+      uint32_t offset = i & ARRAY_CHUNK_MASK;
+      uint32_t count = ARRAY_CHUNK_SIZE - offset;
+      if (count > end - i) count = end - i;
+      char *slots = getSlots(i);
+      const PPtr *from = items.data() + (i - start);
+      _mm->snapshotRange(slots, count * slot_size);
+      if (doubles) {
+        for (uint32_t j = 0; j < count; ++j) {
+          memcpy(slots + j * sizeof(double), &(from[j].off), sizeof(double));
+        }
+      } else {
+        memcpy(slots, from, count * sizeof(PPtr));
+      }
+      i += count;
+    }
+    if (end > getLength()) {
+      PVarObject *ob = (PVarObject *)_parr;
+      _mm->snapshotRange(&(ob->ob_size), sizeof(PVarObject::ob_size));
+      ob->ob_size = end;
+    }
+  }
+  MM_TX_END(_mm)
+}
 
 void PMSimpleArray::_deallocate() {
   MM_TX_BEGIN(_mm) {
-    _mm->free(_parr->ob_items);
+    freeChunks();
     _mm->free(_pptr);
   }
   MM_TX_END(_mm)
 }
 
+// Runs the Float64 kernels over the slots, a chunk at a time.
+bool PMSimpleArray::reduce(NumberReduction op, uint32_t start, uint32_t end,
+                           double *result) {
+  if (!isDoubles()) return false;
+  uint32_t length = getLength();
+  if (end > length) end = length;
+  *result = reductionStart(op);
+  for (uint32_t i = start; i < end;) {
+    uint32_t count = ARRAY_CHUNK_SIZE - (i & ARRAY_CHUNK_MASK);
+    if (count > end - i) count = end - i;
+    reduceDoubles(op, (const double *)getSlots(i), count, result);
+    i += count;
+  }
+  return true;
+}
+
+// The chunks are copied as they are, then the items of PPtr chunks are
+// mapped one by one.
+PPtr PMSimpleArray::clone(const std::function<PPtr(PPtr)> &copy_value) {
+  PPtr copy_pptr;
+  MM_TX_BEGIN(_mm) {
+    copy_pptr = _mm->tx_copy(_pptr, sizeof(PArrayObject));
+    PArrayObject *copy = (PArrayObject *)_mm->direct(copy_pptr);
+    PPtr *chunks = getChunks();
+    if (chunks != nullptr) {
+      copy->ob_items =
+          _mm->tx_copy(_parr->ob_items, _parr->ob_chunks * sizeof(PPtr));
+      PPtr *copy_chunks = (PPtr *)_mm->direct(copy->ob_items);
+      uint64_t allocated = getAllocated();
+      uint64_t chunk_size =
+          allocated < ARRAY_CHUNK_SIZE ? allocated : ARRAY_CHUNK_SIZE;
+      uint64_t length = getLength();
+      bool doubles = isDoubles();
+      for (uint64_t c = 0; c < ARRAY_CHUNK_COUNT(allocated); ++c) {
+        copy_chunks[c] = _mm->tx_copy(chunks[c], chunk_size * slotSize());
+        if (doubles) continue;
+        PPtr *items = (PPtr *)_mm->direct(copy_chunks[c]);
+        uint64_t start = c << ARRAY_CHUNK_SHIFT;
+        for (uint64_t i = 0; i < chunk_size && start + i < length; ++i) {
+          items[i] = copy_value(items[i]);
+        }
+      }
+    }
+  }
+  MM_TX_END(_mm)
+  return copy_pptr;
+}
+
 bool PMSimpleArray::shouldConvertToNumDict(uint32_t index) {
   uint32_t allocated = getAllocated();
   if (index < allocated) return false;
@@ -158,81 +344,240 @@ bool PMSimpleArray::shouldConvertToNumDict(uint32_t index) {
   uint32_t new_allocated = (new_size >> 3) + (new_size < 9 ? 3 : 6) + new_size;
   if (new_allocated < ARRAY_MAX_UNCHECK) return false;
 
-  uint64_t array_space = new_allocated * sizeof(PPtr);
+  uint64_t array_space = new_allocated * slotSize();
   uint64_t dict_space = allocated * sizeof(PNumDictKeyEntry);
   return dict_space * ARRAY_ELEMENTS_SIZE_FACTOR < array_space;
 }
 
 void *PMSimpleArray::convertToNumDict() {
-  PPtr *items = (PPtr *)_mm->direct(_parr->ob_items);
   uint32_t size = _parr->ob_base.ob_size;
+  std::vector<PPtr> items;
+  getRange(0, size, &items);
 
   PMNumDict *pnumdict = new PMNumDict(_mm);
   MM_TX_BEGIN(_mm) {
     for (uint32_t i = 0; i < size; ++i) {
-      if (!PPTR_EQUALS(*(items + i), PPTR_NULL)) {
-        pnumdict->setProperty(i, *(items + i));
+      if (!PPTR_EQUALS(items[i], PPTR_NULL)) {
+        pnumdict->setProperty(i, items[i]);
       }
     }
-    _mm->free(_parr->ob_items);
+    freeChunks();
     _mm->free(_pptr);
   }
   MM_TX_END(_mm)
   return pnumdict;
 }
 
+bool PMSimpleArray::isDoubles() {
+  return ((PObject *)_parr)->ob_type == TYPE_CODE_DOUBLE_ARRAY;
+}
+
+uint64_t PMSimpleArray::slotSize() {
+  return isDoubles() ? sizeof(double) : sizeof(PPtr);
+}
+
+// A double is a single 8-byte store, so outside a transaction it needs none.
+void PMSimpleArray::setDouble(uint32_t idx, uint64_t bits, snapshotFlag flag) {
+  if ((idx + 1) > getAllocated()) {
+    reserve(idx + 1);
+  }
+  char *slot = getSlots(idx);
+  PVarObject *ob = (PVarObject *)_parr;
+  if (_mm->inTransaction()) {
+    MM_TX_BEGIN(_mm) {
+      if (flag) _mm->snapshotRange(slot, sizeof(double));
+      memcpy(slot, &bits, sizeof(double));
+      if (idx + 1 > getLength()) {
+        if (flag)
+          _mm->snapshotRange(&(ob->ob_size), sizeof(PVarObject::ob_size));
+        ob->ob_size = idx + 1;
+      }
+    }
+    MM_TX_END(_mm)
+  } else {
+    memcpy(slot, &bits, sizeof(double));
+    _mm->persist(slot, sizeof(double));
+    if (idx + 1 > getLength()) {
+      ob->ob_size = idx + 1;
+      _mm->persist(&(ob->ob_size), sizeof(PVarObject::ob_size));
+    }
+  }
+}
+
+// Moves the numbers of a double array to PPtr slots, the PArrayObject stays
+// where it is, so the owner keeps pointing to it.
+void PMSimpleArray::toPPtrSlots() {
+  uint32_t length = getLength();
+  std::vector<PPtr> items;
+  items.reserve(length);
+  getRange(0, length, &items);
+  MM_TX_BEGIN(_mm) {
+    _mm->snapshotRange(_parr, sizeof(PArrayObject));
+    freeChunks();
+    _parr->ob_items = PPTR_NULL;
+    _parr->allocated = 0;
+    _parr->ob_chunks = 0;
+    ((PObject *)_parr)->ob_type = TYPE_CODE_ARRAY;
+    if (length > 0) setRange(0, items);
+  }
+  MM_TX_END(_mm)
+}
+
 uint32_t PMSimpleArray::formatIndex(uint32_t index) { return index; }
 
 uint64_t PMSimpleArray::getAllocated() {
   return ((PArrayObject *)_parr)->allocated;
 }
 
-void PMSimpleArray::resize(uint32_t new_size) {
-  uint32_t allocated = getAllocated();
-  PPtr *items = getItems();
+uint64_t PMSimpleArray::overallocate(uint64_t new_size) {
+  // reuse CPython's overallocation algorithm
+  return (new_size >> 3) + (new_size < 9 ? 3 : 6) + new_size;
+}
 
-  if (allocated >= new_size && new_size >= (allocated >> 1)) {
-    // no need to allocate new space since there is enough space
-    // but initialization is required
-    assert(items != nullptr || new_size == 0);
-    MM_TX_BEGIN(_mm) {
-      PVarObject *ob = (PVarObject *)_parr;
-      _mm->snapshotRange(&(ob->ob_size), sizeof(PVarObject::ob_size));
-      ob->ob_size = new_size;
-      // set to PPTR_NULL
-      memset(items + new_size, 0, (allocated - new_size) * sizeof(PPtr));
-      _mm->persist(items + new_size, (allocated - new_size) * sizeof(PPtr));
+// Makes room for at least new_size items. Only the first chunk is ever
+// reallocated (and so copied), every other chunk is allocated once and never
+// moves.
+void PMSimpleArray::reserve(uint64_t new_size) {
+  uint64_t allocated = getAllocated();
+  if (new_size <= allocated) return;
+
+  MM_TX_BEGIN(_mm) {
+    _mm->snapshotRange(_parr, sizeof(PArrayObject));
+    if (allocated < ARRAY_CHUNK_SIZE) {
+      uint64_t first_size = overallocate(new_size);
+      if (first_size > ARRAY_CHUNK_SIZE) first_size = ARRAY_CHUNK_SIZE;
+      reserveChunks(1);
+      PPtr *chunks = getChunks();
+      const void *first;
+      if (allocated == 0) {
+        first = _mm->tx_zalloc(first_size * slotSize(), ARRAY_ITEMS_TYPE_NUM);
+      } else {
+        first = _mm->tz_zrealloc(chunks[0], first_size * slotSize(),
+                                 ARRAY_ITEMS_TYPE_NUM);
+      }
+      _mm->snapshotRange(chunks, sizeof(PPtr));
+      chunks[0] = _mm->pptr(first);
+      _parr->allocated = first_size;
+    }
+
+    uint64_t nchunks = ARRAY_CHUNK_COUNT(new_size);
+    if (nchunks > 1) {
+      reserveChunks(nchunks);
+      PPtr *chunks = getChunks();
+      for (uint64_t c = ARRAY_CHUNK_COUNT(_parr->allocated); c < nchunks;
+           ++c) {
+        const void *chunk = _mm->tx_zalloc(ARRAY_CHUNK_SIZE * slotSize(),
+                                           ARRAY_ITEMS_TYPE_NUM);
+        _mm->snapshotRange(chunks + c, sizeof(PPtr));
+        chunks[c] = _mm->pptr(chunk);
+      }
+      _parr->allocated = nchunks * ARRAY_CHUNK_SIZE;
     }
-    MM_TX_END(_mm)
-    return;
   }
+  MM_TX_END(_mm)
+}
 
-  uint32_t new_allocated = (new_size >> 3) + (new_size < 9 ? 3 : 6) + new_size;
-  if (new_size == 0) new_allocated = 0;
+// Grows the directory to hold at least nchunks chunks. Must be called inside
+// a transaction with _parr already snapshotted.
+void PMSimpleArray::reserveChunks(uint64_t nchunks) {
+  uint64_t ob_chunks = _parr->ob_chunks;
+  if (nchunks <= ob_chunks) return;
+  uint64_t new_chunks = ob_chunks < 4 ? 4 : ob_chunks;
+  while (new_chunks < nchunks) new_chunks = new_chunks << 1;
   const void *new_addr;
-  MM_TX_BEGIN(_mm) {
-    if (items == nullptr) {
-      new_addr =
-          _mm->tx_zalloc(new_allocated * sizeof(PPtr), ARRAY_ITEMS_TYPE_NUM);
+  if (ob_chunks == 0) {
+    new_addr = _mm->tx_zalloc(new_chunks * sizeof(PPtr), ARRAY_CHUNKS_TYPE_NUM);
+  } else {
+    new_addr = _mm->tz_zrealloc(_parr->ob_items, new_chunks * sizeof(PPtr),
+                                ARRAY_CHUNKS_TYPE_NUM);
+  }
+  _parr->ob_items = _mm->pptr(new_addr);
+  _parr->ob_chunks = new_chunks;
+}
+
+// Clears the slots in [new_length, old_length) and releases the chunks that
+// are not needed anymore. One spare chunk is kept, so that push and pop
+// around a chunk boundary do not allocate and free a chunk every time. Must
+// be called inside a transaction.
+void PMSimpleArray::truncate(uint32_t old_length, uint32_t new_length) {
+  uint64_t allocated = getAllocated();
+  uint64_t nchunks = ARRAY_CHUNK_COUNT(allocated);
+  uint64_t keep = ARRAY_CHUNK_COUNT(new_length) + 1;
+  PPtr *chunks = getChunks();
+
+  _mm->snapshotRange(_parr, sizeof(PArrayObject));
+  if (nchunks > 1 && keep < nchunks) {
+    _mm->snapshotRange(chunks + keep, (nchunks - keep) * sizeof(PPtr));
+    for (uint64_t c = keep; c < nchunks; ++c) {
+      _mm->free(chunks[c]);
+      chunks[c] = PPTR_NULL;
+    }
+    allocated = keep * ARRAY_CHUNK_SIZE;
+    nchunks = keep;
+    _parr->allocated = allocated;
+  }
+  if (nchunks == 1 && new_length < (allocated >> 2)) {
+    // the first chunk shrinks like it grows
+    uint64_t first_size = new_length == 0 ? 0 : overallocate(new_length);
+    if (first_size == 0) {
+      freeChunks();
+      _parr->ob_items = PPTR_NULL;
+      _parr->ob_chunks = 0;
     } else {
-      new_addr =
-          _mm->tz_zrealloc(((PArrayObject *)_parr)->ob_items,
-                           new_allocated * sizeof(PPtr), ARRAY_ITEMS_TYPE_NUM);
+      const void *first = _mm->tz_zrealloc(
+          chunks[0], first_size * slotSize(), ARRAY_ITEMS_TYPE_NUM);
+      _mm->snapshotRange(chunks, sizeof(PPtr));
+      chunks[0] = _mm->pptr(first);
     }
-    _mm->snapshotRange(_parr, sizeof(PArrayObject));
-    ((PArrayObject *)_parr)->ob_items = _mm->pptr(new_addr);
-    ((PVarObject *)_parr)->ob_size = new_size;
-    ((PArrayObject *)_parr)->allocated = new_allocated;
+    allocated = first_size;
+    _parr->allocated = allocated;
+  }
+
+  uint64_t end = old_length < allocated ? old_length : allocated;
+  for (uint64_t i = new_length; i < end;) {
+    uint64_t offset = i & ARRAY_CHUNK_MASK;
+    uint64_t count = ARRAY_CHUNK_SIZE - offset;
+    if (count > end - i) count = end - i;
+    char *slots = getSlots(i);
+    _mm->snapshotRange(slots, count * slotSize());
+    memset(slots, 0, count * slotSize());
+    i += count;
   }
-  MM_TX_END(_mm)
 }
 
-PPtr *PMSimpleArray::getItems() {
-  PPtr items_pptr = ((PArrayObject *)_parr)->ob_items;
-  if (PPTR_EQUALS(items_pptr, PPTR_NULL)) {
+// Frees every chunk and the directory. Must be called inside a transaction.
+void PMSimpleArray::freeChunks() {
+  PPtr *chunks = getChunks();
+  if (chunks == nullptr) return;
+  uint64_t nchunks = ARRAY_CHUNK_COUNT(getAllocated());
+  for (uint64_t c = 0; c < nchunks; ++c) {
+    _mm->free(chunks[c]);
+  }
+  _mm->free(_parr->ob_items);
+}
+
+PPtr *PMSimpleArray::getChunks() {
+  PPtr chunks_pptr = ((PArrayObject *)_parr)->ob_items;
+  if (PPTR_EQUALS(chunks_pptr, PPTR_NULL)) {
     return nullptr;
   }
-  return (PPtr *)_mm->direct(items_pptr);
+  return (PPtr *)_mm->direct(chunks_pptr);
+}
+
+PPtr *PMSimpleArray::getChunk(uint64_t chunk) {
+  return (PPtr *)_mm->direct(getChunks()[chunk]);
+}
+
+PPtr *PMSimpleArray::getItem(uint32_t idx) {
+  assert(idx < getAllocated());
+  return getChunk(idx >> ARRAY_CHUNK_SHIFT) + (idx & ARRAY_CHUNK_MASK);
+}
+
+// the slots from idx to the end of its chunk, of either kind
+char *PMSimpleArray::getSlots(uint32_t idx) {
+  assert(idx < getAllocated());
+  return (char *)_mm->direct(getChunks()[idx >> ARRAY_CHUNK_SHIFT]) +
+         (idx & ARRAY_CHUNK_MASK) * slotSize();
 }
 
 // NumDict
@@ -260,48 +605,49 @@ void PMNumDict::setProperty(uint32_t index, PPtr value_pptr,
                             snapshotFlag flag) {
   assert(index < UINT32_MAX);
   uint64_t khash = fixedHash(index);
-  PNumDictKeysObject *keys = getKeys();
-  PNumDictKeyEntry *ep = lookup(index, khash);
 
   MM_TX_BEGIN(_mm) {
-    PPtr old_value_pptr = ep->me_value;
-    uint32_t me_key = ep->me_key;
-    uint32_t me_state = ep->me_state;
-    if (!PPTR_EQUALS(old_value_pptr, PPTR_NULL)) {
-      assert(me_state != ENTRY_NULL && me_state != ENTRY_DUMMY);
+    migrate(MIGRATE_STEP);
+    PNumDictKeysObject *keys = getKeys();
+    PNumDictKeyEntry *ep = lookup(keys, index, khash);
+    PNumDictKeyEntry *old_ep = nullptr;
+    if (ep->me_state != ENTRY_FULL) {
+      old_ep = lookupOld(index, khash);
+    }
+    if (old_ep != nullptr) {
+      // not migrated yet, update it in the old key table
+      if (flag) _mm->snapshotRange(&(old_ep->me_value), sizeof(PPtr));
+      old_ep->me_value = value_pptr;
+    } else if (ep->me_state == ENTRY_FULL) {
+      assert(ep->me_key == index);
       if (flag) _mm->snapshotRange(&(ep->me_value), sizeof(PPtr));
       ep->me_value = value_pptr;
     } else {
-      if (flag) _mm->snapshotRange(ep, sizeof(PNumDictKeyEntry));
-      if (me_state == ENTRY_NULL) {
+      if (ep->me_state == ENTRY_NULL) {
         if (keys->dk_usable <= 0) {
           insertionResize();
           keys = getKeys();
         }
-        ep = findEmptySlot(khash);
+        ep = findEmptySlot(keys, khash);
         if (flag) _mm->snapshotRange(&(keys->dk_usable), sizeof(int64_t));
         keys->dk_usable -= 1;
         assert(keys->dk_usable >= 0);
-        ep->me_key = index;
-        ep->me_hash = khash;
-        ep->me_state = ENTRY_FULL;
-        if (flag)
-          _mm->snapshotRange(&(_pnumdict->ob_base.ob_size), sizeof(int64_t));
-        if (_pnumdict->ob_base.ob_size < index + 1)
-          _pnumdict->ob_base.ob_size = index + 1;
-
       } else {
-        if (me_state == ENTRY_DUMMY) {
-          ep->me_key = me_key;
-          ep->me_hash = khash;
-        } else {
-          throw "failed to set property";
-        }
+        // reuse the tombstone, it is already counted out of dk_usable
+        assert(ep->me_state == ENTRY_DUMMY);
       }
+      if (flag) _mm->snapshotRange(ep, sizeof(PNumDictKeyEntry));
+      ep->me_key = index;
+      ep->me_hash = khash;
+      ep->me_state = ENTRY_FULL;
+      ep->me_value = value_pptr;
       if (flag) _mm->snapshotRange(&(_pnumdict->ma_used), sizeof(int64_t));
       _pnumdict->ma_used += 1;
-      ep->me_value = value_pptr;
-      assert(ep->me_state != ENTRY_NULL && ep->me_state != ENTRY_DUMMY);
+      if (_pnumdict->ob_base.ob_size < index + 1) {
+        if (flag)
+          _mm->snapshotRange(&(_pnumdict->ob_base.ob_size), sizeof(int64_t));
+        _pnumdict->ob_base.ob_size = index + 1;
+      }
     }
   }
   MM_TX_END(_mm)
@@ -311,16 +657,27 @@ PPtr PMNumDict::getProperty(uint32_t key) {
   if (key >= getLength()) {
     return PPTR_UNDEFINED;
   }
-  uint64_t khash = fixedHash(key);
-  PNumDictKeyEntry *ep = lookup(key, khash);
-  if (ep->me_state == ENTRY_NULL) {
+  PNumDictKeyEntry *ep = find(key);
+  if (ep == nullptr) {
     return PPTR_UNDEFINED;
   }
   return ep->me_value;
 }
 
 void PMNumDict::delProperty(uint32_t key, snapshotFlag flag) {
-  setProperty(key, PPTR_NULL, flag);
+  MM_TX_BEGIN(_mm) {
+    migrate(MIGRATE_STEP);
+    PNumDictKeyEntry *ep = find(key);
+    if (ep != nullptr) {
+      if (flag) _mm->snapshotRange(ep, sizeof(PNumDictKeyEntry));
+      ep->me_value = PPTR_NULL;
+      ep->me_state = ENTRY_DUMMY;
+      if (flag) _mm->snapshotRange(&(_pnumdict->ma_used), sizeof(int64_t));
+      _pnumdict->ma_used -= 1;
+      deletionResize();
+    }
+  }
+  MM_TX_END(_mm)
 }
 
 std::list<uint32_t> PMNumDict::getValidIndex() {
@@ -335,6 +692,18 @@ std::list<uint32_t> PMNumDict::getValidIndex() {
       indexes.push_back(ep->me_key);
     }
   }
+  if (isMigrating()) {
+    // entries before ma_migrated are stale copies of migrated ones
+    keys = getOldKeys();
+    dk_size = keys->dk_size;
+    ep0 = keys->dk_entries;
+    for (int i = _pnumdict->ma_migrated; i < dk_size; ++i) {
+      ep = ep0 + i;
+      if (ep->me_state == ENTRY_FULL) {
+        indexes.push_back(ep->me_key);
+      }
+    }
+  }
   return indexes;
 }
 
@@ -346,9 +715,8 @@ void PMNumDict::push(PPtr value_pptr, snapshotFlag flag) {
 std::shared_ptr<const void> PMNumDict::pop(snapshotFlag flag) {
   uint32_t length = getLength();
   uint32_t key = length - 1;
-  uint64_t khash = fixedHash(key);
-  PNumDictKeyEntry *ep = lookup(key, khash);
-  if (ep->me_state == ENTRY_NULL) {
+  PNumDictKeyEntry *ep = find(key);
+  if (ep == nullptr) {
     return std::make_shared<PPtr>(PPTR_UNDEFINED);
   }
   PPtr old_value_pptr;
@@ -360,6 +728,7 @@ std::shared_ptr<const void> PMNumDict::pop(snapshotFlag flag) {
     _pnumdict->ma_used -= 1;
     _pnumdict->ob_base.ob_size -= 1;
     ep->me_state = ENTRY_DUMMY;
+    deletionResize();
   }
   MM_TX_END(_mm)
   return std::make_shared<PPtr>(old_value_pptr);
@@ -383,14 +752,68 @@ void PMNumDict::setLength(uint32_t new_length) {
   MM_TX_END(_mm)
 }
 
+void PMNumDict::getRange(uint32_t start, uint32_t end,
+                         std::vector<PPtr> *items) {
+  uint32_t length = getLength();
+  if (end > length) end = length;
+  for (uint32_t i = start; i < end; ++i) {
+    PNumDictKeyEntry *ep = find(i);
+    items->push_back(ep == nullptr ? PPTR_NULL : ep->me_value);
+  }
+}
+
+void PMNumDict::setRange(uint32_t start, const std::vector<PPtr> &items) {
+  assert(start <= getLength());
+  MM_TX_BEGIN(_mm) {
+    for (size_t i = 0; i < items.size(); ++i) {
+      if (PPTR_EQUALS(items[i], PPTR_NULL)) {
+        delProperty(start + i);
+      } else {
+        setProperty(start + i, items[i]);
+      }
+    }
+    // a trailing hole does not extend the length by itself
+    if (start + items.size() > getLength()) setLength(start + items.size());
+  }
+  MM_TX_END(_mm)
+}
+
 void PMNumDict::_deallocate() {
   MM_TX_BEGIN(_mm) {
     _mm->free(_pnumdict->ma_keys);
+    _mm->free(_pnumdict->ma_oldkeys);
     _mm->free(_pptr);
   }
   MM_TX_END(_mm)
 }
 
+PPtr PMNumDict::clone(const std::function<PPtr(PPtr)> &copy_value) {
+  PPtr copy_pptr;
+  MM_TX_BEGIN(_mm) {
+    copy_pptr = _mm->tx_copy(_pptr, sizeof(PNumDictObject));
+    PNumDictObject *copy = (PNumDictObject *)_mm->direct(copy_pptr);
+    PPtr *tables[2] = {&(copy->ma_keys), &(copy->ma_oldkeys)};
+    for (int t = 0; t < 2; ++t) {
+      if (PPTR_EQUALS(*tables[t], PPTR_NULL)) continue;
+      PNumDictKeysObject *keys = (PNumDictKeysObject *)_mm->direct(*tables[t]);
+      uint64_t size = sizeof(PNumDictKeysObject) +
+                      sizeof(PNumDictKeyEntry) * (keys->dk_size - 1);
+      *tables[t] = _mm->tx_copy(*tables[t], size);
+      keys = (PNumDictKeysObject *)_mm->direct(*tables[t]);
+      // the entries before ma_migrated in the old table are stale
+      for (uint64_t i = (t == 0) ? 0 : copy->ma_migrated; i < keys->dk_size;
+           ++i) {
+        PNumDictKeyEntry *ep = keys->dk_entries + i;
+        if (ep->me_state == ENTRY_FULL) {
+          ep->me_value = copy_value(ep->me_value);
+        }
+      }
+    }
+  }
+  MM_TX_END(_mm)
+  return copy_pptr;
+}
+
 bool PMNumDict::shouldConvertToSimpleArray(uint32_t key) {
   uint32_t length = getLength();
   uint32_t allocated = getAllocated();
@@ -405,6 +828,9 @@ bool PMNumDict::shouldConvertToSimpleArray(uint32_t key) {
 }
 
 void *PMNumDict::convertToSimpleArray() {
+  if (isMigrating()) {
+    resize(getKeys()->dk_size);
+  }
   PNumDictKeysObject *pkeys =
       (PNumDictKeysObject *)_mm->direct(_pnumdict->ma_keys);
   uint32_t dk_size = pkeys->dk_size;
@@ -418,15 +844,14 @@ void *PMNumDict::convertToSimpleArray() {
     // resize() is invoked during the process, which tx_zalloc() a region
     // so that no snapshot is required
     parr->setProperty(size - 1, PPTR_UNDEFINED);
-    PArrayObject *parr_obj = (PArrayObject *)_mm->direct(parr->getPPtr());
-    PPtr *items = (PPtr *)_mm->direct(parr_obj->ob_items);
     uint32_t index;
     for (size_t i = 0; i < dk_size; ++i) {
       ep = ep0 + i;
       if (ep->me_state == ENTRY_FULL) {
         index = ep->me_key;
         assert(index < size);
-        *(items + index) = ep->me_value;
+        // the chunks are fresh, there is nothing to snapshot
+        parr->setProperty(index, ep->me_value, kNotSnapshot);
       }
     }
     _mm->free(_pnumdict->ma_keys);
@@ -445,6 +870,14 @@ PNumDictKeysObject *PMNumDict::getKeys() {
   return (PNumDictKeysObject *)_mm->direct(_pnumdict->ma_keys);
 }
 
+PNumDictKeysObject *PMNumDict::getOldKeys() {
+  return (PNumDictKeysObject *)_mm->direct(_pnumdict->ma_oldkeys);
+}
+
+bool PMNumDict::isMigrating() {
+  return !PPTR_EQUALS(_pnumdict->ma_oldkeys, PPTR_NULL);
+}
+
 PPtr PMNumDict::newKeysObject(uint64_t size) {
   assert(size > MIN_SIZE_SPLIT);
 
@@ -482,87 +915,184 @@ uint64_t PMNumDict::fixedHash(uint32_t key) {
   return (uint64_t)key;
 }
 
-PNumDictKeyEntry *PMNumDict::lookup(uint32_t key, uint64_t khash) {
-  while (true) {
-    PPtr ma_keys = _pnumdict->ma_keys;
-    PNumDictKeysObject *keys = (PNumDictKeysObject *)_mm->direct(ma_keys);
-
-    ssize_t mask = keys->dk_size - 1;
-    PNumDictKeyEntry *ep0 = keys->dk_entries;
-    ssize_t idx = khash & mask;
-    PNumDictKeyEntry *ep = ep0 + idx;
-    uint32_t me_key = ep->me_key;
-    uint32_t me_state = ep->me_state;
-    PNumDictKeyEntry *freeslot;
+// Returns the entry of the key if it exists, otherwise the first empty or
+// dummy entry on the probe sequence of the key.
+PNumDictKeyEntry *PMNumDict::lookup(PNumDictKeysObject *keys, uint32_t key,
+                                    uint64_t khash) {
+  ssize_t mask = keys->dk_size - 1;
+  PNumDictKeyEntry *ep0 = keys->dk_entries;
+  ssize_t idx = khash & mask;
+  PNumDictKeyEntry *ep = ep0 + idx;
+  uint32_t me_key = ep->me_key;
+  uint32_t me_state = ep->me_state;
+  PNumDictKeyEntry *freeslot;
+
+  if (me_state == ENTRY_NULL) {
+    return ep;
+  } else if (me_state == ENTRY_DUMMY) {
+    freeslot = ep;
+  } else {
+    if (ep->me_key == key) {
+      return ep;
+    }
+    freeslot = nullptr;
+  }
+  uint64_t perturb = khash;
 
+  while (true) {
+    idx = (idx << 2) + idx + perturb + 1;
+    ep = ep0 + (idx & mask);
+    me_key = ep->me_key;
+    me_state = ep->me_state;
     if (me_state == ENTRY_NULL) {
+      return (freeslot == nullptr) ? ep : freeslot;
+    }
+    if (me_state == ENTRY_FULL && me_key == key) {
       return ep;
-    } else if (me_state == ENTRY_DUMMY) {
+    } else if (me_state == ENTRY_DUMMY && freeslot == nullptr) {
       freeslot = ep;
-    } else {
-      if (ep->me_key == key) {
-        return ep;
-      }
-      freeslot = nullptr;
     }
-    uint64_t perturb = khash;
+    perturb = perturb >> PERTURB_SHIFT;
+  }
+}
 
-    while (true) {
-      idx = (idx << 2) + idx + perturb + 1;
-      ep = ep0 + (idx & mask);
-      me_key = ep->me_key;
-      me_state = ep->me_state;
-      if (me_state == ENTRY_NULL) {
-        return (freeslot == nullptr) ? ep : freeslot;
-      }
-      if (me_key == key) {
-        return ep;
-      } else if (me_state == ENTRY_DUMMY && freeslot == nullptr) {
-        freeslot = ep;
-      }
-      perturb = perturb >> PERTURB_SHIFT;
-    }
+// Returns the entry of the key in the old key table if a resize is in
+// progress and the key has not been migrated yet, otherwise nullptr.
+PNumDictKeyEntry *PMNumDict::lookupOld(uint32_t key, uint64_t khash) {
+  if (!isMigrating()) return nullptr;
+  PNumDictKeysObject *old_keys = getOldKeys();
+  PNumDictKeyEntry *ep = lookup(old_keys, key, khash);
+  if (ep->me_state != ENTRY_FULL ||
+      (uint64_t)(ep - old_keys->dk_entries) < _pnumdict->ma_migrated) {
+    return nullptr;
   }
+  return ep;
+}
+
+// Returns the live entry of the key in either key table, or nullptr.
+PNumDictKeyEntry *PMNumDict::find(uint32_t key) {
+  uint64_t khash = fixedHash(key);
+  PNumDictKeyEntry *ep = lookup(getKeys(), key, khash);
+  if (ep->me_state == ENTRY_FULL) return ep;
+  return lookupOld(key, khash);
 }
 
 void PMNumDict::insertionResize() {
-  size_t minused = growRate();
-  size_t newsize = MIN_SIZE_COMBINED;
-  while (newsize <= minused && newsize > 0) {
-    newsize = newsize << 1;
+  if (isMigrating()) {
+    // the new table ran out of space before the old one was drained, so
+    // finish the resize at once
+    resize(calculateKeysize(growRate()));
+    return;
   }
-  PNumDictKeysObject *old_keys = getKeys();
-  PPtr old_keys_pptr = _pnumdict->ma_keys;
+  // Tombstones consume dk_usable as well, if they outnumber the live entries
+  // rehashing at the current size is enough to make room again.
+  if (countDummies() > _pnumdict->ma_used) {
+    startMigration(getKeys()->dk_size);
+    return;
+  }
+  startMigration(calculateKeysize(growRate()));
+}
+
+void PMNumDict::deletionResize() {
+  uint64_t dk_size = getKeys()->dk_size;
+  if (isMigrating() || dk_size <= MIN_SIZE_COMBINED ||
+      _pnumdict->ma_used >= dk_size / SHRINK_FACTOR) {
+    return;
+  }
+  uint64_t newsize = calculateKeysize(_pnumdict->ma_used * SHRINK_TARGET);
+  if (newsize < dk_size) {
+    startMigration(newsize);
+  }
+}
+
+// Rehashes every entry into a new key table of newsize at once.
+void PMNumDict::resize(uint64_t newsize) {
+  PPtr keys_pptr = _pnumdict->ma_keys;
+  PPtr old_keys_pptr = _pnumdict->ma_oldkeys;
 
   MM_TX_BEGIN(_mm) {
-    _mm->snapshotRange(&(_pnumdict->ma_keys), sizeof(PPtr));
+    PNumDictKeysObject *keys = getKeys();
+    PNumDictKeysObject *old_keys = getOldKeys();
+    _mm->snapshotRange(_pnumdict, sizeof(PNumDictObject));
     _pnumdict->ma_keys = newKeysObject(newsize);
-    size_t oldsize = old_keys->dk_size;
-    PNumDictKeyEntry *old_ep0 = old_keys->dk_entries;
-    for (size_t i = 0; i < oldsize; ++i) {
-      PNumDictKeyEntry *old_ep = old_ep0 + i;
-      PPtr me_value = old_ep->me_value;
-      if (!PPTR_EQUALS(me_value, PPTR_NULL)) {
-        uint32_t me_key = old_ep->me_key;
-        uint32_t me_state = old_ep->me_state;
-        assert(me_state != ENTRY_DUMMY);
-        uint64_t me_hash = old_ep->me_hash;
-        PNumDictKeyEntry *new_ep = findEmptySlot(me_hash);
-        new_ep->me_key = me_key;
-        new_ep->me_state = me_state;
-        new_ep->me_hash = me_hash;
-        new_ep->me_value = me_value;
-      }
+    moveEntries(keys, 0, keys->dk_size, kNotSnapshot);
+    if (old_keys != nullptr) {
+      moveEntries(old_keys, _pnumdict->ma_migrated, old_keys->dk_size,
+                  kNotSnapshot);
     }
-    PNumDictKeysObject *new_keys = getKeys();
-    new_keys->dk_usable -= _pnumdict->ma_used;
+    _pnumdict->ma_oldkeys = PPTR_NULL;
+    _pnumdict->ma_migrated = 0;
+    _mm->free(keys_pptr);
     _mm->free(old_keys_pptr);
   }
   MM_TX_END(_mm)
 }
 
-PNumDictKeyEntry *PMNumDict::findEmptySlot(uint64_t khash) {
+// Installs an empty key table of newsize, the entries of the current one are
+// moved over by later calls to migrate().
+void PMNumDict::startMigration(uint64_t newsize) {
+  MM_TX_BEGIN(_mm) {
+    _mm->snapshotRange(_pnumdict, sizeof(PNumDictObject));
+    _pnumdict->ma_oldkeys = _pnumdict->ma_keys;
+    _pnumdict->ma_keys = newKeysObject(newsize);
+    _pnumdict->ma_migrated = 0;
+  }
+  MM_TX_END(_mm)
+}
+
+void PMNumDict::migrate(uint64_t nslots) {
+  if (!isMigrating()) return;
+  PNumDictKeysObject *old_keys = getOldKeys();
+  uint64_t start = _pnumdict->ma_migrated;
+  uint64_t end = start + nslots;
+  if (end > old_keys->dk_size) end = old_keys->dk_size;
+  MM_TX_BEGIN(_mm) {
+    moveEntries(old_keys, start, end, kSnapshot);
+    if (end == old_keys->dk_size) {
+      _mm->snapshotRange(&(_pnumdict->ma_oldkeys), sizeof(PPtr));
+      _mm->free(_pnumdict->ma_oldkeys);
+      _pnumdict->ma_oldkeys = PPTR_NULL;
+      end = 0;
+    }
+    _mm->snapshotRange(&(_pnumdict->ma_migrated), sizeof(uint64_t));
+    _pnumdict->ma_migrated = end;
+  }
+  MM_TX_END(_mm)
+}
+
+// Inserts the live entries in [start, end) of from into the current key
+// table, the entries in from are left as is.
+void PMNumDict::moveEntries(PNumDictKeysObject *from, uint64_t start,
+                            uint64_t end, snapshotFlag flag) {
   PNumDictKeysObject *keys = getKeys();
+  PNumDictKeyEntry *from_ep0 = from->dk_entries;
+  for (uint64_t i = start; i < end; ++i) {
+    PNumDictKeyEntry *from_ep = from_ep0 + i;
+    if (from_ep->me_state == ENTRY_FULL) {
+      uint64_t me_hash = from_ep->me_hash;
+      PNumDictKeyEntry *new_ep = findEmptySlot(keys, me_hash);
+      if (flag) _mm->snapshotRange(new_ep, sizeof(PNumDictKeyEntry));
+      new_ep->me_key = from_ep->me_key;
+      new_ep->me_state = ENTRY_FULL;
+      new_ep->me_hash = me_hash;
+      new_ep->me_value = from_ep->me_value;
+      if (flag) _mm->snapshotRange(&(keys->dk_usable), sizeof(int64_t));
+      keys->dk_usable -= 1;
+      assert(keys->dk_usable >= 0);
+    }
+  }
+}
+
+uint64_t PMNumDict::calculateKeysize(uint64_t minsize) {
+  uint64_t newsize = MIN_SIZE_COMBINED;
+  while (newsize <= minsize && newsize > 0) {
+    newsize = newsize << 1;
+  }
+  return newsize;
+}
+
+PNumDictKeyEntry *PMNumDict::findEmptySlot(PNumDictKeysObject *keys,
+                                           uint64_t khash) {
   ssize_t mask = keys->dk_size - 1;
   PNumDictKeyEntry *ep0 = keys->dk_entries;
   ssize_t idx = khash & mask;
@@ -577,6 +1107,13 @@ PNumDictKeyEntry *PMNumDict::findEmptySlot(uint64_t khash) {
   return ep;
 }
 
+uint64_t PMNumDict::countDummies() {
+  // every occupied slot, live or dummy, has been taken from dk_usable
+  assert(!isMigrating());
+  PNumDictKeysObject *keys = getKeys();
+  return usableFraction(keys->dk_size) - keys->dk_usable - _pnumdict->ma_used;
+}
+
 uint64_t PMNumDict::growRate() {
   PNumDictKeysObject *keys = getKeys();
   assert(_pnumdict->ma_used < UINT32_MAX);
@@ -3,14 +3,24 @@
 
 #include <stddef.h>
 #include <sys/stat.h>
+#include <functional>
 #include <list>
 #include <memory>
+#include <vector>
 
 #include "memorymanager.h"
 
 namespace internal {
+enum NumberReduction { kReduceSum, kReduceMin, kReduceMax };
+
 namespace impl {
 
+// Folds the reduction of n doubles into *acc, which starts at
+// reductionStart(op). Same results as the Float64 kernels of typed arrays.
+double reductionStart(NumberReduction op);
+void reduceDoubles(NumberReduction op, const double* values, uint64_t n,
+                   double* acc);
+
 class PMArray {
  public:
   virtual ~PMArray() = 0;
@@ -24,7 +34,21 @@ class PMArray {
   virtual std::shared_ptr<const void> pop(snapshotFlag flag = kSnapshot) = 0;
   virtual uint32_t getLength() = 0;
   virtual void setLength(uint32_t new_length) = 0;
+  // Reads the items in [start, end), a hole reads as PPTR_NULL.
+  virtual void getRange(uint32_t start, uint32_t end,
+                        std::vector<PPtr>* items) = 0;
+  // Overwrites the items from start on, start must be within the length and
+  // the items past it extend the array. A PPTR_NULL item makes a hole.
+  virtual void setRange(uint32_t start, const std::vector<PPtr>& items) = 0;
   virtual void _deallocate() = 0;
+  // Folds the items in [start, end) into *result if they are kept as
+  // doubles, otherwise returns false and leaves it to the caller.
+  virtual bool reduce(NumberReduction op, uint32_t start, uint32_t end,
+                      double* result) {
+    return false;
+  };
+  // A copy in new allocations whose values are mapped by copy_value.
+  virtual PPtr clone(const std::function<PPtr(PPtr)>& copy_value) = 0;
 
   virtual bool shouldConvertToNumDict(uint32_t index) { return false; };
   virtual bool shouldConvertToSimpleArray(uint32_t index) { return false; };
@@ -38,7 +62,8 @@ class PMArray {
 
 class PMSimpleArray : public PMArray {
  public:
-  PMSimpleArray(MemoryManager* mm);
+  // doubles starts it as a TYPE_CODE_DOUBLE_ARRAY
+  PMSimpleArray(MemoryManager* mm, bool doubles = false);
   PMSimpleArray(MemoryManager* mm, PPtr pptr);
   ~PMSimpleArray(){};
   PPtr getPPtr();
@@ -51,16 +76,32 @@ class PMSimpleArray : public PMArray {
   std::shared_ptr<const void> pop(snapshotFlag flag = kSnapshot);
   uint32_t getLength();
   void setLength(uint32_t new_length);
+  void getRange(uint32_t start, uint32_t end, std::vector<PPtr>* items);
+  void setRange(uint32_t start, const std::vector<PPtr>& items);
   void _deallocate();
+  bool reduce(NumberReduction op, uint32_t start, uint32_t end,
+              double* result);
+  PPtr clone(const std::function<PPtr(PPtr)>& copy_value);
 
   bool shouldConvertToNumDict(uint32_t index);
   void* convertToNumDict();
 
  private:
+  bool isDoubles();
+  uint64_t slotSize();
+  void setDouble(uint32_t idx, uint64_t bits, snapshotFlag flag);
+  void toPPtrSlots();
   uint32_t formatIndex(uint32_t index);
   uint64_t getAllocated();
-  void resize(uint32_t new_size);
-  PPtr* getItems();
+  uint64_t overallocate(uint64_t new_size);
+  void reserve(uint64_t new_size);
+  void reserveChunks(uint64_t nchunks);
+  void truncate(uint32_t old_length, uint32_t new_length);
+  void freeChunks();
+  PPtr* getChunks();
+  PPtr* getChunk(uint64_t chunk);
+  PPtr* getItem(uint32_t idx);
+  char* getSlots(uint32_t idx);
 
   MemoryManager* _mm;
   PPtr _pptr;
@@ -82,7 +123,10 @@ class PMNumDict : public PMArray {
   std::shared_ptr<const void> pop(snapshotFlag flag = kSnapshot);
   uint32_t getLength();
   void setLength(uint32_t new_length);
+  void getRange(uint32_t start, uint32_t end, std::vector<PPtr>* items);
+  void setRange(uint32_t start, const std::vector<PPtr>& items);
   void _deallocate();
+  PPtr clone(const std::function<PPtr(PPtr)>& copy_value);
 
   bool shouldConvertToSimpleArray(uint32_t key);
   void* convertToSimpleArray();
@@ -90,12 +134,25 @@ class PMNumDict : public PMArray {
  private:
   uint64_t getAllocated();
   PNumDictKeysObject* getKeys();
+  PNumDictKeysObject* getOldKeys();
+  bool isMigrating();
   PPtr newKeysObject(uint64_t size);
   uint64_t usableFraction(uint64_t size);
   uint64_t fixedHash(uint32_t key);
-  PNumDictKeyEntry* lookup(uint32_t key, uint64_t khash);
+  PNumDictKeyEntry* lookup(PNumDictKeysObject* keys, uint32_t key,
+                           uint64_t khash);
+  PNumDictKeyEntry* lookupOld(uint32_t key, uint64_t khash);
+  PNumDictKeyEntry* find(uint32_t key);
   void insertionResize();
-  PNumDictKeyEntry* findEmptySlot(uint64_t khash);
+  void deletionResize();
+  void resize(uint64_t newsize);
+  void startMigration(uint64_t newsize);
+  void migrate(uint64_t nslots);
+  void moveEntries(PNumDictKeysObject* from, uint64_t start, uint64_t end,
+                   snapshotFlag flag);
+  uint64_t calculateKeysize(uint64_t minsize);
+  PNumDictKeyEntry* findEmptySlot(PNumDictKeysObject* keys, uint64_t khash);
+  uint64_t countDummies();
   uint64_t growRate();
 
   MemoryManager* _mm;
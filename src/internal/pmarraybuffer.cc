@@ -1,7 +1,287 @@
+#include <math.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "pmarraybuffer.h"
 #include "common.h"
 
 namespace internal {
+
+static const uint32_t element_sizes[ELEMENT_KIND_MAX] = {1, 1, 1, 1, 2,
+                                                         2, 4, 4, 4, 8};
+
+// Calls F<T>(args...) with T being the C type of the elements of kind.
+#define DISPATCH_ELEMENT_KIND(kind, F, ...)                           \
+  switch (kind) {                                                     \
+    case ELEMENT_KIND_INT8:                                           \
+      return F<int8_t>(__VA_ARGS__);                                  \
+    case ELEMENT_KIND_UINT8:                                          \
+    case ELEMENT_KIND_UINT8_CLAMPED:                                  \
+      return F<uint8_t>(__VA_ARGS__);                                 \
+    case ELEMENT_KIND_INT16:                                          \
+      return F<int16_t>(__VA_ARGS__);                                 \
+    case ELEMENT_KIND_UINT16:                                         \
+      return F<uint16_t>(__VA_ARGS__);                                \
+    case ELEMENT_KIND_INT32:                                          \
+      return F<int32_t>(__VA_ARGS__);                                 \
+    case ELEMENT_KIND_UINT32:                                         \
+      return F<uint32_t>(__VA_ARGS__);                                \
+    case ELEMENT_KIND_FLOAT32:                                        \
+      return F<float>(__VA_ARGS__);                                   \
+    case ELEMENT_KIND_FLOAT64:                                        \
+      return F<double>(__VA_ARGS__);                                  \
+    default:                                                          \
+      throw "not a typed array";                                      \
+  }
+
+template <typename T>
+static double sumOf(const void *data, uint64_t n) {
+  const T *elements = (const T *)data;
+  double result = 0;
+  for (uint64_t i = 0; i < n; ++i) result += elements[i];
+  return result;
+}
+
+template <typename T>
+static double dotOf(const void *a, const void *b, uint64_t n) {
+  const T *x = (const T *)a;
+  const T *y = (const T *)b;
+  double result = 0;
+  for (uint64_t i = 0; i < n; ++i) result += (double)x[i] * y[i];
+  return result;
+}
+
+// Like Math.min/Math.max, NaN wins and an empty range gives +/-Infinity.
+template <typename T>
+static double minOf(const void *data, uint64_t n) {
+  const T *elements = (const T *)data;
+  double result = INFINITY;
+  for (uint64_t i = 0; i < n; ++i) {
+    double v = elements[i];
+    if (v != v) return NAN;
+    if (v < result) result = v;
+  }
+  return result;
+}
+
+template <typename T>
+static double maxOf(const void *data, uint64_t n) {
+  const T *elements = (const T *)data;
+  double result = -INFINITY;
+  for (uint64_t i = 0; i < n; ++i) {
+    double v = elements[i];
+    if (v != v) return NAN;
+    if (v > result) result = v;
+  }
+  return result;
+}
+
+#ifdef __SSE2__
+// Float64 kernels process 4 elements per iteration in two registers. The
+// summation order differs from a plain loop, so results may differ in the
+// last bits.
+template <>
+double sumOf<double>(const void *data, uint64_t n) {
+  const double *elements = (const double *)data;
+  __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+  uint64_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    acc0 = _mm_add_pd(acc0, _mm_loadu_pd(elements + i));
+    acc1 = _mm_add_pd(acc1, _mm_loadu_pd(elements + i + 2));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+  double result = lanes[0] + lanes[1];
+  for (; i < n; ++i) result += elements[i];
+  return result;
+}
+
+template <>
+double dotOf<double>(const void *a, const void *b, uint64_t n) {
+  const double *x = (const double *)a;
+  const double *y = (const double *)b;
+  __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+  uint64_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    acc0 = _mm_add_pd(acc0,
+                      _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+    acc1 = _mm_add_pd(
+        acc1, _mm_mul_pd(_mm_loadu_pd(x + i + 2), _mm_loadu_pd(y + i + 2)));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+  double result = lanes[0] + lanes[1];
+  for (; i < n; ++i) result += x[i] * y[i];
+  return result;
+}
+
+// minpd/maxpd do not propagate NaN, so unordered lanes are tracked apart.
+template <>
+double minOf<double>(const void *data, uint64_t n) {
+  const double *elements = (const double *)data;
+  __m128d acc = _mm_set1_pd(INFINITY);
+  __m128d nan = _mm_setzero_pd();
+  uint64_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128d v = _mm_loadu_pd(elements + i);
+    nan = _mm_or_pd(nan, _mm_cmpunord_pd(v, v));
+    acc = _mm_min_pd(acc, v);
+  }
+  if (_mm_movemask_pd(nan)) return NAN;
+  double lanes[2];
+  _mm_storeu_pd(lanes, acc);
+  double result = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+  for (; i < n; ++i) {
+    if (elements[i] != elements[i]) return NAN;
+    if (elements[i] < result) result = elements[i];
+  }
+  return result;
+}
+
+template <>
+double maxOf<double>(const void *data, uint64_t n) {
+  const double *elements = (const double *)data;
+  __m128d acc = _mm_set1_pd(-INFINITY);
+  __m128d nan = _mm_setzero_pd();
+  uint64_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128d v = _mm_loadu_pd(elements + i);
+    nan = _mm_or_pd(nan, _mm_cmpunord_pd(v, v));
+    acc = _mm_max_pd(acc, v);
+  }
+  if (_mm_movemask_pd(nan)) return NAN;
+  double lanes[2];
+  _mm_storeu_pd(lanes, acc);
+  double result = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+  for (; i < n; ++i) {
+    if (elements[i] != elements[i]) return NAN;
+    if (elements[i] > result) result = elements[i];
+  }
+  return result;
+}
+
+// Float32 elements are widened to double before they are accumulated.
+template <>
+double sumOf<float>(const void *data, uint64_t n) {
+  const float *elements = (const float *)data;
+  __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+  uint64_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 v = _mm_loadu_ps(elements + i);
+    acc0 = _mm_add_pd(acc0, _mm_cvtps_pd(v));
+    acc1 = _mm_add_pd(acc1, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+  double result = lanes[0] + lanes[1];
+  for (; i < n; ++i) result += elements[i];
+  return result;
+}
+
+template <>
+double dotOf<float>(const void *a, const void *b, uint64_t n) {
+  const float *x = (const float *)a;
+  const float *y = (const float *)b;
+  __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+  uint64_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 vx = _mm_loadu_ps(x + i);
+    __m128 vy = _mm_loadu_ps(y + i);
+    acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_cvtps_pd(vx), _mm_cvtps_pd(vy)));
+    acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(vx, vx)),
+                                       _mm_cvtps_pd(_mm_movehl_ps(vy, vy))));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+  double result = lanes[0] + lanes[1];
+  for (; i < n; ++i) result += (double)x[i] * y[i];
+  return result;
+}
+#endif
+
+double sumFloat64(const double *values, uint64_t n) {
+  return sumOf<double>(values, n);
+}
+
+double minFloat64(const double *values, uint64_t n) {
+  return minOf<double>(values, n);
+}
+
+double maxFloat64(const double *values, uint64_t n) {
+  return maxOf<double>(values, n);
+}
+
+// Converts value the way a store into a TypedArray of T does.
+template <typename T>
+static T toElement(double value) {
+  if (value != value || isinf(value)) return 0;
+  // integers wrap modulo 2^bits, no element is wider than 32 bits
+  double wrapped = fmod(trunc(value), 4294967296.0);
+  if (wrapped < 0) wrapped += 4294967296.0;
+  return (T)(uint32_t)wrapped;
+}
+
+template <>
+float toElement<float>(double value) {
+  return (float)value;
+}
+
+template <>
+double toElement<double>(double value) {
+  return value;
+}
+
+static uint8_t toClampedElement(double value) {
+  if (!(value > 0)) return 0;
+  if (value >= 255) return 255;
+  // round half to even
+  return (uint8_t)nearbyint(value);
+}
+
+template <typename T>
+static void fillOf(void *data, uint64_t n, double value) {
+  T *elements = (T *)data;
+  T v = toElement<T>(value);
+  for (uint64_t i = 0; i < n; ++i) elements[i] = v;
+}
+
+static void fillElements(uint32_t kind, void *data, uint64_t n,
+                         double value) {
+  if (kind == ELEMENT_KIND_UINT8_CLAMPED) {
+    memset(data, toClampedElement(value), n);
+    return;
+  }
+  DISPATCH_ELEMENT_KIND(kind, fillOf, data, n, value);
+}
+
+struct ArrayBufferInit {
+  const void *data;  // copied in, or nullptr to zero-fill
+  uint64_t length;
+  uint32_t kind;
+};
+
+// pmemobj_xalloc constructor of an ArrayBuffer allocated outside a
+// transaction, the object is filled and persisted before it is published.
+static int constructArrayBuffer(PMEMobjpool *pop, void *ptr, void *arg) {
+  ArrayBufferInit *init = (ArrayBufferInit *)arg;
+  PArrayBufferObject *pab = (PArrayBufferObject *)ptr;
+  char *elements = (char *)ptr + sizeof(PArrayBufferObject);
+  ((PObject *)pab)->ob_type = TYPE_CODE_ARRAYBUFFER;
+  pab->ob_length = init->length;
+  pab->ob_kind = init->kind;
+  if (init->data == nullptr) {
+    pmemobj_memset(pop, elements, 0, init->length, PMEMOBJ_F_MEM_NODRAIN);
+  } else {
+    pmemobj_memcpy(pop, elements, init->data, init->length,
+                   PMEMOBJ_F_MEM_NONTEMPORAL | PMEMOBJ_F_MEM_NODRAIN);
+  }
+  // drains the data as well
+  pmemobj_persist(pop, pab, sizeof(PArrayBufferObject));
+  return 0;
+}
+
 PMArrayBuffer::PMArrayBuffer(MemoryManager *mm, void *data) {
   _mm = mm;
   _pptr = *((PPtr *)data);
@@ -9,21 +289,51 @@ PMArrayBuffer::PMArrayBuffer(MemoryManager *mm, void *data) {
 
 }
 
+// The allocation is not zeroed since the header is set and the data is
+// overwritten right away, the data is copied with non-temporal stores.
 PMArrayBuffer::PMArrayBuffer(MemoryManager *mm, void *data, uint32_t length) {
   _mm = mm;
   if (_mm->inTransaction()) {
-    _pab = (PArrayBufferObject *)_mm->tx_zalloc(
+    // the new object is flushed on commit
+    _pab = (PArrayBufferObject *)_mm->tx_alloc(
         sizeof(PArrayBufferObject) + length, POBJ_TYPE_NUM);
     ((PObject *)_pab)->ob_type = TYPE_CODE_ARRAYBUFFER;
     _pab->ob_length = length;
-    memcpy(((char *)_pab) + sizeof(PArrayBufferObject), data, length);
+    _pab->ob_kind = ELEMENT_KIND_NONE;
+    _mm->memcpyNoDrain(((char *)_pab) + sizeof(PArrayBufferObject), data,
+                       length);
   } else {
-    _pab = (PArrayBufferObject *)_mm->zalloc(
+    ArrayBufferInit init = {data, length, ELEMENT_KIND_NONE};
+    _pab = (PArrayBufferObject *)_mm->alloc(
+        sizeof(PArrayBufferObject) + length, POBJ_TYPE_NUM,
+        constructArrayBuffer, &init);
+  }
+  _pptr = _mm->pptr(_pab);
+}
+
+// Creates a zero-filled typed array of element_length elements of kind, or a
+// plain ArrayBuffer of element_length bytes for ELEMENT_KIND_NONE.
+PMArrayBuffer::PMArrayBuffer(MemoryManager *mm, uint32_t kind,
+                             uint32_t element_length) {
+  _mm = mm;
+  if (kind >= ELEMENT_KIND_MAX) {
+    throw "invalid element kind";
+  }
+  uint64_t length = (uint64_t)element_length * element_sizes[kind];
+  if (length > UINT32_MAX) {
+    throw "invalid typed array length";
+  }
+  if (_mm->inTransaction()) {
+    _pab = (PArrayBufferObject *)_mm->tx_zalloc(
         sizeof(PArrayBufferObject) + length, POBJ_TYPE_NUM);
     ((PObject *)_pab)->ob_type = TYPE_CODE_ARRAYBUFFER;
     _pab->ob_length = length;
-    memcpy(((char *)_pab) + sizeof(PArrayBufferObject), data, length);
-    _mm->persist(_pab, sizeof(PArrayBufferObject) + length);
+    _pab->ob_kind = kind;
+  } else {
+    ArrayBufferInit init = {nullptr, length, kind};
+    _pab = (PArrayBufferObject *)_mm->alloc(
+        sizeof(PArrayBufferObject) + length, POBJ_TYPE_NUM,
+        constructArrayBuffer, &init);
   }
   _pptr = _mm->pptr(_pab);
 }
@@ -42,8 +352,120 @@ void PMArrayBuffer::persist(uint32_t offset, uint32_t length) {
   _mm->persist(((char *)_pab) + sizeof(PArrayBufferObject) + offset, length);
 }
 
+// Flushes every [offset, offset + length) range and drains once.
+void PMArrayBuffer::persistRanges(
+    const std::vector<std::pair<uint32_t, uint32_t>> &ranges) {
+  uint64_t buffer_length = getLength();
+  for (auto it = ranges.begin(); it != ranges.end(); ++it) {
+    if ((uint64_t)it->first + it->second > buffer_length) {
+      throw "invalid range";
+    }
+  }
+  char *data = (char *)getBuffer();
+  for (auto it = ranges.begin(); it != ranges.end(); ++it) {
+    _mm->flush(data + it->first, it->second);
+  }
+  _mm->drain();
+}
+
 void PMArrayBuffer::snapshot(uint32_t offset, uint32_t length) {
   _mm->snapshotRange(((char *)_pab) + sizeof(PArrayBufferObject) + offset,
                      length);
 }
-}
\ No newline at end of file
+
+uint32_t PMArrayBuffer::getKind() { return _pab->ob_kind; }
+
+uint32_t PMArrayBuffer::getElementSize() {
+  return element_sizes[_pab->ob_kind];
+}
+
+uint32_t PMArrayBuffer::getElementLength() {
+  return _pab->ob_length / getElementSize();
+}
+
+void PMArrayBuffer::clampRange(uint32_t *start, uint32_t *end) {
+  uint32_t length = getElementLength();
+  if (*end > length) *end = length;
+  if (*start > *end) *start = *end;
+}
+
+double PMArrayBuffer::sum(uint32_t start, uint32_t end) {
+  clampRange(&start, &end);
+  char *data = (char *)getBuffer() + (uint64_t)start * getElementSize();
+  DISPATCH_ELEMENT_KIND(getKind(), sumOf, data, end - start);
+}
+
+double PMArrayBuffer::min(uint32_t start, uint32_t end) {
+  clampRange(&start, &end);
+  char *data = (char *)getBuffer() + (uint64_t)start * getElementSize();
+  DISPATCH_ELEMENT_KIND(getKind(), minOf, data, end - start);
+}
+
+double PMArrayBuffer::max(uint32_t start, uint32_t end) {
+  clampRange(&start, &end);
+  char *data = (char *)getBuffer() + (uint64_t)start * getElementSize();
+  DISPATCH_ELEMENT_KIND(getKind(), maxOf, data, end - start);
+}
+
+double PMArrayBuffer::mean(uint32_t start, uint32_t end) {
+  clampRange(&start, &end);
+  if (start == end) return NAN;
+  return sum(start, end) / (end - start);
+}
+
+double PMArrayBuffer::dot(PMArrayBuffer *other, uint32_t start,
+                          uint32_t end) {
+  if (other->getKind() != getKind()) {
+    throw "element kinds do not match";
+  }
+  clampRange(&start, &end);
+  other->clampRange(&start, &end);
+  uint64_t offset = (uint64_t)start * getElementSize();
+  char *a = (char *)getBuffer() + offset;
+  char *b = (char *)other->getBuffer() + offset;
+  DISPATCH_ELEMENT_KIND(getKind(), dotOf, a, b, end - start);
+}
+
+void PMArrayBuffer::fill(double value, uint32_t start, uint32_t end) {
+  clampRange(&start, &end);
+  uint32_t element_size = getElementSize();
+  char *data = (char *)getBuffer() + (uint64_t)start * element_size;
+  uint64_t length = (uint64_t)(end - start) * element_size;
+  if (length == 0) return;
+  if (_mm->inTransaction()) {
+    MM_TX_BEGIN(_mm) {
+      _mm->snapshotRange(data, length);
+      fillElements(getKind(), data, end - start, value);
+    }
+    MM_TX_END(_mm)
+  } else {
+    fillElements(getKind(), data, end - start, value);
+    _mm->persist(data, length);
+  }
+}
+
+void PMArrayBuffer::copyWithin(uint32_t target, uint32_t start,
+                               uint32_t end) {
+  clampRange(&start, &end);
+  uint32_t element_length = getElementLength();
+  if (target >= element_length) return;
+  uint32_t count = end - start;
+  if (count > element_length - target) count = element_length - target;
+  if (count == 0) return;
+  uint32_t element_size = getElementSize();
+  char *data = (char *)getBuffer();
+  char *dest = data + (uint64_t)target * element_size;
+  char *src = data + (uint64_t)start * element_size;
+  uint64_t length = (uint64_t)count * element_size;
+  if (_mm->inTransaction()) {
+    MM_TX_BEGIN(_mm) {
+      _mm->snapshotRange(dest, length);
+      memmove(dest, src, length);
+    }
+    MM_TX_END(_mm)
+  } else {
+    memmove(dest, src, length);
+    _mm->persist(dest, length);
+  }
+}
+}
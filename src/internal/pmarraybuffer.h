@@ -4,29 +4,52 @@
 #include <stddef.h>
 #include <sys/stat.h>
 #include <memory>
+#include <utility>
+#include <vector>
 
 #include "memorymanager.h"
 
 namespace internal {
+// the Float64 kernels of the typed arrays, also run over packed double arrays
+double sumFloat64(const double *values, uint64_t n);
+double minFloat64(const double *values, uint64_t n);
+double maxFloat64(const double *values, uint64_t n);
+
 class PMArrayBuffer {
  public:
   PMArrayBuffer(MemoryManager *mm, void *data);
   PMArrayBuffer(MemoryManager *mm, void *data, uint32_t length);
+  PMArrayBuffer(MemoryManager *mm, uint32_t kind, uint32_t element_length);
   PMArrayBuffer &operator=(const PMArrayBuffer &other) = delete;
 
   std::shared_ptr<const void> getPPtr();
   void *getBuffer();
   uint32_t getLength();
   void persist(uint32_t offset, uint32_t length);
+  void persistRanges(const std::vector<std::pair<uint32_t, uint32_t>> &ranges);
   void snapshot(uint32_t offset, uint32_t length);
 
+  // typed array, element ranges are [start, end) and clamped to the length
+  uint32_t getKind();
+  uint32_t getElementSize();
+  uint32_t getElementLength();
+  double sum(uint32_t start, uint32_t end);
+  double min(uint32_t start, uint32_t end);
+  double max(uint32_t start, uint32_t end);
+  double mean(uint32_t start, uint32_t end);
+  double dot(PMArrayBuffer *other, uint32_t start, uint32_t end);
+  void fill(double value, uint32_t start, uint32_t end);
+  void copyWithin(uint32_t target, uint32_t start, uint32_t end);
+
   void _deallocate();
 
  private:
+  void clampRange(uint32_t *start, uint32_t *end);
+
   MemoryManager *_mm;
   PArrayBufferObject *_pab;
 
   PPtr _pptr;
 };
 }
-#endif
\ No newline at end of file
+#endif
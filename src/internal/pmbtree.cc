@@ -0,0 +1,421 @@
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+
+#include "common.h"
+#include "pmbtree.h"
+
+#define BTREE_NODE_HEADER_SIZE offsetof(PBTreeNode, bn_keys)
+
+namespace internal {
+
+PMBTree::PMBTree(MemoryManager *mm, void *data) {
+  _mm = mm;
+  _pptr = *((PPtr *)data);
+  _pbt = (PBTreeObject *)_mm->direct(_pptr);
+}
+
+PMBTree::PMBTree(MemoryManager *mm) {
+  _mm = mm;
+  MM_TX_BEGIN(_mm) {
+    _pbt = (PBTreeObject *)_mm->tx_zalloc(sizeof(PBTreeObject));
+    ((PObject *)_pbt)->ob_type = TYPE_CODE_BTREE;
+    _pbt->bt_height = 1;
+    _pbt->bt_root = newNode(true);
+    _pptr = _mm->pptr(_pbt);
+  }
+  MM_TX_END(_mm)
+}
+
+std::shared_ptr<const void> PMBTree::getPPtr() {
+  return std::make_shared<PPtr>(_pptr);
+}
+
+uint64_t PMBTree::size() { return _pbt->bt_size; }
+
+std::shared_ptr<const void> PMBTree::get(const PMKey &key) {
+  PBTreeNode *leaf = findLeaf(key, nullptr);
+  uint32_t pos = lowerBound(leaf, key);
+  if (pos < leaf->bn_count && compare(leaf->bn_keys[pos], key) == 0) {
+    return std::make_shared<PPtr>(leaf->bn_slots[pos]);
+  }
+  return std::make_shared<PPtr>(PPTR_UNDEFINED);
+}
+
+bool PMBTree::has(const PMKey &key) {
+  PBTreeNode *leaf = findLeaf(key, nullptr);
+  uint32_t pos = lowerBound(leaf, key);
+  return pos < leaf->bn_count && compare(leaf->bn_keys[pos], key) == 0;
+}
+
+// A full node is split on the way back up. Only the part of it that changes
+// and the new node's parent are snapshotted, the new node needs none.
+void PMBTree::set(const PMKey &key, std::shared_ptr<const void> value_pptr_ptr,
+                  snapshotFlag flag) {
+  PPtr value_pptr = *((PPtr *)value_pptr_ptr.get());
+  Path path;
+  PBTreeNode *leaf = findLeaf(key, &path);
+  uint32_t pos = lowerBound(leaf, key);
+
+  MM_TX_BEGIN(_mm) {
+    if (pos < leaf->bn_count && compare(leaf->bn_keys[pos], key) == 0) {
+      if (flag) _mm->snapshotRange(&(leaf->bn_slots[pos]), sizeof(PPtr));
+      leaf->bn_slots[pos] = value_pptr;
+    } else {
+      PPtr key_pptr = key.pptr;
+      if (key.str != nullptr) {
+        key_pptr = _mm->persistString(std::string(key.str, key.len));
+      }
+      PBTreeNode *node = leaf;
+      PPtr slot = value_pptr;
+      while (node->bn_count == BTREE_NODE_KEYS) {
+        PPtr separator, right;
+        split(node, pos, key_pptr, slot, &separator, &right);
+        key_pptr = separator;
+        slot = right;
+        if (path.empty()) {
+          PBTreeNode *root = getNode(newNode(false));
+          root->bn_count = 1;
+          root->bn_keys[0] = separator;
+          root->bn_slots[0] = _pbt->bt_root;
+          root->bn_slots[1] = right;
+          _mm->snapshotRange(&(_pbt->bt_height),
+                             sizeof(uint64_t) + sizeof(PPtr));
+          _pbt->bt_height += 1;
+          _pbt->bt_root = _mm->pptr(root);
+          node = nullptr;
+          break;
+        }
+        node = path.back().first;
+        pos = path.back().second;
+        path.pop_back();
+      }
+      if (node != nullptr) insertAt(node, pos, key_pptr, slot);
+      _mm->snapshotRange(&(_pbt->bt_size), sizeof(uint64_t));
+      _pbt->bt_size += 1;
+    }
+  }
+  MM_TX_END(_mm)
+}
+
+// A node is freed once it is empty, underfull nodes are not merged.
+bool PMBTree::del(const PMKey &key) {
+  Path path;
+  PBTreeNode *leaf = findLeaf(key, &path);
+  uint32_t pos = lowerBound(leaf, key);
+  if (pos >= leaf->bn_count || compare(leaf->bn_keys[pos], key) != 0) {
+    return false;
+  }
+
+  MM_TX_BEGIN(_mm) {
+    removeAt(leaf, pos, pos);
+    _mm->snapshotRange(&(_pbt->bt_size), sizeof(uint64_t));
+    _pbt->bt_size -= 1;
+    if (leaf->bn_count == 0 && !path.empty()) {
+      PBTreeNode *prev = prevLeaf(path);
+      if (prev != nullptr) {
+        _mm->snapshotRange(&(prev->bn_next), sizeof(PPtr));
+        prev->bn_next = leaf->bn_next;
+      }
+      PPtr node_pptr = _mm->pptr(leaf);
+      // the root always has a key, so this stops before the path is empty
+      while (!path.empty()) {
+        PBTreeNode *parent = path.back().first;
+        uint32_t index = path.back().second;
+        path.pop_back();
+        _mm->free(node_pptr);
+        if (parent->bn_count > 0) {
+          removeAt(parent, index > 0 ? index - 1 : 0, index);
+          break;
+        }
+        node_pptr = _mm->pptr(parent);
+      }
+      // a root left with a single child is replaced by it
+      PBTreeNode *root = getNode(_pbt->bt_root);
+      while (_pbt->bt_height > 1 && root->bn_count == 0) {
+        PPtr old_root = _pbt->bt_root;
+        _mm->snapshotRange(&(_pbt->bt_height),
+                           sizeof(uint64_t) + sizeof(PPtr));
+        _pbt->bt_height -= 1;
+        _pbt->bt_root = root->bn_slots[0];
+        _mm->free(old_root);
+        root = getNode(_pbt->bt_root);
+      }
+    }
+  }
+  MM_TX_END(_mm)
+  return true;
+}
+
+void PMBTree::clear() {
+  MM_TX_BEGIN(_mm) {
+    freeNodes(_pbt->bt_root, _pbt->bt_height);
+    _mm->snapshotRange(&(_pbt->bt_size), sizeof(PBTreeObject) -
+                                             offsetof(PBTreeObject, bt_size));
+    _pbt->bt_size = 0;
+    _pbt->bt_height = 1;
+    _pbt->bt_root = newNode(true);
+  }
+  MM_TX_END(_mm)
+}
+
+std::vector<PMBTreeEntry> PMBTree::range(const PMKey *lo, bool lo_exclusive,
+                                         const PMKey *hi, uint64_t limit) {
+  std::vector<PMBTreeEntry> entries;
+  PBTreeNode *leaf;
+  uint32_t pos = 0;
+  if (lo != nullptr) {
+    leaf = findLeaf(*lo, nullptr);
+    pos = lo_exclusive ? upperBound(leaf, *lo) : lowerBound(leaf, *lo);
+  } else {
+    leaf = getNode(_pbt->bt_root);
+    while (!leaf->bn_leaf) leaf = getNode(leaf->bn_slots[0]);
+  }
+  while (entries.size() < limit) {
+    if (pos >= leaf->bn_count) {
+      if (PPTR_EQUALS(leaf->bn_next, PPTR_NULL)) break;
+      leaf = getNode(leaf->bn_next);
+      pos = 0;
+      continue;
+    }
+    if (hi != nullptr && compare(leaf->bn_keys[pos], *hi) >= 0) break;
+    entries.push_back(PMBTreeEntry(leaf->bn_keys[pos], leaf->bn_slots[pos]));
+    ++pos;
+  }
+  return entries;
+}
+
+bool PMBTree::floor(const PMKey &key, PMBTreeEntry *entry) {
+  Path path;
+  PBTreeNode *leaf = findLeaf(key, &path);
+  uint32_t pos = upperBound(leaf, key);
+  if (pos == 0) {
+    // only the root may be an empty leaf
+    leaf = prevLeaf(path);
+    if (leaf == nullptr) return false;
+    pos = leaf->bn_count;
+  }
+  *entry = PMBTreeEntry(leaf->bn_keys[pos - 1], leaf->bn_slots[pos - 1]);
+  return true;
+}
+
+bool PMBTree::ceil(const PMKey &key, PMBTreeEntry *entry) {
+  PBTreeNode *leaf = findLeaf(key, nullptr);
+  uint32_t pos = lowerBound(leaf, key);
+  if (pos == leaf->bn_count) {
+    if (PPTR_EQUALS(leaf->bn_next, PPTR_NULL)) return false;
+    leaf = getNode(leaf->bn_next);
+    pos = 0;
+  }
+  *entry = PMBTreeEntry(leaf->bn_keys[pos], leaf->bn_slots[pos]);
+  return true;
+}
+
+bool PMBTree::first(PMBTreeEntry *entry) {
+  PBTreeNode *node = getNode(_pbt->bt_root);
+  while (!node->bn_leaf) node = getNode(node->bn_slots[0]);
+  if (node->bn_count == 0) return false;
+  *entry = PMBTreeEntry(node->bn_keys[0], node->bn_slots[0]);
+  return true;
+}
+
+bool PMBTree::last(PMBTreeEntry *entry) {
+  PBTreeNode *node = getNode(_pbt->bt_root);
+  while (!node->bn_leaf) node = getNode(node->bn_slots[node->bn_count]);
+  if (node->bn_count == 0) return false;
+  uint32_t pos = node->bn_count - 1;
+  *entry = PMBTreeEntry(node->bn_keys[pos], node->bn_slots[pos]);
+  return true;
+}
+
+void PMBTree::_deallocate() {
+  MM_TX_BEGIN(_mm) {
+    freeNodes(_pbt->bt_root, _pbt->bt_height);
+    _mm->free(_pptr);
+  }
+  MM_TX_END(_mm)
+}
+
+PBTreeNode *PMBTree::getNode(PPtr pptr) {
+  return (PBTreeNode *)_mm->direct(pptr);
+}
+
+PPtr PMBTree::newNode(bool is_leaf) {
+  PBTreeNode *node =
+      (PBTreeNode *)_mm->tx_zalloc(sizeof(PBTreeNode), BTREE_NODES_TYPE_NUM);
+  node->bn_leaf = is_leaf;
+  return _mm->pptr(node);
+}
+
+// Numbers come before strings. Strings compare by their UTF-8 bytes, which
+// is the order of their code points.
+int PMBTree::compare(PPtr stored, const PMKey &key) {
+  bool stored_is_number = stored.pool_uuid_lo == TYPE_CODE_NUMBER;
+  bool key_is_number =
+      key.str == nullptr && key.pptr.pool_uuid_lo == TYPE_CODE_NUMBER;
+  if (stored_is_number != key_is_number) return stored_is_number ? -1 : 1;
+  if (stored_is_number) {
+    double a, b;
+    memcpy(&a, &(stored.off), sizeof(double));
+    memcpy(&b, &(key.pptr.off), sizeof(double));
+    return a < b ? -1 : (a > b ? 1 : 0);
+  }
+  const char *str = "";
+  if (!PPTR_EQUALS(stored, PPTR_EMPTY_STRING)) {
+    str = (const char *)_mm->direct(stored) + sizeof(PStringObject);
+  }
+  if (key.str == nullptr) return str[0] == '\0' ? 0 : 1;
+  // neither string contains '\0'
+  int result = strncmp(str, key.str, key.len);
+  if (result != 0) return result;
+  return str[key.len] == '\0' ? 0 : 1;
+}
+
+// the position of the first key >= key
+uint32_t PMBTree::lowerBound(PBTreeNode *node, const PMKey &key) {
+  uint32_t lo = 0, hi = node->bn_count;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (compare(node->bn_keys[mid], key) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// the position of the first key > key
+uint32_t PMBTree::upperBound(PBTreeNode *node, const PMKey &key) {
+  uint32_t lo = 0, hi = node->bn_count;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (compare(node->bn_keys[mid], key) <= 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+PBTreeNode *PMBTree::findLeaf(const PMKey &key, Path *path) {
+  PBTreeNode *node = getNode(_pbt->bt_root);
+  while (!node->bn_leaf) {
+    uint32_t index = upperBound(node, key);
+    if (path != nullptr) path->push_back(std::make_pair(node, index));
+    node = getNode(node->bn_slots[index]);
+  }
+  return node;
+}
+
+// the leaf before the one path leads to, nullptr for the first leaf
+PBTreeNode *PMBTree::prevLeaf(const Path &path) {
+  for (auto it = path.rbegin(); it != path.rend(); ++it) {
+    if (it->second == 0) continue;
+    PBTreeNode *node = getNode(it->first->bn_slots[it->second - 1]);
+    while (!node->bn_leaf) node = getNode(node->bn_slots[node->bn_count]);
+    return node;
+  }
+  return nullptr;
+}
+
+// Inserts key at pos, with slot as its value in a leaf or as the child after
+// it in an inner node. The node must not be full.
+void PMBTree::insertAt(PBTreeNode *node, uint32_t pos, PPtr key, PPtr slot) {
+  uint32_t count = node->bn_count;
+  uint32_t slot_pos = node->bn_leaf ? pos : pos + 1;
+  uint32_t slots = node->bn_leaf ? count : count + 1;
+  assert(count < BTREE_NODE_KEYS);
+  _mm->snapshotRange(node, BTREE_NODE_HEADER_SIZE);
+  _mm->snapshotRange(node->bn_keys + pos, (count + 1 - pos) * sizeof(PPtr));
+  _mm->snapshotRange(node->bn_slots + slot_pos,
+                     (slots + 1 - slot_pos) * sizeof(PPtr));
+  memmove(node->bn_keys + pos + 1, node->bn_keys + pos,
+          (count - pos) * sizeof(PPtr));
+  memmove(node->bn_slots + slot_pos + 1, node->bn_slots + slot_pos,
+          (slots - slot_pos) * sizeof(PPtr));
+  node->bn_keys[pos] = key;
+  node->bn_slots[slot_pos] = slot;
+  node->bn_count = count + 1;
+}
+
+// Splits a full node while inserting key like insertAt(). The upper half
+// moves to a new node right, and separator is the least key under right. A
+// leaf keeps separator, an inner node hands it up to the parent.
+void PMBTree::split(PBTreeNode *node, uint32_t pos, PPtr key, PPtr slot,
+                    PPtr *separator, PPtr *right) {
+  bool is_leaf = node->bn_leaf;
+  uint32_t slot_pos = is_leaf ? pos : pos + 1;
+  uint32_t slots = is_leaf ? BTREE_NODE_KEYS : BTREE_NODE_KEYS + 1;
+  PPtr keys[BTREE_NODE_KEYS + 1];
+  PPtr all_slots[BTREE_NODE_KEYS + 2];
+  std::copy(node->bn_keys, node->bn_keys + pos, keys);
+  keys[pos] = key;
+  std::copy(node->bn_keys + pos, node->bn_keys + BTREE_NODE_KEYS,
+            keys + pos + 1);
+  std::copy(node->bn_slots, node->bn_slots + slot_pos, all_slots);
+  all_slots[slot_pos] = slot;
+  std::copy(node->bn_slots + slot_pos, node->bn_slots + slots,
+            all_slots + slot_pos + 1);
+
+  uint32_t left_count = (BTREE_NODE_KEYS + 1) / 2;
+  // the separator stays in a leaf, it is moved out of an inner node
+  uint32_t right_start = is_leaf ? left_count : left_count + 1;
+  uint32_t left_slots = is_leaf ? left_count : left_count + 1;
+  *right = newNode(is_leaf);
+  PBTreeNode *right_node = getNode(*right);
+  right_node->bn_count = BTREE_NODE_KEYS + 1 - right_start;
+  std::copy(keys + right_start, keys + BTREE_NODE_KEYS + 1,
+            right_node->bn_keys);
+  std::copy(all_slots + left_slots, all_slots + slots + 1,
+            right_node->bn_slots);
+  *separator = keys[left_count];
+
+  // the positions before pos and from the new count on are left as they are
+  _mm->snapshotRange(node, BTREE_NODE_HEADER_SIZE);
+  if (pos < left_count) {
+    _mm->snapshotRange(node->bn_keys + pos,
+                       (left_count - pos) * sizeof(PPtr));
+    std::copy(keys + pos, keys + left_count, node->bn_keys + pos);
+  }
+  if (slot_pos < left_slots) {
+    _mm->snapshotRange(node->bn_slots + slot_pos,
+                       (left_slots - slot_pos) * sizeof(PPtr));
+    std::copy(all_slots + slot_pos, all_slots + left_slots,
+              node->bn_slots + slot_pos);
+  }
+  if (is_leaf) {
+    right_node->bn_next = node->bn_next;
+    node->bn_next = *right;
+  }
+  node->bn_count = left_count;
+}
+
+void PMBTree::removeAt(PBTreeNode *node, uint32_t key_pos,
+                       uint32_t slot_pos) {
+  uint32_t count = node->bn_count;
+  uint32_t slots = node->bn_leaf ? count : count + 1;
+  _mm->snapshotRange(node, BTREE_NODE_HEADER_SIZE);
+  _mm->snapshotRange(node->bn_keys + key_pos,
+                     (count - key_pos) * sizeof(PPtr));
+  _mm->snapshotRange(node->bn_slots + slot_pos,
+                     (slots - slot_pos) * sizeof(PPtr));
+  memmove(node->bn_keys + key_pos, node->bn_keys + key_pos + 1,
+          (count - key_pos - 1) * sizeof(PPtr));
+  memmove(node->bn_slots + slot_pos, node->bn_slots + slot_pos + 1,
+          (slots - slot_pos - 1) * sizeof(PPtr));
+  node->bn_count = count - 1;
+}
+
+void PMBTree::freeNodes(PPtr node_pptr, uint64_t height) {
+  if (height > 1) {
+    PBTreeNode *node = getNode(node_pptr);
+    for (uint32_t i = 0; i <= node->bn_count; ++i) {
+      freeNodes(node->bn_slots[i], height - 1);
+    }
+  }
+  _mm->free(node_pptr);
+}
+}  // namespace internal
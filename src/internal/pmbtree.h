@@ -0,0 +1,67 @@
+#ifndef INTERNAL_PMBTREE_H
+#define INTERNAL_PMBTREE_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "memorymanager.h"
+
+namespace internal {
+// (key, value) of a PMBTree
+typedef std::pair<PPtr, PPtr> PMBTreeEntry;
+
+class PMBTree {
+ public:
+  PMBTree(MemoryManager* mm, void* data);
+  PMBTree(MemoryManager* mm);
+  PMBTree(const PMBTree& other) = delete;
+  PMBTree& operator=(const PMBTree& other) = delete;
+
+  std::shared_ptr<const void> getPPtr();
+  uint64_t size();
+  // keys must be numbers other than NaN or strings
+  std::shared_ptr<const void> get(const PMKey& key);
+  bool has(const PMKey& key);
+  void set(const PMKey& key, std::shared_ptr<const void> value_pptr_ptr,
+           snapshotFlag flag = kSnapshot);
+  bool del(const PMKey& key);
+  void clear();
+  // Up to limit entries in key order, from lo (the first key if lo is null,
+  // excluded if lo_exclusive) until hi (excluded, the last key if hi is null).
+  std::vector<PMBTreeEntry> range(const PMKey* lo, bool lo_exclusive,
+                                  const PMKey* hi, uint64_t limit);
+  // the entry of the greatest key <= key, false if there is none
+  bool floor(const PMKey& key, PMBTreeEntry* entry);
+  // the entry of the least key >= key, false if there is none
+  bool ceil(const PMKey& key, PMBTreeEntry* entry);
+  bool first(PMBTreeEntry* entry);
+  bool last(PMBTreeEntry* entry);
+
+  void _deallocate();
+
+ private:
+  // the inner nodes from the root down to a leaf, with the child taken
+  typedef std::vector<std::pair<PBTreeNode*, uint32_t>> Path;
+
+  PBTreeNode* getNode(PPtr pptr);
+  PPtr newNode(bool is_leaf);
+  int compare(PPtr stored, const PMKey& key);
+  uint32_t lowerBound(PBTreeNode* node, const PMKey& key);
+  uint32_t upperBound(PBTreeNode* node, const PMKey& key);
+  PBTreeNode* findLeaf(const PMKey& key, Path* path);
+  PBTreeNode* prevLeaf(const Path& path);
+  void insertAt(PBTreeNode* node, uint32_t pos, PPtr key, PPtr slot);
+  void split(PBTreeNode* node, uint32_t pos, PPtr key, PPtr slot,
+             PPtr* separator, PPtr* right);
+  void removeAt(PBTreeNode* node, uint32_t key_pos, uint32_t slot_pos);
+  void freeNodes(PPtr node_pptr, uint64_t height);
+
+  MemoryManager* _mm;
+  PBTreeObject* _pbt;
+  PPtr _pptr;
+};
+}
+#endif
@@ -0,0 +1,188 @@
+#include <assert.h>
+#include <string.h>
+#include <list>
+
+#include "common.h"
+#include "pmdeque.h"
+
+namespace internal {
+
+PMDeque::PMDeque(MemoryManager *mm, void *data) {
+  _mm = mm;
+  _pptr = *((PPtr *)data);
+  _pdq = (PDequeObject *)_mm->direct(_pptr);
+}
+
+PMDeque::PMDeque(MemoryManager *mm) {
+  _mm = mm;
+  MM_TX_BEGIN(_mm) {
+    _pdq = (PDequeObject *)_mm->tx_zalloc(sizeof(PDequeObject));
+    ((PObject *)_pdq)->ob_type = TYPE_CODE_DEQUE;
+    PPtr *blocks = (PPtr *)_mm->tx_zalloc(sizeof(PPtr), DEQUE_BLOCKS_TYPE_NUM);
+    blocks[0] = newBlock();
+    _pdq->dq_capacity = DEQUE_BLOCK_SIZE;
+    _pdq->dq_blocks = _mm->pptr(blocks);
+    _pptr = _mm->pptr(_pdq);
+  }
+  MM_TX_END(_mm)
+}
+
+std::shared_ptr<const void> PMDeque::getPPtr() {
+  return std::make_shared<PPtr>(_pptr);
+}
+
+uint64_t PMDeque::getLength() { return _pdq->dq_tail - _pdq->dq_head; }
+
+void PMDeque::push(std::shared_ptr<const void> value_pptr_ptr) {
+  if (getLength() == _pdq->dq_capacity) grow();
+  uint64_t tail = _pdq->dq_tail;
+  writeSlot(tail, *((PPtr *)value_pptr_ptr.get()));
+  setTail(tail + 1);
+}
+
+void PMDeque::unshift(std::shared_ptr<const void> value_pptr_ptr) {
+  if (getLength() == _pdq->dq_capacity) grow();
+  // dq_head may wrap below zero, positions are taken modulo the capacity
+  uint64_t head = _pdq->dq_head - 1;
+  writeSlot(head, *((PPtr *)value_pptr_ptr.get()));
+  setHead(head);
+}
+
+std::shared_ptr<const void> PMDeque::pop() {
+  if (getLength() == 0) return std::make_shared<PPtr>(PPTR_UNDEFINED);
+  uint64_t tail = _pdq->dq_tail - 1;
+  std::shared_ptr<const void> result = std::make_shared<PPtr>(*getSlot(tail));
+  // the slot is left as it is, gc only traces [dq_head, dq_tail)
+  setTail(tail);
+  return result;
+}
+
+std::shared_ptr<const void> PMDeque::shift() {
+  if (getLength() == 0) return std::make_shared<PPtr>(PPTR_UNDEFINED);
+  uint64_t head = _pdq->dq_head;
+  std::shared_ptr<const void> result = std::make_shared<PPtr>(*getSlot(head));
+  setHead(head + 1);
+  return result;
+}
+
+std::shared_ptr<const void> PMDeque::front() { return get(0); }
+
+std::shared_ptr<const void> PMDeque::back() {
+  uint64_t length = getLength();
+  if (length == 0) return std::make_shared<PPtr>(PPTR_UNDEFINED);
+  return get(length - 1);
+}
+
+std::shared_ptr<const void> PMDeque::get(uint64_t index) {
+  if (index >= getLength()) return std::make_shared<PPtr>(PPTR_UNDEFINED);
+  return std::make_shared<PPtr>(*getSlot(_pdq->dq_head + index));
+}
+
+std::list<std::shared_ptr<const void>> PMDeque::getItems() {
+  std::list<std::shared_ptr<const void>> items;
+  for (uint64_t pos = _pdq->dq_head; pos != _pdq->dq_tail; ++pos) {
+    items.push_back(std::make_shared<PPtr>(*getSlot(pos)));
+  }
+  return items;
+}
+
+void PMDeque::clear() { setHead(_pdq->dq_tail); }
+
+void PMDeque::_deallocate() {
+  MM_TX_BEGIN(_mm) {
+    PPtr *blocks = (PPtr *)_mm->direct(_pdq->dq_blocks);
+    uint64_t nblocks = _pdq->dq_capacity >> DEQUE_BLOCK_SHIFT;
+    for (uint64_t i = 0; i < nblocks; ++i) _mm->free(blocks[i]);
+    _mm->free(_pdq->dq_blocks);
+    _mm->free(_pptr);
+  }
+  MM_TX_END(_mm)
+}
+
+PPtr PMDeque::newBlock() {
+  void *block =
+      _mm->tx_zalloc(DEQUE_BLOCK_SIZE * sizeof(PPtr), DEQUE_BLOCKS_TYPE_NUM);
+  return _mm->pptr(block);
+}
+
+PPtr *PMDeque::getSlot(uint64_t position) {
+  uint64_t slot = position & (_pdq->dq_capacity - 1);
+  PPtr *blocks = (PPtr *)_mm->direct(_pdq->dq_blocks);
+  PPtr *block = (PPtr *)_mm->direct(blocks[slot >> DEQUE_BLOCK_SHIFT]);
+  return block + (slot & DEQUE_BLOCK_MASK);
+}
+
+// The slot is outside [dq_head, dq_tail) until the following setHead() or
+// setTail(), so outside a transaction it needs no snapshot, only to be
+// durable before them. Inside one, it may have been live when the
+// transaction began.
+void PMDeque::writeSlot(uint64_t position, PPtr value) {
+  PPtr *slot = getSlot(position);
+  if (_mm->inTransaction()) {
+    _mm->snapshotRange(slot, sizeof(PPtr));
+    *slot = value;
+  } else {
+    // the value may be a new object that is only reserved yet
+    _mm->publish();
+    *slot = value;
+    _mm->persist(slot, sizeof(PPtr));
+  }
+}
+
+void PMDeque::setHead(uint64_t head) {
+  if (_mm->inTransaction()) {
+    _mm->snapshotRange(&(_pdq->dq_head), sizeof(uint64_t));
+    _pdq->dq_head = head;
+  } else {
+    _pdq->dq_head = head;
+    _mm->persist(&(_pdq->dq_head), sizeof(uint64_t));
+  }
+}
+
+void PMDeque::setTail(uint64_t tail) {
+  if (_mm->inTransaction()) {
+    _mm->snapshotRange(&(_pdq->dq_tail), sizeof(uint64_t));
+    _pdq->dq_tail = tail;
+  } else {
+    _pdq->dq_tail = tail;
+    _mm->persist(&(_pdq->dq_tail), sizeof(uint64_t));
+  }
+}
+
+// Doubles the capacity of a full deque. The blocks are reordered so that the
+// ring starts at the block of dq_head, then the items in front of dq_head in
+// that block are moved to the first new block, which follows the old ones.
+void PMDeque::grow() {
+  uint64_t capacity = _pdq->dq_capacity;
+  uint64_t nblocks = capacity >> DEQUE_BLOCK_SHIFT;
+  uint64_t head = _pdq->dq_head & (capacity - 1);
+  uint64_t head_block = head >> DEQUE_BLOCK_SHIFT;
+  uint64_t head_offset = head & DEQUE_BLOCK_MASK;
+  assert(getLength() == capacity);
+
+  MM_TX_BEGIN(_mm) {
+    PPtr *old_blocks = (PPtr *)_mm->direct(_pdq->dq_blocks);
+    PPtr *blocks = (PPtr *)_mm->tx_alloc(2 * nblocks * sizeof(PPtr),
+                                         DEQUE_BLOCKS_TYPE_NUM);
+    for (uint64_t i = 0; i < nblocks; ++i) {
+      blocks[i] = old_blocks[(head_block + i) & (nblocks - 1)];
+    }
+    for (uint64_t i = nblocks; i < 2 * nblocks; ++i) {
+      blocks[i] = newBlock();
+    }
+    if (head_offset > 0) {
+      memcpy(_mm->direct(blocks[nblocks]), _mm->direct(blocks[0]),
+             head_offset * sizeof(PPtr));
+    }
+    PPtr old_blocks_pptr = _pdq->dq_blocks;
+    _mm->snapshotRange(&(_pdq->dq_head), sizeof(PDequeObject) -
+                                             offsetof(PDequeObject, dq_head));
+    _pdq->dq_head = head_offset;
+    _pdq->dq_tail = head_offset + capacity;
+    _pdq->dq_capacity = 2 * capacity;
+    _pdq->dq_blocks = _mm->pptr(blocks);
+    _mm->free(old_blocks_pptr);
+  }
+  MM_TX_END(_mm)
+}
+}  // namespace internal
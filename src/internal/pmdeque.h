@@ -0,0 +1,48 @@
+#ifndef INTERNAL_PMDEQUE_H
+#define INTERNAL_PMDEQUE_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <list>
+#include <memory>
+
+#include "memorymanager.h"
+
+namespace internal {
+class PMDeque {
+ public:
+  PMDeque(MemoryManager* mm, void* data);
+  PMDeque(MemoryManager* mm);
+  PMDeque(const PMDeque& other) = delete;
+  PMDeque& operator=(const PMDeque& other) = delete;
+
+  std::shared_ptr<const void> getPPtr();
+  uint64_t getLength();
+  // pop(), shift(), front(), back() and get() give PPTR_UNDEFINED when there
+  // is no such item
+  void push(std::shared_ptr<const void> value_pptr_ptr);
+  void unshift(std::shared_ptr<const void> value_pptr_ptr);
+  std::shared_ptr<const void> pop();
+  std::shared_ptr<const void> shift();
+  std::shared_ptr<const void> front();
+  std::shared_ptr<const void> back();
+  std::shared_ptr<const void> get(uint64_t index);
+  std::list<std::shared_ptr<const void>> getItems();
+  void clear();
+
+  void _deallocate();
+
+ private:
+  PPtr newBlock();
+  PPtr* getSlot(uint64_t position);
+  void writeSlot(uint64_t position, PPtr value);
+  void setHead(uint64_t head);
+  void setTail(uint64_t tail);
+  void grow();
+
+  MemoryManager* _mm;
+  PDequeObject* _pdq;
+  PPtr _pptr;
+};
+}
+#endif
@@ -2,16 +2,72 @@
 #include <openssl/md5.h>
 #include <list>
 #include <string>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "common.h"
 #include "pmdict.h"
 
-#define MIN_SIZE_COMBINED 8
+#define MIN_SIZE_COMBINED DK_MIN_SIZE
 #define MIN_SIZE_SPLIT 4
-#define PERTURB_SHIFT 5
+// the lowest 7 bits of the hash are stored in the control bytes, and the rest
+// of the bits choose the group where the probe starts
+#define CTRL_H1(hash) ((hash) >> 7)
+#define CTRL_H2(hash) ((int8_t)((hash)&0x7F))
+// Shrink once fewer than 1/SHRINK_FACTOR of the slots are in use, and size
+// the new table so that it is about 1/SHRINK_TARGET full afterwards.
+#define SHRINK_FACTOR 8
+#define SHRINK_TARGET 4
+// number of slots of the old key table migrated by every set/del while a
+// resize is in progress
+#define MIGRATE_STEP 16
 
 namespace internal {
 namespace impl {
+// Each of the following returns a bitmask with bit i set if control byte i
+// of the group matches.
+static inline uint32_t groupMatch(const int8_t *ctrl, int8_t tag) {
+#ifdef __SSE2__
+  __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(tag), group));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < DK_GROUP_WIDTH; ++i) {
+    if (ctrl[i] == tag) mask |= 1u << i;
+  }
+  return mask;
+#endif
+}
+
+static inline uint32_t groupMatchEmpty(const int8_t *ctrl) {
+  return groupMatch(ctrl, CTRL_EMPTY);
+}
+
+static inline uint32_t groupMatchEmptyOrDeleted(const int8_t *ctrl) {
+  // only CTRL_EMPTY and CTRL_DELETED have the sign bit set
+#ifdef __SSE2__
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < DK_GROUP_WIDTH; ++i) {
+    if (ctrl[i] < 0) mask |= 1u << i;
+  }
+  return mask;
+#endif
+}
+
+// The padding control bytes of a table smaller than a group are always
+// CTRL_EMPTY, they must not be taken as slots.
+static inline uint32_t groupSlotMask(uint64_t dk_size) {
+  return dk_size < DK_GROUP_WIDTH ? (1u << dk_size) - 1
+                                  : (1u << DK_GROUP_WIDTH) - 1;
+}
+
+static inline uint64_t groupCount(uint64_t dk_size) {
+  return dk_size < DK_GROUP_WIDTH ? 1 : dk_size / DK_GROUP_WIDTH;
+}
+
 PMDict::PMDict(MemoryManager *mm, PPtr pptr) {
   _mm = mm;
   _pptr = pptr;
@@ -38,39 +94,46 @@ void PMDict::setProperty(std::string key, PPtr value_pptr, snapshotFlag flag) {
   const char *kstr = key.c_str();
   Logger::Debug("PMDict::setProperty: trying to set property %s\n", kstr);
   uint64_t khash = fixedHash(kstr);
-  PDictKeysObject *keys = getKeys();
-  PDictKeyEntry *ep = lookup(kstr, khash);
   MM_TX_BEGIN(_mm) {
-    PPtr old_value_pptr = ep->me_value;
-    PPtr me_key = ep->me_key;
-    if (!PPTR_EQUALS(old_value_pptr, PPTR_NULL)) {
-      assert(!PPTR_EQUALS(me_key, PPTR_NULL) &&
-             !PPTR_EQUALS(me_key, PPTR_DUMMY));
+    migrate(MIGRATE_STEP);
+    PDictKeysObject *keys = getKeys();
+    PDictKeyEntry *ep = lookup(keys, kstr, khash);
+    PDictKeyEntry *old_ep = nullptr;
+    if (PPTR_EQUALS(ep->me_value, PPTR_NULL)) {
+      old_ep = lookupOld(kstr, khash);
+    }
+    if (old_ep != nullptr) {
+      // not migrated yet, update it in the old key table
+      if (flag) _mm->snapshotRange(&(old_ep->me_value), sizeof(PPtr));
+      old_ep->me_value = value_pptr;
+    } else if (!PPTR_EQUALS(ep->me_value, PPTR_NULL)) {
+      assert(!PPTR_EQUALS(ep->me_key, PPTR_NULL) &&
+             !PPTR_EQUALS(ep->me_key, PPTR_DUMMY));
       if (flag) _mm->snapshotRange(&(ep->me_value), sizeof(PPtr));
       ep->me_value = value_pptr;
     } else {
       PPtr key_pptr = _mm->persistString(key);
-      if (flag) _mm->snapshotRange(ep, sizeof(PDictKeyEntry));
-      if (PPTR_EQUALS(me_key, PPTR_NULL)) {
+      if (PPTR_EQUALS(ep->me_key, PPTR_NULL)) {
         if (keys->dk_usable <= 0) {
           insertionResize();
           keys = getKeys();
+          // ep pointed into the table that was just replaced
+          ep = findEmptySlot(keys, khash);
         }
+        if (flag) _mm->snapshotRange(ep, sizeof(PDictKeyEntry));
         if (flag) _mm->snapshotRange(&(keys->dk_usable), sizeof(int64_t));
         keys->dk_usable -= 1;
         assert(keys->dk_usable >= 0);
-        ep->me_key = key_pptr;
-        ep->me_hash = khash;
       } else {
-        assert(PPTR_EQUALS(me_key, PPTR_DUMMY));
-        ep->me_key = key_pptr;
-        ep->me_hash = khash;
+        assert(PPTR_EQUALS(ep->me_key, PPTR_DUMMY));
+        if (flag) _mm->snapshotRange(ep, sizeof(PDictKeyEntry));
       }
+      ep->me_key = key_pptr;
+      ep->me_hash = khash;
+      setCtrl(keys, ep, CTRL_H2(khash), flag);
       if (flag) _mm->snapshotRange(&(_pdict->ma_used), sizeof(uint64_t));
       _pdict->ma_used += 1;
       ep->me_value = value_pptr;
-      assert(!PPTR_EQUALS(ep->me_key, PPTR_NULL) &&
-             !PPTR_EQUALS(ep->me_key, PPTR_DUMMY));
     }
   }
   MM_TX_END(_mm)
@@ -80,9 +143,12 @@ PPtr PMDict::getProperty(std::string key) {
   const char *kstr = key.c_str();
   Logger::Debug("PMDict::setProperty: trying to get property %s\n", kstr);
   uint64_t khash = fixedHash(kstr);
-  PDictKeyEntry *ep = lookup(kstr, khash);
-  if (PPTR_EQUALS(ep->me_key, PPTR_NULL)) {
-    return PPTR_EMPTY;
+  PDictKeyEntry *ep = lookup(getKeys(), kstr, khash);
+  // lookup() returns a tombstone if the probe passed one before reaching an
+  // empty slot, so the value rather than the key tells whether it was found
+  if (PPTR_EQUALS(ep->me_value, PPTR_NULL)) {
+    ep = lookupOld(kstr, khash);
+    if (ep == nullptr) return PPTR_EMPTY;
   }
   return ep->me_value;
 }
@@ -90,31 +156,47 @@ PPtr PMDict::getProperty(std::string key) {
 void PMDict::delProperty(std::string key, snapshotFlag flag) {
   const char *kstr = key.c_str();
   uint64_t khash = fixedHash(kstr);
-  PDictKeyEntry *ep = lookup(kstr, khash);
-  if (ep == nullptr || PPTR_EQUALS(ep->me_value, PPTR_NULL)) {
-    return;
-  }
   Logger::Debug("PMDict::delProperty: trying to delete property %s\n", kstr);
   MM_TX_BEGIN(_mm) {
-    if (flag) _mm->snapshotRange(ep, sizeof(PDictKeyEntry));
-    PPtr old_value_pptr = ep->me_value;
-    ep->me_value = PPTR_NULL;
-    if (flag) _mm->snapshotRange(&(_pdict->ma_used), sizeof(uint64_t));
-    _pdict->ma_used -= 1;
-    PPtr old_key_pptr = ep->me_key;
-    ep->me_key = PPTR_DUMMY;
-    _mm->free(old_key_pptr);
-    _mm->free(old_value_pptr);
+    migrate(MIGRATE_STEP);
+    PDictKeysObject *keys = getKeys();
+    PDictKeyEntry *ep = lookup(keys, kstr, khash);
+    if (PPTR_EQUALS(ep->me_value, PPTR_NULL)) {
+      keys = getOldKeys();
+      ep = lookupOld(kstr, khash);
+    }
+    if (ep != nullptr) {
+      if (flag) _mm->snapshotRange(ep, sizeof(PDictKeyEntry));
+      PPtr old_value_pptr = ep->me_value;
+      PPtr old_key_pptr = ep->me_key;
+      ep->me_value = PPTR_NULL;
+      uint64_t group = (ep - DK_ENTRIES(keys)) / DK_GROUP_WIDTH;
+      // No probe ever went past a group that still has an empty slot, so the
+      // slot can be emptied instead of leaving a tombstone in it.
+      if (groupMatchEmpty(keys->dk_ctrl + group * DK_GROUP_WIDTH)) {
+        ep->me_key = PPTR_NULL;
+        setCtrl(keys, ep, CTRL_EMPTY, flag);
+        if (flag) _mm->snapshotRange(&(keys->dk_usable), sizeof(int64_t));
+        keys->dk_usable += 1;
+      } else {
+        ep->me_key = PPTR_DUMMY;
+        setCtrl(keys, ep, CTRL_DELETED, flag);
+      }
+      if (flag) _mm->snapshotRange(&(_pdict->ma_used), sizeof(uint64_t));
+      _pdict->ma_used -= 1;
+      _mm->free(old_key_pptr);
+      _mm->freeUnshared(old_value_pptr);
+      deletionResize();
+    }
   }
   MM_TX_END(_mm)
 }
 
 std::list<std::shared_ptr<const void>> PMDict::getPropertyNames() {
   std::list<std::shared_ptr<const void>> names;
-  PPtr ma_keys = _pdict->ma_keys;
-  PDictKeysObject *keys = (PDictKeysObject *)_mm->direct(ma_keys);
+  PDictKeysObject *keys = getKeys();
   int64_t dk_size = keys->dk_size;
-  PDictKeyEntry *ep0 = keys->dk_entries;
+  PDictKeyEntry *ep0 = DK_ENTRIES(keys);
   PDictKeyEntry *ep;
   for (int i = 0; i < dk_size; ++i) {
     ep = ep0 + i;
@@ -122,29 +204,69 @@ std::list<std::shared_ptr<const void>> PMDict::getPropertyNames() {
       names.push_back(std::make_shared<PPtr>(ep->me_key));
     }
   }
+  if (isMigrating()) {
+    // entries before ma_migrated are stale copies of migrated ones
+    keys = getOldKeys();
+    dk_size = keys->dk_size;
+    ep0 = DK_ENTRIES(keys);
+    for (int i = _pdict->ma_migrated; i < dk_size; ++i) {
+      ep = ep0 + i;
+      if (ep->me_key.pool_uuid_lo != 0) {
+        names.push_back(std::make_shared<PPtr>(ep->me_key));
+      }
+    }
+  }
   return names;
 }
 
-void PMDict::_deallocate(){MM_TX_BEGIN(_mm){_mm->free(_pdict->ma_keys);
-_mm->free(_pptr);
+void PMDict::_deallocate() {
+  MM_TX_BEGIN(_mm) {
+    _mm->free(_pdict->ma_keys);
+    _mm->free(_pdict->ma_oldkeys);
+    _mm->free(_pptr);
+  }
+  MM_TX_END(_mm)
 }
-MM_TX_END(_mm)
+
+PPtr PMDict::clone(const std::function<PPtr(PPtr)> &copy_value) {
+  PPtr copy_pptr;
+  MM_TX_BEGIN(_mm) {
+    copy_pptr = _mm->tx_copy(_pptr, sizeof(PDictObject));
+    PDictObject *copy = (PDictObject *)_mm->direct(copy_pptr);
+    PPtr *tables[2] = {&(copy->ma_keys), &(copy->ma_oldkeys)};
+    for (int t = 0; t < 2; ++t) {
+      if (PPTR_EQUALS(*tables[t], PPTR_NULL)) continue;
+      PDictKeysObject *keys = (PDictKeysObject *)_mm->direct(*tables[t]);
+      *tables[t] = _mm->tx_copy(*tables[t], DK_OBJECT_SIZE(keys->dk_size));
+      keys = (PDictKeysObject *)_mm->direct(*tables[t]);
+      PDictKeyEntry *ep0 = DK_ENTRIES(keys);
+      // the entries before ma_migrated in the old table are stale
+      for (uint64_t i = (t == 0) ? 0 : copy->ma_migrated; i < keys->dk_size;
+           ++i) {
+        PDictKeyEntry *ep = ep0 + i;
+        if (ep->me_key.pool_uuid_lo != 0) {
+          ep->me_key = copy_value(ep->me_key);
+          ep->me_value = copy_value(ep->me_value);
+        }
+      }
+    }
+  }
+  MM_TX_END(_mm)
+  return copy_pptr;
 }
 
 PPtr PMDict::newKeysObject(uint64_t size) {
   assert(size > MIN_SIZE_SPLIT);
   PDictKeysObject *keys;
   MM_TX_BEGIN(_mm) {
-    keys = (PDictKeysObject *)_mm->tx_zalloc(
-        sizeof(PDictKeysObject) + sizeof(PDictKeyEntry) * (size - 1),
-        PDICTKEYSOBJECT_TYPE_NUM);
+    keys = (PDictKeysObject *)_mm->tx_zalloc(DK_OBJECT_SIZE(size),
+                                             PDICTKEYSOBJECT_TYPE_NUM);
     keys->dk_size = size;
     uint64_t usable = usableFraction(size);
     assert(usable < INT64_MAX);
     keys->dk_usable = usable;
-    PDictKeyEntry *ep = keys->dk_entries;
-    // Hash value of slot 0 is used by popitem, so it must be initialized
-    ep->me_hash = 0;
+    memset(keys->dk_ctrl, CTRL_EMPTY, DK_CTRL_SIZE(size));
+    PDictKeyEntry *ep = DK_ENTRIES(keys);
     for (size_t i = 0; i < size; ++i) {
       (ep + i)->me_key = PPTR_NULL;
       (ep + i)->me_value = PPTR_NULL;
@@ -168,87 +290,184 @@ PDictKeysObject *PMDict::getKeys() {
   return (PDictKeysObject *)_mm->direct(_pdict->ma_keys);
 }
 
-PDictKeyEntry *PMDict::lookup(const char *key, uint64_t khash) {
-  while (true) {
-    PPtr ma_keys = _pdict->ma_keys;
-    PDictKeysObject *keys = (PDictKeysObject *)_mm->direct(ma_keys);
+PDictKeysObject *PMDict::getOldKeys() {
+  return (PDictKeysObject *)_mm->direct(_pdict->ma_oldkeys);
+}
 
-    ssize_t mask = keys->dk_size - 1;
-    PDictKeyEntry *ep0 = keys->dk_entries;
-    // find the index based on hash value
-    ssize_t idx = khash & mask;
-    PDictKeyEntry *ep = ep0 + idx;
-    PPtr me_key = ep->me_key;
+bool PMDict::isMigrating() {
+  return !PPTR_EQUALS(_pdict->ma_oldkeys, PPTR_NULL);
+}
 
-    PDictKeyEntry *freeslot;
-    if (PPTR_EQUALS(me_key, PPTR_NULL)) {
-      return ep;
-    } else if (PPTR_EQUALS(me_key, PPTR_DUMMY)) {
-      freeslot = ep;
-    } else {
-      if (ep->me_hash == khash) {
-        char *str = (char *)_mm->direct(me_key) + sizeof(PStringObject);
-        if (strcmp(str, key) == 0) {
-          return ep;
-        }
-      }
-      freeslot = nullptr;
-    }
-    uint64_t perturb = khash;
-
-    while (true) {
-      idx = (idx << 2) + idx + perturb + 1;
-      ep = ep0 + (idx & mask);
-      me_key = ep->me_key;
-      if (PPTR_EQUALS(me_key, PPTR_NULL)) {
-        return (freeslot == nullptr) ? ep : freeslot;
-      }
-      if (ep->me_hash == khash && !PPTR_EQUALS(me_key, PPTR_DUMMY)) {
-        char *str = (char *)_mm->direct(me_key) + sizeof(PStringObject);
-        ;
+// Returns the entry of the key if it exists, otherwise the first empty or
+// dummy entry on the probe sequence of the key.
+PDictKeyEntry *PMDict::lookup(PDictKeysObject *keys, const char *key,
+                              uint64_t khash, uint64_t migrated) {
+  PDictKeyEntry *ep0 = DK_ENTRIES(keys);
+  uint64_t group_mask = groupCount(keys->dk_size) - 1;
+  uint32_t slot_mask = groupSlotMask(keys->dk_size);
+  int8_t tag = CTRL_H2(khash);
+  uint64_t group = CTRL_H1(khash) & group_mask;
+  PDictKeyEntry *freeslot = nullptr;
+  // triangular probing over the groups visits every group once
+  for (uint64_t step = 1;; ++step) {
+    const int8_t *ctrl = keys->dk_ctrl + group * DK_GROUP_WIDTH;
+    PDictKeyEntry *group_ep0 = ep0 + group * DK_GROUP_WIDTH;
+    uint32_t match = groupMatch(ctrl, tag) & slot_mask;
+    while (match) {
+      PDictKeyEntry *ep = group_ep0 + __builtin_ctz(match);
+      // a migrated slot of an old table may hold a key freed since
+      if ((uint64_t)(ep - ep0) >= migrated && ep->me_hash == khash) {
+        char *str = (char *)_mm->direct(ep->me_key) + sizeof(PStringObject);
         if (strcmp(str, key) == 0) return ep;
-      } else if (PPTR_EQUALS(me_key, PPTR_DUMMY) && freeslot == nullptr) {
-        freeslot = ep;
       }
-      perturb = perturb >> PERTURB_SHIFT;
+      match &= match - 1;
+    }
+    if (freeslot == nullptr) {
+      uint32_t available = groupMatchEmptyOrDeleted(ctrl) & slot_mask;
+      if (available) freeslot = group_ep0 + __builtin_ctz(available);
     }
+    if (groupMatchEmpty(ctrl)) {
+      assert(freeslot != nullptr);
+      return freeslot;
+    }
+    group = (group + step) & group_mask;
   }
 }
 
+// Returns the entry of the key in the old key table if a resize is in
+// progress and the key has not been migrated yet, otherwise nullptr.
+PDictKeyEntry *PMDict::lookupOld(const char *key, uint64_t khash) {
+  if (!isMigrating()) return nullptr;
+  PDictKeysObject *old_keys = getOldKeys();
+  PDictKeyEntry *ep = lookup(old_keys, key, khash, _pdict->ma_migrated);
+  // the free slot returned instead may be a migrated one
+  if (PPTR_EQUALS(ep->me_value, PPTR_NULL) ||
+      (uint64_t)(ep - DK_ENTRIES(old_keys)) < _pdict->ma_migrated) {
+    return nullptr;
+  }
+  return ep;
+}
+
 void PMDict::insertionResize() {
-  size_t minused = growRate();
-  size_t newsize = MIN_SIZE_COMBINED;
-  while (newsize <= minused && newsize > 0) {
-    newsize = newsize << 1;
+  if (isMigrating()) {
+    // the new table ran out of space before the old one was drained, so
+    // finish the resize at once
+    resize(calculateKeysize(growRate()));
+    return;
+  }
+  // Tombstones consume dk_usable as well, if they outnumber the live entries
+  // rehashing at the current size is enough to make room again.
+  if (countDummies() > _pdict->ma_used) {
+    startMigration(getKeys()->dk_size);
+    return;
   }
-  PDictKeysObject *old_keys = getKeys();
-  PPtr old_keys_pptr = _pdict->ma_keys;
+  startMigration(calculateKeysize(growRate()));
+}
+
+void PMDict::deletionResize() {
+  uint64_t dk_size = getKeys()->dk_size;
+  if (isMigrating() || dk_size <= MIN_SIZE_COMBINED ||
+      _pdict->ma_used >= dk_size / SHRINK_FACTOR) {
+    return;
+  }
+  uint64_t newsize = calculateKeysize(_pdict->ma_used * SHRINK_TARGET);
+  if (newsize < dk_size) {
+    startMigration(newsize);
+  }
+}
+
+// Rehashes every entry into a new key table of newsize at once.
+void PMDict::resize(uint64_t newsize) {
+  PPtr keys_pptr = _pdict->ma_keys;
+  PPtr old_keys_pptr = _pdict->ma_oldkeys;
+  Logger::Debug("PMDict::resize: resizing from %llu to %llu\n",
+                getKeys()->dk_size, newsize);
 
   MM_TX_BEGIN(_mm) {
-    _mm->snapshotRange(&(_pdict->ma_keys), sizeof(PPtr));
+    PDictKeysObject *keys = getKeys();
+    PDictKeysObject *old_keys = getOldKeys();
+    _mm->snapshotRange(_pdict, sizeof(PDictObject));
     _pdict->ma_keys = newKeysObject(newsize);
-    size_t oldsize = old_keys->dk_size;
-    PDictKeyEntry *old_ep0 = old_keys->dk_entries;
-    for (size_t i = 0; i < oldsize; ++i) {
-      PDictKeyEntry *old_ep = old_ep0 + i;
-      PPtr me_value = old_ep->me_value;
-      if (!PPTR_EQUALS(me_value, PPTR_NULL)) {
-        PPtr me_key = old_ep->me_key;
-        assert(!PPTR_EQUALS(me_key, PPTR_DUMMY));
-        uint64_t me_hash = old_ep->me_hash;
-        PDictKeyEntry *new_ep = findEmptySlot(me_hash);
-        new_ep->me_key = me_key;
-        new_ep->me_hash = me_hash;
-        new_ep->me_value = me_value;
-      }
+    moveEntries(keys, 0, keys->dk_size, kNotSnapshot);
+    if (old_keys != nullptr) {
+      moveEntries(old_keys, _pdict->ma_migrated, old_keys->dk_size,
+                  kNotSnapshot);
     }
-    PDictKeysObject *new_keys = getKeys();
-    new_keys->dk_usable -= _pdict->ma_used;
+    _pdict->ma_oldkeys = PPTR_NULL;
+    _pdict->ma_migrated = 0;
+    _mm->free(keys_pptr);
     _mm->free(old_keys_pptr);
   }
   MM_TX_END(_mm)
 }
 
+// Installs an empty key table of newsize, the entries of the current one are
+// moved over by later calls to migrate().
+void PMDict::startMigration(uint64_t newsize) {
+  Logger::Debug("PMDict::startMigration: resizing from %llu to %llu\n",
+                getKeys()->dk_size, newsize);
+  MM_TX_BEGIN(_mm) {
+    _mm->snapshotRange(_pdict, sizeof(PDictObject));
+    _pdict->ma_oldkeys = _pdict->ma_keys;
+    _pdict->ma_keys = newKeysObject(newsize);
+    _pdict->ma_migrated = 0;
+  }
+  MM_TX_END(_mm)
+}
+
+void PMDict::migrate(uint64_t nslots) {
+  if (!isMigrating()) return;
+  PDictKeysObject *old_keys = getOldKeys();
+  uint64_t start = _pdict->ma_migrated;
+  uint64_t end = start + nslots;
+  if (end > old_keys->dk_size) end = old_keys->dk_size;
+  MM_TX_BEGIN(_mm) {
+    moveEntries(old_keys, start, end, kSnapshot);
+    if (end == old_keys->dk_size) {
+      _mm->snapshotRange(&(_pdict->ma_oldkeys), sizeof(PPtr));
+      _mm->free(_pdict->ma_oldkeys);
+      _pdict->ma_oldkeys = PPTR_NULL;
+      end = 0;
+    }
+    _mm->snapshotRange(&(_pdict->ma_migrated), sizeof(uint64_t));
+    _pdict->ma_migrated = end;
+  }
+  MM_TX_END(_mm)
+}
+
+// Inserts the live entries in [start, end) of from into the current key
+// table. The key strings are shared, the entries in from are left as is.
+void PMDict::moveEntries(PDictKeysObject *from, uint64_t start, uint64_t end,
+                         snapshotFlag flag) {
+  PDictKeysObject *keys = getKeys();
+  PDictKeyEntry *from_ep0 = DK_ENTRIES(from);
+  for (uint64_t i = start; i < end; ++i) {
+    PDictKeyEntry *from_ep = from_ep0 + i;
+    PPtr me_value = from_ep->me_value;
+    if (!PPTR_EQUALS(me_value, PPTR_NULL)) {
+      assert(!PPTR_EQUALS(from_ep->me_key, PPTR_DUMMY));
+      uint64_t me_hash = from_ep->me_hash;
+      PDictKeyEntry *new_ep = findEmptySlot(keys, me_hash);
+      if (flag) _mm->snapshotRange(new_ep, sizeof(PDictKeyEntry));
+      new_ep->me_key = from_ep->me_key;
+      new_ep->me_hash = me_hash;
+      new_ep->me_value = me_value;
+      setCtrl(keys, new_ep, CTRL_H2(me_hash), flag);
+      if (flag) _mm->snapshotRange(&(keys->dk_usable), sizeof(int64_t));
+      keys->dk_usable -= 1;
+      assert(keys->dk_usable >= 0);
+    }
+  }
+}
+
+uint64_t PMDict::calculateKeysize(uint64_t minsize) {
+  uint64_t newsize = MIN_SIZE_COMBINED;
+  while (newsize <= minsize && newsize > 0) {
+    newsize = newsize << 1;
+  }
+  return newsize;
+}
+
 uint64_t PMDict::usableFraction(uint64_t size) {
   if (size >= UINT32_MAX) {
     return size / 3 * 2;
@@ -256,28 +475,44 @@ uint64_t PMDict::usableFraction(uint64_t size) {
   return (2 * size + 1) / 3;
 }
 
+uint64_t PMDict::countDummies() {
+  // every occupied slot, live or dummy, has been taken from dk_usable
+  assert(!isMigrating());
+  PDictKeysObject *keys = getKeys();
+  return usableFraction(keys->dk_size) - keys->dk_usable - _pdict->ma_used;
+}
+
 uint64_t PMDict::growRate() {
   PDictKeysObject *keys = getKeys();
   assert(_pdict->ma_used < UINT32_MAX);
   assert(UINT64_MAX - (_pdict->ma_used << 2) > (keys->dk_size >> 1));
-  return _pdict->ma_used * 2 + (getKeys()->dk_size >> 1);
+  return _pdict->ma_used * 2 + (keys->dk_size >> 1);
 }
 
-PDictKeyEntry *PMDict::findEmptySlot(uint64_t khash) {
-  PDictKeysObject *keys = getKeys();
-  int64_t mask = keys->dk_size - 1;
-  PDictKeyEntry *ep0 = keys->dk_entries;
-  int64_t idx = khash & mask;
-  PDictKeyEntry *ep = ep0 + idx;
-  uint64_t perturb = khash;
-  while (!PPTR_EQUALS(ep->me_key, PPTR_NULL)) {
-    idx = (idx << 2) + idx + perturb + 1;
-    ep = ep0 + (idx & mask);
-    perturb = perturb >> PERTURB_SHIFT;
+PDictKeyEntry *PMDict::findEmptySlot(PDictKeysObject *keys, uint64_t khash) {
+  PDictKeyEntry *ep0 = DK_ENTRIES(keys);
+  uint64_t group_mask = groupCount(keys->dk_size) - 1;
+  uint32_t slot_mask = groupSlotMask(keys->dk_size);
+  uint64_t group = CTRL_H1(khash) & group_mask;
+  for (uint64_t step = 1;; ++step) {
+    const int8_t *ctrl = keys->dk_ctrl + group * DK_GROUP_WIDTH;
+    uint32_t available = groupMatchEmptyOrDeleted(ctrl) & slot_mask;
+    if (available) {
+      PDictKeyEntry *ep =
+          ep0 + group * DK_GROUP_WIDTH + __builtin_ctz(available);
+      assert(PPTR_EQUALS(ep->me_value, PPTR_NULL));
+      return ep;
+    }
+    group = (group + step) & group_mask;
   }
-  assert(PPTR_EQUALS(ep->me_key, PPTR_NULL));
-  return ep;
+}
+
+void PMDict::setCtrl(PDictKeysObject *keys, PDictKeyEntry *ep, int8_t ctrl,
+                     snapshotFlag flag) {
+  int8_t *ctrl_ptr = keys->dk_ctrl + (ep - DK_ENTRIES(keys));
+  if (flag) _mm->snapshotRange(ctrl_ptr, sizeof(int8_t));
+  *ctrl_ptr = ctrl;
 }
 
 }  // namespace impl
-}  // namespace internal
\ No newline at end of file
+}  // namespace internal
@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <sys/stat.h>
+#include <functional>
 #include <list>
 #include <memory>
 
@@ -21,16 +22,34 @@ class PMDict {
   void delProperty(std::string key, snapshotFlag flag = kSnapshot);
   std::list<std::shared_ptr<const void>> getPropertyNames();
   void _deallocate();
+  // A copy in new allocations whose keys and values are mapped by
+  // copy_value.
+  PPtr clone(const std::function<PPtr(PPtr)>& copy_value);
 
  private:
   PPtr newKeysObject(uint64_t size);
   uint64_t fixedHash(const char* key);
   PDictKeysObject* getKeys();
-  PDictKeyEntry* lookup(const char* key, uint64_t khash);
+  PDictKeysObject* getOldKeys();
+  bool isMigrating();
+  // the slots of keys below migrated are never matched
+  PDictKeyEntry* lookup(PDictKeysObject* keys, const char* key,
+                        uint64_t khash, uint64_t migrated = 0);
+  PDictKeyEntry* lookupOld(const char* key, uint64_t khash);
   void insertionResize();
+  void deletionResize();
+  void resize(uint64_t newsize);
+  void startMigration(uint64_t newsize);
+  void migrate(uint64_t nslots);
+  void moveEntries(PDictKeysObject* from, uint64_t start, uint64_t end,
+                   snapshotFlag flag);
+  uint64_t calculateKeysize(uint64_t minsize);
   uint64_t usableFraction(uint64_t size);
+  uint64_t countDummies();
   uint64_t growRate();
-  PDictKeyEntry* findEmptySlot(uint64_t khash);
+  PDictKeyEntry* findEmptySlot(PDictKeysObject* keys, uint64_t khash);
+  void setCtrl(PDictKeysObject* keys, PDictKeyEntry* ep, int8_t ctrl,
+               snapshotFlag flag);
 
   MemoryManager* _mm;
   PDictObject* _pdict;
@@ -0,0 +1,230 @@
+#include <assert.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "pmarray.h"
+#include "pmbtree.h"
+#include "pmindex.h"
+#include "pmmap.h"
+#include "pmobject.h"
+
+namespace internal {
+
+PMIndex::PMIndex(MemoryManager *mm, void *data) {
+  _mm = mm;
+  _pptr = *((PPtr *)data);
+  _pix = (PIndexObject *)_mm->direct(_pptr);
+}
+
+PMIndex::PMIndex(MemoryManager *mm, PPtr collection, const std::string &field,
+                 uint64_t flags) {
+  _mm = mm;
+  MM_TX_BEGIN(_mm) {
+    _pix = (PIndexObject *)_mm->tx_zalloc(sizeof(PIndexObject));
+    ((PObject *)_pix)->ob_type = TYPE_CODE_INDEX;
+    _pix->ix_flags = flags;
+    _pix->ix_collection = collection;
+    _pix->ix_field = _mm->persistString(field);
+    if (flags & INDEX_FLAG_ORDERED) {
+      _pix->ix_table = *((PPtr *)PMBTree(_mm).getPPtr().get());
+    } else {
+      _pix->ix_table = *((PPtr *)PMMap(_mm).getPPtr().get());
+    }
+    _pix->ix_records = *((PPtr *)PMMap(_mm).getPPtr().get());
+    _pptr = _mm->pptr(_pix);
+  }
+  MM_TX_END(_mm)
+}
+
+std::shared_ptr<const void> PMIndex::getPPtr() {
+  return std::make_shared<PPtr>(_pptr);
+}
+
+PPtr PMIndex::getCollection() { return _pix->ix_collection; }
+
+std::string PMIndex::getField() {
+  return std::string((const char *)_mm->direct(_pix->ix_field) +
+                     sizeof(PStringObject));
+}
+
+uint64_t PMIndex::getFlags() { return _pix->ix_flags; }
+
+void PMIndex::add(PPtr record) {
+  PPtr value;
+  PMKey key;
+  if (!getValue(record, &value) || !toKey(value, &key)) return;
+  PPtr found = find(key);
+  // thrown before the transaction is entered, so that aborting the caller's
+  // transaction leaves none open
+  if ((_pix->ix_flags & INDEX_FLAG_UNIQUE) && !PPTR_EQUALS(found, PPTR_NULL)) {
+    throw "duplicate key";
+  }
+  MM_TX_BEGIN(_mm) {
+    if (_pix->ix_flags & INDEX_FLAG_UNIQUE) {
+      put(key, record);
+    } else if (PPTR_EQUALS(found, PPTR_NULL)) {
+      impl::PMSimpleArray bucket(_mm);
+      bucket.push(record);
+      put(key, bucket.getPPtr());
+    } else {
+      impl::PMSimpleArray bucket(_mm, found);
+      bucket.push(record);
+    }
+    PMKey record_key = {record, nullptr, 0};
+    PMMap(_mm, &(_pix->ix_records))
+        .set(record_key, std::make_shared<PPtr>(value));
+  }
+  MM_TX_END(_mm)
+}
+
+// The record is looked up by the value it was indexed by, which its property
+// may no longer have.
+void PMIndex::remove(PPtr record) {
+  PMMap records(_mm, &(_pix->ix_records));
+  PMKey record_key = {record, nullptr, 0};
+  if (!records.has(record_key)) return;
+  PPtr value = *((PPtr *)records.get(record_key).get());
+  PMKey key;
+  if (!toKey(value, &key)) return;
+  PPtr found = find(key);
+  if (PPTR_EQUALS(found, PPTR_NULL)) return;
+
+  MM_TX_BEGIN(_mm) {
+    bool indexed = false;
+    if (_pix->ix_flags & INDEX_FLAG_UNIQUE) {
+      erase(key);
+    } else {
+      impl::PMSimpleArray bucket(_mm, found);
+      std::vector<PPtr> items;
+      bucket.getRange(0, bucket.getLength(), &items);
+      size_t pos = 0;
+      while (pos < items.size() && !PPTR_EQUALS(items[pos], record)) ++pos;
+      if (pos < items.size()) {
+        // the order of a bucket does not matter, the last record fills the
+        // gap
+        if (pos + 1 < items.size()) bucket.setProperty(pos, items.back());
+        bucket.pop();
+        items.erase(items.begin() + pos);
+      }
+      if (items.empty()) {
+        erase(key);
+        bucket._deallocate();
+      }
+      // the same record may be in the collection more than once
+      for (size_t i = 0; i < items.size(); ++i) {
+        if (PPTR_EQUALS(items[i], record)) indexed = true;
+      }
+    }
+    if (!indexed) records.del(record_key);
+  }
+  MM_TX_END(_mm)
+}
+
+std::vector<PPtr> PMIndex::lookup(const PMKey &key) {
+  std::vector<PPtr> result;
+  appendRecords(find(key), &result);
+  return result;
+}
+
+std::vector<PPtr> PMIndex::range(const PMKey *lo, const PMKey *hi,
+                                 uint64_t limit) {
+  assert(_pix->ix_flags & INDEX_FLAG_ORDERED);
+  std::vector<PPtr> result;
+  PMBTree table(_mm, &(_pix->ix_table));
+  bool exclusive = false;
+  PMKey from;
+  // a bucket may hold more records than asked for, so the tree is read an
+  // entry at a time
+  while (result.size() < limit) {
+    std::vector<PMBTreeEntry> entries = table.range(lo, exclusive, hi, 1);
+    if (entries.empty()) break;
+    appendRecords(entries[0].second, &result);
+    toKey(entries[0].first, &from);
+    lo = &from;
+    exclusive = true;
+  }
+  if (result.size() > limit) result.resize(limit);
+  return result;
+}
+
+void PMIndex::_deallocate() {
+  MM_TX_BEGIN(_mm) { _mm->free(_pptr); }
+  MM_TX_END(_mm)
+}
+
+// the property of the record, false if record is not an object or has no
+// such property
+bool PMIndex::getValue(PPtr record, PPtr *value) {
+  if (PPTR_IS_INLINE(record) || PPTR_EQUALS(record, PPTR_NULL)) return false;
+  PObject *pobj = (PObject *)_mm->direct(record);
+  if (pobj->ob_type != TYPE_CODE_OBJECT) return false;
+  if (((PObjectObject *)pobj)->is_array) return false;
+  *value = *((PPtr *)PMObject(_mm, &record).getProperty(getField()).get());
+  return !PPTR_EQUALS(*value, PPTR_EMPTY);
+}
+
+bool PMIndex::toKey(PPtr value, PMKey *key) {
+  *key = {value, nullptr, 0};
+  if (value.pool_uuid_lo == TYPE_CODE_NUMBER) {
+    if (!(_pix->ix_flags & INDEX_FLAG_ORDERED)) return true;
+    double number;
+    memcpy(&number, &(value.off), sizeof(double));
+    // -0 and 0 are the same key
+    if (number != number) return false;
+    if (number == 0) key->pptr = PPTR_ZERO;
+    return true;
+  }
+  if (PPTR_EQUALS(value, PPTR_EMPTY_STRING)) return true;
+  if (value.pool_uuid_lo == TYPE_CODE_SINGLETON ||
+      value.pool_uuid_lo == TYPE_CODE_BIGINT) {
+    return !(_pix->ix_flags & INDEX_FLAG_ORDERED);
+  }
+  if (PPTR_IS_INLINE(value) || PPTR_EQUALS(value, PPTR_NULL)) return false;
+  PObject *pobj = (PObject *)_mm->direct(value);
+  if (pobj->ob_type != TYPE_CODE_STRING) return false;
+  key->pptr = PPTR_NULL;
+  key->str = (const char *)pobj + sizeof(PStringObject);
+  key->len = strlen(key->str);
+  return true;
+}
+
+// the record or the bucket of records, PPTR_NULL if there is none
+PPtr PMIndex::find(const PMKey &key) {
+  if (_pix->ix_flags & INDEX_FLAG_ORDERED) {
+    PMBTree table(_mm, &(_pix->ix_table));
+    if (!table.has(key)) return PPTR_NULL;
+    return *((PPtr *)table.get(key).get());
+  }
+  PMMap table(_mm, &(_pix->ix_table));
+  if (!table.has(key)) return PPTR_NULL;
+  return *((PPtr *)table.get(key).get());
+}
+
+void PMIndex::put(const PMKey &key, PPtr value) {
+  if (_pix->ix_flags & INDEX_FLAG_ORDERED) {
+    PMBTree(_mm, &(_pix->ix_table)).set(key, std::make_shared<PPtr>(value));
+  } else {
+    PMMap(_mm, &(_pix->ix_table)).set(key, std::make_shared<PPtr>(value));
+  }
+}
+
+void PMIndex::erase(const PMKey &key) {
+  if (_pix->ix_flags & INDEX_FLAG_ORDERED) {
+    PMBTree(_mm, &(_pix->ix_table)).del(key);
+  } else {
+    PMMap(_mm, &(_pix->ix_table)).del(key);
+  }
+}
+
+void PMIndex::appendRecords(PPtr value, std::vector<PPtr> *records) {
+  if (PPTR_EQUALS(value, PPTR_NULL)) return;
+  if (_pix->ix_flags & INDEX_FLAG_UNIQUE) {
+    records->push_back(value);
+  } else {
+    impl::PMSimpleArray bucket(_mm, value);
+    bucket.getRange(0, bucket.getLength(), records);
+  }
+}
+}  // namespace internal
@@ -0,0 +1,53 @@
+#ifndef INTERNAL_PMINDEX_H
+#define INTERNAL_PMINDEX_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "memorymanager.h"
+
+namespace internal {
+// A record is indexed by the value its property has when it is stored in the
+// collection, records without the property or with a value that is not a
+// key are left out. Keys are primitives for a hash index, and numbers or
+// strings for an ordered one.
+class PMIndex {
+ public:
+  PMIndex(MemoryManager* mm, void* data);
+  PMIndex(MemoryManager* mm, PPtr collection, const std::string& field,
+          uint64_t flags);
+  PMIndex(const PMIndex& other) = delete;
+  PMIndex& operator=(const PMIndex& other) = delete;
+
+  std::shared_ptr<const void> getPPtr();
+  PPtr getCollection();
+  std::string getField();
+  uint64_t getFlags();
+  // throws "duplicate key" if the index is unique and holds the key already
+  void add(PPtr record);
+  void remove(PPtr record);
+  // the records indexed by key
+  std::vector<PPtr> lookup(const PMKey& key);
+  // Up to limit records indexed by keys in [lo, hi) in key order, lo or hi
+  // may be null for no bound. Only for an ordered index.
+  std::vector<PPtr> range(const PMKey* lo, const PMKey* hi, uint64_t limit);
+
+  void _deallocate();
+
+ private:
+  bool getValue(PPtr record, PPtr* value);
+  bool toKey(PPtr value, PMKey* key);
+  PPtr find(const PMKey& key);
+  void put(const PMKey& key, PPtr value);
+  void erase(const PMKey& key);
+  void appendRecords(PPtr value, std::vector<PPtr>* records);
+
+  MemoryManager* _mm;
+  PIndexObject* _pix;
+  PPtr _pptr;
+};
+}
+#endif
@@ -0,0 +1,333 @@
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <list>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "pmmap.h"
+
+#define MIN_SIZE_COMBINED 8
+#define PERTURB_SHIFT 5
+// same as PMDict
+#define SHRINK_FACTOR 8
+#define SHRINK_TARGET 4
+
+namespace internal {
+
+// finalizer of splitmix64, spreads the bits of inline keys over the hash
+static inline uint64_t mixHash(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// String keys are persisted by set() and owned by the map, like the key
+// strings of PMDict. Other keys are values shared with the rest of the pool.
+static void freeKeyString(MemoryManager *mm, PPtr key) {
+  if (PPTR_EQUALS(key, PPTR_NULL) || PPTR_IS_INLINE(key)) return;
+  if (((PObject *)mm->direct(key))->ob_type == TYPE_CODE_STRING) {
+    mm->free(key);
+  }
+}
+
+PMMap::PMMap(MemoryManager *mm, void *data) {
+  _mm = mm;
+  _pptr = *((PPtr *)data);
+  _pmap = (PMapObject *)_mm->direct(_pptr);
+}
+
+PMMap::PMMap(MemoryManager *mm, bool is_set) {
+  _mm = mm;
+  MM_TX_BEGIN(_mm) {
+    _pmap = (PMapObject *)_mm->tx_zalloc(sizeof(PMapObject));
+    ((PObject *)_pmap)->ob_type = is_set ? TYPE_CODE_SET : TYPE_CODE_MAP;
+    _pmap->ma_keys = newKeysObject(MIN_SIZE_COMBINED);
+    _pptr = _mm->pptr(_pmap);
+  }
+  MM_TX_END(_mm)
+}
+
+std::shared_ptr<const void> PMMap::getPPtr() {
+  return std::make_shared<PPtr>(_pptr);
+}
+
+bool PMMap::isSet() { return ((PObject *)_pmap)->ob_type == TYPE_CODE_SET; }
+
+uint64_t PMMap::size() { return _pmap->ma_used; }
+
+std::shared_ptr<const void> PMMap::get(const PMKey &key) {
+  int64_t *ip = lookup(key, keyHash(key));
+  if (*ip < 0) {
+    return std::make_shared<PPtr>(PPTR_UNDEFINED);
+  }
+  return std::make_shared<PPtr>(MK_ENTRIES(getKeys())[*ip].me_value);
+}
+
+bool PMMap::has(const PMKey &key) {
+  return *lookup(key, keyHash(key)) >= 0;
+}
+
+void PMMap::set(const PMKey &key,
+                std::shared_ptr<const void> value_pptr_ptr,
+                snapshotFlag flag) {
+  PPtr value_pptr = *((PPtr *)value_pptr_ptr.get());
+  if (isSet()) value_pptr = PPTR_TRUE;
+  uint64_t khash = keyHash(key);
+
+  MM_TX_BEGIN(_mm) {
+    int64_t *ip = lookup(key, khash);
+    if (*ip >= 0) {
+      PMapEntry *ep = MK_ENTRIES(getKeys()) + *ip;
+      if (flag) _mm->snapshotRange(&(ep->me_value), sizeof(PPtr));
+      ep->me_value = value_pptr;
+    } else {
+      PPtr key_pptr = key.pptr;
+      if (key.str != nullptr) {
+        key_pptr = _mm->persistString(std::string(key.str, key.len));
+      }
+      if (getKeys()->dk_usable <= 0) {
+        // compact the entries, and grow if they are mostly alive
+        resize(calculateKeysize(_pmap->ma_used * 3));
+      }
+      PMapKeysObject *keys = getKeys();
+      ip = findEmptyIndex(keys, khash);
+      uint64_t ix = keys->dk_nentries;
+      PMapEntry *ep = MK_ENTRIES(keys) + ix;
+      if (flag) {
+        _mm->snapshotRange(ip, sizeof(int64_t));
+        _mm->snapshotRange(ep, sizeof(PMapEntry));
+        _mm->snapshotRange(keys, offsetof(PMapKeysObject, dk_indices));
+        _mm->snapshotRange(&(_pmap->ma_used), sizeof(uint64_t));
+      }
+      ep->me_hash = khash;
+      ep->me_key = key_pptr;
+      ep->me_value = value_pptr;
+      *ip = ix;
+      keys->dk_nentries += 1;
+      keys->dk_usable -= 1;
+      _pmap->ma_used += 1;
+    }
+  }
+  MM_TX_END(_mm)
+}
+
+bool PMMap::del(const PMKey &key, snapshotFlag flag) {
+  uint64_t khash = keyHash(key);
+  int64_t *ip = lookup(key, khash);
+  if (*ip < 0) return false;
+
+  MM_TX_BEGIN(_mm) {
+    PMapKeysObject *keys = getKeys();
+    PMapEntry *ep = MK_ENTRIES(keys) + *ip;
+    if (flag) {
+      _mm->snapshotRange(ip, sizeof(int64_t));
+      _mm->snapshotRange(ep, sizeof(PMapEntry));
+      _mm->snapshotRange(&(_pmap->ma_used), sizeof(uint64_t));
+    }
+    freeKeyString(_mm, ep->me_key);
+    *ip = MK_IX_DUMMY;
+    ep->me_key = PPTR_NULL;
+    ep->me_value = PPTR_NULL;
+    _pmap->ma_used -= 1;
+    if (keys->dk_size > MIN_SIZE_COMBINED &&
+        _pmap->ma_used < keys->dk_size / SHRINK_FACTOR) {
+      uint64_t newsize = calculateKeysize(_pmap->ma_used * SHRINK_TARGET);
+      if (newsize < keys->dk_size) resize(newsize);
+    }
+  }
+  MM_TX_END(_mm)
+  return true;
+}
+
+void PMMap::clear() {
+  MM_TX_BEGIN(_mm) {
+    PMapKeysObject *keys = getKeys();
+    PMapEntry *ep0 = MK_ENTRIES(keys);
+    for (uint64_t i = 0; i < keys->dk_nentries; ++i) {
+      freeKeyString(_mm, ep0[i].me_key);
+    }
+    PPtr old_keys = _pmap->ma_keys;
+    _mm->snapshotRange(_pmap, sizeof(PMapObject));
+    _pmap->ma_keys = newKeysObject(MIN_SIZE_COMBINED);
+    _pmap->ma_used = 0;
+    _mm->free(old_keys);
+  }
+  MM_TX_END(_mm)
+}
+
+std::list<std::pair<std::shared_ptr<const void>, std::shared_ptr<const void>>>
+PMMap::getEntries() {
+  std::list<std::pair<std::shared_ptr<const void>, std::shared_ptr<const void>>>
+      entries;
+  PMapKeysObject *keys = getKeys();
+  PMapEntry *ep0 = MK_ENTRIES(keys);
+  for (uint64_t i = 0; i < keys->dk_nentries; ++i) {
+    PMapEntry *ep = ep0 + i;
+    if (PPTR_EQUALS(ep->me_key, PPTR_NULL)) continue;
+    entries.emplace_back(std::make_shared<PPtr>(ep->me_key),
+                         std::make_shared<PPtr>(ep->me_value));
+  }
+  return entries;
+}
+
+void PMMap::_deallocate() {
+  MM_TX_BEGIN(_mm) {
+    _mm->free(_pmap->ma_keys);
+    _mm->free(_pptr);
+  }
+  MM_TX_END(_mm)
+}
+
+PPtr PMMap::newKeysObject(uint64_t size) {
+  assert(size >= MIN_SIZE_COMBINED && (size & (size - 1)) == 0);
+  uint64_t usable = usableFraction(size);
+  PMapKeysObject *keys;
+  MM_TX_BEGIN(_mm) {
+    keys = (PMapKeysObject *)_mm->tx_zalloc(
+        offsetof(PMapKeysObject, dk_indices) + size * sizeof(int64_t) +
+            usable * sizeof(PMapEntry),
+        PMAPKEYSOBJECT_TYPE_NUM);
+    keys->dk_size = size;
+    keys->dk_usable = usable;
+    keys->dk_nentries = 0;
+    // MK_IX_EMPTY is all ones
+    memset(keys->dk_indices, 0xff, size * sizeof(int64_t));
+  }
+  MM_TX_END(_mm)
+  return _mm->pptr(keys);
+}
+
+PMapKeysObject *PMMap::getKeys() {
+  return (PMapKeysObject *)_mm->direct(_pmap->ma_keys);
+}
+
+uint64_t PMMap::keyHash(const PMKey &key) {
+  if (key.str != nullptr) {
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < key.len; ++i) {
+      h = (h ^ (unsigned char)key.str[i]) * 0x100000001b3ULL;
+    }
+    return mixHash(h);
+  }
+  if (key.pptr.pool_uuid_lo == TYPE_CODE_NUMBER) {
+    double d;
+    memcpy(&d, &(key.pptr.off), sizeof(double));
+    // SameValueZero: -0 equals +0 and every NaN equals each other
+    if (d == 0) d = 0;
+    if (d != d) d = NAN;
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(double));
+    return mixHash(bits ^ TYPE_CODE_NUMBER);
+  }
+  return mixHash(key.pptr.off ^ (key.pptr.pool_uuid_lo << 56));
+}
+
+// Returns the index slot of the key if it exists, otherwise an empty slot on
+// its probe sequence, which then holds a negative index.
+int64_t *PMMap::lookup(const PMKey &key, uint64_t khash) {
+  PMapKeysObject *keys = getKeys();
+  uint64_t mask = keys->dk_size - 1;
+  PMapEntry *ep0 = MK_ENTRIES(keys);
+  uint64_t idx = khash & mask;
+  uint64_t perturb = khash;
+  while (true) {
+    int64_t *ip = keys->dk_indices + idx;
+    if (*ip == MK_IX_EMPTY) return ip;
+    if (*ip >= 0) {
+      PMapEntry *ep = ep0 + *ip;
+      if (ep->me_hash == khash && _mm->keyEquals(ep->me_key, key)) return ip;
+    }
+    perturb = perturb >> PERTURB_SHIFT;
+    idx = (idx * 5 + perturb + 1) & mask;
+  }
+}
+
+int64_t *PMMap::findEmptyIndex(PMapKeysObject *keys, uint64_t khash) {
+  uint64_t mask = keys->dk_size - 1;
+  uint64_t idx = khash & mask;
+  uint64_t perturb = khash;
+  while (keys->dk_indices[idx] >= 0) {
+    perturb = perturb >> PERTURB_SHIFT;
+    idx = (idx * 5 + perturb + 1) & mask;
+  }
+  return keys->dk_indices + idx;
+}
+
+// Rebuilds the key table with newsize slots, dropping deleted entries.
+void PMMap::resize(uint64_t newsize) {
+  PPtr old_keys_pptr = _pmap->ma_keys;
+  PMapKeysObject *old_keys = getKeys();
+  MM_TX_BEGIN(_mm) {
+    PPtr new_keys_pptr = newKeysObject(newsize);
+    PMapKeysObject *new_keys = (PMapKeysObject *)_mm->direct(new_keys_pptr);
+    PMapEntry *old_ep0 = MK_ENTRIES(old_keys);
+    PMapEntry *new_ep0 = MK_ENTRIES(new_keys);
+    uint64_t ix = 0;
+    for (uint64_t i = 0; i < old_keys->dk_nentries; ++i) {
+      PMapEntry *ep = old_ep0 + i;
+      if (PPTR_EQUALS(ep->me_key, PPTR_NULL)) continue;
+      new_ep0[ix] = *ep;
+      *findEmptyIndex(new_keys, ep->me_hash) = ix;
+      ix += 1;
+    }
+    new_keys->dk_nentries = ix;
+    new_keys->dk_usable -= ix;
+    assert(new_keys->dk_usable > 0);
+    _mm->snapshotRange(&(_pmap->ma_keys), sizeof(PPtr));
+    _pmap->ma_keys = new_keys_pptr;
+    _mm->free(old_keys_pptr);
+  }
+  MM_TX_END(_mm)
+}
+
+void PMMap::rehash() {
+  PMapKeysObject *keys = getKeys();
+  PMapEntry *ep0 = MK_ENTRIES(keys);
+  std::vector<std::pair<PMapEntry *, uint64_t>> stale;
+  for (uint64_t i = 0; i < keys->dk_nentries; ++i) {
+    PMapEntry *ep = ep0 + i;
+    if (PPTR_EQUALS(ep->me_key, PPTR_NULL) || PPTR_IS_INLINE(ep->me_key)) {
+      continue;
+    }
+    // a string is hashed by its content, which does not move
+    PObject *pobj = (PObject *)_mm->direct(ep->me_key);
+    if (pobj->ob_type == TYPE_CODE_STRING) continue;
+    PMKey key = {ep->me_key, nullptr, 0};
+    uint64_t khash = keyHash(key);
+    if (khash != ep->me_hash) stale.push_back(std::make_pair(ep, khash));
+  }
+  if (stale.empty()) return;
+
+  MM_TX_BEGIN(_mm) {
+    for (size_t i = 0; i < stale.size(); ++i) {
+      _mm->snapshotRange(&(stale[i].first->me_hash), sizeof(uint64_t));
+      stale[i].first->me_hash = stale[i].second;
+    }
+    // the index slots are laid out again from the new hashes, in place so
+    // that the entries keep their address
+    _mm->snapshotRange(keys->dk_indices, keys->dk_size * sizeof(int64_t));
+    for (uint64_t i = 0; i < keys->dk_size; ++i) {
+      keys->dk_indices[i] = MK_IX_EMPTY;
+    }
+    for (uint64_t i = 0; i < keys->dk_nentries; ++i) {
+      if (PPTR_EQUALS(ep0[i].me_key, PPTR_NULL)) continue;
+      *findEmptyIndex(keys, ep0[i].me_hash) = i;
+    }
+  }
+  MM_TX_END(_mm)
+}
+
+uint64_t PMMap::calculateKeysize(uint64_t minsize) {
+  uint64_t newsize = MIN_SIZE_COMBINED;
+  while (usableFraction(newsize) <= minsize && newsize > 0) {
+    newsize = newsize << 1;
+  }
+  return newsize;
+}
+
+uint64_t PMMap::usableFraction(uint64_t size) { return (2 * size) / 3; }
+}  // namespace internal
@@ -0,0 +1,53 @@
+#ifndef INTERNAL_PMMAP_H
+#define INTERNAL_PMMAP_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <list>
+#include <memory>
+#include <utility>
+
+#include "memorymanager.h"
+
+namespace internal {
+class PMMap {
+ public:
+  PMMap(MemoryManager* mm, void* data);
+  PMMap(MemoryManager* mm, bool is_set = false);
+  PMMap(const PMMap& other) = delete;
+  PMMap& operator=(const PMMap& other) = delete;
+
+  std::shared_ptr<const void> getPPtr();
+  bool isSet();
+  uint64_t size();
+  std::shared_ptr<const void> get(const PMKey& key);
+  bool has(const PMKey& key);
+  void set(const PMKey& key, std::shared_ptr<const void> value_pptr_ptr,
+           snapshotFlag flag = kSnapshot);
+  bool del(const PMKey& key, snapshotFlag flag = kSnapshot);
+  void clear();
+  // (key, value) pairs in insertion order
+  std::list<std::pair<std::shared_ptr<const void>, std::shared_ptr<const void>>>
+  getEntries();
+  // Updates the hashes of the keys held by their PPtr, such as the records of
+  // an index, after MemoryManager::defrag() moved their objects.
+  void rehash();
+
+  void _deallocate();
+
+ private:
+  PPtr newKeysObject(uint64_t size);
+  PMapKeysObject* getKeys();
+  uint64_t keyHash(const PMKey& key);
+  int64_t* lookup(const PMKey& key, uint64_t khash);
+  int64_t* findEmptyIndex(PMapKeysObject* keys, uint64_t khash);
+  void resize(uint64_t newsize);
+  uint64_t calculateKeysize(uint64_t minsize);
+  uint64_t usableFraction(uint64_t size);
+
+  MemoryManager* _mm;
+  PMapObject* _pmap;
+  PPtr _pptr;
+};
+}
+#endif
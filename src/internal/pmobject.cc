@@ -1,7 +1,11 @@
+#include <assert.h>
+#include <algorithm>
+
 #include "pmobject.h"
 #include "common.h"
 #include "pmarray.h"
 #include "pmdict.h"
+#include "pmindex.h"
 
 namespace internal {
 PMObject::PMObject(MemoryManager* mm, void* data) {
@@ -10,28 +14,16 @@ PMObject::PMObject(MemoryManager* mm, void* data) {
   Logger::Debug("PMObject::PMObject: construct by (%llu, %llu)\n",
                 _pptr.pool_uuid_lo, _pptr.off);
   _pobj = (PObjectObject*)_mm->direct(_pptr);
-  PObject* pobj = (PObject*)_mm->direct(_pobj->elements);
-
-  if (pobj->ob_type == TYPE_CODE_ARRAY) {
-    _elements = new impl::PMSimpleArray(_mm, _pobj->elements);
-  } else if (pobj->ob_type == TYPE_CODE_NUMDICT) {
-    _elements = new impl::PMNumDict(_mm, _pobj->elements);
-  } else {
-    // TODO: throw an error
-    _elements = nullptr;
-  }
-  _extra_props = new impl::PMDict(_mm, _pobj->extra_props);
 }
 
+// Only the object itself is allocated, its elements and extra_props are
+// allocated once they are needed.
 PMObject::PMObject(MemoryManager* mm, bool is_array) {
   _mm = mm;
   MM_TX_BEGIN(_mm) {
-    _pobj = (PObjectObject*)_mm->tx_zalloc(sizeof(PObjectObject));
+    _pobj = (PObjectObject*)_mm->tx_zalloc(is_array ? OBJECT_ARRAY_SIZE
+                                                    : sizeof(PObjectObject));
     ((PObject*)_pobj)->ob_type = TYPE_CODE_OBJECT;
-    _extra_props = new impl::PMDict(_mm);
-    _pobj->extra_props = _extra_props->getPPtr();
-    _elements = new impl::PMSimpleArray(_mm);
-    _pobj->elements = _elements->getPPtr();
     _pobj->is_array = is_array;
     _pptr = _mm->pptr(_pobj);
   }
@@ -49,15 +41,125 @@ std::shared_ptr<const void> PMObject::getPPtr() {
   return std::make_shared<PPtr>(_pptr);
 }
 
+impl::PMArray* PMObject::getElements() {
+  if (PPTR_EQUALS(_pobj->elements, _elements_pptr)) return _elements;
+  delete _elements;
+  _elements = nullptr;
+  _elements_pptr = _pobj->elements;
+  if (PPTR_EQUALS(_elements_pptr, PPTR_NULL)) return nullptr;
+  PObject* pobj = (PObject*)_mm->direct(_elements_pptr);
+  if (pobj->ob_type == TYPE_CODE_NUMDICT) {
+    _elements = new impl::PMNumDict(_mm, _elements_pptr);
+  } else {
+    _elements = new impl::PMSimpleArray(_mm, _elements_pptr);
+  }
+  return _elements;
+}
+
+impl::PMArray* PMObject::newElements(bool doubles) {
+  if (getElements() != nullptr) return _elements;
+  MM_TX_BEGIN(_mm) {
+    impl::PMSimpleArray* elements = new impl::PMSimpleArray(_mm, doubles);
+    _mm->snapshotRange(&(_pobj->elements), sizeof(PPtr));
+    _pobj->elements = elements->getPPtr();
+    _elements = elements;
+    _elements_pptr = _pobj->elements;
+  }
+  MM_TX_END(_mm)
+  return _elements;
+}
+
+impl::PMDict* PMObject::getExtraProps() {
+  if (PPTR_EQUALS(_pobj->extra_props, _extra_props_pptr)) return _extra_props;
+  delete _extra_props;
+  _extra_props = nullptr;
+  _extra_props_pptr = _pobj->extra_props;
+  if (PPTR_EQUALS(_extra_props_pptr, PPTR_NULL)) return nullptr;
+  _extra_props = new impl::PMDict(_mm, _extra_props_pptr);
+  return _extra_props;
+}
+
+impl::PMDict* PMObject::newExtraProps() {
+  if (getExtraProps() != nullptr) return _extra_props;
+  MM_TX_BEGIN(_mm) {
+    impl::PMDict* extra_props = new impl::PMDict(_mm);
+    _mm->snapshotRange(&(_pobj->extra_props), sizeof(PPtr));
+    _pobj->extra_props = extra_props->getPPtr();
+    _extra_props = extra_props;
+    _extra_props_pptr = _pobj->extra_props;
+  }
+  MM_TX_END(_mm)
+  return _extra_props;
+}
+
+PInlineProp* PMObject::findInline(const std::string& key) {
+  if (_pobj->is_array) return nullptr;
+  PMKey pmkey = {PPTR_NULL, key.c_str(), key.size()};
+  for (int i = 0; i < OBJECT_INLINE_PROPS; ++i) {
+    PInlineProp* prop = &(_pobj->ob_props[i]);
+    if (!PPTR_EQUALS(prop->key, PPTR_NULL) &&
+        _mm->keyEquals(prop->key, pmkey)) {
+      return prop;
+    }
+  }
+  return nullptr;
+}
+
+PInlineProp* PMObject::freeInline() {
+  if (_pobj->is_array) return nullptr;
+  for (int i = 0; i < OBJECT_INLINE_PROPS; ++i) {
+    PInlineProp* prop = &(_pobj->ob_props[i]);
+    if (PPTR_EQUALS(prop->key, PPTR_NULL)) return prop;
+  }
+  return nullptr;
+}
+
+// A key lives either in ob_props or in extra_props. A new key takes a free
+// slot of ob_props if there is one.
 void PMObject::setProperty(std::string key,
                            std::shared_ptr<const void> value_pptr_ptr,
                            snapshotFlag flag) {
-  _extra_props->setProperty(key, *((PPtr*)value_pptr_ptr.get()), flag);
+  PPtr value_pptr = *((PPtr*)value_pptr_ptr.get());
+  PInlineProp* prop = findInline(key);
+  if (prop == nullptr) {
+    impl::PMDict* extra_props = getExtraProps();
+    if (extra_props != nullptr &&
+        !PPTR_EQUALS(extra_props->getProperty(key), PPTR_EMPTY)) {
+      extra_props->setProperty(key, value_pptr, flag);
+      return;
+    }
+    prop = freeInline();
+  }
+  if (prop == nullptr) {
+    newExtraProps()->setProperty(key, value_pptr, flag);
+    return;
+  }
+  MM_TX_BEGIN(_mm) {
+    if (flag) _mm->snapshotRange(prop, sizeof(PInlineProp));
+    if (PPTR_EQUALS(prop->key, PPTR_NULL)) prop->key = _mm->persistString(key);
+    prop->value = value_pptr;
+  }
+  MM_TX_END(_mm)
 }
 
 void PMObject::setProperty(uint32_t index,
                            std::shared_ptr<const void> value_pptr_ptr,
                            snapshotFlag flag) {
+  PPtr value_pptr = *((PPtr*)value_pptr_ptr.get());
+  if (PPTR_EQUALS(_pobj->indexes, PPTR_NULL)) {
+    setElement(index, value_pptr, flag);
+    return;
+  }
+  PPtr old_value = newElements()->getProperty(index);
+  MM_TX_BEGIN(_mm) {
+    setElement(index, value_pptr, flag);
+    updateIndexes({old_value}, {value_pptr});
+  }
+  MM_TX_END(_mm)
+}
+
+void PMObject::setElement(uint32_t index, PPtr value_pptr, snapshotFlag flag) {
+  newElements(PPTR_IS_NUMBER(value_pptr));
   if (_elements->shouldConvertToNumDict(index)) {
     MM_TX_BEGIN(_mm) {
       impl::PMNumDict* new_elements =
@@ -66,6 +168,7 @@ void PMObject::setProperty(uint32_t index,
       _pobj->elements = new_elements->getPPtr();
       delete ((impl::PMSimpleArray*)_elements);
       _elements = new_elements;
+      _elements_pptr = _pobj->elements;
     }
     MM_TX_END(_mm)
   } else if (_elements->shouldConvertToSimpleArray(index)) {
@@ -76,50 +179,341 @@ void PMObject::setProperty(uint32_t index,
       _pobj->elements = new_elements->getPPtr();
       delete ((impl::PMNumDict*)_elements);
       _elements = new_elements;
+      _elements_pptr = _pobj->elements;
     }
     MM_TX_END(_mm)
   }
-  _elements->setProperty(index, *((PPtr*)value_pptr_ptr.get()), flag);
+  _elements->setProperty(index, value_pptr, flag);
 }
 
 std::shared_ptr<const void> PMObject::getProperty(std::string key) {
-  PPtr pptr = _extra_props->getProperty(key);
+  PInlineProp* prop = findInline(key);
+  if (prop != nullptr) return std::make_shared<PPtr>(prop->value);
+  impl::PMDict* extra_props = getExtraProps();
+  PPtr pptr =
+      extra_props == nullptr ? PPTR_EMPTY : extra_props->getProperty(key);
   return std::make_shared<PPtr>(pptr);
 }
 
 std::shared_ptr<const void> PMObject::getProperty(uint32_t index) {
-  PPtr pptr = _elements->getProperty(index);
+  impl::PMArray* elements = getElements();
+  PPtr pptr =
+      elements == nullptr ? PPTR_UNDEFINED : elements->getProperty(index);
   return std::make_shared<PPtr>(pptr);
 }
 
+// frees the key, and the value unless it may be shared, like PMDict
 void PMObject::delProperty(std::string key, snapshotFlag flag) {
-  _extra_props->delProperty(key, flag);
+  PInlineProp* prop = findInline(key);
+  if (prop == nullptr) {
+    impl::PMDict* extra_props = getExtraProps();
+    if (extra_props != nullptr) extra_props->delProperty(key, flag);
+    return;
+  }
+  MM_TX_BEGIN(_mm) {
+    if (flag) _mm->snapshotRange(prop, sizeof(PInlineProp));
+    PPtr old_key_pptr = prop->key;
+    PPtr old_value_pptr = prop->value;
+    prop->key = PPTR_NULL;
+    prop->value = PPTR_NULL;
+    _mm->free(old_key_pptr);
+    _mm->freeUnshared(old_value_pptr);
+  }
+  MM_TX_END(_mm)
 }
 
 void PMObject::delProperty(uint32_t index, snapshotFlag flag) {
-  _elements->delProperty(index, flag);
+  impl::PMArray* elements = getElements();
+  if (elements == nullptr) return;
+  if (PPTR_EQUALS(_pobj->indexes, PPTR_NULL)) {
+    elements->delProperty(index, flag);
+    return;
+  }
+  PPtr old_value = elements->getProperty(index);
+  MM_TX_BEGIN(_mm) {
+    elements->delProperty(index, flag);
+    updateIndexes({old_value}, {});
+  }
+  MM_TX_END(_mm)
 }
 
 std::list<std::shared_ptr<const void>> PMObject::getPropertyNames() {
-  return _extra_props->getPropertyNames();
+  std::list<std::shared_ptr<const void>> names;
+  for (int i = 0; !_pobj->is_array && i < OBJECT_INLINE_PROPS; ++i) {
+    PPtr key_pptr = _pobj->ob_props[i].key;
+    if (!PPTR_EQUALS(key_pptr, PPTR_NULL)) {
+      names.push_back(std::make_shared<PPtr>(key_pptr));
+    }
+  }
+  impl::PMDict* extra_props = getExtraProps();
+  if (extra_props != nullptr) {
+    names.splice(names.end(), extra_props->getPropertyNames());
+  }
+  return names;
 }
 
 std::list<uint32_t> PMObject::getValidIndex() {
-  return _elements->getValidIndex();
+  impl::PMArray* elements = getElements();
+  if (elements == nullptr) return std::list<uint32_t>();
+  return elements->getValidIndex();
 }
 
 void PMObject::push(std::shared_ptr<const void> data) {
-  _elements->push(*((PPtr*)data.get()));
+  PPtr value_pptr = *((PPtr*)data.get());
+  if (PPTR_EQUALS(_pobj->indexes, PPTR_NULL)) {
+    newElements(PPTR_IS_NUMBER(value_pptr))->push(value_pptr);
+    return;
+  }
+  MM_TX_BEGIN(_mm) {
+    newElements()->push(value_pptr);
+    updateIndexes({}, {value_pptr});
+  }
+  MM_TX_END(_mm)
 }
 
-std::shared_ptr<const void> PMObject::pop() { return _elements->pop(); }
+std::shared_ptr<const void> PMObject::pop() {
+  impl::PMArray* elements = getElements();
+  if (elements == nullptr) return std::make_shared<PPtr>(PPTR_UNDEFINED);
+  if (PPTR_EQUALS(_pobj->indexes, PPTR_NULL)) return elements->pop();
+  std::shared_ptr<const void> popped;
+  MM_TX_BEGIN(_mm) {
+    popped = elements->pop();
+    updateIndexes({*((PPtr*)popped.get())}, {});
+  }
+  MM_TX_END(_mm)
+  return popped;
+}
 
 bool PMObject::isArray() { return _pobj->is_array; }
 
-uint32_t PMObject::getLength() { return _elements->getLength(); }
+uint32_t PMObject::getLength() {
+  impl::PMArray* elements = getElements();
+  return elements == nullptr ? 0 : elements->getLength();
+}
 
 void PMObject::setLength(uint32_t new_length) {
-  _elements->setLength(new_length);
+  uint32_t length = getLength();
+  if (length == new_length) return;
+  if (PPTR_EQUALS(_pobj->indexes, PPTR_NULL) || new_length >= length) {
+    newElements()->setLength(new_length);
+    return;
+  }
+  std::vector<PPtr> removed = getRange(new_length, length);
+  MM_TX_BEGIN(_mm) {
+    _elements->setLength(new_length);
+    updateIndexes(removed, {});
+  }
+  MM_TX_END(_mm)
+}
+
+std::vector<PPtr> PMObject::getRange(uint32_t start, uint32_t end) {
+  std::vector<PPtr> items;
+  impl::PMArray* elements = getElements();
+  if (start < end && elements != nullptr) {
+    items.reserve(end - start);
+    elements->getRange(start, end, &items);
+  }
+  return items;
+}
+
+void PMObject::setRange(uint32_t start, const std::vector<PPtr>& items) {
+  if (items.empty()) return;
+  if (PPTR_EQUALS(_pobj->indexes, PPTR_NULL)) {
+    newElements(PPTR_IS_NUMBER(items[0]))->setRange(start, items);
+    return;
+  }
+  std::vector<PPtr> removed = getRange(start, start + items.size());
+  MM_TX_BEGIN(_mm) {
+    newElements()->setRange(start, items);
+    updateIndexes(removed, items);
+  }
+  MM_TX_END(_mm)
+}
+
+// The items after the removed ones are moved with setRange(), which copies
+// a chunk at a time and extends the array if it grows.
+std::vector<PPtr> PMObject::splice(uint32_t start, uint32_t delete_count,
+                                   const std::vector<PPtr>& items) {
+  uint32_t length = getLength();
+  if (start > length) start = length;
+  if (delete_count > length - start) delete_count = length - start;
+  std::vector<PPtr> removed = getRange(start, start + delete_count);
+  uint64_t new_length = (uint64_t)length - delete_count + items.size();
+  if (new_length >= UINT32_MAX) throw "invalid array length";
+  if (items.size() == delete_count) {
+    setRange(start, items);
+    return removed;
+  }
+
+  std::vector<PPtr> moved = items;
+  impl::PMArray* elements =
+      newElements(!items.empty() && PPTR_IS_NUMBER(items[0]));
+  elements->getRange(start + delete_count, length, &moved);
+  MM_TX_BEGIN(_mm) {
+    if (!moved.empty()) elements->setRange(start, moved);
+    if (new_length < length) elements->setLength(new_length);
+    // the moved records stay in the collection
+    updateIndexes(removed, items);
+  }
+  MM_TX_END(_mm)
+  return removed;
+}
+
+int64_t PMObject::indexOf(const PMKey& key, uint32_t from, bool match_holes) {
+  uint32_t length = getLength();
+  bool is_undefined =
+      key.str == nullptr && PPTR_EQUALS(key.pptr, PPTR_UNDEFINED);
+  std::vector<PPtr> items;
+  // a chunk at a time, so that a hit near from does not read the whole array
+  for (uint32_t start = from; start < length; start += ARRAY_CHUNK_SIZE) {
+    items.clear();
+    getElements()->getRange(start, start + ARRAY_CHUNK_SIZE, &items);
+    for (size_t i = 0; i < items.size(); ++i) {
+      if (PPTR_EQUALS(items[i], PPTR_NULL)) {
+        if (match_holes && is_undefined) return start + i;
+      } else if (_mm->keyEquals(items[i], key)) {
+        return start + i;
+      }
+    }
+  }
+  return -1;
+}
+
+void PMObject::reverse() {
+  std::vector<PPtr> items = getRange(0, getLength());
+  std::reverse(items.begin(), items.end());
+  // the same records, the indexes stay as they are
+  if (!items.empty()) getElements()->setRange(0, items);
+}
+
+void PMObject::fill(PPtr value, uint32_t start, uint32_t end) {
+  uint32_t length = getLength();
+  if (end > length) end = length;
+  if (start >= end) return;
+  setRange(start, std::vector<PPtr>(end - start, value));
+}
+
+void PMObject::permute(const std::vector<uint32_t>& order) {
+  std::vector<PPtr> items = getRange(0, getLength());
+  if (order.size() != items.size()) throw "invalid argument";
+  std::vector<bool> seen(items.size(), false);
+  std::vector<PPtr> permuted(items.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    if (order[i] >= items.size() || seen[order[i]]) throw "invalid argument";
+    seen[order[i]] = true;
+    permuted[i] = items[order[i]];
+  }
+  if (!permuted.empty()) getElements()->setRange(0, permuted);
+}
+
+// Double arrays are reduced over their slots, other elements over their
+// items, which must all be numbers then.
+double PMObject::reduce(NumberReduction op, uint32_t start, uint32_t end) {
+  impl::PMArray* elements = getElements();
+  double result = impl::reductionStart(op);
+  if (elements == nullptr || start >= end) return result;
+  if (elements->reduce(op, start, end, &result)) return result;
+  std::vector<PPtr> items;
+  std::vector<double> values;
+  for (uint32_t i = start; i < end; i += ARRAY_CHUNK_SIZE) {
+    items.clear();
+    values.clear();
+    uint32_t count = end - i > ARRAY_CHUNK_SIZE ? ARRAY_CHUNK_SIZE : end - i;
+    elements->getRange(i, i + count, &items);
+    for (const PPtr& item : items) {
+      if (!PPTR_IS_NUMBER(item)) throw "not a number";
+      values.push_back(reinterpret_cast<const double&>(item.off));
+    }
+    impl::reduceDoubles(op, values.data(), values.size(), &result);
+  }
+  return result;
+}
+
+PPtr PMObject::createIndex(const std::string& field, uint64_t flags) {
+  if (!PPTR_EQUALS(_pobj->indexes, PPTR_NULL)) {
+    impl::PMSimpleArray indexes(_mm, _pobj->indexes);
+    for (uint32_t i = 0; i < indexes.getLength(); ++i) {
+      PPtr index_pptr = indexes.getProperty(i);
+      PMIndex index(_mm, &index_pptr);
+      if (index.getField() == field && index.getFlags() == flags) {
+        return index_pptr;
+      }
+    }
+  }
+
+  PPtr index_pptr;
+  MM_TX_BEGIN(_mm) {
+    PMIndex index(_mm, _pptr, field, flags);
+    index_pptr = *((PPtr*)index.getPPtr().get());
+    std::vector<PPtr> records = getRange(0, getLength());
+    for (size_t i = 0; i < records.size(); ++i) index.add(records[i]);
+    if (PPTR_EQUALS(_pobj->indexes, PPTR_NULL)) {
+      _mm->snapshotRange(&(_pobj->indexes), sizeof(PPtr));
+      _pobj->indexes = impl::PMSimpleArray(_mm).getPPtr();
+    }
+    impl::PMSimpleArray(_mm, _pobj->indexes).push(index_pptr);
+  }
+  MM_TX_END(_mm)
+  return index_pptr;
+}
+
+// The index is left to the garbage collector, it may still be referenced.
+void PMObject::dropIndex(PPtr index_pptr) {
+  if (PPTR_EQUALS(_pobj->indexes, PPTR_NULL)) return;
+  impl::PMSimpleArray indexes(_mm, _pobj->indexes);
+  std::vector<PPtr> items;
+  indexes.getRange(0, indexes.getLength(), &items);
+  for (size_t i = 0; i < items.size(); ++i) {
+    if (!PPTR_EQUALS(items[i], index_pptr)) continue;
+    MM_TX_BEGIN(_mm) {
+      if (items.size() == 1) {
+        _mm->snapshotRange(&(_pobj->indexes), sizeof(PPtr));
+        _pobj->indexes = PPTR_NULL;
+        indexes._deallocate();
+      } else {
+        items.erase(items.begin() + i);
+        indexes.setRange(0, items);
+        indexes.pop();
+      }
+    }
+    MM_TX_END(_mm)
+    return;
+  }
+}
+
+// Called inside the transaction that changes the elements, all removed
+// records go first so that a unique key may move from one record to another.
+void PMObject::updateIndexes(const std::vector<PPtr>& removed,
+                             const std::vector<PPtr>& added) {
+  if (PPTR_EQUALS(_pobj->indexes, PPTR_NULL)) return;
+  impl::PMSimpleArray index_array(_mm, _pobj->indexes);
+  std::vector<PPtr> indexes;
+  index_array.getRange(0, index_array.getLength(), &indexes);
+  for (size_t i = 0; i < indexes.size(); ++i) {
+    PMIndex index(_mm, &indexes[i]);
+    for (size_t j = 0; j < removed.size(); ++j) index.remove(removed[j]);
+    for (size_t j = 0; j < added.size(); ++j) index.add(added[j]);
+  }
+}
+
+void PMObject::copyFrom(PMObject& src,
+                        const std::function<PPtr(PPtr)>& copy_value) {
+  assert(_pobj->is_array == src._pobj->is_array);
+  MM_TX_BEGIN(_mm) {
+    for (int i = 0; !_pobj->is_array && i < OBJECT_INLINE_PROPS; ++i) {
+      PInlineProp* prop = &(src._pobj->ob_props[i]);
+      if (PPTR_EQUALS(prop->key, PPTR_NULL)) continue;
+      _pobj->ob_props[i].key = copy_value(prop->key);
+      _pobj->ob_props[i].value = copy_value(prop->value);
+    }
+    impl::PMArray* elements = src.getElements();
+    if (elements != nullptr) _pobj->elements = elements->clone(copy_value);
+    impl::PMDict* extra_props = src.getExtraProps();
+    if (extra_props != nullptr) {
+      _pobj->extra_props = extra_props->clone(copy_value);
+    }
+  }
+  MM_TX_END(_mm)
 }
 
 void PMObject::_deallocate() {
@@ -3,8 +3,11 @@
 
 #include <stddef.h>
 #include <sys/stat.h>
+#include <functional>
 #include <list>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "memorymanager.h"
 #include "pmdict.h"
@@ -35,15 +38,61 @@ class PMObject {
   uint32_t getLength();
   void setLength(uint32_t new_length);
 
+  // Array operations over the elements, each in one transaction. Holes are
+  // PPTR_NULL.
+  std::vector<PPtr> getRange(uint32_t start, uint32_t end);
+  void setRange(uint32_t start, const std::vector<PPtr>& items);
+  std::vector<PPtr> splice(uint32_t start, uint32_t delete_count,
+                           const std::vector<PPtr>& items);
+  // -1 if not found; includes() matches holes for undefined, indexOf() skips
+  // them
+  int64_t indexOf(const PMKey& key, uint32_t from, bool match_holes);
+  void reverse();
+  void fill(PPtr value, uint32_t start, uint32_t end);
+  // the item at order[i] moves to i, order must be a permutation of the
+  // indexes
+  void permute(const std::vector<uint32_t>& order);
+  // op over the numbers in [start, end), throws if an item is not a number
+  double reduce(NumberReduction op, uint32_t start, uint32_t end);
+
+  // Secondary indexes over the records in the elements, kept in sync by the
+  // operations above. createIndex() returns the index on field with the same
+  // flags if there is one already.
+  PPtr createIndex(const std::string& field, uint64_t flags);
+  void dropIndex(PPtr index);
+
+  // Makes this object, which must be new and of the same kind, a copy of src
+  // in new allocations, with the keys and values mapped by copy_value. The
+  // indexes of src are not copied.
+  void copyFrom(PMObject& src, const std::function<PPtr(PPtr)>& copy_value);
+
   void _deallocate();
 
  private:
+  // The elements and extra_props of the object, nullptr while it has none.
+  // The wrappers are rebuilt whenever the PPtr in _pobj changed, e.g. when
+  // an abort rolled it back. new*() allocate them on first use, the elements
+  // as a double array if doubles, i.e. the first item is a number.
+  impl::PMArray* getElements();
+  impl::PMArray* newElements(bool doubles = false);
+  impl::PMDict* getExtraProps();
+  impl::PMDict* newExtraProps();
+  // the slot of key in ob_props, nullptr if it is not there
+  PInlineProp* findInline(const std::string& key);
+  // a free slot of ob_props, nullptr if there is none
+  PInlineProp* freeInline();
+  void setElement(uint32_t index, PPtr value_pptr, snapshotFlag flag);
+  void updateIndexes(const std::vector<PPtr>& removed,
+                     const std::vector<PPtr>& added);
+
   MemoryManager* _mm;
   PObjectObject* _pobj;
   PPtr _pptr;
 
-  impl::PMArray* _elements;
-  impl::PMDict* _extra_props;
+  impl::PMArray* _elements = nullptr;
+  PPtr _elements_pptr = PPTR_NULL;
+  impl::PMDict* _extra_props = nullptr;
+  PPtr _extra_props_pptr = PPTR_NULL;
 };
 }
 #endif
\ No newline at end of file
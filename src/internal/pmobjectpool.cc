@@ -1,8 +1,15 @@
+#include <stddef.h>
+#include <string.h>
 #include <exception>
+#include <functional>
+#include <map>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "common.h"
+#include "pmobject.h"
 #include "pmobjectpool.h"
 
 namespace internal {
@@ -11,17 +18,21 @@ int PMObjectPool::check(std::string path, std::string layout) {
   return MemoryManager::check(path, layout);
 }
 
-PMObjectPool::PMObjectPool(std::string path, std::string layout) {
-  _mm = new MemoryManager(path, layout);
+PMObjectPool::PMObjectPool(std::string path, std::string layout,
+                           const PoolOptions& options) {
+  _mm = MemoryManager::acquire(path, layout, options);
 }
 
 PMObjectPool::PMObjectPool(std::string path, std::string layout,
-                           uint32_t poolsize, mode_t mode) {
-  _mm = new MemoryManager(path, layout, poolsize, mode);
+                           uint32_t poolsize, mode_t mode,
+                           const PoolOptions& options) {
+  _mm = MemoryManager::acquire(path, layout, poolsize, mode, options);
   setRoot(std::make_shared<PPtr>(PPTR_UNDEFINED));
 }
 
-PMObjectPool::~PMObjectPool() { delete _mm; }
+PMObjectPool::~PMObjectPool() {
+  if (_mm != nullptr) MemoryManager::release(_mm);
+}
 
 MemoryManager* PMObjectPool::getMemoryManager() { return _mm; }
 
@@ -35,9 +46,7 @@ std::shared_ptr<const void> PMObjectPool::getRoot() {
 
 void PMObjectPool::setRoot(std::shared_ptr<const void> data) {
   PPtr pptr = *((PPtr*)data.get());
-  uint64_t type_code = *((uint64_t*)data.get());
-  if (!(type_code == TYPE_CODE_NUMBER || type_code == TYPE_CODE_SINGLETON) &&
-      _mm->direct(pptr) == NULL) {
+  if (!PPTR_IS_INLINE(pptr) && _mm->direct(pptr) == NULL) {
     throw "invalid argument";
   }
   PPtr root_pptr = _mm->root(sizeof(PRoot));
@@ -59,6 +68,12 @@ PERSISTENT_VALUE PMObjectPool::getValue(std::shared_ptr<const void> data) {
     // number
     value.type = PERSISTENT_TYPE_NUMBER;
     value.data = (uint64_t*)data.get() + 1;
+  } else if (type_code == TYPE_CODE_DATE) {
+    value.type = PERSISTENT_TYPE_DATE;
+    value.data = (uint64_t*)data.get() + 1;
+  } else if (type_code == TYPE_CODE_BIGINT) {
+    value.type = PERSISTENT_TYPE_BIGINT64;
+    value.data = (uint64_t*)data.get() + 1;
   } else if (type_code == TYPE_CODE_SINGLETON) {
     // singleton
     uint64_t off = *((uint64_t*)data.get() + 1);
@@ -83,12 +98,28 @@ PERSISTENT_VALUE PMObjectPool::getValue(std::shared_ptr<const void> data) {
     if (pobj->ob_type == TYPE_CODE_STRING) {
       value.type = PERSISTENT_TYPE_STRING;
       value.data = (char*)pobj + sizeof(PStringObject);
+    } else if (pobj->ob_type == TYPE_CODE_BIGINT) {
+      value.type = PERSISTENT_TYPE_BIGINT;
+      value.data = pobj;
     } else if (pobj->ob_type == TYPE_CODE_ARRAYBUFFER) {
       value.type = PERSISTENT_TYPE_ARRAYBUFFER;
       value.data = data.get();
     } else if (pobj->ob_type == TYPE_CODE_OBJECT) {
       value.type = PERSISTENT_TYPE_OBJECT;
       value.data = data.get();
+    } else if (pobj->ob_type == TYPE_CODE_MAP ||
+               pobj->ob_type == TYPE_CODE_SET) {
+      value.type = PERSISTENT_TYPE_MAP;
+      value.data = data.get();
+    } else if (pobj->ob_type == TYPE_CODE_DEQUE) {
+      value.type = PERSISTENT_TYPE_DEQUE;
+      value.data = data.get();
+    } else if (pobj->ob_type == TYPE_CODE_BTREE) {
+      value.type = PERSISTENT_TYPE_BTREE;
+      value.data = data.get();
+    } else if (pobj->ob_type == TYPE_CODE_INDEX) {
+      value.type = PERSISTENT_TYPE_INDEX;
+      value.data = data.get();
     } else
       throw "invalid argument";
   }
@@ -101,6 +132,63 @@ std::shared_ptr<const void> PMObjectPool::persistDouble(double value) {
   return std::make_shared<PPtr>(pptr);
 }
 
+std::shared_ptr<const void> PMObjectPool::persistDate(double value) {
+  PPtr pptr = {pool_uuid_lo : TYPE_CODE_DATE, off : 0};
+  pptr.off = reinterpret_cast<uint64_t&>(value);
+  return std::make_shared<PPtr>(pptr);
+}
+
+struct BigIntInit {
+  int sign;
+  const uint64_t* words;
+  size_t word_count;
+};
+
+static void fillBigInt(PBigIntObject* pbig, const BigIntInit* init) {
+  ((PObject*)pbig)->ob_type = TYPE_CODE_BIGINT;
+  pbig->ob_sign = init->sign ? 1 : 0;
+  pbig->ob_words = init->word_count;
+  memcpy(pbig->ob_digits, init->words, init->word_count * 8);
+}
+
+// pmemobj_xalloc constructor of a BigInt allocated outside a transaction,
+// the object is filled and persisted before it is published.
+static int constructBigInt(PMEMobjpool* pop, void* ptr, void* arg) {
+  BigIntInit* init = (BigIntInit*)arg;
+  fillBigInt((PBigIntObject*)ptr, init);
+  pmemobj_persist(pop, ptr,
+                  offsetof(PBigIntObject, ob_digits) + init->word_count * 8);
+  return 0;
+}
+
+// words is the magnitude, little endian, as given by napi
+std::shared_ptr<const void> PMObjectPool::persistBigInt(int sign,
+                                                        const uint64_t* words,
+                                                        size_t word_count) {
+  while (word_count > 0 && words[word_count - 1] == 0) word_count -= 1;
+  uint64_t magnitude = (word_count == 0) ? 0 : words[0];
+  // inline if it fits an int64_t, including INT64_MIN
+  if (word_count <= 1 &&
+      (magnitude <= (uint64_t)INT64_MAX ||
+       (sign && magnitude == (uint64_t)INT64_MAX + 1))) {
+    PPtr pptr = {pool_uuid_lo : TYPE_CODE_BIGINT, off : 0};
+    pptr.off = sign ? (uint64_t)0 - magnitude : magnitude;
+    return std::make_shared<PPtr>(pptr);
+  }
+  size_t length = offsetof(PBigIntObject, ob_digits) + word_count * 8;
+  BigIntInit init = {sign, words, word_count};
+  PBigIntObject* pbig;
+  if (_mm->inTransaction()) {
+    // the new object is flushed on commit
+    pbig = (PBigIntObject*)_mm->tx_alloc(length, POBJ_TYPE_NUM);
+    fillBigInt(pbig, &init);
+  } else {
+    pbig = (PBigIntObject*)_mm->alloc(length, POBJ_TYPE_NUM, constructBigInt,
+                                      &init);
+  }
+  return std::make_shared<PPtr>(_mm->pptr(pbig));
+}
+
 std::shared_ptr<const void> PMObjectPool::persistBoolean(bool value) {
   if (value)
     return std::make_shared<PPtr>(PPTR_TRUE);
@@ -126,10 +214,108 @@ std::shared_ptr<const void> PMObjectPool::persistString(std::string value) {
   }
 }
 
-void PMObjectPool::close() { _mm->close(); }
+// the pool stays open while other threads use it
+void PMObjectPool::close() {
+  MemoryManager::release(_mm);
+  _mm = nullptr;
+}
+
+// A string is copied rather than shared, as deleting a property frees its
+// key and value. An object held by a deep copy is allocated right away and
+// filled later, so that nesting takes no recursion and cycles end.
+std::shared_ptr<const void> PMObjectPool::clone(
+    std::shared_ptr<const void> data, bool deep) {
+  PPtr src = *((PPtr*)data.get());
+  PObjectObject* src_obj = (PObjectObject*)_mm->direct(src);
+  if (src_obj == nullptr || ((PObject*)src_obj)->ob_type != TYPE_CODE_OBJECT) {
+    throw "invalid argument";
+  }
+  // the copies by the offset of the object they copy
+  std::map<uint64_t, PPtr> copies;
+  std::vector<std::pair<PPtr, PPtr>> pending;
+  std::function<PPtr(PPtr)> copy_object = [&](PPtr value) -> PPtr {
+    std::map<uint64_t, PPtr>::iterator it = copies.find(value.off);
+    if (it != copies.end()) return it->second;
+    PObjectObject* pobj = (PObjectObject*)_mm->direct(value);
+    PMObject copy(_mm, (bool)pobj->is_array);
+    PPtr copy_pptr = *((PPtr*)copy.getPPtr().get());
+    copies[value.off] = copy_pptr;
+    pending.push_back(std::make_pair(value, copy_pptr));
+    return copy_pptr;
+  };
+  std::function<PPtr(PPtr)> copy_value = [&](PPtr value) -> PPtr {
+    if (PPTR_IS_INLINE(value)) return value;
+    PObject* pobj = (PObject*)_mm->direct(value);
+    if (pobj == nullptr) return value;
+    switch (pobj->ob_type) {
+      case TYPE_CODE_STRING: {
+        size_t length = strlen((char*)pobj + sizeof(PStringObject));
+        return _mm->tx_copy(value, sizeof(PStringObject) + length + 1);
+      }
+      case TYPE_CODE_BIGINT:
+        return _mm->tx_copy(value, offsetof(PBigIntObject, ob_digits) +
+                                       ((PBigIntObject*)pobj)->ob_words * 8);
+      case TYPE_CODE_ARRAYBUFFER:
+        if (!deep) return value;
+        return _mm->tx_copy(value, sizeof(PArrayBufferObject) +
+                                       ((PArrayBufferObject*)pobj)->ob_length);
+      case TYPE_CODE_OBJECT:
+        return deep ? copy_object(value) : value;
+      default:
+        // Map, Set, deque, ordered map and index
+        if (!deep) return value;
+        throw "cannot clone";
+    }
+  };
+
+  PPtr result;
+  MM_TX_BEGIN(_mm) {
+    result = copy_object(src);
+    // copyFrom() appends the objects it meets to pending
+    for (size_t i = 0; i < pending.size(); ++i) {
+      PPtr from_pptr = pending[i].first;
+      PPtr to_pptr = pending[i].second;
+      PMObject from(_mm, (void*)&from_pptr);
+      PMObject to(_mm, (void*)&to_pptr);
+      to.copyFrom(from, copy_value);
+    }
+  }
+  MM_TX_END(_mm)
+  return std::make_shared<PPtr>(result);
+}
 
 void PMObjectPool::gc() { _mm->gc(); }
 
+DefragReport PMObjectPool::defrag(double budget_ms) {
+  return _mm->defrag(budget_ms);
+}
+
+unsigned PMObjectPool::getArena() { return _mm->getArena(); }
+
+std::vector<size_t> PMObjectPool::getArenaSizes() {
+  return _mm->getArenaSizes();
+}
+
+double PMObjectPool::ctlGet(const std::string& name) {
+  return _mm->ctlGet(name);
+}
+
+void PMObjectPool::ctlSet(const std::string& name, double value) {
+  _mm->ctlSet(name, value);
+}
+
+void PMObjectPool::tx_enter_context() { _mm->tx_enter_context(); }
+
+void PMObjectPool::tx_exit_context() { _mm->tx_exit_context(); }
+
+void PMObjectPool::tx_abort_context() { _mm->tx_abort_context(); }
+
+void PMObjectPool::reserve_enter_context() { _mm->reserve_enter_context(); }
+
+void PMObjectPool::reserve_exit_context() { _mm->reserve_exit_context(); }
+
+void PMObjectPool::publish() { _mm->publish(); }
+
 int PMObjectPool::tx_begin() { return _mm->tx_begin(); }
 
 void PMObjectPool::tx_commit() { _mm->tx_commit(); }
@@ -139,4 +325,10 @@ void PMObjectPool::tx_abort() { _mm->tx_abort(); }
 int PMObjectPool::tx_end() { return _mm->tx_end(); }
 
 int PMObjectPool::tx_stage() { return _mm->tx_stage(); }
+
+int PMObjectPool::group_begin() { return _mm->group_begin(); }
+
+int PMObjectPool::group_end() { return _mm->group_end(); }
+
+uint32_t PMObjectPool::group_ops() { return _mm->group_ops(); }
 }  // namespace internal
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <sys/stat.h>
 #include <memory>
+#include <vector>
 
 #include "memorymanager.h"
 #include "../util.h"
@@ -14,9 +15,10 @@ class PMObjectPool {
   static int check(std::string path, std::string layout);
 
  public:
-  PMObjectPool(std::string path, std::string layout);
+  PMObjectPool(std::string path, std::string layout,
+               const PoolOptions& options);
   PMObjectPool(std::string path, std::string layout, uint32_t poolsize,
-               mode_t mode);
+               mode_t mode, const PoolOptions& options);
   PMObjectPool(const PMObjectPool& other) = delete;
   PMObjectPool& operator=(const PMObjectPool& other) = delete;
 
@@ -29,19 +31,41 @@ class PMObjectPool {
 
   PERSISTENT_VALUE getValue(std::shared_ptr<const void> data);
   std::shared_ptr<const void> persistDouble(double value);
+  std::shared_ptr<const void> persistDate(double value);
+  std::shared_ptr<const void> persistBigInt(int sign, const uint64_t* words,
+                                            size_t word_count);
   std::shared_ptr<const void> persistBoolean(bool value);
   std::shared_ptr<const void> persistJSNull();
   std::shared_ptr<const void> persistUndefined();
   std::shared_ptr<const void> persistString(std::string value);
+  // A copy of the object or array data in one transaction. A deep copy
+  // copies the objects and arrays it holds as well, keeping the ones held
+  // twice, or in a cycle, shared in the copy.
+  std::shared_ptr<const void> clone(std::shared_ptr<const void> data,
+                                    bool deep);
 
   void close();
   void gc();
+  DefragReport defrag(double budget_ms);
+  unsigned getArena();
+  std::vector<size_t> getArenaSizes();
+  double ctlGet(const std::string& name);
+  void ctlSet(const std::string& name, double value);
 
+  void tx_enter_context();
+  void tx_exit_context();
+  void tx_abort_context();
+  void reserve_enter_context();
+  void reserve_exit_context();
+  void publish();
   int tx_begin();
   void tx_commit();
   void tx_abort();
   int tx_end();
   int tx_stage();
+  int group_begin();
+  int group_end();
+  uint32_t group_ops();
 
  private:
   MemoryManager* _mm = nullptr;
@@ -1,8 +1,12 @@
 #include <napi.h>
 
 #include "persistentarraybuffer.h"
+#include "persistentdeque.h"
+#include "persistentindex.h"
+#include "persistentmap.h"
 #include "persistentobject.h"
 #include "persistentobjectpool.h"
+#include "persistentorderedmap.h"
 
 Napi::Value newPool(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
@@ -19,14 +23,27 @@ Napi::Object initModule(Napi::Env env, Napi::Object exports) {
   obj.Set("TX_STAGE_ONCOMMIT", Napi::Number::New(env, TX_STAGE_ONCOMMIT));
   obj.Set("TX_STAGE_ONABORT", Napi::Number::New(env, TX_STAGE_ONABORT));
   obj.Set("TX_STAGE_FINALLY", Napi::Number::New(env, TX_STAGE_FINALLY));
+  obj.Set("STATS_ENABLED_TRANSIENT",
+          Napi::Number::New(env, POBJ_STATS_ENABLED_TRANSIENT));
+  obj.Set("STATS_ENABLED_BOTH",
+          Napi::Number::New(env, POBJ_STATS_ENABLED_BOTH));
+  obj.Set("STATS_ENABLED_PERSISTENT",
+          Napi::Number::New(env, POBJ_STATS_ENABLED_PERSISTENT));
+  obj.Set("STATS_DISABLED", Napi::Number::New(env, POBJ_STATS_DISABLED));
   exports.Set(Napi::String::New(env, "constants"), obj);
   return exports;
 }
 
+// Runs once per thread loading the addon, the main one and each worker, which
+// is why the constructor references are thread_local.
 Napi::Object initAll(Napi::Env env, Napi::Object exports) {
   PersistentObjectPool::init(env);
   PersistentObject::init(env);
   PersistentArrayBuffer::init(env);
+  PersistentMap::init(env);
+  PersistentDeque::init(env);
+  PersistentOrderedMap::init(env);
+  PersistentIndex::init(env);
   return initModule(env, exports);
 }
 
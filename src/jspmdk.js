@@ -1,12 +1,16 @@
 'use strict'
 const fs = require('fs');
 const jspmdk = require('bindings')('jspmdk');
-const layout_version = 'jspmdk-0.0.1';
+const layout_version = 'jspmdk-0.0.2';
 const constants = jspmdk.constants;
 
 var sym_pool = Symbol('pool');
 var sym_pobj = Symbol('pobj');
 var sym_pab = Symbol('pab');
+var sym_pmap = Symbol('pmap');
+var sym_pdq = Symbol('pdq');
+var sym_pom = Symbol('pom');
+var sym_pix = Symbol('pix');
 
 function isValidString(str) {
   var reg =
@@ -22,8 +26,506 @@ class PersistentArrayBuffer {
   persist(offset, length) {
     this[sym_pab]._persist(offset, length);
   }
+
+  // persist many [offset, length] ranges with a single fence
+  persist_ranges(ranges) {
+    var flat = [];
+    for (var range of ranges) flat.push(range[0], range[1]);
+    this[sym_pab]._persist_ranges(flat);
+  }
+  }
+
+// resolve a relative index like TypedArray.prototype methods do
+function relativeIndex(index, length, default_index) {
+  if (index === undefined) return default_index;
+  index = Math.trunc(index) || 0;
+  if (index < 0) return Math.max(length + index, 0);
+  return Math.min(index, length);
+}
+
+class PersistentTypedArray {
+  snapshot(start, end) {
+    start = relativeIndex(start, this.length, 0);
+    end = relativeIndex(end, this.length, this.length);
+    if (end <= start) return;
+    this[sym_pab]._snapshot(
+        start * this.BYTES_PER_ELEMENT, (end - start) * this.BYTES_PER_ELEMENT);
+  }
+
+  persist(start, end) {
+    start = relativeIndex(start, this.length, 0);
+    end = relativeIndex(end, this.length, this.length);
+    if (end <= start) return;
+    this[sym_pab]._persist(
+        start * this.BYTES_PER_ELEMENT, (end - start) * this.BYTES_PER_ELEMENT);
+  }
+
+  // persist many [start, end] element ranges with a single fence
+  persist_ranges(ranges) {
+    var flat = [];
+    for (var range of ranges) {
+      var start = relativeIndex(range[0], this.length, 0);
+      var end = relativeIndex(range[1], this.length, this.length);
+      if (end <= start) continue;
+      flat.push(
+          start * this.BYTES_PER_ELEMENT,
+          (end - start) * this.BYTES_PER_ELEMENT);
+    }
+    this[sym_pab]._persist_ranges(flat);
+  }
+
+  sum(start, end) {
+    return this[sym_pab]._sum(
+        relativeIndex(start, this.length, 0),
+        relativeIndex(end, this.length, this.length));
+  }
+
+  min(start, end) {
+    return this[sym_pab]._min(
+        relativeIndex(start, this.length, 0),
+        relativeIndex(end, this.length, this.length));
+  }
+
+  max(start, end) {
+    return this[sym_pab]._max(
+        relativeIndex(start, this.length, 0),
+        relativeIndex(end, this.length, this.length));
+  }
+
+  mean(start, end) {
+    return this[sym_pab]._mean(
+        relativeIndex(start, this.length, 0),
+        relativeIndex(end, this.length, this.length));
+  }
+
+  dot(other, start, end) {
+    if (!other || !other[sym_pab])
+      throw new Error('dot() expects a persistent typed array');
+    return this[sym_pab]._dot(
+        other[sym_pab], relativeIndex(start, this.length, 0),
+        relativeIndex(end, this.length, this.length));
+  }
+
+  // fill() and copyWithin() write through to pmem, snapshotting the range
+  // when called inside a transaction
+  fill(value, start, end) {
+    this[sym_pab]._fill(
+        Number(value), relativeIndex(start, this.length, 0),
+        relativeIndex(end, this.length, this.length));
+    return this;
+  }
+
+  copyWithin(target, start, end) {
+    this[sym_pab]._copy_within(
+        relativeIndex(target, this.length, 0),
+        relativeIndex(start, this.length, 0),
+        relativeIndex(end, this.length, this.length));
+    return this;
+  }
+  }
+
+// Turn a _PersistentArrayBuffer into an ArrayBuffer or a TypedArray over
+// pmem. Both are detached when the pool is closed.
+function resurrectArrayBuffer(_pab) {
+  var view = _pab._get_typed_array();
+  if (view === undefined) {
+    var pab = _pab._get_buffer();
+    pab[sym_pab] = _pab;
+    pab.snapshot = PersistentArrayBuffer.prototype.snapshot;
+    pab.persist = PersistentArrayBuffer.prototype.persist;
+    pab.persist_ranges = PersistentArrayBuffer.prototype.persist_ranges;
+    return pab;
+  }
+  view[sym_pab] = _pab;
+  for (var name of Object.getOwnPropertyNames(
+           PersistentTypedArray.prototype)) {
+    if (name != 'constructor') {
+      view[name] = PersistentTypedArray.prototype[name];
+    }
+  }
+  return view;
+}
+
+// Map and Set stored in the pool. Keys must be primitives, iteration walks a
+// snapshot of the entries taken when it starts.
+class PersistentMap {
+  constructor(pmap) {
+    this[sym_pmap] = pmap;
+  }
+
+  get size() {
+    return this[sym_pmap]._size();
+  }
+
+  get(key) {
+    return wrapValue(this[sym_pmap]._get(key));
+  }
+
+  set(key, value) {
+    if (typeof(key) == 'string' && !isValidString(key))
+      throw new Error('invalid characters');
+    if (typeof(value) == 'string' && !isValidString(value))
+      throw new Error('invalid characters');
+    this[sym_pmap]._set(key, unwrapValue(value));
+    return this;
+  }
+
+  has(key) {
+    return this[sym_pmap]._has(key);
+  }
+
+  delete(key) {
+    return this[sym_pmap]._delete(key);
+  }
+
+  clear() {
+    this[sym_pmap]._clear();
+  }
+
+  * entries() {
+    var flat = this[sym_pmap]._entries();
+    for (var i = 0; i < flat.length; i += 2) {
+      yield [flat[i], wrapValue(flat[i + 1])];
+    }
+  }
+
+  * keys() {
+    for (var entry of this.entries()) yield entry[0];
+  }
+
+  * values() {
+    for (var entry of this.entries()) yield entry[1];
+  }
+
+  forEach(callback, this_arg) {
+    for (var entry of this.entries()) {
+      callback.call(this_arg, entry[1], entry[0], this);
+    }
+  }
+
+  [Symbol.iterator]() {
+    return this.entries();
+  }
+  }
+
+class PersistentSet {
+  constructor(pmap) {
+    this[sym_pmap] = pmap;
+  }
+
+  get size() {
+    return this[sym_pmap]._size();
+  }
+
+  add(value) {
+    if (typeof(value) == 'string' && !isValidString(value))
+      throw new Error('invalid characters');
+    this[sym_pmap]._set(value);
+    return this;
+  }
+
+  has(value) {
+    return this[sym_pmap]._has(value);
+  }
+
+  delete(value) {
+    return this[sym_pmap]._delete(value);
   }
 
+  clear() {
+    this[sym_pmap]._clear();
+  }
+
+  * values() {
+    var flat = this[sym_pmap]._entries();
+    for (var i = 0; i < flat.length; i += 2) yield flat[i];
+  }
+
+  * entries() {
+    for (var value of this.values()) yield [value, value];
+  }
+
+  keys() {
+    return this.values();
+  }
+
+  forEach(callback, this_arg) {
+    for (var value of this.values()) {
+      callback.call(this_arg, value, value, this);
+    }
+  }
+
+  [Symbol.iterator]() {
+    return this.values();
+  }
+  }
+
+// Double-ended queue stored in the pool. push(), pop(), shift() and
+// unshift() are O(1) and failure-atomic, also outside of a transaction.
+class PersistentDeque {
+  constructor(pdq) {
+    this[sym_pdq] = pdq;
+  }
+
+  get length() {
+    return this[sym_pdq]._get_length();
+  }
+
+  push(...items) {
+    var length = this.length;
+    for (var item of items) length = this[sym_pdq]._push(unwrapValue(item));
+    return length;
+  }
+
+  // unshift(a, b) leaves a in front of b, like Array.prototype.unshift()
+  unshift(...items) {
+    var length = this.length;
+    for (var i = items.length - 1; i >= 0; --i) {
+      length = this[sym_pdq]._unshift(unwrapValue(items[i]));
+    }
+    return length;
+  }
+
+  pop() {
+    return wrapValue(this[sym_pdq]._pop());
+  }
+
+  shift() {
+    return wrapValue(this[sym_pdq]._shift());
+  }
+
+  peek_front() {
+    return wrapValue(this[sym_pdq]._front());
+  }
+
+  peek_back() {
+    return wrapValue(this[sym_pdq]._back());
+  }
+
+  at(index) {
+    index = Math.trunc(index) || 0;
+    if (index < 0) index += this.length;
+    return wrapValue(this[sym_pdq]._get(index));
+  }
+
+  clear() {
+    this[sym_pdq]._clear();
+  }
+
+  * [Symbol.iterator]() {
+    for (var item of this[sym_pdq]._get_items()) yield wrapValue(item);
+  }
+  }
+
+// entries read from the binding at a time when iterating a
+// PersistentOrderedMap
+const ordered_map_batch_size = 256;
+
+function wrapEntry(entry) {
+  if (entry !== undefined) entry[1] = wrapValue(entry[1]);
+  return entry;
+}
+
+// Map stored in the pool as a B+tree, whose keys are numbers or strings kept
+// in order: numbers first by value, then strings by code point.
+class PersistentOrderedMap {
+  constructor(pom) {
+    this[sym_pom] = pom;
+  }
+
+  get size() {
+    return this[sym_pom]._size();
+  }
+
+  get(key) {
+    return wrapValue(this[sym_pom]._get(key));
+  }
+
+  set(key, value) {
+    if (typeof(key) == 'string' && !isValidString(key))
+      throw new Error('invalid characters');
+    if (typeof(value) == 'string' && !isValidString(value))
+      throw new Error('invalid characters');
+    this[sym_pom]._set(key, unwrapValue(value));
+    return this;
+  }
+
+  has(key) {
+    return this[sym_pom]._has(key);
+  }
+
+  delete(key) {
+    return this[sym_pom]._delete(key);
+  }
+
+  clear() {
+    this[sym_pom]._clear();
+  }
+
+  // [key, value] of the greatest key <= key, or undefined
+  floor(key) {
+    return wrapEntry(this[sym_pom]._floor(key));
+  }
+
+  // [key, value] of the least key >= key, or undefined
+  ceil(key) {
+    return wrapEntry(this[sym_pom]._ceil(key));
+  }
+
+  first() {
+    return wrapEntry(this[sym_pom]._first());
+  }
+
+  last() {
+    return wrapEntry(this[sym_pom]._last());
+  }
+
+  // An array of up to limit [key, value] with lo <= key < hi, lo and hi may
+  // be undefined for no bound.
+  range(lo, hi, limit) {
+    var result = [];
+    if (limit === undefined) limit = Infinity;
+    var exclusive = false;
+    while (result.length < limit) {
+      var count = Math.min(limit - result.length, ordered_map_batch_size);
+      var flat = this[sym_pom]._range(lo, hi, count, exclusive);
+      for (var i = 0; i < flat.length; i += 2) {
+        result.push([flat[i], wrapValue(flat[i + 1])]);
+      }
+      if (flat.length < 2 * count) break;
+      lo = flat[flat.length - 2];
+      exclusive = true;
+    }
+    return result;
+  }
+
+  // Iterates over the entries with lo <= key < hi in key order. Entries are
+  // read in batches, each continuing after the last key of the one before.
+  * entries(lo, hi) {
+    var batch_size = ordered_map_batch_size;
+    var exclusive = false;
+    while (true) {
+      var flat = this[sym_pom]._range(lo, hi, batch_size, exclusive);
+      for (var i = 0; i < flat.length; i += 2) {
+        yield [flat[i], wrapValue(flat[i + 1])];
+      }
+      if (flat.length < 2 * batch_size) return;
+      lo = flat[flat.length - 2];
+      exclusive = true;
+    }
+  }
+
+  * keys(lo, hi) {
+    for (var entry of this.entries(lo, hi)) yield entry[0];
+  }
+
+  * values(lo, hi) {
+    for (var entry of this.entries(lo, hi)) yield entry[1];
+  }
+
+  forEach(callback, this_arg) {
+    for (var entry of this.entries()) {
+      callback.call(this_arg, entry[1], entry[0], this);
+    }
+  }
+
+  [Symbol.iterator]() {
+    return this.entries();
+  }
+  }
+
+// Secondary index over the records of a persistent array, kept in sync by
+// the native push/pop/splice/element writes of the array in the same
+// transaction. A record is indexed by the value its field had when it was
+// stored, so an in-place change of the field needs the record to be stored
+// again, e.g. coll[i] = coll[i].
+class PersistentIndex {
+  constructor(pix) {
+    this[sym_pix] = pix;
+  }
+
+  get field() {
+    return this[sym_pix]._field();
+  }
+
+  get unique() {
+    return this[sym_pix]._is_unique();
+  }
+
+  get ordered() {
+    return this[sym_pix]._is_ordered();
+  }
+
+  get collection() {
+    return wrapValue(this[sym_pix]._collection());
+  }
+
+  // an array of the records whose field is value
+  lookup(value) {
+    return this[sym_pix]._lookup(value).map(wrapValue);
+  }
+
+  // An array of up to limit records with lo <= field < hi in the order of
+  // the field, lo and hi may be undefined for no bound. Only for an ordered
+  // index.
+  range(lo, hi, limit) {
+    if (limit === undefined || limit > Number.MAX_SAFE_INTEGER)
+      limit = Number.MAX_SAFE_INTEGER;
+    return this[sym_pix]._range(lo, hi, limit).map(wrapValue);
+  }
+  }
+
+function resurrectMap(_pmap) {
+  if (_pmap._is_set()) return new PersistentSet(_pmap);
+  return new PersistentMap(_pmap);
+}
+
+// Wrap a value returned by the binding into its JS facade.
+function wrapValue(obj) {
+  if (obj != undefined && obj.constructor.name == '_PersistentObject') {
+    return new Proxy(new PersistentObject(obj), PersistentObjectProxyHandler);
+  }
+  if (obj != undefined && obj.constructor.name == '_PersistentArrayBuffer') {
+    return resurrectArrayBuffer(obj);
+  }
+  if (obj != undefined && obj.constructor.name == '_PersistentMap') {
+    return resurrectMap(obj);
+  }
+  if (obj != undefined && obj.constructor.name == '_PersistentDeque') {
+    return new PersistentDeque(obj);
+  }
+  if (obj != undefined && obj.constructor.name == '_PersistentOrderedMap') {
+    return new PersistentOrderedMap(obj);
+  }
+  if (obj != undefined && obj.constructor.name == '_PersistentIndex') {
+    return new PersistentIndex(obj);
+  }
+  return obj;
+}
+
+// Unwrap a JS facade into the binding object it stands for.
+function unwrapValue(value) {
+  if (value && value.constructor.name == 'PersistentObject') {
+    return value[sym_pobj];
+  }
+  if (value && value[sym_pab]) {
+    return value[sym_pab];
+  }
+  if (value && value[sym_pmap]) {
+    return value[sym_pmap];
+  }
+  if (value && value[sym_pdq]) {
+    return value[sym_pdq];
+  }
+  if (value && value[sym_pom]) {
+    return value[sym_pom];
+  }
+  if (value && value[sym_pix]) {
+    return value[sym_pix];
+  }
+  return value;
+}
+
 class PersistentObject {
   constructor(pobj) {
     this[sym_pobj] = pobj;
@@ -35,10 +537,7 @@ class PersistentObject {
 
   push(item) {
     if (this[sym_pobj]._is_array()) {
-      if (item && (item.constructor.name == 'PersistentObject')) {
-        item = item[sym_pobj];
-      }
-      this[sym_pobj]._push(item);
+      this[sym_pobj]._push(unwrapValue(item));
       }
     else {
       throw new Error('push is not a function');
@@ -53,7 +552,170 @@ class PersistentObject {
       throw new Error('push is not a function');
     }
   }
+
+  // The Array.prototype methods below run in the binding, each in a single
+  // transaction, rather than through the proxy one element at a time.
+  indexOf(value, from) {
+    arrayOnly(this, 'indexOf');
+    var length = this[sym_pobj]._get_length();
+    from = relativeIndex(from, length, 0);
+    if (!isSearchable(value)) {
+      if (typeof(value) != 'bigint') return -1;
+      var index =
+          PersistentObject.prototype.slice.call(this, from).indexOf(value);
+      return index < 0 ? -1 : from + index;
+    }
+    return this[sym_pobj]._index_of(unwrapValue(value), from);
+  }
+
+  includes(value, from) {
+    arrayOnly(this, 'includes');
+    var length = this[sym_pobj]._get_length();
+    from = relativeIndex(from, length, 0);
+    if (!isSearchable(value)) {
+      if (typeof(value) != 'bigint') return false;
+      return PersistentObject.prototype.slice.call(this, from).includes(value);
+    }
+    return this[sym_pobj]._includes(unwrapValue(value), from);
+  }
+
+  // returns a plain array
+  slice(start, end) {
+    arrayOnly(this, 'slice');
+    var length = this[sym_pobj]._get_length();
+    start = relativeIndex(start, length, 0);
+    end = relativeIndex(end, length, length);
+    if (end <= start) return [];
+    return this[sym_pobj]._slice(start, end).map(wrapValue);
+  }
+
+  splice(start, delete_count, ...items) {
+    arrayOnly(this, 'splice');
+    var length = this[sym_pobj]._get_length();
+    start = relativeIndex(start, length, 0);
+    if (arguments.length == 0) {
+      delete_count = 0;
+    } else if (arguments.length == 1) {
+      delete_count = length - start;
+    } else {
+      delete_count = Math.min(
+          Math.max(Math.trunc(delete_count) || 0, 0), length - start);
+    }
+    for (var item of items) {
+      if (typeof(item) == 'string' && !isValidString(item))
+        throw new Error('invalid characters');
+    }
+    return this[sym_pobj]
+        ._splice(start, delete_count, items.map(unwrapValue))
+        .map(wrapValue);
+  }
+
+  // Without a comparator the items are ordered by their string values in the
+  // binding. With one, the comparator runs over a copy of the items and the
+  // resulting order is applied at once.
+  sort(comparator) {
+    arrayOnly(this, 'sort');
+    if (comparator === undefined) {
+      this[sym_pobj]._sort();
+      return this;
+    }
+    if (typeof(comparator) != 'function')
+      throw new TypeError('comparator must be a function');
+    var items = PersistentObject.prototype.slice.call(this);
+    var order = [];
+    var tail = [];
+    for (var i = 0; i < items.length; ++i) {
+      if (items[i] === undefined) {
+        tail.push(i);
+      } else {
+        order.push(i);
+      }
+    }
+    order.sort(function(a, b) {
+      return comparator(items[a], items[b]);
+    });
+    this[sym_pobj]._permute(order.concat(tail));
+    return this;
+  }
+
+  reverse() {
+    arrayOnly(this, 'reverse');
+    this[sym_pobj]._reverse();
+    return this;
+  }
+
+  fill(value, start, end) {
+    arrayOnly(this, 'fill');
+    if (typeof(value) == 'string' && !isValidString(value))
+      throw new Error('invalid characters');
+    var length = this[sym_pobj]._get_length();
+    start = relativeIndex(start, length, 0);
+    end = relativeIndex(end, length, length);
+    if (start < end) this[sym_pobj]._fill(unwrapValue(value), start, end);
+    return this;
+  }
+
+  // Native reductions over the numbers in [start, end), like those of
+  // PersistentTypedArray. They throw if an item is not a number.
+  sum(start, end) {
+    arrayOnly(this, 'sum');
+    var length = this[sym_pobj]._get_length();
+    return this[sym_pobj]._sum(
+        relativeIndex(start, length, 0), relativeIndex(end, length, length));
+  }
+
+  min(start, end) {
+    arrayOnly(this, 'min');
+    var length = this[sym_pobj]._get_length();
+    return this[sym_pobj]._min(
+        relativeIndex(start, length, 0), relativeIndex(end, length, length));
+  }
+
+  max(start, end) {
+    arrayOnly(this, 'max');
+    var length = this[sym_pobj]._get_length();
+    return this[sym_pobj]._max(
+        relativeIndex(start, length, 0), relativeIndex(end, length, length));
+  }
+
+  // returns a plain array
+  concat(...values) {
+    arrayOnly(this, 'concat');
+    var result = PersistentObject.prototype.slice.call(this);
+    for (var value of values) {
+      if (Array.isArray(value) ||
+          (value && value[sym_pobj] && value[sym_pobj]._is_array())) {
+        for (var i = 0; i < value.length; ++i) result.push(value[i]);
+      } else {
+        result.push(value);
+      }
+    }
+    return result;
+  }
+  }
+
+const array_methods = [
+  'indexOf', 'includes', 'slice', 'splice', 'sort', 'reverse', 'fill', 'concat',
+  'sum', 'min', 'max'
+];
+
+function arrayOnly(obj, name) {
+  if (!obj[sym_pobj]._is_array()) throw new Error(name + ' is not a function');
+}
+
+// Whether the binding can look value up without persisting it: primitives
+// other than BigInts beyond 64 bits, and persistent objects. Any other object
+// is never found, like in a plain array.
+function isSearchable(value) {
+  if (typeof(value) == 'bigint') {
+    return BigInt.asIntN(64, value) === value;
+  }
+  if (typeof(value) == 'string') return !/\0/.test(value);
+  if (typeof(value) == 'object' && value !== null) {
+    return unwrapValue(value) !== value;
   }
+  return typeof(value) != 'symbol' && typeof(value) != 'function';
+}
 
 const PersistentObjectProxyHandler = {
   get: function(target, prop) {
@@ -80,11 +742,7 @@ const PersistentObjectProxyHandler = {
         else
           throw new Error(err.message);
         }
-      if (obj != undefined && obj.constructor.name == '_PersistentObject') {
-        obj =
-            new Proxy(new PersistentObject(obj), PersistentObjectProxyHandler);
-        }
-      return obj;
+      return wrapValue(obj);
       }
     else {
       return target[prop];
@@ -106,10 +764,7 @@ const PersistentObjectProxyHandler = {
       // since NAPI cannot tell wether a number is a uint32, we have to call
       // _set_property({prop: value}) rather than _set_property(prop, value)
       var arg = {};
-      if (value && value.constructor.name == 'PersistentObject') {
-        value = value[sym_pobj];
-      }
-      arg[prop] = value;
+      arg[prop] = unwrapValue(value);
       target[sym_pobj]._set_property(arg);
       }
     else {
@@ -140,38 +795,156 @@ const PersistentObjectProxyHandler = {
   },
 };
 
+// Check the options of open() and create():
+//   prefault: touch every page of the pool when it is mapped
+//   tx_cache_size: bytes of undo log kept for small snapshots
+//   stats: whether libpmemobj keeps statistics, or a stats.enabled value
+//   post_commit_worker: clean up after commits on a thread of libpmemobj
+// stats.enabled is an enum of libpmemobj, true counts in DRAM only
+function statsEnabled(value) {
+  if (typeof(value) != 'boolean') return value;
+  return value ? constants.STATS_ENABLED_TRANSIENT : constants.STATS_DISABLED;
+}
+
+function poolOptions(options) {
+  var result = {};
+  if (options === undefined) return result;
+  if (typeof(options) != 'object' || options === null)
+    throw new Error('invalid pool options');
+  if (options.prefault !== undefined) result.prefault = !!options.prefault;
+  if (options.tx_cache_size !== undefined) {
+    if (!Number.isInteger(options.tx_cache_size) || options.tx_cache_size < 0)
+      throw new Error('invalid tx_cache_size');
+    result.tx_cache_size = options.tx_cache_size;
+  }
+  if (options.stats !== undefined) {
+    var stats = statsEnabled(options.stats);
+    if (!Number.isInteger(stats) || stats < 0) throw new Error('invalid stats');
+    result.stats = stats;
+  }
+  if (options.post_commit_worker !== undefined)
+    result.post_commit_worker = !!options.post_commit_worker;
+  if (options.alloc_classes !== undefined)
+    result.alloc_classes = !!options.alloc_classes;
+  return result;
+}
+
 class PersistentObjectPool {
   constructor(pool) {
     this[sym_pool] = pool;
     this._closed = true;
   }
-  open() {
+  // options are settings of libpmemobj, see poolOptions()
+  open(options) {
     if (!this._closed) throw new Error('pool already created or opened');
-    this[sym_pool]._open();
+    this[sym_pool]._open(poolOptions(options));
     this._closed = false;
   }
-  create() {
+  create(options) {
     if (!this._closed) throw new Error('pool already created or opened');
-    this[sym_pool]._create();
+    this[sym_pool]._create(poolOptions(options));
     this._closed = false;
   }
   // TODO: document that it does not support create object by persistent
   // object
+  // create_arraybuffer(length) allocates a zero-filled buffer in the pool,
+  // create_arraybuffer(buffer) copies an existing ArrayBuffer into it. The
+  // returned ArrayBuffer is backed by pmem, writes to it go straight to the
+  // pool and are made durable by persist() or by a transaction.
   create_arraybuffer(buffer) {
     if (this._closed) throw new Error('pool not opened or already closed');
+    if (typeof(buffer) == 'number' &&
+        (!Number.isInteger(buffer) || buffer < 0))
+      throw new Error('invalid arraybuffer length');
     var _pab = this[sym_pool]._create_arraybuffer(buffer);
-    var pab = _pab._get_buffer();  // ArrayBuffer
-    pab = new ArrayBuffer(10);
-    pab[sym_pab] = _pab;
-    pab.snapshot = PersistentArrayBuffer.prototype.snapshot;
-    pab.persist = PersistentArrayBuffer.prototype.persist;
-    return pab;
+    return resurrectArrayBuffer(_pab);
+  }
+  // create a zero-filled typed array of type (e.g. Float64Array) stored in
+  // the pool, returned as a TypedArray view over pmem
+  create_typed_array(type, length) {
+    if (this._closed) throw new Error('pool not opened or already closed');
+    if (typeof(type) != 'function') throw new Error('invalid typed array type');
+    var sample = new type(0);
+    if (!ArrayBuffer.isView(sample) || sample instanceof DataView)
+      throw new Error('invalid typed array type');
+    if (!Number.isInteger(length) || length < 0)
+      throw new Error('invalid typed array length');
+    var _pab = this[sym_pool]._create_typed_array(sample, length);
+    return resurrectArrayBuffer(_pab);
   }
   create_object(js_obj) {
     if (this._closed) throw new Error('pool not opened or already closed');
     var _pobj = this[sym_pool]._create_object(js_obj);
     return new Proxy(new PersistentObject(_pobj), PersistentObjectProxyHandler);
   }
+  // Copy the persistent object or array obj in one transaction. The copy
+  // shares the objects obj holds, unless options.deep copies them too.
+  clone(obj, options) {
+    if (this._closed) throw new Error('pool not opened or already closed');
+    if (!obj || obj.constructor.name != 'PersistentObject')
+      throw new Error('obj must be a persistent object or array');
+    var _pobj = this[sym_pool]._clone(
+        obj[sym_pobj], Boolean((options || {}).deep));
+    return new Proxy(new PersistentObject(_pobj), PersistentObjectProxyHandler);
+  }
+  // create a Map stored in the pool, copying the [key, value] pairs of
+  // iterable if given
+  create_map(iterable) {
+    if (this._closed) throw new Error('pool not opened or already closed');
+    var _pmap = this[sym_pool]._create_map(new Map(iterable));
+    return new PersistentMap(_pmap);
+  }
+  // create a Set stored in the pool, copying the values of iterable if given
+  create_set(iterable) {
+    if (this._closed) throw new Error('pool not opened or already closed');
+    var _pmap = this[sym_pool]._create_map(new Set(iterable));
+    return new PersistentSet(_pmap);
+  }
+  // create a double-ended queue holding the items of iterable if given
+  create_deque(iterable) {
+    if (this._closed) throw new Error('pool not opened or already closed');
+    var _pdq = this[sym_pool]._create_deque(Array.from(iterable || []));
+    return new PersistentDeque(_pdq);
+  }
+  // create an ordered map holding the [key, value] pairs of iterable if given
+  create_ordered_map(iterable) {
+    if (this._closed) throw new Error('pool not opened or already closed');
+    var entries = Array.from(iterable || []);
+    for (var entry of entries) {
+      if ((typeof(entry[0]) == 'string' && !isValidString(entry[0])) ||
+          (typeof(entry[1]) == 'string' && !isValidString(entry[1])))
+        throw new Error('invalid characters');
+    }
+    var _pom = this[sym_pool]._create_ordered_map(
+        entries.map((entry) => [entry[0], unwrapValue(entry[1])]));
+    return new PersistentOrderedMap(_pom);
+  }
+  // Create an index on field over the records of the persistent array
+  // collection, or return the existing one with the same options. options
+  // are {unique, ordered}; a unique index rejects a second record with the
+  // same field, an ordered one supports range() over numbers and strings.
+  create_index(collection, field, options) {
+    if (this._closed) throw new Error('pool not opened or already closed');
+    if (!collection || collection.constructor.name != 'PersistentObject')
+      throw new Error('collection must be a persistent array');
+    if (typeof(field) != 'string' || !isValidString(field))
+      throw new Error('invalid field');
+    options = options || {};
+    var _pix = this[sym_pool]._create_index(
+        collection[sym_pobj], field, Boolean(options.unique),
+        Boolean(options.ordered));
+    return new PersistentIndex(_pix);
+  }
+  // an array of the records of index whose field is value
+  lookup(index, value) {
+    if (this._closed) throw new Error('pool not opened or already closed');
+    return index.lookup(value);
+  }
+  // stop keeping index in sync with its collection
+  drop_index(index) {
+    if (this._closed) throw new Error('pool not opened or already closed');
+    index[sym_pix]._drop();
+  }
   close() {
     if (this._closed) throw new Error('pool not opened or already closed');
     this[sym_pool]._close();
@@ -180,15 +953,57 @@ class PersistentObjectPool {
   check() {
     return this[sym_pool]._check();
   }
+  // {arena, arenas: [{id, size}]}, the arena of this thread and the bytes
+  // allocated in each arena
+  arena_stats() {
+    if (this._closed) throw new Error('pool not opened or already closed');
+    return this[sym_pool]._arena_stats();
+  }
   gc() {
     if (this._closed) throw new Error('pool not opened or already closed');
     this[sym_pool]._gc();
   }
+  // Move the objects reachable from the root together, to leave the free
+  // space of the pool in larger blocks. options.budget bounds the
+  // milliseconds spent, the next call resumes an unfinished pass. Like
+  // reopening the pool, it invalidates every persistent value read before,
+  // which then throws when used. The ArrayBuffers do not move and stay valid.
+  defrag(options) {
+    if (this._closed) throw new Error('pool not opened or already closed');
+    var budget = (options || {}).budget || 0;
+    if (typeof(budget) != 'number' || !(budget >= 0))
+      throw new Error('invalid budget');
+    return this[sym_pool]._defrag(budget);
+  }
+  // read or write a ctl entry of libpmemobj that holds a number, e.g.
+  // 'tx.cache.size' or 'stats.heap.curr_allocated'
+  ctl_get(name) {
+    if (this._closed) throw new Error('pool not opened or already closed');
+    if (typeof(name) != 'string') throw new Error('invalid ctl name');
+    return this[sym_pool]._ctl_get(name);
+  }
+  ctl_set(name, value) {
+    if (this._closed) throw new Error('pool not opened or already closed');
+    if (typeof(name) != 'string') throw new Error('invalid ctl name');
+    if (name == 'stats.enabled') value = statsEnabled(value);
+    if (typeof(value) == 'boolean') value = Number(value);
+    if (typeof(value) != 'number' || !Number.isFinite(value))
+      throw new Error('invalid ctl value');
+    this[sym_pool]._ctl_set(name, value);
+  }
   // TODO: document this process is sync
   transaction(run) {
     if (this._closed) throw new Error('pool not opened or already closed');
-    this[sym_pool]._tx_begin();
-    run();
+    if (this[sym_pool]._tx_begin())
+      throw new Error('failed to begin transaction');
+    try {
+      run();
+    } catch (e) {
+      // a nested transaction() aborts the outermost one as well
+      this[sym_pool]._tx_abort();
+      this[sym_pool]._tx_end();
+      throw e;
+    }
     var stage = this[sym_pool]._tx_stage();
     if (stage == constants.TX_STAGE_WORK) {
       this[sym_pool]._tx_commit();
@@ -196,9 +1011,76 @@ class PersistentObjectPool {
       }
     else {
       this[sym_pool]._tx_abort();
+      this[sym_pool]._tx_end();
       throw new Error('transaction aborted');
     }
   }
+  // Apply mutations in one transaction on a worker thread, so that a large
+  // batch does not block the event loop. Each mutation is one of
+  //   {op: 'set', target, key, value}
+  //   {op: 'del', target, key}
+  //   {op: 'push', target, value}
+  // where target is a persistent object or array. The promise resolves once
+  // all of them are durable, or rejects with none of them applied.
+  async transaction_async(mutations) {
+    if (this._closed) throw new Error('pool not opened or already closed');
+    var batch = Array.from(mutations, (mutation) => {
+      var target = mutation.target;
+      if (!target || target.constructor.name != 'PersistentObject')
+        throw new Error('target must be a persistent object');
+      if (mutation.op == 'push') {
+        if (!target.is_array()) throw new Error('push is not a function');
+        return {op: 'push', target: target[sym_pobj],
+                arg: unwrapValue(mutation.value)};
+      }
+      if (mutation.op != 'set' && mutation.op != 'del')
+        throw new Error('invalid mutation');
+      var key = String(mutation.key);
+      if (!isValidString(key) ||
+          (typeof(mutation.value) == 'string' &&
+           !isValidString(mutation.value)))
+        throw new Error('invalid characters');
+      // {key: value} as for _set_property()
+      var arg = {};
+      arg[key] = (mutation.op == 'set') ? unwrapValue(mutation.value) : null;
+      return {op: mutation.op, target: target[sym_pobj], arg};
+    });
+    return this[sym_pool]._transaction_async(batch);
+  }
+  // Group commit: the writes made outside a transaction join one transaction
+  // instead of committing one each. It is committed at the end of the turn
+  // of the event loop, options.delay milliseconds after its first write if
+  // given, or once it holds options.operations writes. The open group holds
+  // the pool lock, which every other thread waits for, so the delay is at
+  // most a second. group_commit(false) commits the open group and turns it
+  // off.
+  group_commit(options) {
+    if (this._closed) throw new Error('pool not opened or already closed');
+    if (options === false) {
+      this[sym_pool]._group_commit(0, undefined);
+      return;
+    }
+    options = options || {};
+    var operations = (options.operations === undefined) ? 1024 :
+                                                          options.operations;
+    var delay = options.delay || 0;
+    if (!Number.isInteger(operations) || operations < 1 ||
+        operations > 0xffffffff)
+      throw new Error('invalid number of operations');
+    if (typeof(delay) != 'number' || !(delay >= 0) || delay > 1000)
+      throw new Error('invalid delay');
+    var flush = () => {
+      if (!this._closed) this[sym_pool]._flush();
+    };
+    var schedule = (delay > 0) ? () => setTimeout(flush, delay) :
+                                 () => setImmediate(flush);
+    this[sym_pool]._group_commit(operations, schedule);
+  }
+  // commit the open group now, its writes are durable once it returns
+  flush() {
+    if (this._closed) throw new Error('pool not opened or already closed');
+    this[sym_pool]._flush();
+  }
   tx_begin() {
     if (this._closed) throw new Error('pool not opened or already closed');
     this[sym_pool]._tx_begin();
@@ -225,12 +1107,7 @@ const PersistentObjectPoolProxyHandler = {
   get: function(target, prop) {
     if (prop == 'root') {
       if (!target[sym_pool]) throw new Error('pool had been close');
-      var root = target[sym_pool]._get_root();
-      if (root != undefined && root.constructor.name == '_PersistentObject') {
-        root =
-            new Proxy(new PersistentObject(root), PersistentObjectProxyHandler);
-        }
-      return root;
+      return wrapValue(target[sym_pool]._get_root());
       }
     else {
       return target[prop];
@@ -240,10 +1117,7 @@ const PersistentObjectPoolProxyHandler = {
   set: function(target, prop, value) {
     if (prop == 'root') {
       if (!target[sym_pool]) throw new Error('pool had been closed');
-      if (value && value.constructor.name == 'PersistentObject') {
-        value = value[sym_pobj];
-      }
-      target[sym_pool]._set_root(value);
+      target[sym_pool]._set_root(unwrapValue(value));
       }
     else {
       target[prop] = value;
@@ -279,6 +1153,12 @@ var bind = function(obj, fn) {
     if (!fn.prototype.pop) {
       new_obj.pop = PersistentObject.prototype.pop;
     }
+    // attach the other array methods that fn does not define
+    for (var name of array_methods) {
+      if (!fn.prototype[name]) {
+        new_obj[name] = PersistentObject.prototype[name];
+      }
+    }
     Object.setPrototypeOf(new_obj, fn.prototype);
     return new Proxy(new_obj, PersistentObjectProxyHandler);
     }
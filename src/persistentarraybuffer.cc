@@ -5,7 +5,7 @@
 #include "persistentobjectpool.h"
 #include "util.h"
 
-Napi::FunctionReference PersistentArrayBuffer::constructor;
+thread_local Napi::FunctionReference PersistentArrayBuffer::constructor;
 
 PersistentArrayBuffer::PersistentArrayBuffer(const Napi::CallbackInfo& info)
     : Napi::ObjectWrap<PersistentArrayBuffer>(info) {
@@ -26,6 +26,24 @@ PersistentArrayBuffer::PersistentArrayBuffer(const Napi::CallbackInfo& info)
       // pmem
       _impl =
           new internal::PMArrayBuffer(_pool->getMemoryManager(), data, length);
+    }
+    // construct a zero-filled ArrayBuffer of info[1] bytes
+    else if (info[1].IsNumber()) {
+      uint32_t length = info[1].As<Napi::Number>().Uint32Value();
+      _impl = new internal::PMArrayBuffer(_pool->getMemoryManager(),
+                                          ELEMENT_KIND_NONE, length);
+    }
+    // construct a zero-filled typed array of the type of info[1]
+    else if (info[1].IsTypedArray()) {
+      napi_typedarray_type type =
+          info[1].As<Napi::TypedArray>().TypedArrayType();
+      uint32_t length = info[2].As<Napi::Number>().Uint32Value();
+      if (type > napi_float64_array) {
+        throw Napi::Error::New(env, "unsupported typed array type");
+      }
+      // ELEMENT_KIND follows the order of napi_typedarray_type
+      _impl = new internal::PMArrayBuffer(_pool->getMemoryManager(),
+                                          (uint32_t)type + 1, length);
     } else
       throw Napi::Error::New(
           env, "invalid argument to initialize PersistentArrayBuffer");
@@ -44,7 +62,18 @@ void PersistentArrayBuffer::init(Napi::Env env) {
       {
           InstanceMethod("_get_buffer", &PersistentArrayBuffer::getBuffer),
           InstanceMethod("_persist", &PersistentArrayBuffer::persist),
+          InstanceMethod("_persist_ranges",
+                         &PersistentArrayBuffer::persistRanges),
           InstanceMethod("_snapshot", &PersistentArrayBuffer::snapshot),
+          InstanceMethod("_get_typed_array",
+                         &PersistentArrayBuffer::getTypedArray),
+          InstanceMethod("_sum", &PersistentArrayBuffer::sum),
+          InstanceMethod("_min", &PersistentArrayBuffer::min),
+          InstanceMethod("_max", &PersistentArrayBuffer::max),
+          InstanceMethod("_mean", &PersistentArrayBuffer::mean),
+          InstanceMethod("_dot", &PersistentArrayBuffer::dot),
+          InstanceMethod("_fill", &PersistentArrayBuffer::fill),
+          InstanceMethod("_copy_within", &PersistentArrayBuffer::copyWithin),
       });
   constructor = Napi::Persistent(func);
   constructor.SuppressDestruct();
@@ -54,7 +83,7 @@ Napi::Object PersistentArrayBuffer::newInstance(Napi::Env env,
                                                 PersistentObjectPool* pool,
                                                 const Napi::Value value) {
   Napi::EscapableHandleScope scope(env);
-  ASSERT_TYPE(value.IsArrayBuffer());
+  ASSERT_TYPE(value.IsArrayBuffer() || value.IsNumber());
   Napi::External<PersistentObjectPool> ext_pool =
       Napi::External<PersistentObjectPool>::New(env, pool);
   Napi::Object obj = constructor.New({ext_pool, value});
@@ -73,6 +102,23 @@ Napi::Object PersistentArrayBuffer::newInstance(Napi::Env env,
   return scope.Escape(napi_value(obj)).ToObject();
 };
 
+Napi::Object PersistentArrayBuffer::newInstance(Napi::Env env,
+                                                PersistentObjectPool* pool,
+                                                const Napi::Value sample,
+                                                const Napi::Value length) {
+  Napi::EscapableHandleScope scope(env);
+  ASSERT_TYPE(sample.IsTypedArray());
+  Napi::External<PersistentObjectPool> ext_pool =
+      Napi::External<PersistentObjectPool>::New(env, pool);
+  Napi::Object obj = constructor.New({ext_pool, sample, length});
+  return scope.Escape(napi_value(obj)).ToObject();
+}
+
+bool PersistentArrayBuffer::isInstance(const Napi::Value value) {
+  return value.IsObject() &&
+         value.As<Napi::Object>().InstanceOf(constructor.Value());
+}
+
 std::shared_ptr<const void> PersistentArrayBuffer::getPPtr(Napi::Env env) {
   try {
     return _impl->getPPtr();
@@ -83,10 +129,14 @@ std::shared_ptr<const void> PersistentArrayBuffer::getPPtr(Napi::Env env) {
 
 Napi::Value PersistentArrayBuffer::getBuffer(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
+  LOCK_POOL(_pool, false);
   try {
     void* buffer = _impl->getBuffer();
     size_t length = _impl->getLength();
-    return Napi::ArrayBuffer::New(env, buffer, length);
+    // the data stays in pmem, the pool detaches the buffer on close
+    Napi::ArrayBuffer result = Napi::ArrayBuffer::New(env, buffer, length);
+    _pool->trackBuffer(result);
+    return result;
   } catch (const char* errmsg) {
     _pool->tx_abort_context(env);
     throw Napi::Error::New(env, "failed to retrieve PersistentArrayBuffer");
@@ -95,6 +145,7 @@ Napi::Value PersistentArrayBuffer::getBuffer(const Napi::CallbackInfo& info) {
 
 Napi::Value PersistentArrayBuffer::persist(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
+  LOCK_POOL(_pool, false);
   ASSERT_ARGS_LENGTH(info.Length() == 2);
   // TODO: notes in doc: NAPI do not support uint64, so maximum length of buffer
   // should be
@@ -110,8 +161,31 @@ Napi::Value PersistentArrayBuffer::persist(const Napi::CallbackInfo& info) {
   }
 }
 
+// info[0] is a flat array of byte ranges: [offset0, length0, offset1, ...]
+Napi::Value PersistentArrayBuffer::persistRanges(
+    const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_POOL(_pool, false);
+  ASSERT_ARGS_LENGTH(info.Length() == 1);
+  Napi::Array array = info[0].As<Napi::Array>();
+  std::vector<std::pair<uint32_t, uint32_t>> ranges;
+  ranges.reserve(array.Length() / 2);
+  for (uint32_t i = 0; i + 1 < array.Length(); i += 2) {
+    ranges.emplace_back(array.Get(i).As<Napi::Number>().Uint32Value(),
+                        array.Get(i + 1).As<Napi::Number>().Uint32Value());
+  }
+  try {
+    _impl->persistRanges(ranges);
+    return Napi::Value();
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to persist PersistentArrayBuffer");
+  }
+}
+
 Napi::Value PersistentArrayBuffer::snapshot(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
+  LOCK_POOL(_pool, false);
   ASSERT_ARGS_LENGTH(info.Length() == 2);
   // TODO: notes in doc:  NAPI do not support uint64, so maximum length of
   // buffer should be
@@ -125,4 +199,147 @@ Napi::Value PersistentArrayBuffer::snapshot(const Napi::CallbackInfo& info) {
     _pool->tx_abort_context(env);
     throw Napi::Error::New(env, "failed to snapshot PersistentArrayBuffer");
   }
+}
+
+// Returns a TypedArray over the persistent data, or undefined for a plain
+// ArrayBuffer.
+Napi::Value PersistentArrayBuffer::getTypedArray(
+    const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_POOL(_pool, false);
+  uint32_t kind = _impl->getKind();
+  if (kind == ELEMENT_KIND_NONE) {
+    return env.Undefined();
+  }
+  Napi::ArrayBuffer buffer =
+      Napi::ArrayBuffer::New(env, _impl->getBuffer(), _impl->getLength());
+  _pool->trackBuffer(buffer);
+  size_t length = _impl->getElementLength();
+  napi_typedarray_type type = (napi_typedarray_type)(kind - 1);
+  switch (kind) {
+    case ELEMENT_KIND_INT8:
+      return Napi::TypedArrayOf<int8_t>::New(env, length, buffer, 0, type);
+    case ELEMENT_KIND_UINT8:
+    case ELEMENT_KIND_UINT8_CLAMPED:
+      return Napi::TypedArrayOf<uint8_t>::New(env, length, buffer, 0, type);
+    case ELEMENT_KIND_INT16:
+      return Napi::TypedArrayOf<int16_t>::New(env, length, buffer, 0, type);
+    case ELEMENT_KIND_UINT16:
+      return Napi::TypedArrayOf<uint16_t>::New(env, length, buffer, 0, type);
+    case ELEMENT_KIND_INT32:
+      return Napi::TypedArrayOf<int32_t>::New(env, length, buffer, 0, type);
+    case ELEMENT_KIND_UINT32:
+      return Napi::TypedArrayOf<uint32_t>::New(env, length, buffer, 0, type);
+    case ELEMENT_KIND_FLOAT32:
+      return Napi::TypedArrayOf<float>::New(env, length, buffer, 0, type);
+    case ELEMENT_KIND_FLOAT64:
+      return Napi::TypedArrayOf<double>::New(env, length, buffer, 0, type);
+    default:
+      throw Napi::Error::New(env, "unknown typed array type");
+  }
+}
+
+// Kernels take an element range [start, end), already normalized by the JS
+// wrapper.
+Napi::Value PersistentArrayBuffer::sum(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_POOL(_pool, false);
+  ASSERT_ARGS_LENGTH(info.Length() == 2);
+  uint32_t start = info[0].As<Napi::Number>().Uint32Value();
+  uint32_t end = info[1].As<Napi::Number>().Uint32Value();
+  try {
+    return Napi::Number::New(env, _impl->sum(start, end));
+  } catch (const char* errmsg) {
+    throw Napi::Error::New(env, errmsg);
+  }
+}
+
+Napi::Value PersistentArrayBuffer::min(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_POOL(_pool, false);
+  ASSERT_ARGS_LENGTH(info.Length() == 2);
+  uint32_t start = info[0].As<Napi::Number>().Uint32Value();
+  uint32_t end = info[1].As<Napi::Number>().Uint32Value();
+  try {
+    return Napi::Number::New(env, _impl->min(start, end));
+  } catch (const char* errmsg) {
+    throw Napi::Error::New(env, errmsg);
+  }
+}
+
+Napi::Value PersistentArrayBuffer::max(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_POOL(_pool, false);
+  ASSERT_ARGS_LENGTH(info.Length() == 2);
+  uint32_t start = info[0].As<Napi::Number>().Uint32Value();
+  uint32_t end = info[1].As<Napi::Number>().Uint32Value();
+  try {
+    return Napi::Number::New(env, _impl->max(start, end));
+  } catch (const char* errmsg) {
+    throw Napi::Error::New(env, errmsg);
+  }
+}
+
+Napi::Value PersistentArrayBuffer::mean(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_POOL(_pool, false);
+  ASSERT_ARGS_LENGTH(info.Length() == 2);
+  uint32_t start = info[0].As<Napi::Number>().Uint32Value();
+  uint32_t end = info[1].As<Napi::Number>().Uint32Value();
+  try {
+    return Napi::Number::New(env, _impl->mean(start, end));
+  } catch (const char* errmsg) {
+    throw Napi::Error::New(env, errmsg);
+  }
+}
+
+Napi::Value PersistentArrayBuffer::dot(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_POOL(_pool, false);
+  ASSERT_ARGS_LENGTH(info.Length() == 3);
+  if (!isInstance(info[0])) {
+    throw Napi::Error::New(env, "dot() expects a persistent typed array");
+  }
+  PersistentArrayBuffer* other =
+      Napi::ObjectWrap<PersistentArrayBuffer>::Unwrap(
+          info[0].As<Napi::Object>());
+  uint32_t start = info[1].As<Napi::Number>().Uint32Value();
+  uint32_t end = info[2].As<Napi::Number>().Uint32Value();
+  try {
+    return Napi::Number::New(env, _impl->dot(other->_impl, start, end));
+  } catch (const char* errmsg) {
+    throw Napi::Error::New(env, errmsg);
+  }
+}
+
+Napi::Value PersistentArrayBuffer::fill(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_POOL(_pool, true);
+  ASSERT_ARGS_LENGTH(info.Length() == 3);
+  double value = info[0].As<Napi::Number>().DoubleValue();
+  uint32_t start = info[1].As<Napi::Number>().Uint32Value();
+  uint32_t end = info[2].As<Napi::Number>().Uint32Value();
+  try {
+    _impl->fill(value, start, end);
+    return Napi::Value();
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to fill persistent typed array");
+  }
+}
+
+Napi::Value PersistentArrayBuffer::copyWithin(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_POOL(_pool, true);
+  ASSERT_ARGS_LENGTH(info.Length() == 3);
+  uint32_t target = info[0].As<Napi::Number>().Uint32Value();
+  uint32_t start = info[1].As<Napi::Number>().Uint32Value();
+  uint32_t end = info[2].As<Napi::Number>().Uint32Value();
+  try {
+    _impl->copyWithin(target, start, end);
+    return Napi::Value();
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to copy within persistent typed array");
+  }
 }
\ No newline at end of file
@@ -14,6 +14,10 @@ class PersistentArrayBuffer : public Napi::ObjectWrap<PersistentArrayBuffer> {
                                   const Napi::Value value);
   static Napi::Object newInstance(Napi::Env env, PersistentObjectPool* pool,
                                   const void* data);
+  static Napi::Object newInstance(Napi::Env env, PersistentObjectPool* pool,
+                                  const Napi::Value sample,
+                                  const Napi::Value length);
+  static bool isInstance(const Napi::Value value);
 
  public:
   PersistentArrayBuffer(const Napi::CallbackInfo& info);
@@ -23,12 +27,21 @@ class PersistentArrayBuffer : public Napi::ObjectWrap<PersistentArrayBuffer> {
   std::shared_ptr<const void> getPPtr(Napi::Env env);
 
  private:
-  static Napi::FunctionReference constructor;
+  static thread_local Napi::FunctionReference constructor;
 
  private:
   Napi::Value getBuffer(const Napi::CallbackInfo& info);
   Napi::Value persist(const Napi::CallbackInfo& info);
+  Napi::Value persistRanges(const Napi::CallbackInfo& info);
   Napi::Value snapshot(const Napi::CallbackInfo& info);
+  Napi::Value getTypedArray(const Napi::CallbackInfo& info);
+  Napi::Value sum(const Napi::CallbackInfo& info);
+  Napi::Value min(const Napi::CallbackInfo& info);
+  Napi::Value max(const Napi::CallbackInfo& info);
+  Napi::Value mean(const Napi::CallbackInfo& info);
+  Napi::Value dot(const Napi::CallbackInfo& info);
+  Napi::Value fill(const Napi::CallbackInfo& info);
+  Napi::Value copyWithin(const Napi::CallbackInfo& info);
 
   internal::PMArrayBuffer* _impl;
   PersistentObjectPool* _pool;
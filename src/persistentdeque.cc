@@ -0,0 +1,217 @@
+#include <exception>
+#include <list>
+
+#include "internal/pmdeque.h"
+#include "persistentdeque.h"
+#include "persistentobjectpool.h"
+#include "util.h"
+
+thread_local Napi::FunctionReference PersistentDeque::constructor;
+
+PersistentDeque::PersistentDeque(const Napi::CallbackInfo& info)
+    : Napi::ObjectWrap<PersistentDeque>(info) {
+  Napi::Env env = info.Env();
+  Napi::HandleScope scope(env);
+  _pool = info[0].As<Napi::External<PersistentObjectPool>>().Data();
+  _generation = _pool->generation();
+  // construct by existing PersistentDeque
+  if (info[1].IsExternal()) {
+    void* data = info[1].As<Napi::External<void>>().Data();
+    try {
+      _impl = new internal::PMDeque(_pool->getMemoryManager(), data);
+    } catch (const char* errmsg) {
+      _pool->tx_abort_context(env);
+      throw Napi::Error::New(env, "failed to create PersistentDeque");
+    }
+  }
+  // construct by Array
+  else if (info[1].IsArray()) {
+    PersistentObjectPool::CheckedScope checked(_pool, env, info[1]);
+    try {
+      _pool->tx_enter_context(env);
+      _impl = new internal::PMDeque(_pool->getMemoryManager());
+      Napi::Array items = info[1].As<Napi::Array>();
+      for (uint32_t i = 0; i < items.Length(); ++i) {
+        _impl->push(_pool->persist(env, items.Get(i)));
+      }
+      _pool->tx_exit_context(env);
+    } catch (const char* errmsg) {
+      _pool->tx_abort_context(env);
+      throw Napi::Error::New(env, "failed to create PersistentDeque");
+    } catch (const Napi::Error& error) {
+      // e.g. a stale handle among the values
+      _pool->tx_abort_context(env);
+      throw;
+    }
+  } else {
+    throw Napi::Error::New(env,
+                           "invalid argument to initialize PersistentDeque");
+  }
+};
+
+PersistentDeque::~PersistentDeque() { delete _impl; }
+
+void PersistentDeque::init(Napi::Env env) {
+  Napi::HandleScope scope(env);
+  Napi::Function func = DefineClass(
+      env, "_PersistentDeque",
+      {
+          InstanceMethod("_push", &PersistentDeque::push),
+          InstanceMethod("_unshift", &PersistentDeque::unshift),
+          InstanceMethod("_pop", &PersistentDeque::pop),
+          InstanceMethod("_shift", &PersistentDeque::shift),
+          InstanceMethod("_front", &PersistentDeque::front),
+          InstanceMethod("_back", &PersistentDeque::back),
+          InstanceMethod("_get", &PersistentDeque::get),
+          InstanceMethod("_get_length", &PersistentDeque::getLength),
+          InstanceMethod("_get_items", &PersistentDeque::getItems),
+          InstanceMethod("_clear", &PersistentDeque::clear),
+      });
+  constructor = Napi::Persistent(func);
+  constructor.SuppressDestruct();
+}
+
+Napi::Object PersistentDeque::newInstance(Napi::Env env,
+                                          PersistentObjectPool* pool,
+                                          const Napi::Value value) {
+  Napi::EscapableHandleScope scope(env);
+  // new PersistentDeque(js_array);
+  Napi::External<PersistentObjectPool> ext_pool =
+      Napi::External<PersistentObjectPool>::New(env, pool);
+  Napi::Object obj = constructor.New({ext_pool, value});
+  return scope.Escape(napi_value(obj)).ToObject();
+}
+
+Napi::Object PersistentDeque::newInstance(Napi::Env env,
+                                          PersistentObjectPool* pool,
+                                          const void* data) {
+  Napi::EscapableHandleScope scope(env);
+  // new PersistentDeque(void *data);
+  Napi::External<PersistentObjectPool> ext_pool =
+      Napi::External<PersistentObjectPool>::New(env, pool);
+  Napi::External<void> ext_data = Napi::External<void>::New(env, (void*)data);
+  Napi::Object obj = constructor.New({ext_pool, ext_data});
+  return scope.Escape(napi_value(obj)).ToObject();
+}
+
+bool PersistentDeque::isInstance(const Napi::Value value) {
+  return value.IsObject() &&
+         value.As<Napi::Object>().InstanceOf(constructor.Value());
+}
+
+std::shared_ptr<const void> PersistentDeque::getPPtr(Napi::Env env) {
+  CHECK_HANDLE();
+  return _impl->getPPtr();
+}
+
+Napi::Value PersistentDeque::push(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
+  try {
+    _impl->push(_pool->persist(env, info[0]));
+    return Napi::Number::New(env, _impl->getLength());
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to push");
+  }
+}
+
+Napi::Value PersistentDeque::unshift(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
+  try {
+    _impl->unshift(_pool->persist(env, info[0]));
+    return Napi::Number::New(env, _impl->getLength());
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to unshift");
+  }
+}
+
+Napi::Value PersistentDeque::pop(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
+  try {
+    return _pool->resurrect(env, _impl->pop());
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to pop");
+  }
+}
+
+Napi::Value PersistentDeque::shift(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
+  try {
+    return _pool->resurrect(env, _impl->shift());
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to shift");
+  }
+}
+
+Napi::Value PersistentDeque::front(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  try {
+    return _pool->resurrect(env, _impl->front());
+  } catch (const char* errmsg) {
+    throw Napi::Error::New(env, "failed to get front");
+  }
+}
+
+Napi::Value PersistentDeque::back(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  try {
+    return _pool->resurrect(env, _impl->back());
+  } catch (const char* errmsg) {
+    throw Napi::Error::New(env, "failed to get back");
+  }
+}
+
+Napi::Value PersistentDeque::get(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  try {
+    int64_t index = info[0].As<Napi::Number>().Int64Value();
+    if (index < 0) return env.Undefined();
+    return _pool->resurrect(env, _impl->get(index));
+  } catch (const char* errmsg) {
+    throw Napi::Error::New(env, "failed to get item");
+  }
+}
+
+Napi::Value PersistentDeque::getLength(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  return Napi::Number::New(env, _impl->getLength());
+}
+
+Napi::Value PersistentDeque::getItems(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  Napi::Array result = Napi::Array::New(env);
+  try {
+    std::list<std::shared_ptr<const void>> items = _impl->getItems();
+    uint32_t index = 0;
+    for (auto it = items.begin(); it != items.end(); ++it) {
+      result.Set(index++, _pool->resurrect(env, *it));
+    }
+    return result;
+  } catch (const char* errmsg) {
+    throw Napi::Error::New(env, "failed to get items");
+  }
+}
+
+Napi::Value PersistentDeque::clear(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
+  try {
+    _impl->clear();
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to clear");
+  }
+  return Napi::Value();
+}
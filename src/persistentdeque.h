@@ -0,0 +1,47 @@
+#ifndef PERSISTENTDEQUE_H
+#define PERSISTENTDEQUE_H
+
+#include <napi.h>
+#include <memory>
+
+#include "internal/pmdeque.h"
+#include "persistentobjectpool.h"
+
+class PersistentDeque : public Napi::ObjectWrap<PersistentDeque> {
+ public:
+  static void init(Napi::Env env);
+  static Napi::Object newInstance(Napi::Env env, PersistentObjectPool* pool,
+                                  const Napi::Value value);
+  static Napi::Object newInstance(Napi::Env env, PersistentObjectPool* pool,
+                                  const void* data);
+  static bool isInstance(const Napi::Value value);
+
+ public:
+  PersistentDeque(const Napi::CallbackInfo& info);
+  PersistentDeque(const PersistentDeque& other) = delete;
+  PersistentDeque& operator=(const PersistentDeque& other) = delete;
+  ~PersistentDeque();
+  std::shared_ptr<const void> getPPtr(Napi::Env env);
+
+ private:
+  static thread_local Napi::FunctionReference constructor;
+
+ private:
+  Napi::Value push(const Napi::CallbackInfo& info);
+  Napi::Value unshift(const Napi::CallbackInfo& info);
+  Napi::Value pop(const Napi::CallbackInfo& info);
+  Napi::Value shift(const Napi::CallbackInfo& info);
+  Napi::Value front(const Napi::CallbackInfo& info);
+  Napi::Value back(const Napi::CallbackInfo& info);
+  Napi::Value get(const Napi::CallbackInfo& info);
+  Napi::Value getLength(const Napi::CallbackInfo& info);
+  Napi::Value getItems(const Napi::CallbackInfo& info);
+  Napi::Value clear(const Napi::CallbackInfo& info);
+
+  internal::PMDeque* _impl;
+  PersistentObjectPool* _pool;
+  // the defrag generation of the pool when the handle was made
+  uint64_t _generation;
+};
+
+#endif
@@ -0,0 +1,220 @@
+#include <math.h>
+#include <exception>
+
+#include "internal/pmindex.h"
+#include "internal/pmobject.h"
+#include "persistentindex.h"
+#include "persistentobject.h"
+#include "persistentobjectpool.h"
+#include "util.h"
+
+thread_local Napi::FunctionReference PersistentIndex::constructor;
+
+PersistentIndex::PersistentIndex(const Napi::CallbackInfo& info)
+    : Napi::ObjectWrap<PersistentIndex>(info) {
+  Napi::Env env = info.Env();
+  Napi::HandleScope scope(env);
+  _pool = info[0].As<Napi::External<PersistentObjectPool>>().Data();
+  _generation = _pool->generation();
+  // construct by existing PersistentIndex
+  if (info[1].IsExternal()) {
+    void* data = info[1].As<Napi::External<void>>().Data();
+    try {
+      _impl = new internal::PMIndex(_pool->getMemoryManager(), data);
+    } catch (const char* errmsg) {
+      _pool->tx_abort_context(env);
+      throw Napi::Error::New(env, "failed to create PersistentIndex");
+    }
+  }
+  // construct by (collection, field, unique, ordered)
+  else if (PersistentObject::isInstance(info[1]) && info[2].IsString()) {
+    PersistentObject* pobj =
+        Napi::ObjectWrap<PersistentObject>::Unwrap(info[1].As<Napi::Object>());
+    std::shared_ptr<const void> collection = pobj->getPPtr(env);
+    std::string field = info[2].As<Napi::String>().Utf8Value();
+    uint64_t flags = 0;
+    if (info[3].ToBoolean().Value()) flags |= INDEX_FLAG_UNIQUE;
+    if (info[4].ToBoolean().Value()) flags |= INDEX_FLAG_ORDERED;
+    internal::PMObject collection_obj(_pool->getMemoryManager(),
+                                      (void*)collection.get());
+    if (!collection_obj.isArray()) {
+      throw Napi::Error::New(env, "collection must be a persistent array");
+    }
+    try {
+      PPtr index_pptr = collection_obj.createIndex(field, flags);
+      _impl = new internal::PMIndex(_pool->getMemoryManager(), &index_pptr);
+    } catch (const char* errmsg) {
+      _pool->tx_abort_context(env);
+      throw Napi::Error::New(env, errmsg);
+    }
+  } else {
+    throw Napi::Error::New(env,
+                           "invalid argument to initialize PersistentIndex");
+  }
+};
+
+PersistentIndex::~PersistentIndex() { delete _impl; }
+
+void PersistentIndex::init(Napi::Env env) {
+  Napi::HandleScope scope(env);
+  Napi::Function func =
+      DefineClass(env, "_PersistentIndex",
+                  {
+                      InstanceMethod("_lookup", &PersistentIndex::lookup),
+                      InstanceMethod("_range", &PersistentIndex::range),
+                      InstanceMethod("_field", &PersistentIndex::field),
+                      InstanceMethod("_is_unique", &PersistentIndex::isUnique),
+                      InstanceMethod("_is_ordered",
+                                     &PersistentIndex::isOrdered),
+                      InstanceMethod("_collection",
+                                     &PersistentIndex::collection),
+                      InstanceMethod("_drop", &PersistentIndex::drop),
+                  });
+  constructor = Napi::Persistent(func);
+  constructor.SuppressDestruct();
+}
+
+Napi::Object PersistentIndex::newInstance(Napi::Env env,
+                                          PersistentObjectPool* pool,
+                                          const Napi::CallbackInfo& info) {
+  Napi::EscapableHandleScope scope(env);
+  // new PersistentIndex(collection, field, unique, ordered);
+  Napi::External<PersistentObjectPool> ext_pool =
+      Napi::External<PersistentObjectPool>::New(env, pool);
+  Napi::Object obj =
+      constructor.New({ext_pool, info[0], info[1], info[2], info[3]});
+  return scope.Escape(napi_value(obj)).ToObject();
+}
+
+Napi::Object PersistentIndex::newInstance(Napi::Env env,
+                                          PersistentObjectPool* pool,
+                                          const void* data) {
+  Napi::EscapableHandleScope scope(env);
+  // new PersistentIndex(void *data);
+  Napi::External<PersistentObjectPool> ext_pool =
+      Napi::External<PersistentObjectPool>::New(env, pool);
+  Napi::External<void> ext_data = Napi::External<void>::New(env, (void*)data);
+  Napi::Object obj = constructor.New({ext_pool, ext_data});
+  return scope.Escape(napi_value(obj)).ToObject();
+}
+
+bool PersistentIndex::isInstance(const Napi::Value value) {
+  return value.IsObject() &&
+         value.As<Napi::Object>().InstanceOf(constructor.Value());
+}
+
+std::shared_ptr<const void> PersistentIndex::getPPtr(Napi::Env env) {
+  CHECK_HANDLE();
+  return _impl->getPPtr();
+}
+
+// The key to look up, or PPTR_NULL in key.pptr if no record can have it.
+internal::PMKey PersistentIndex::toKey(Napi::Env env, const Napi::Value key,
+                                       std::string& holder) {
+  internal::PMKey result = {PPTR_NULL, nullptr, 0};
+  if (!(_impl->getFlags() & INDEX_FLAG_ORDERED)) {
+    if (key.IsObject()) return result;
+    return _pool->toKey(env, key, holder);
+  }
+  if (key.IsNumber()) {
+    double number = key.As<Napi::Number>().DoubleValue();
+    if (isnan(number)) return result;
+    if (number == 0) number = 0;
+    return _pool->toKey(env, Napi::Number::New(env, number), holder);
+  }
+  if (key.IsString()) return _pool->toKey(env, key, holder);
+  return result;
+}
+
+Napi::Value PersistentIndex::toArray(Napi::Env env,
+                                     const std::vector<PPtr>& records) {
+  Napi::Array result = Napi::Array::New(env, records.size());
+  for (uint32_t i = 0; i < records.size(); ++i) {
+    result.Set(i, _pool->resurrect(env, std::make_shared<PPtr>(records[i])));
+  }
+  return result;
+}
+
+Napi::Value PersistentIndex::lookup(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  std::string holder;
+  internal::PMKey key = toKey(env, info[0], holder);
+  if (key.str == nullptr && PPTR_EQUALS(key.pptr, PPTR_NULL)) {
+    return Napi::Array::New(env);
+  }
+  try {
+    return toArray(env, _impl->lookup(key));
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to look up");
+  }
+}
+
+// _range(lo, hi, limit) returns the records with keys in [lo, hi), lo or hi
+// may be undefined for no bound.
+Napi::Value PersistentIndex::range(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  if (!(_impl->getFlags() & INDEX_FLAG_ORDERED)) {
+    throw Napi::Error::New(env, "range of an index that is not ordered");
+  }
+  std::string lo_holder, hi_holder;
+  internal::PMKey lo, hi;
+  bool has_lo = !info[0].IsUndefined();
+  bool has_hi = !info[1].IsUndefined();
+  if (has_lo) lo = toKey(env, info[0], lo_holder);
+  if (has_hi) hi = toKey(env, info[1], hi_holder);
+  if ((has_lo && lo.str == nullptr && PPTR_EQUALS(lo.pptr, PPTR_NULL)) ||
+      (has_hi && hi.str == nullptr && PPTR_EQUALS(hi.pptr, PPTR_NULL))) {
+    throw Napi::Error::New(env, "unsupported key type");
+  }
+  uint64_t limit = info[2].As<Napi::Number>().Int64Value();
+  try {
+    return toArray(env, _impl->range(has_lo ? &lo : nullptr,
+                                     has_hi ? &hi : nullptr, limit));
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to get range");
+  }
+}
+
+Napi::Value PersistentIndex::field(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  return Napi::String::New(env, _impl->getField());
+}
+
+Napi::Value PersistentIndex::isUnique(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  return Napi::Boolean::New(env, _impl->getFlags() & INDEX_FLAG_UNIQUE);
+}
+
+Napi::Value PersistentIndex::isOrdered(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  return Napi::Boolean::New(env, _impl->getFlags() & INDEX_FLAG_ORDERED);
+}
+
+Napi::Value PersistentIndex::collection(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  return _pool->resurrect(env,
+                          std::make_shared<PPtr>(_impl->getCollection()));
+}
+
+// Detaches the index from its collection, which no longer keeps it in sync.
+Napi::Value PersistentIndex::drop(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
+  PPtr collection = _impl->getCollection();
+  try {
+    internal::PMObject(_pool->getMemoryManager(), &collection)
+        .dropIndex(*((PPtr*)_impl->getPPtr().get()));
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to drop index");
+  }
+  return Napi::Value();
+}
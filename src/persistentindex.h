@@ -0,0 +1,50 @@
+#ifndef PERSISTENTINDEX_H
+#define PERSISTENTINDEX_H
+
+#include <napi.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "internal/pmindex.h"
+#include "persistentobjectpool.h"
+
+class PersistentIndex : public Napi::ObjectWrap<PersistentIndex> {
+ public:
+  static void init(Napi::Env env);
+  static Napi::Object newInstance(Napi::Env env, PersistentObjectPool* pool,
+                                  const Napi::CallbackInfo& info);
+  static Napi::Object newInstance(Napi::Env env, PersistentObjectPool* pool,
+                                  const void* data);
+  static bool isInstance(const Napi::Value value);
+
+ public:
+  PersistentIndex(const Napi::CallbackInfo& info);
+  PersistentIndex(const PersistentIndex& other) = delete;
+  PersistentIndex& operator=(const PersistentIndex& other) = delete;
+  ~PersistentIndex();
+  std::shared_ptr<const void> getPPtr(Napi::Env env);
+
+ private:
+  static thread_local Napi::FunctionReference constructor;
+
+ private:
+  internal::PMKey toKey(Napi::Env env, const Napi::Value key,
+                        std::string& holder);
+  Napi::Value toArray(Napi::Env env, const std::vector<PPtr>& records);
+
+  Napi::Value lookup(const Napi::CallbackInfo& info);
+  Napi::Value range(const Napi::CallbackInfo& info);
+  Napi::Value field(const Napi::CallbackInfo& info);
+  Napi::Value isUnique(const Napi::CallbackInfo& info);
+  Napi::Value isOrdered(const Napi::CallbackInfo& info);
+  Napi::Value collection(const Napi::CallbackInfo& info);
+  Napi::Value drop(const Napi::CallbackInfo& info);
+
+  internal::PMIndex* _impl;
+  PersistentObjectPool* _pool;
+  // the defrag generation of the pool when the handle was made
+  uint64_t _generation;
+};
+
+#endif
@@ -0,0 +1,245 @@
+#include <exception>
+#include <list>
+
+#include "internal/pmmap.h"
+#include "persistentmap.h"
+#include "persistentobjectpool.h"
+#include "util.h"
+
+thread_local Napi::FunctionReference PersistentMap::constructor;
+
+PersistentMap::PersistentMap(const Napi::CallbackInfo& info)
+    : Napi::ObjectWrap<PersistentMap>(info) {
+  Napi::Env env = info.Env();
+  Napi::HandleScope scope(env);
+  _pool = info[0].As<Napi::External<PersistentObjectPool>>().Data();
+  _generation = _pool->generation();
+  // construct by existing PersistentMap
+  if (info[1].IsExternal()) {
+    void* data = info[1].As<Napi::External<void>>().Data();
+    try {
+      _impl = new internal::PMMap(_pool->getMemoryManager(), data);
+    } catch (const char* errmsg) {
+      _pool->tx_abort_context(env);
+      throw Napi::Error::New(env, "failed to create PersistentMap");
+    }
+  }
+  // construct by Map or Set
+  else if (isJSMapOrSet(env, info[1])) {
+    Napi::Object global = env.Global();
+    bool is_set = info[1].As<Napi::Object>().InstanceOf(
+        global.Get("Set").As<Napi::Function>());
+    // Map gives [key, value] pairs, Set gives its values
+    Napi::Array items = global.Get("Array")
+                            .As<Napi::Object>()
+                            .Get("from")
+                            .As<Napi::Function>()
+                            .Call({info[1]})
+                            .As<Napi::Array>();
+    PersistentObjectPool::CheckedScope checked(_pool, env, info[1]);
+    try {
+      _pool->tx_enter_context(env);
+      _impl = new internal::PMMap(_pool->getMemoryManager(), is_set);
+      _pool->_cache.insert(
+          std::map<Napi::Value, std::shared_ptr<const void>>::value_type(
+              info[1], _impl->getPPtr()));
+      for (uint32_t i = 0; i < items.Length(); ++i) {
+        Napi::Value key = items.Get(i);
+        Napi::Value value = env.Undefined();
+        if (!is_set) {
+          Napi::Array pair = key.As<Napi::Array>();
+          key = pair.Get((uint32_t)0);
+          value = pair.Get((uint32_t)1);
+        }
+        std::string holder;
+        _impl->set(toKey(env, key, holder), _pool->persist(env, value),
+                   kNotSnapshot);
+      }
+      _pool->tx_exit_context(env);
+    } catch (const char* errmsg) {
+      _pool->tx_abort_context(env);
+      throw Napi::Error::New(env, "failed to create PersistentMap");
+    } catch (const Napi::Error& error) {
+      // e.g. a stale handle among the values
+      _pool->tx_abort_context(env);
+      throw;
+    }
+  }
+  // construct an empty Map, or an empty Set if info[1] is true
+  else if (info[1].IsBoolean()) {
+    try {
+      _impl = new internal::PMMap(_pool->getMemoryManager(),
+                                  info[1].As<Napi::Boolean>().Value());
+    } catch (const char* errmsg) {
+      _pool->tx_abort_context(env);
+      throw Napi::Error::New(env, "failed to create PersistentMap");
+    }
+  } else {
+    throw Napi::Error::New(env, "invalid argument to initialize PersistentMap");
+  }
+};
+
+PersistentMap::~PersistentMap() { delete _impl; }
+
+void PersistentMap::init(Napi::Env env) {
+  Napi::HandleScope scope(env);
+  Napi::Function func = DefineClass(
+      env, "_PersistentMap",
+      {
+          InstanceMethod("_get", &PersistentMap::get),
+          InstanceMethod("_has", &PersistentMap::has),
+          InstanceMethod("_set", &PersistentMap::set),
+          InstanceMethod("_delete", &PersistentMap::del),
+          InstanceMethod("_clear", &PersistentMap::clear),
+          InstanceMethod("_size", &PersistentMap::size),
+          InstanceMethod("_entries", &PersistentMap::entries),
+          InstanceMethod("_is_set", &PersistentMap::isSet),
+      });
+  constructor = Napi::Persistent(func);
+  constructor.SuppressDestruct();
+}
+
+Napi::Object PersistentMap::newInstance(Napi::Env env,
+                                        PersistentObjectPool* pool,
+                                        const Napi::Value value) {
+  Napi::EscapableHandleScope scope(env);
+  // new PersistentMap(js_map_or_set | is_set);
+  Napi::External<PersistentObjectPool> ext_pool =
+      Napi::External<PersistentObjectPool>::New(env, pool);
+  Napi::Object obj = constructor.New({ext_pool, value});
+  return scope.Escape(napi_value(obj)).ToObject();
+}
+
+Napi::Object PersistentMap::newInstance(Napi::Env env,
+                                        PersistentObjectPool* pool,
+                                        const void* data) {
+  Napi::EscapableHandleScope scope(env);
+  // new PersistentMap(void *data);
+  Napi::External<PersistentObjectPool> ext_pool =
+      Napi::External<PersistentObjectPool>::New(env, pool);
+  Napi::External<void> ext_data = Napi::External<void>::New(env, (void*)data);
+  Napi::Object obj = constructor.New({ext_pool, ext_data});
+  return scope.Escape(napi_value(obj)).ToObject();
+}
+
+bool PersistentMap::isInstance(const Napi::Value value) {
+  return value.IsObject() &&
+         value.As<Napi::Object>().InstanceOf(constructor.Value());
+}
+
+bool PersistentMap::isJSMapOrSet(Napi::Env env, const Napi::Value value) {
+  if (!value.IsObject()) return false;
+  Napi::Object global = env.Global();
+  Napi::Object obj = value.As<Napi::Object>();
+  return obj.InstanceOf(global.Get("Map").As<Napi::Function>()) ||
+         obj.InstanceOf(global.Get("Set").As<Napi::Function>());
+}
+
+std::shared_ptr<const void> PersistentMap::getPPtr(Napi::Env env) {
+  CHECK_HANDLE();
+  return _impl->getPPtr();
+}
+
+// Keys are limited to primitives, a string key is only persisted by
+// internal::PMMap when it is inserted.
+internal::PMKey PersistentMap::toKey(Napi::Env env, const Napi::Value key,
+                                     std::string& holder) {
+  if (key.IsObject()) throw Napi::Error::New(env, "unsupported key type");
+  return _pool->toKey(env, key, holder);
+}
+
+Napi::Value PersistentMap::get(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  std::string holder;
+  internal::PMKey key = toKey(env, info[0], holder);
+  try {
+    return _pool->resurrect(env, _impl->get(key));
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to get entry");
+  }
+}
+
+Napi::Value PersistentMap::has(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  std::string holder;
+  internal::PMKey key = toKey(env, info[0], holder);
+  try {
+    return Napi::Boolean::New(env, _impl->has(key));
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to look up entry");
+  }
+}
+
+Napi::Value PersistentMap::set(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
+  std::string holder;
+  internal::PMKey key = toKey(env, info[0], holder);
+  try {
+    _impl->set(key, _pool->persist(env, info[1]), kSnapshot);
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to set entry");
+  }
+  return Napi::Value();
+}
+
+Napi::Value PersistentMap::del(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
+  std::string holder;
+  internal::PMKey key = toKey(env, info[0], holder);
+  try {
+    return Napi::Boolean::New(env, _impl->del(key, kSnapshot));
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to delete entry");
+  }
+}
+
+Napi::Value PersistentMap::clear(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
+  try {
+    _impl->clear();
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to clear");
+  }
+  return Napi::Value();
+}
+
+Napi::Value PersistentMap::size(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  return Napi::Number::New(env, _impl->size());
+}
+
+// Returns [key0, value0, key1, value1, ...] in insertion order.
+Napi::Value PersistentMap::entries(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  Napi::Array result = Napi::Array::New(env);
+  try {
+    auto entries = _impl->getEntries();
+    uint32_t index = 0;
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+      result.Set(index++, _pool->resurrect(env, it->first));
+      result.Set(index++, _pool->resurrect(env, it->second));
+    }
+    return result;
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to get entries");
+  }
+}
+
+Napi::Value PersistentMap::isSet(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  return Napi::Boolean::New(env, _impl->isSet());
+}
@@ -0,0 +1,51 @@
+#ifndef PERSISTENTMAP_H
+#define PERSISTENTMAP_H
+
+#include <napi.h>
+#include <memory>
+#include <string>
+
+#include "internal/pmmap.h"
+#include "persistentobjectpool.h"
+
+class PersistentMap : public Napi::ObjectWrap<PersistentMap> {
+ public:
+  static void init(Napi::Env env);
+  static Napi::Object newInstance(Napi::Env env, PersistentObjectPool* pool,
+                                  const Napi::Value value);
+  static Napi::Object newInstance(Napi::Env env, PersistentObjectPool* pool,
+                                  const void* data);
+  static bool isInstance(const Napi::Value value);
+  // whether value is a JS Map or Set
+  static bool isJSMapOrSet(Napi::Env env, const Napi::Value value);
+
+ public:
+  PersistentMap(const Napi::CallbackInfo& info);
+  PersistentMap(const PersistentMap& other) = delete;
+  PersistentMap& operator=(const PersistentMap& other) = delete;
+  ~PersistentMap();
+  std::shared_ptr<const void> getPPtr(Napi::Env env);
+
+ private:
+  static thread_local Napi::FunctionReference constructor;
+
+ private:
+  internal::PMKey toKey(Napi::Env env, const Napi::Value key,
+                        std::string& holder);
+
+  Napi::Value get(const Napi::CallbackInfo& info);
+  Napi::Value has(const Napi::CallbackInfo& info);
+  Napi::Value set(const Napi::CallbackInfo& info);
+  Napi::Value del(const Napi::CallbackInfo& info);
+  Napi::Value clear(const Napi::CallbackInfo& info);
+  Napi::Value size(const Napi::CallbackInfo& info);
+  Napi::Value entries(const Napi::CallbackInfo& info);
+  Napi::Value isSet(const Napi::CallbackInfo& info);
+
+  internal::PMMap* _impl;
+  PersistentObjectPool* _pool;
+  // the defrag generation of the pool when the handle was made
+  uint64_t _generation;
+};
+
+#endif
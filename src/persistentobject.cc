@@ -1,17 +1,22 @@
+#include <algorithm>
+#include <cmath>
 #include <exception>
 #include <list>
+#include <string>
+#include <vector>
 
 #include "internal/pmobjectpool.h"
 #include "persistentobject.h"
 #include "util.h"
 
-Napi::FunctionReference PersistentObject::constructor;
+thread_local Napi::FunctionReference PersistentObject::constructor;
 
 PersistentObject::PersistentObject(const Napi::CallbackInfo& info)
     : Napi::ObjectWrap<PersistentObject>(info) {
   Napi::Env env = info.Env();
   Napi::HandleScope scope(env);
   _pool = info[0].As<Napi::External<PersistentObjectPool>>().Data();
+  _generation = _pool->generation();
   // construct by existing PersistentObject
   if (info[1].IsExternal()) {
     void* data = info[1].As<Napi::External<void>>().Data();
@@ -24,11 +29,13 @@ PersistentObject::PersistentObject(const Napi::CallbackInfo& info)
   }
   // construct by Object or Array
   else if (info[1].IsObject()) {
-    // using transaction here can help to improve the performance
+    // Outside a transaction, the new objects are reserved rather than
+    // undo-logged, and published by the transaction that links them.
     Logger::Debug(
         "PersistentObject::PersistentObject: constructed by JS object\n");
+    PersistentObjectPool::CheckedScope checked(_pool, env, info[1]);
     try {
-      _pool->tx_enter_context(env);
+      _pool->reserve_enter_context(env);
       internal::MemoryManager* mm = _pool->getMemoryManager();
       _impl = new internal::PMObject(mm, info[1].IsArray());
       _pool->_cache.insert(
@@ -53,10 +60,14 @@ PersistentObject::PersistentObject(const Napi::CallbackInfo& info)
                              _pool->persist(env, value), kNotSnapshot);
         }
       }
-      _pool->tx_exit_context(env);
+      _pool->reserve_exit_context(env);
     } catch (const char* errmsg) {
       _pool->tx_abort_context(env);
       throw Napi::Error::New(env, "failed to create PersistentObject");
+    } catch (const Napi::Error& error) {
+      // e.g. an unsupported value, the reservations are cancelled
+      _pool->tx_abort_context(env);
+      throw;
     }
   } else {
     throw Napi::Error::New(env,
@@ -81,6 +92,17 @@ void PersistentObject::init(Napi::Env env) {
           InstanceMethod("_push", &PersistentObject::push),
           InstanceMethod("_pop", &PersistentObject::pop),
           InstanceMethod("_is_array", &PersistentObject::isArray),
+          InstanceMethod("_index_of", &PersistentObject::indexOf),
+          InstanceMethod("_includes", &PersistentObject::includes),
+          InstanceMethod("_slice", &PersistentObject::slice),
+          InstanceMethod("_splice", &PersistentObject::splice),
+          InstanceMethod("_sort", &PersistentObject::sort),
+          InstanceMethod("_permute", &PersistentObject::permute),
+          InstanceMethod("_reverse", &PersistentObject::reverse),
+          InstanceMethod("_fill", &PersistentObject::fill),
+          InstanceMethod("_sum", &PersistentObject::sum),
+          InstanceMethod("_min", &PersistentObject::min),
+          InstanceMethod("_max", &PersistentObject::max),
       });
   constructor = Napi::Persistent(func);
   constructor.SuppressDestruct();
@@ -109,12 +131,19 @@ Napi::Object PersistentObject::newInstance(Napi::Env env,
   return scope.Escape(napi_value(obj)).ToObject();
 }
 
+bool PersistentObject::isInstance(const Napi::Value value) {
+  return value.IsObject() &&
+         value.As<Napi::Object>().InstanceOf(constructor.Value());
+}
+
 std::shared_ptr<const void> PersistentObject::getPPtr(Napi::Env env) {
+  CHECK_HANDLE();
   return _impl->getPPtr();
 }
 
 Napi::Value PersistentObject::getProperty(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
   Napi::Object arg = info[0].As<Napi::Object>();
   Napi::Value key = arg.GetPropertyNames().Get((uint32_t)0);
   ASSERT_TYPE(key.IsNumber() || key.IsString());
@@ -137,6 +166,7 @@ Napi::Value PersistentObject::getProperty(const Napi::CallbackInfo& info) {
 
 Napi::Value PersistentObject::setProperty(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
   Napi::Object arg = info[0].As<Napi::Object>();
   Napi::Value key = arg.GetPropertyNames().Get((uint32_t)0);
   Napi::Value value = arg.Get(key);
@@ -160,6 +190,7 @@ Napi::Value PersistentObject::setProperty(const Napi::CallbackInfo& info) {
 
 Napi::Value PersistentObject::delProperty(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
   Napi::Object arg = info[0].As<Napi::Object>();
   Napi::Value key = arg.GetPropertyNames().Get((uint32_t)0);
   ASSERT_TYPE(key.IsNumber() || key.IsString());
@@ -180,6 +211,7 @@ Napi::Value PersistentObject::delProperty(const Napi::CallbackInfo& info) {
 
 Napi::Value PersistentObject::getPropertyNames(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
   Napi::Array result = Napi::Array::New(env);
   try {
     std::list<std::shared_ptr<const void>> names = _impl->getPropertyNames();
@@ -208,6 +240,7 @@ Napi::Value PersistentObject::getPropertyNames(const Napi::CallbackInfo& info) {
 
 Napi::Value PersistentObject::push(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
   try {
     _impl->push(_pool->persist(env, info[0]));
     return Napi::Value();
@@ -219,6 +252,7 @@ Napi::Value PersistentObject::push(const Napi::CallbackInfo& info) {
 
 Napi::Value PersistentObject::pop(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
   try {
     Napi::Value result = _pool->resurrect(env, _impl->pop());
     return result;
@@ -229,6 +263,7 @@ Napi::Value PersistentObject::pop(const Napi::CallbackInfo& info) {
 
 Napi::Value PersistentObject::isArray(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
   try {
     if (_impl->isArray()) {
       return Napi::Boolean::New(env, true);
@@ -243,6 +278,7 @@ Napi::Value PersistentObject::isArray(const Napi::CallbackInfo& info) {
 
 Napi::Value PersistentObject::getLength(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
   try {
     Napi::Value result = Napi::Number::New(env, _impl->getLength());
     return result;
@@ -253,6 +289,7 @@ Napi::Value PersistentObject::getLength(const Napi::CallbackInfo& info) {
 
 Napi::Value PersistentObject::setLength(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
   try {
     _impl->setLength(info[0].As<Napi::Number>().Uint32Value());
     return Napi::Value();
@@ -260,4 +297,232 @@ Napi::Value PersistentObject::setLength(const Napi::CallbackInfo& info) {
     _pool->tx_abort_context(env);
     throw Napi::Error::New(env, "failed to set length");
   }
-}
\ No newline at end of file
+}
+
+// holes read as undefined
+Napi::Array PersistentObject::toArray(Napi::Env env,
+                                      const std::vector<PPtr>& items) {
+  Napi::Array result = Napi::Array::New(env, items.size());
+  for (uint32_t i = 0; i < items.size(); ++i) {
+    if (PPTR_EQUALS(items[i], PPTR_NULL)) {
+      result.Set(i, env.Undefined());
+    } else {
+      result.Set(i, _pool->resurrect(env, std::make_shared<PPtr>(items[i])));
+    }
+  }
+  return result;
+}
+
+// _index_of(value, from), value is a primitive or a persistent object
+Napi::Value PersistentObject::indexOf(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  // NaN is never found by indexOf()
+  if (info[0].IsNumber() &&
+      std::isnan(info[0].As<Napi::Number>().DoubleValue())) {
+    return Napi::Number::New(env, -1);
+  }
+  std::string holder;
+  internal::PMKey key = _pool->toKey(env, info[0], holder);
+  try {
+    return Napi::Number::New(
+        env, _impl->indexOf(key, info[1].As<Napi::Number>().Uint32Value(),
+                            false));
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to search array");
+  }
+}
+
+// _includes(value, from), same as _index_of() but a hole matches undefined
+// and NaN matches NaN
+Napi::Value PersistentObject::includes(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  std::string holder;
+  internal::PMKey key = _pool->toKey(env, info[0], holder);
+  try {
+    return Napi::Boolean::New(
+        env, _impl->indexOf(key, info[1].As<Napi::Number>().Uint32Value(),
+                            true) >= 0);
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to search array");
+  }
+}
+
+// _slice(start, end) with non-negative indexes
+Napi::Value PersistentObject::slice(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  try {
+    uint32_t length = _impl->getLength();
+    uint32_t end = std::min(info[1].As<Napi::Number>().Uint32Value(), length);
+    return toArray(
+        env, _impl->getRange(info[0].As<Napi::Number>().Uint32Value(), end));
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to slice");
+  }
+}
+
+// _splice(start, delete_count, items), returns the removed items
+Napi::Value PersistentObject::splice(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
+  Napi::Array items = info[2].As<Napi::Array>();
+  PersistentObjectPool::CheckedScope checked(_pool, env, items);
+  try {
+    _pool->tx_enter_context(env);
+    std::vector<PPtr> pitems;
+    pitems.reserve(items.Length());
+    for (uint32_t i = 0; i < items.Length(); ++i) {
+      pitems.push_back(*((PPtr*)_pool->persist(env, items.Get(i)).get()));
+    }
+    uint32_t start = info[0].As<Napi::Number>().Uint32Value();
+    uint32_t delete_count = info[1].As<Napi::Number>().Uint32Value();
+    std::vector<PPtr> removed = _impl->splice(start, delete_count, pitems);
+    _pool->tx_exit_context(env);
+    return toArray(env, removed);
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to splice");
+  } catch (const Napi::Error& error) {
+    // e.g. a stale handle among the values
+    _pool->tx_abort_context(env);
+    throw;
+  }
+}
+
+// _sort() sorts like Array.prototype.sort() without a comparator: by the
+// string values, undefined after them and holes last.
+Napi::Value PersistentObject::sort(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
+  try {
+    std::vector<PPtr> items = _impl->getRange(0, _impl->getLength());
+    std::vector<std::pair<std::u16string, uint32_t>> keyed;
+    std::vector<uint32_t> undefineds;
+    std::vector<uint32_t> holes;
+    for (uint32_t i = 0; i < items.size(); ++i) {
+      if (PPTR_EQUALS(items[i], PPTR_NULL)) {
+        holes.push_back(i);
+      } else if (PPTR_EQUALS(items[i], PPTR_UNDEFINED)) {
+        undefineds.push_back(i);
+      } else {
+        Napi::Value value =
+            _pool->resurrect(env, std::make_shared<PPtr>(items[i]));
+        keyed.emplace_back(value.ToString().Utf16Value(), i);
+      }
+    }
+    std::stable_sort(keyed.begin(), keyed.end(),
+                     [](const std::pair<std::u16string, uint32_t>& lhs,
+                        const std::pair<std::u16string, uint32_t>& rhs) {
+                       return lhs.first < rhs.first;
+                     });
+    std::vector<uint32_t> order;
+    order.reserve(items.size());
+    for (auto it = keyed.begin(); it != keyed.end(); ++it) {
+      order.push_back(it->second);
+    }
+    order.insert(order.end(), undefineds.begin(), undefineds.end());
+    order.insert(order.end(), holes.begin(), holes.end());
+    _impl->permute(order);
+    return Napi::Value();
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to sort");
+  }
+}
+
+// _permute(order) moves the item at order[i] to i
+Napi::Value PersistentObject::permute(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
+  Napi::Array array = info[0].As<Napi::Array>();
+  std::vector<uint32_t> order(array.Length());
+  for (uint32_t i = 0; i < order.size(); ++i) {
+    order[i] = array.Get(i).As<Napi::Number>().Uint32Value();
+  }
+  try {
+    _impl->permute(order);
+    return Napi::Value();
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to sort");
+  }
+}
+
+Napi::Value PersistentObject::reverse(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
+  try {
+    _impl->reverse();
+    return Napi::Value();
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to reverse");
+  }
+}
+
+// _fill(value, start, end) with non-negative indexes
+Napi::Value PersistentObject::fill(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
+  try {
+    _pool->tx_enter_context(env);
+    PPtr value = *((PPtr*)_pool->persist(env, info[0]).get());
+    _impl->fill(value, info[1].As<Napi::Number>().Uint32Value(),
+                info[2].As<Napi::Number>().Uint32Value());
+    _pool->tx_exit_context(env);
+    return Napi::Value();
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to fill");
+  } catch (const Napi::Error& error) {
+    // e.g. a stale handle among the values
+    _pool->tx_abort_context(env);
+    throw;
+  }
+}
+
+// _sum/_min/_max(start, end) with non-negative indexes, the items must be
+// numbers
+Napi::Value PersistentObject::sum(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  try {
+    return Napi::Number::New(
+        env, _impl->reduce(internal::kReduceSum,
+                           info[0].As<Napi::Number>().Uint32Value(),
+                           info[1].As<Napi::Number>().Uint32Value()));
+  } catch (const char* errmsg) {
+    throw Napi::Error::New(env, errmsg);
+  }
+}
+
+Napi::Value PersistentObject::min(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  try {
+    return Napi::Number::New(
+        env, _impl->reduce(internal::kReduceMin,
+                           info[0].As<Napi::Number>().Uint32Value(),
+                           info[1].As<Napi::Number>().Uint32Value()));
+  } catch (const char* errmsg) {
+    throw Napi::Error::New(env, errmsg);
+  }
+}
+
+Napi::Value PersistentObject::max(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  try {
+    return Napi::Number::New(
+        env, _impl->reduce(internal::kReduceMax,
+                           info[0].As<Napi::Number>().Uint32Value(),
+                           info[1].As<Napi::Number>().Uint32Value()));
+  } catch (const char* errmsg) {
+    throw Napi::Error::New(env, errmsg);
+  }
+}
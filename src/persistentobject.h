@@ -13,6 +13,7 @@ class PersistentObject : public Napi::ObjectWrap<PersistentObject> {
                                   const Napi::Value value);
   static Napi::Object newInstance(Napi::Env env, PersistentObjectPool* pool,
                                   const void* data);
+  static bool isInstance(const Napi::Value value);
 
  public:
   PersistentObject(const Napi::CallbackInfo& info);
@@ -22,7 +23,8 @@ class PersistentObject : public Napi::ObjectWrap<PersistentObject> {
   std::shared_ptr<const void> getPPtr(Napi::Env env);
 
  private:
-  static Napi::FunctionReference constructor;
+  friend class AsyncTransaction;
+  static thread_local Napi::FunctionReference constructor;
 
  private:
   // NAPI cannot tell wether a Napi::Value is a uint32, so we
@@ -37,9 +39,23 @@ class PersistentObject : public Napi::ObjectWrap<PersistentObject> {
   Napi::Value isArray(const Napi::CallbackInfo& info);
   Napi::Value getLength(const Napi::CallbackInfo& info);
   Napi::Value setLength(const Napi::CallbackInfo& info);
+  Napi::Value indexOf(const Napi::CallbackInfo& info);
+  Napi::Value includes(const Napi::CallbackInfo& info);
+  Napi::Value slice(const Napi::CallbackInfo& info);
+  Napi::Value splice(const Napi::CallbackInfo& info);
+  Napi::Value sort(const Napi::CallbackInfo& info);
+  Napi::Value permute(const Napi::CallbackInfo& info);
+  Napi::Value reverse(const Napi::CallbackInfo& info);
+  Napi::Value fill(const Napi::CallbackInfo& info);
+  Napi::Value sum(const Napi::CallbackInfo& info);
+  Napi::Value min(const Napi::CallbackInfo& info);
+  Napi::Value max(const Napi::CallbackInfo& info);
+  Napi::Array toArray(Napi::Env env, const std::vector<PPtr>& items);
 
   internal::PMObject* _impl;
   PersistentObjectPool* _pool;
+  // the defrag generation of the pool when the handle was made
+  uint64_t _generation;
 };
 
 #endif
\ No newline at end of file
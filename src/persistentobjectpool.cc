@@ -1,10 +1,18 @@
 #include <napi.h>
 #include <stdio.h>
+#include <string.h>
+#include <algorithm>
 #include <exception>
+#include <vector>
 
+#include "asynctransaction.h"
 #include "persistentarraybuffer.h"
+#include "persistentdeque.h"
+#include "persistentindex.h"
+#include "persistentmap.h"
 #include "persistentobject.h"
 #include "persistentobjectpool.h"
+#include "persistentorderedmap.h"
 #include "util.h"
 
 #define CHECK_POOL_IS_AVAILABLE()                                     \
@@ -14,7 +22,7 @@
     }                                                                 \
   }
 
-Napi::FunctionReference PersistentObjectPool::constructor;
+thread_local Napi::FunctionReference PersistentObjectPool::constructor;
 
 PersistentObjectPool::PersistentObjectPool(const Napi::CallbackInfo& info)
     : Napi::ObjectWrap<PersistentObjectPool>(info) {
@@ -26,6 +34,11 @@ PersistentObjectPool::PersistentObjectPool(const Napi::CallbackInfo& info)
   _poolsize = info[2].As<Napi::Number>().Uint32Value();
   _mode = info[3].As<Napi::Number>().Uint32Value();
   _impl = nullptr;
+  _buffers_limit = 64;
+  _async_transactions = 0;
+  _group_max_ops = 0;
+  _group_scheduled = false;
+  _value_checked = false;
 };
 
 void PersistentObjectPool::init(Napi::Env env) {
@@ -41,13 +54,29 @@ void PersistentObjectPool::init(Napi::Env env) {
           InstanceMethod("_create_object", &PersistentObjectPool::createObject),
           InstanceMethod("_create_arraybuffer",
                          &PersistentObjectPool::createArrayBuffer),
+          InstanceMethod("_create_typed_array",
+                         &PersistentObjectPool::createTypedArray),
+          InstanceMethod("_create_map", &PersistentObjectPool::createMap),
+          InstanceMethod("_create_deque", &PersistentObjectPool::createDeque),
+          InstanceMethod("_create_ordered_map",
+                         &PersistentObjectPool::createOrderedMap),
+          InstanceMethod("_create_index", &PersistentObjectPool::createIndex),
+          InstanceMethod("_clone", &PersistentObjectPool::clone),
           InstanceMethod("_close", &PersistentObjectPool::close),
           InstanceMethod("_gc", &PersistentObjectPool::gc),
+          InstanceMethod("_defrag", &PersistentObjectPool::defrag),
+          InstanceMethod("_arena_stats", &PersistentObjectPool::arenaStats),
+          InstanceMethod("_ctl_get", &PersistentObjectPool::ctlGet),
+          InstanceMethod("_ctl_set", &PersistentObjectPool::ctlSet),
           InstanceMethod("_tx_begin", &PersistentObjectPool::tx_begin),
           InstanceMethod("_tx_commit", &PersistentObjectPool::tx_commit),
           InstanceMethod("_tx_abort", &PersistentObjectPool::tx_abort),
           InstanceMethod("_tx_end", &PersistentObjectPool::tx_end),
           InstanceMethod("_tx_stage", &PersistentObjectPool::tx_stage),
+          InstanceMethod("_transaction_async",
+                         &PersistentObjectPool::transactionAsync),
+          InstanceMethod("_group_commit", &PersistentObjectPool::groupCommit),
+          InstanceMethod("_flush", &PersistentObjectPool::flush),
       });
   constructor = Napi::Persistent(func);
   constructor.SuppressDestruct();
@@ -69,10 +98,17 @@ Napi::Value PersistentObjectPool::check(const Napi::CallbackInfo& info) {
   return Napi::Number::New(env, result);
 }
 
+// nullptr once the pool is closed
 internal::MemoryManager* PersistentObjectPool::getMemoryManager() {
+  if (_impl == nullptr) return nullptr;
   return _impl->getMemoryManager();
 };
 
+uint64_t PersistentObjectPool::generation() {
+  internal::MemoryManager* mm = getMemoryManager();
+  return (mm == nullptr) ? 0 : mm->defragGeneration();
+}
+
 Napi::Value PersistentObjectPool::resurrect(
     Napi::Env env, std::shared_ptr<const void> pptr_ptr) {
   try {
@@ -82,6 +118,8 @@ Napi::Value PersistentObjectPool::resurrect(
       return Napi::Number::New(env, *((double*)(pvalue.data)));
     } else if (pvalue.type == PERSISTENT_TYPE_STRING) {
       return Napi::String::New(env, (char*)(pvalue.data));
+    } else if (pvalue.type == PERSISTENT_TYPE_EMPTY_STRING) {
+      return Napi::String::New(env, "");
     } else if (pvalue.type == PERSISTENT_TYPE_TRUE) {
       return Napi::Boolean::New(env, true);
     } else if (pvalue.type == PERSISTENT_TYPE_FALSE) {
@@ -90,21 +128,116 @@ Napi::Value PersistentObjectPool::resurrect(
       return env.Null();
     } else if (pvalue.type == PERSISTENT_TYPE_UNDEFINED) {
       return env.Undefined();
+    } else if (pvalue.type == PERSISTENT_TYPE_DATE) {
+      return Napi::Date::New(env, *((double*)(pvalue.data)));
+    } else if (pvalue.type == PERSISTENT_TYPE_BIGINT64) {
+      return Napi::BigInt::New(env, *((int64_t*)(pvalue.data)));
+    } else if (pvalue.type == PERSISTENT_TYPE_BIGINT) {
+      PBigIntObject* pbig = (PBigIntObject*)pvalue.data;
+      return Napi::BigInt::New(env, pbig->ob_sign, pbig->ob_words,
+                               pbig->ob_digits);
     } else if (pvalue.type == PERSISTENT_TYPE_OBJECT) {
       return PersistentObject::newInstance(env, this, pvalue.data);
     } else if (pvalue.type == PERSISTENT_TYPE_ARRAYBUFFER) {
       return PersistentArrayBuffer::newInstance(env, this, pvalue.data);
+    } else if (pvalue.type == PERSISTENT_TYPE_MAP) {
+      return PersistentMap::newInstance(env, this, pvalue.data);
+    } else if (pvalue.type == PERSISTENT_TYPE_DEQUE) {
+      return PersistentDeque::newInstance(env, this, pvalue.data);
+    } else if (pvalue.type == PERSISTENT_TYPE_BTREE) {
+      return PersistentOrderedMap::newInstance(env, this, pvalue.data);
+    } else if (pvalue.type == PERSISTENT_TYPE_INDEX) {
+      return PersistentIndex::newInstance(env, this, pvalue.data);
     } else {
       throw Napi::Error::New(env, "unknown persistent type");
     }
   } catch (const char* errmsg) {
-    tx_abort_context(env);
+    // e.g. "key not found", nothing was written that needs an abort
     throw Napi::Error::New(env, errmsg);
   };
 }
 
+PersistentObjectPool::CheckedScope::CheckedScope(PersistentObjectPool* pool,
+                                                 Napi::Env env,
+                                                 const Napi::Value value)
+    : _pool(pool), _outermost(!pool->_value_checked) {
+  if (!_outermost) return;
+  pool->checkValue(env, value);
+  pool->_value_checked = true;
+}
+
+PersistentObjectPool::CheckedScope::~CheckedScope() {
+  if (_outermost) _pool->_value_checked = false;
+}
+
+// Walks value as persist() would, without writing: a persistent value is
+// checked to be current, a JS object or array, Map or Set is walked once.
+void PersistentObjectPool::checkValue(Napi::Env env, const Napi::Value value) {
+  Napi::Object global = env.Global();
+  Napi::Object seen = global.Get("Set").As<Napi::Function>().New({});
+  Napi::Function has = seen.Get("has").As<Napi::Function>();
+  Napi::Function add = seen.Get("add").As<Napi::Function>();
+  Napi::Function from =
+      global.Get("Array").As<Napi::Object>().Get("from").As<Napi::Function>();
+  std::vector<Napi::Value> pending(1, value);
+  while (!pending.empty()) {
+    Napi::Value item = pending.back();
+    pending.pop_back();
+    if (item.IsBuffer() || item.IsDataView() || item.IsFunction() ||
+        item.IsPromise()) {
+      throw Napi::Error::New(env, "unsupported type");
+    } else if (item.IsNumber() || item.IsString() || item.IsNull() ||
+               item.IsUndefined() || item.IsBoolean() || item.IsDate() ||
+               item.IsBigInt() || item.IsArrayBuffer() ||
+               PersistentArrayBuffer::isInstance(item)) {
+      continue;
+    } else if (PersistentObject::isInstance(item)) {
+      Napi::ObjectWrap<PersistentObject>::Unwrap(item.As<Napi::Object>())
+          ->getPPtr(env);
+    } else if (PersistentMap::isInstance(item)) {
+      Napi::ObjectWrap<PersistentMap>::Unwrap(item.As<Napi::Object>())
+          ->getPPtr(env);
+    } else if (PersistentDeque::isInstance(item)) {
+      Napi::ObjectWrap<PersistentDeque>::Unwrap(item.As<Napi::Object>())
+          ->getPPtr(env);
+    } else if (PersistentOrderedMap::isInstance(item)) {
+      Napi::ObjectWrap<PersistentOrderedMap>::Unwrap(item.As<Napi::Object>())
+          ->getPPtr(env);
+    } else if (PersistentIndex::isInstance(item)) {
+      Napi::ObjectWrap<PersistentIndex>::Unwrap(item.As<Napi::Object>())
+          ->getPPtr(env);
+    } else if (!item.IsObject()) {
+      throw Napi::Error::New(env, "unsupported type");
+    } else if (!has.Call(seen, {item}).ToBoolean().Value()) {
+      add.Call(seen, {item});
+      if (PersistentMap::isJSMapOrSet(env, item)) {
+        bool is_set = item.As<Napi::Object>().InstanceOf(
+            global.Get("Set").As<Napi::Function>());
+        Napi::Array entries = from.Call({item}).As<Napi::Array>();
+        for (uint32_t i = 0; i < entries.Length(); ++i) {
+          Napi::Value key = entries.Get(i);
+          if (!is_set) {
+            Napi::Array pair = key.As<Napi::Array>();
+            key = pair.Get((uint32_t)0);
+            pending.push_back(pair.Get((uint32_t)1));
+          }
+          std::string holder;
+          toKey(env, key, holder);
+        }
+        continue;
+      }
+      Napi::Object obj = item.As<Napi::Object>();
+      Napi::Array props = obj.GetPropertyNames();
+      for (uint32_t i = 0; i < props.Length(); ++i) {
+        pending.push_back(obj.Get(props.Get(i)));
+      }
+    }
+  }
+}
+
 std::shared_ptr<const void> PersistentObjectPool::persist(
     Napi::Env env, const Napi::Value value) {
+  CheckedScope checked(this, env, value);
   try {
     if (value.IsBuffer() || value.IsDataView() || value.IsFunction() ||
         value.IsPromise()) {
@@ -119,12 +252,53 @@ std::shared_ptr<const void> PersistentObjectPool::persist(
       return _impl->persistUndefined();
     } else if (value.IsBoolean()) {
       return _impl->persistBoolean(value.As<Napi::Boolean>().Value());
+    } else if (value.IsDate()) {
+      return _impl->persistDate(value.As<Napi::Date>().ValueOf());
+    } else if (value.IsBigInt()) {
+      Napi::BigInt bigint = value.As<Napi::BigInt>();
+      int sign;
+      size_t word_count = bigint.WordCount();
+      std::vector<uint64_t> words(word_count);
+      bigint.ToWords(&sign, &word_count, words.data());
+      return _impl->persistBigInt(sign, words.data(), word_count);
     } else if (value.IsArrayBuffer()) {
       Napi::Object n_pab = PersistentArrayBuffer::newInstance(env, this, value);
       PersistentArrayBuffer* pab =
           Napi::ObjectWrap<PersistentArrayBuffer>::Unwrap(
               n_pab.As<Napi::Object>());
       return pab->getPPtr(env);
+    } else if (PersistentArrayBuffer::isInstance(value)) {
+      PersistentArrayBuffer* pab =
+          Napi::ObjectWrap<PersistentArrayBuffer>::Unwrap(
+              value.As<Napi::Object>());
+      return pab->getPPtr(env);
+    } else if (PersistentMap::isInstance(value)) {
+      PersistentMap* pmap =
+          Napi::ObjectWrap<PersistentMap>::Unwrap(value.As<Napi::Object>());
+      return pmap->getPPtr(env);
+    } else if (PersistentDeque::isInstance(value)) {
+      PersistentDeque* pdq =
+          Napi::ObjectWrap<PersistentDeque>::Unwrap(value.As<Napi::Object>());
+      return pdq->getPPtr(env);
+    } else if (PersistentOrderedMap::isInstance(value)) {
+      PersistentOrderedMap* pom =
+          Napi::ObjectWrap<PersistentOrderedMap>::Unwrap(
+              value.As<Napi::Object>());
+      return pom->getPPtr(env);
+    } else if (PersistentIndex::isInstance(value)) {
+      PersistentIndex* pix =
+          Napi::ObjectWrap<PersistentIndex>::Unwrap(value.As<Napi::Object>());
+      return pix->getPPtr(env);
+    } else if (PersistentMap::isJSMapOrSet(env, value)) {
+      for (auto it = _cache.begin(); it != _cache.end(); ++it) {
+        if (it->first == value) {
+          return it->second;
+        }
+      }
+      bool clear_cache = _cache.empty();
+      Napi::Object n_map = PersistentMap::newInstance(env, this, value);
+      if (clear_cache) _cache.clear();
+      return Napi::ObjectWrap<PersistentMap>::Unwrap(n_map)->getPPtr(env);
     } else if (value.IsObject()) {
       PersistentObject* pobj = nullptr;
       // if value is PersistentObject
@@ -156,13 +330,48 @@ std::shared_ptr<const void> PersistentObjectPool::persist(
   }
 };
 
+// Converts a primitive, or a persistent object, to a key to look up without
+// persisting anything. holder keeps the content of a string key.
+internal::PMKey PersistentObjectPool::toKey(Napi::Env env,
+                                            const Napi::Value value,
+                                            std::string& holder) {
+  internal::PMKey result = {PPTR_NULL, nullptr, 0};
+  if (value.IsString()) {
+    holder = value.As<Napi::String>().Utf8Value();
+    if (holder.empty()) {
+      result.pptr = PPTR_EMPTY_STRING;
+    } else if (memchr(holder.data(), '\0', holder.size()) != nullptr) {
+      throw Napi::Error::New(env, "unsupported key: string contains NUL");
+    } else {
+      result.str = holder.data();
+      result.len = holder.size();
+    }
+  } else if (value.IsBigInt()) {
+    // only BigInts that are stored inline
+    bool lossless;
+    int64_t bigint = value.As<Napi::BigInt>().Int64Value(&lossless);
+    if (!lossless) throw Napi::Error::New(env, "unsupported key: BigInt");
+    result.pptr.pool_uuid_lo = TYPE_CODE_BIGINT;
+    result.pptr.off = (uint64_t)bigint;
+  } else if (value.IsNumber() || value.IsBoolean() || value.IsNull() ||
+             value.IsUndefined() || PersistentObject::isInstance(value) ||
+             PersistentArrayBuffer::isInstance(value) ||
+             PersistentMap::isInstance(value) ||
+             PersistentDeque::isInstance(value) ||
+             PersistentOrderedMap::isInstance(value) ||
+             PersistentIndex::isInstance(value)) {
+    // inline values and existing persistent objects, nothing is allocated
+    result.pptr = *((PPtr*)persist(env, value).get());
+  } else {
+    throw Napi::Error::New(env, "unsupported key type");
+  }
+  return result;
+}
+
 void PersistentObjectPool::tx_enter_context(Napi::Env env) {
   CHECK_POOL_IS_AVAILABLE();
   try {
-    int errnum = _impl->tx_begin();
-    if (errnum) {
-      throw Napi::Error::New(env, "failed to begin transaction");
-    }
+    _impl->tx_enter_context();
   } catch (const char* errmsg) {
     throw Napi::Error::New(env, "failed to switch transaction state");
   }
@@ -171,37 +380,117 @@ void PersistentObjectPool::tx_enter_context(Napi::Env env) {
 void PersistentObjectPool::tx_exit_context(Napi::Env env) {
   CHECK_POOL_IS_AVAILABLE();
   try {
-    if (_impl->tx_stage() == TX_STAGE_WORK) {
-      _impl->tx_commit();
-    }
-    int errnum = _impl->tx_end();
-    if (errnum) {
-      throw Napi::Error::New(env, "failed to end transaction");
-    }
+    _impl->tx_exit_context();
   } catch (const char* errmsg) {
-    throw Napi::Error::New(env, "failed to switch transaction state");
+    throw Napi::Error::New(env, "failed to end transaction");
   }
 }
 
 void PersistentObjectPool::tx_abort_context(Napi::Env env) {
   CHECK_POOL_IS_AVAILABLE();
   try {
-    if (_impl->tx_stage() == TX_STAGE_WORK) {
-      _impl->tx_abort();
-      _impl->tx_end();
-    }
+    _impl->tx_abort_context();
+  } catch (const char* errmsg) {
+    throw Napi::Error::New(env, "failed to switch transaction state");
+  }
+}
+
+void PersistentObjectPool::reserve_enter_context(Napi::Env env) {
+  CHECK_POOL_IS_AVAILABLE();
+  try {
+    _impl->reserve_enter_context();
   } catch (const char* errmsg) {
     throw Napi::Error::New(env, "failed to switch transaction state");
   }
 }
 
+void PersistentObjectPool::reserve_exit_context(Napi::Env env) {
+  CHECK_POOL_IS_AVAILABLE();
+  try {
+    _impl->reserve_exit_context();
+  } catch (const char* errmsg) {
+    throw Napi::Error::New(env, "failed to end transaction");
+  }
+}
+
+// Called before every write. Opens the group the write joins, after
+// committing the open one if it is full, and has the new group committed
+// later.
+void PersistentObjectPool::joinGroup(Napi::Env env) {
+  if (_group_max_ops == 0) return;
+  try {
+    if (_impl->group_ops() >= _group_max_ops && _impl->group_end() != 0) {
+      throw Napi::Error::New(env, "transaction aborted");
+    }
+    if (_impl->group_begin() != 0) {
+      throw Napi::Error::New(env, "failed to begin transaction");
+    }
+  } catch (const char* errmsg) {
+    throw Napi::Error::New(env, errmsg);
+  }
+  if (!_group_scheduled) {
+    _group_scheduled = true;
+    _group_schedule.Call({});
+  }
+}
+
+// Remembers an ArrayBuffer whose data lives in the pool, so that it can be
+// detached before the pool is unmapped.
+void PersistentObjectPool::trackBuffer(Napi::ArrayBuffer buffer) {
+  if (_buffers.size() >= _buffers_limit) {
+    // drop the buffers that have been collected already
+    _buffers.remove_if(
+        [](const Napi::ObjectReference& ref) { return ref.Value().IsEmpty(); });
+    _buffers_limit = std::max((size_t)64, _buffers.size() * 2);
+  }
+  _buffers.emplace_back(Napi::Weak(buffer));
+}
+
+void PersistentObjectPool::detachBuffers() {
+  for (auto it = _buffers.begin(); it != _buffers.end(); ++it) {
+    Napi::Object buffer = it->Value();
+    if (!buffer.IsEmpty()) {
+      buffer.As<Napi::ArrayBuffer>().Detach();
+    }
+  }
+  _buffers.clear();
+  _buffers_limit = 64;
+}
+
+// options is {prefault, tx_cache_size, stats, post_commit_worker}, checked
+// by jspmdk.js, the missing ones keep their default
+internal::PoolOptions PersistentObjectPool::toPoolOptions(
+    const Napi::Value value) {
+  internal::PoolOptions options;
+  if (!value.IsObject()) return options;
+  Napi::Object obj = value.As<Napi::Object>();
+  if (obj.Has("prefault")) {
+    options.prefault = obj.Get("prefault").ToBoolean().Value() ? 1 : 0;
+  }
+  if (obj.Has("tx_cache_size")) {
+    options.tx_cache_size =
+        obj.Get("tx_cache_size").As<Napi::Number>().Int64Value();
+  }
+  if (obj.Has("stats")) {
+    options.stats_enabled = obj.Get("stats").As<Napi::Number>().Int32Value();
+  }
+  if (obj.Has("post_commit_worker")) {
+    options.post_commit_worker =
+        obj.Get("post_commit_worker").ToBoolean().Value();
+  }
+  if (obj.Has("alloc_classes")) {
+    options.alloc_classes = obj.Get("alloc_classes").ToBoolean().Value();
+  }
+  return options;
+}
+
 Napi::Value PersistentObjectPool::open(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
   if (_impl != nullptr) {
     throw Napi::Error::New(env, "pool already opened or created");
   }
   try {
-    _impl = new internal::PMObjectPool(_path, _layout);
+    _impl = new internal::PMObjectPool(_path, _layout, toPoolOptions(info[0]));
     return Napi::Value();
   } catch (const char* errmsg) {
     throw Napi::Error::New(env, "failed to open pool");
@@ -214,7 +503,8 @@ Napi::Value PersistentObjectPool::create(const Napi::CallbackInfo& info) {
     throw Napi::Error::New(env, "pool already opened or created");
   }
   try {
-    _impl = new internal::PMObjectPool(_path, _layout, _poolsize, _mode);
+    _impl = new internal::PMObjectPool(_path, _layout, _poolsize, _mode,
+                                       toPoolOptions(info[0]));
     return Napi::Value();
   } catch (const char* errmsg) {
     throw Napi::Error::New(env, "failed to create pool");
@@ -224,6 +514,7 @@ Napi::Value PersistentObjectPool::create(const Napi::CallbackInfo& info) {
 Napi::Value PersistentObjectPool::getRoot(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
   CHECK_POOL_IS_AVAILABLE();
+  LOCK_POOL(this, false);
   try {
     Napi::Value result = resurrect(env, _impl->getRoot());
     return result;
@@ -236,6 +527,7 @@ Napi::Value PersistentObjectPool::getRoot(const Napi::CallbackInfo& info) {
 Napi::Value PersistentObjectPool::setRoot(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
   CHECK_POOL_IS_AVAILABLE();
+  LOCK_POOL(this, true);
   ASSERT_ARGS_LENGTH(info.Length() == 1);
   try {
     _impl->setRoot(persist(env, info[0]));
@@ -250,23 +542,111 @@ Napi::Value PersistentObjectPool::setRoot(const Napi::CallbackInfo& info) {
 Napi::Value PersistentObjectPool::createObject(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
   CHECK_POOL_IS_AVAILABLE();
+  LOCK_POOL(this, false);
   ASSERT_ARGS_LENGTH(info.Length() <= 1);
   Napi::Value value = (info.Length() == 1) ? info[0] : Napi::Object::New(env);
-  return PersistentObject::newInstance(env, this, value);
+  Napi::Object result = PersistentObject::newInstance(env, this, value);
+  // nothing links the object, it is published on its own
+  try {
+    _impl->publish();
+  } catch (const char* errmsg) {
+    throw Napi::Error::New(env, errmsg);
+  }
+  return result;
 }
 
 Napi::Value PersistentObjectPool::createArrayBuffer(
     const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
   CHECK_POOL_IS_AVAILABLE();
+  LOCK_POOL(this, false);
   ASSERT_ARGS_LENGTH(info.Length() == 1);
   return PersistentArrayBuffer::newInstance(env, this, info[0]);
 }
 
+Napi::Value PersistentObjectPool::createTypedArray(
+    const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  CHECK_POOL_IS_AVAILABLE();
+  LOCK_POOL(this, false);
+  ASSERT_ARGS_LENGTH(info.Length() == 2);
+  // info[0] is an empty TypedArray of the requested type
+  return PersistentArrayBuffer::newInstance(env, this, info[0], info[1]);
+}
+
+Napi::Value PersistentObjectPool::createMap(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  CHECK_POOL_IS_AVAILABLE();
+  LOCK_POOL(this, false);
+  ASSERT_ARGS_LENGTH(info.Length() == 1);
+  // info[0] is a JS Map or Set to copy, or whether to create an empty Set
+  return PersistentMap::newInstance(env, this, info[0]);
+}
+
+Napi::Value PersistentObjectPool::createDeque(
+    const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  CHECK_POOL_IS_AVAILABLE();
+  LOCK_POOL(this, false);
+  ASSERT_ARGS_LENGTH(info.Length() == 1);
+  // info[0] is an Array of the initial items
+  return PersistentDeque::newInstance(env, this, info[0]);
+}
+
+Napi::Value PersistentObjectPool::createOrderedMap(
+    const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  CHECK_POOL_IS_AVAILABLE();
+  LOCK_POOL(this, false);
+  ASSERT_ARGS_LENGTH(info.Length() == 1);
+  // info[0] is an Array of the initial [key, value] entries
+  return PersistentOrderedMap::newInstance(env, this, info[0]);
+}
+
+Napi::Value PersistentObjectPool::createIndex(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  CHECK_POOL_IS_AVAILABLE();
+  LOCK_POOL(this, true);
+  ASSERT_ARGS_LENGTH(info.Length() == 4);
+  // info[0] is the collection, info[1] the field, info[2] and info[3] whether
+  // the index is unique and ordered
+  return PersistentIndex::newInstance(env, this, info);
+}
+
+Napi::Value PersistentObjectPool::clone(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  CHECK_POOL_IS_AVAILABLE();
+  // the source is read whole, no other thread changes it meanwhile
+  LOCK_POOL(this, true);
+  ASSERT_ARGS_LENGTH(info.Length() == 2);
+  if (!PersistentObject::isInstance(info[0])) {
+    throw Napi::Error::New(env, "invalid argument");
+  }
+  PersistentObject* pobj =
+      Napi::ObjectWrap<PersistentObject>::Unwrap(info[0].As<Napi::Object>());
+  try {
+    std::shared_ptr<const void> result =
+        _impl->clone(pobj->getPPtr(env), info[1].ToBoolean());
+    _impl->publish();
+    return resurrect(env, result);
+  } catch (const char* errmsg) {
+    tx_abort_context(env);
+    throw Napi::Error::New(env, errmsg);
+  }
+}
+
 Napi::Value PersistentObjectPool::close(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
   CHECK_POOL_IS_AVAILABLE();
+  if (_async_transactions > 0) {
+    throw Napi::Error::New(env, "async transactions pending");
+  }
   try {
+    // the open group is committed on the way
+    _group_max_ops = 0;
+    _group_scheduled = false;
+    _group_schedule.Reset();
+    detachBuffers();
     _impl->close();
     delete _impl;
     _impl = nullptr;
@@ -280,6 +660,7 @@ Napi::Value PersistentObjectPool::close(const Napi::CallbackInfo& info) {
 Napi::Value PersistentObjectPool::gc(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
   CHECK_POOL_IS_AVAILABLE();
+  LOCK_POOL(this, true);
   try {
     _impl->gc();
     return Napi::Value();
@@ -289,6 +670,94 @@ Napi::Value PersistentObjectPool::gc(const Napi::CallbackInfo& info) {
   }
 }
 
+// info[0] is the budget in milliseconds, 0 for a whole pass
+Napi::Value PersistentObjectPool::defrag(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  CHECK_POOL_IS_AVAILABLE();
+  ASSERT_ARGS_LENGTH(info.Length() == 1);
+  // the queued transactions hold the objects they change
+  if (_async_transactions > 0) {
+    throw Napi::Error::New(env, "async transactions pending");
+  }
+  // not LOCK_POOL(), which would join the open group: pmemobj_defrag() runs
+  // outside any transaction
+  internal::PoolLock pool_lock(getMemoryManager(), true);
+  if (!pool_lock.held()) {
+    throw Napi::Error::New(env, "failed to lock pool");
+  }
+  try {
+    if (_impl->group_end() != 0) {
+      throw Napi::Error::New(env, "transaction aborted");
+    }
+    if (_impl->tx_stage() != TX_STAGE_NONE) {
+      throw Napi::Error::New(env, "cannot defrag inside a transaction");
+    }
+    internal::DefragReport report =
+        _impl->defrag(info[0].As<Napi::Number>().DoubleValue());
+    Napi::Object result = Napi::Object::New(env);
+    result.Set("objects", Napi::Number::New(env, (double)report.objects));
+    result.Set("relocated", Napi::Number::New(env, (double)report.relocated));
+    result.Set("bytes_moved",
+               Napi::Number::New(env, (double)report.bytes_moved));
+    result.Set("fragmentation_before",
+               Napi::Number::New(env, report.fragmentation_before));
+    result.Set("fragmentation_after",
+               Napi::Number::New(env, report.fragmentation_after));
+    result.Set("done", Napi::Boolean::New(env, report.done));
+    return result;
+  } catch (const char* errmsg) {
+    tx_abort_context(env);
+    throw Napi::Error::New(env, errmsg);
+  }
+}
+
+Napi::Value PersistentObjectPool::arenaStats(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  CHECK_POOL_IS_AVAILABLE();
+  Napi::Object result = Napi::Object::New(env);
+  result.Set("arena", Napi::Number::New(env, _impl->getArena()));
+  std::vector<size_t> sizes = _impl->getArenaSizes();
+  Napi::Array arenas = Napi::Array::New(env, sizes.size());
+  for (uint32_t i = 0; i < sizes.size(); ++i) {
+    Napi::Object arena = Napi::Object::New(env);
+    arena.Set("id", Napi::Number::New(env, i + 1));
+    arena.Set("size", Napi::Number::New(env, (double)sizes[i]));
+    arenas.Set(i, arena);
+  }
+  result.Set("arenas", arenas);
+  return result;
+}
+
+Napi::Value PersistentObjectPool::ctlGet(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  CHECK_POOL_IS_AVAILABLE();
+  LOCK_POOL(this, false);
+  ASSERT_ARGS_LENGTH(info.Length() == 1);
+  try {
+    std::string name = info[0].As<Napi::String>().Utf8Value();
+    return Napi::Number::New(env, _impl->ctlGet(name));
+  } catch (const char* errmsg) {
+    throw Napi::Error::New(env, errmsg);
+  }
+}
+
+// The entries are settings of libpmemobj rather than data of the pool, a
+// shared hold of the lock is enough. They take effect for the transactions
+// begun after it.
+Napi::Value PersistentObjectPool::ctlSet(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  CHECK_POOL_IS_AVAILABLE();
+  LOCK_POOL(this, false);
+  ASSERT_ARGS_LENGTH(info.Length() == 2);
+  try {
+    std::string name = info[0].As<Napi::String>().Utf8Value();
+    _impl->ctlSet(name, info[1].As<Napi::Number>().DoubleValue());
+    return Napi::Value();
+  } catch (const char* errmsg) {
+    throw Napi::Error::New(env, errmsg);
+  }
+}
+
 Napi::Value PersistentObjectPool::tx_begin(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
   CHECK_POOL_IS_AVAILABLE();
@@ -319,4 +788,45 @@ Napi::Value PersistentObjectPool::tx_stage(const Napi::CallbackInfo& info) {
   Napi::Env env = info.Env();
   CHECK_POOL_IS_AVAILABLE();
   return Napi::Number::New(env, _impl->tx_stage());
+}
+
+Napi::Value PersistentObjectPool::transactionAsync(
+    const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  CHECK_POOL_IS_AVAILABLE();
+  ASSERT_ARGS_LENGTH(info.Length() == 1);
+  // The lock is taken by the worker thread, not here. It would wait for a
+  // transaction of this thread, which cannot end while the caller awaits.
+  if (_impl->group_end() != 0) {
+    throw Napi::Error::New(env, "transaction aborted");
+  }
+  if (_impl->tx_stage() != TX_STAGE_NONE) {
+    throw Napi::Error::New(env, "cannot queue inside a transaction");
+  }
+  return AsyncTransaction::queue(env, this, info[0].As<Napi::Array>());
+}
+
+Napi::Value PersistentObjectPool::groupCommit(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  CHECK_POOL_IS_AVAILABLE();
+  ASSERT_ARGS_LENGTH(info.Length() == 2);
+  // info[0] is the most writes in a group, 0 to turn group commit off,
+  // info[1] the function scheduling the commit of a new group
+  _group_max_ops = info[0].As<Napi::Number>().Uint32Value();
+  if (_group_max_ops == 0) {
+    _group_schedule.Reset();
+  } else {
+    _group_schedule = Napi::Persistent(info[1].As<Napi::Function>());
+  }
+  return flush(info);
+}
+
+Napi::Value PersistentObjectPool::flush(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  CHECK_POOL_IS_AVAILABLE();
+  _group_scheduled = false;
+  if (_impl->group_end() != 0) {
+    throw Napi::Error::New(env, "transaction aborted");
+  }
+  return Napi::Value();
 }
\ No newline at end of file
@@ -2,8 +2,10 @@
 #define PERSISTENTOBJECTPOOL_H
 
 #include <napi.h>
+#include <list>
 #include <map>
 #include <memory>
+#include <string>
 
 #include "internal/pmobjectpool.h"
 
@@ -16,16 +18,40 @@ class PersistentObjectPool : public Napi::ObjectWrap<PersistentObjectPool> {
  public:
   PersistentObjectPool(const Napi::CallbackInfo& info);
   internal::MemoryManager *getMemoryManager();
+  // the defrag generation of the pool, 0 if it is not open
+  uint64_t generation();
   Napi::Value resurrect(Napi::Env env, std::shared_ptr<const void>);
   std::shared_ptr<const void> persist(Napi::Env env, const Napi::Value value);
+  internal::PMKey toKey(Napi::Env env, const Napi::Value value,
+                        std::string& holder);
   void tx_enter_context(Napi::Env env);
   void tx_exit_context(Napi::Env env);
   void tx_abort_context(Napi::Env env);
+  void reserve_enter_context(Napi::Env env);
+  void reserve_exit_context(Napi::Env env);
+  void trackBuffer(Napi::ArrayBuffer buffer);
+  void joinGroup(Napi::Env env);
+
+  // Checks that a JS value and the values nested in it can be persisted
+  // before the outermost conversion writes anything, as a write that throws
+  // half way aborts the transaction, and with it the open group. The values
+  // converted in its scope are not checked again.
+  class CheckedScope {
+   public:
+    CheckedScope(PersistentObjectPool* pool, Napi::Env env,
+                 const Napi::Value value);
+    ~CheckedScope();
+
+   private:
+    PersistentObjectPool* _pool;
+    bool _outermost;
+  };
 
   std::map<Napi::Value, std::shared_ptr<const void>> _cache;
 
  private:
-  static Napi::FunctionReference constructor;
+  friend class AsyncTransaction;
+  static thread_local Napi::FunctionReference constructor;
 
  private:
   Napi::Value check(const Napi::CallbackInfo& info);
@@ -35,14 +61,27 @@ class PersistentObjectPool : public Napi::ObjectWrap<PersistentObjectPool> {
   Napi::Value setRoot(const Napi::CallbackInfo& info);
   Napi::Value createObject(const Napi::CallbackInfo& info);
   Napi::Value createArrayBuffer(const Napi::CallbackInfo& info);
+  Napi::Value createTypedArray(const Napi::CallbackInfo& info);
+  Napi::Value createMap(const Napi::CallbackInfo& info);
+  Napi::Value createDeque(const Napi::CallbackInfo& info);
+  Napi::Value createOrderedMap(const Napi::CallbackInfo& info);
+  Napi::Value createIndex(const Napi::CallbackInfo& info);
+  Napi::Value clone(const Napi::CallbackInfo& info);
   Napi::Value close(const Napi::CallbackInfo& info);
   Napi::Value gc(const Napi::CallbackInfo& info);
+  Napi::Value defrag(const Napi::CallbackInfo& info);
+  Napi::Value arenaStats(const Napi::CallbackInfo& info);
+  Napi::Value ctlGet(const Napi::CallbackInfo& info);
+  Napi::Value ctlSet(const Napi::CallbackInfo& info);
 
   Napi::Value tx_begin(const Napi::CallbackInfo& info);
   Napi::Value tx_commit(const Napi::CallbackInfo& info);
   Napi::Value tx_abort(const Napi::CallbackInfo& info);
   Napi::Value tx_end(const Napi::CallbackInfo& info);
   Napi::Value tx_stage(const Napi::CallbackInfo& info);
+  Napi::Value transactionAsync(const Napi::CallbackInfo& info);
+  Napi::Value groupCommit(const Napi::CallbackInfo& info);
+  Napi::Value flush(const Napi::CallbackInfo& info);
 
   std::string _path;
   std::string _layout;
@@ -50,7 +89,24 @@ class PersistentObjectPool : public Napi::ObjectWrap<PersistentObjectPool> {
   uint32_t _poolsize;
   mode_t _mode;
 
+  void detachBuffers();
+  void checkValue(Napi::Env env, const Napi::Value value);
+  internal::PoolOptions toPoolOptions(const Napi::Value value);
+
   internal::PMObjectPool *_impl;
+  // weak references to the ArrayBuffers handed out over pmem
+  std::list<Napi::ObjectReference> _buffers;
+  size_t _buffers_limit;
+  // the transactions queued by transaction_async() and not settled yet, the
+  // pool cannot be closed under them
+  uint32_t _async_transactions;
+  // group commit, off while _group_max_ops is 0. _group_schedule is called
+  // when a group opens, to have it committed later by _flush().
+  uint32_t _group_max_ops;
+  bool _group_scheduled;
+  Napi::FunctionReference _group_schedule;
+  // whether a CheckedScope checked the values being converted
+  bool _value_checked;
 };
 
 #endif
\ No newline at end of file
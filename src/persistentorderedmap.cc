@@ -0,0 +1,298 @@
+#include <math.h>
+#include <exception>
+
+#include "internal/pmbtree.h"
+#include "persistentobjectpool.h"
+#include "persistentorderedmap.h"
+#include "util.h"
+
+thread_local Napi::FunctionReference PersistentOrderedMap::constructor;
+
+PersistentOrderedMap::PersistentOrderedMap(const Napi::CallbackInfo& info)
+    : Napi::ObjectWrap<PersistentOrderedMap>(info) {
+  Napi::Env env = info.Env();
+  Napi::HandleScope scope(env);
+  _pool = info[0].As<Napi::External<PersistentObjectPool>>().Data();
+  _generation = _pool->generation();
+  // construct by existing PersistentOrderedMap
+  if (info[1].IsExternal()) {
+    void* data = info[1].As<Napi::External<void>>().Data();
+    try {
+      _impl = new internal::PMBTree(_pool->getMemoryManager(), data);
+    } catch (const char* errmsg) {
+      _pool->tx_abort_context(env);
+      throw Napi::Error::New(env, "failed to create PersistentOrderedMap");
+    }
+  }
+  // construct by an Array of [key, value]
+  else if (info[1].IsArray()) {
+    Napi::Array items = info[1].As<Napi::Array>();
+    // the keys too are checked before the first write
+    PersistentObjectPool::CheckedScope checked(_pool, env, items);
+    for (uint32_t i = 0; i < items.Length(); ++i) {
+      std::string holder;
+      toKey(env, items.Get(i).As<Napi::Array>().Get((uint32_t)0), holder);
+    }
+    try {
+      _pool->tx_enter_context(env);
+      _impl = new internal::PMBTree(_pool->getMemoryManager());
+      for (uint32_t i = 0; i < items.Length(); ++i) {
+        Napi::Array pair = items.Get(i).As<Napi::Array>();
+        std::string holder;
+        internal::PMKey key = toKey(env, pair.Get((uint32_t)0), holder);
+        _impl->set(key, _pool->persist(env, pair.Get((uint32_t)1)),
+                   kNotSnapshot);
+      }
+      _pool->tx_exit_context(env);
+    } catch (const char* errmsg) {
+      _pool->tx_abort_context(env);
+      throw Napi::Error::New(env, "failed to create PersistentOrderedMap");
+    } catch (const Napi::Error& error) {
+      // e.g. a stale handle among the values
+      _pool->tx_abort_context(env);
+      throw;
+    }
+  } else {
+    throw Napi::Error::New(
+        env, "invalid argument to initialize PersistentOrderedMap");
+  }
+};
+
+PersistentOrderedMap::~PersistentOrderedMap() { delete _impl; }
+
+void PersistentOrderedMap::init(Napi::Env env) {
+  Napi::HandleScope scope(env);
+  Napi::Function func = DefineClass(
+      env, "_PersistentOrderedMap",
+      {
+          InstanceMethod("_get", &PersistentOrderedMap::get),
+          InstanceMethod("_has", &PersistentOrderedMap::has),
+          InstanceMethod("_set", &PersistentOrderedMap::set),
+          InstanceMethod("_delete", &PersistentOrderedMap::del),
+          InstanceMethod("_clear", &PersistentOrderedMap::clear),
+          InstanceMethod("_size", &PersistentOrderedMap::size),
+          InstanceMethod("_range", &PersistentOrderedMap::range),
+          InstanceMethod("_floor", &PersistentOrderedMap::floor),
+          InstanceMethod("_ceil", &PersistentOrderedMap::ceil),
+          InstanceMethod("_first", &PersistentOrderedMap::first),
+          InstanceMethod("_last", &PersistentOrderedMap::last),
+      });
+  constructor = Napi::Persistent(func);
+  constructor.SuppressDestruct();
+}
+
+Napi::Object PersistentOrderedMap::newInstance(Napi::Env env,
+                                               PersistentObjectPool* pool,
+                                               const Napi::Value value) {
+  Napi::EscapableHandleScope scope(env);
+  // new PersistentOrderedMap(js_array);
+  Napi::External<PersistentObjectPool> ext_pool =
+      Napi::External<PersistentObjectPool>::New(env, pool);
+  Napi::Object obj = constructor.New({ext_pool, value});
+  return scope.Escape(napi_value(obj)).ToObject();
+}
+
+Napi::Object PersistentOrderedMap::newInstance(Napi::Env env,
+                                               PersistentObjectPool* pool,
+                                               const void* data) {
+  Napi::EscapableHandleScope scope(env);
+  // new PersistentOrderedMap(void *data);
+  Napi::External<PersistentObjectPool> ext_pool =
+      Napi::External<PersistentObjectPool>::New(env, pool);
+  Napi::External<void> ext_data = Napi::External<void>::New(env, (void*)data);
+  Napi::Object obj = constructor.New({ext_pool, ext_data});
+  return scope.Escape(napi_value(obj)).ToObject();
+}
+
+bool PersistentOrderedMap::isInstance(const Napi::Value value) {
+  return value.IsObject() &&
+         value.As<Napi::Object>().InstanceOf(constructor.Value());
+}
+
+std::shared_ptr<const void> PersistentOrderedMap::getPPtr(Napi::Env env) {
+  CHECK_HANDLE();
+  return _impl->getPPtr();
+}
+
+// Keys are numbers, with -0 stored as 0, or strings.
+internal::PMKey PersistentOrderedMap::toKey(Napi::Env env,
+                                            const Napi::Value key,
+                                            std::string& holder) {
+  if (key.IsNumber()) {
+    double number = key.As<Napi::Number>().DoubleValue();
+    if (isnan(number)) throw Napi::Error::New(env, "unsupported key: NaN");
+    if (number == 0) number = 0;
+    return _pool->toKey(env, Napi::Number::New(env, number), holder);
+  }
+  if (!key.IsString()) throw Napi::Error::New(env, "unsupported key type");
+  return _pool->toKey(env, key, holder);
+}
+
+// [key, value], or undefined if not found
+Napi::Value PersistentOrderedMap::toEntry(Napi::Env env, bool found,
+                                          const internal::PMBTreeEntry& entry) {
+  if (!found) return env.Undefined();
+  Napi::Array result = Napi::Array::New(env, 2);
+  result.Set((uint32_t)0,
+             _pool->resurrect(env, std::make_shared<PPtr>(entry.first)));
+  result.Set((uint32_t)1,
+             _pool->resurrect(env, std::make_shared<PPtr>(entry.second)));
+  return result;
+}
+
+Napi::Value PersistentOrderedMap::get(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  std::string holder;
+  internal::PMKey key = toKey(env, info[0], holder);
+  try {
+    return _pool->resurrect(env, _impl->get(key));
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to get");
+  }
+}
+
+Napi::Value PersistentOrderedMap::has(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  std::string holder;
+  internal::PMKey key = toKey(env, info[0], holder);
+  try {
+    return Napi::Boolean::New(env, _impl->has(key));
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to check key");
+  }
+}
+
+Napi::Value PersistentOrderedMap::set(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
+  std::string holder;
+  internal::PMKey key = toKey(env, info[0], holder);
+  try {
+    _impl->set(key, _pool->persist(env, info[1]), kSnapshot);
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to set");
+  }
+  return Napi::Value();
+}
+
+Napi::Value PersistentOrderedMap::del(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
+  std::string holder;
+  internal::PMKey key = toKey(env, info[0], holder);
+  try {
+    return Napi::Boolean::New(env, _impl->del(key));
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to delete");
+  }
+}
+
+Napi::Value PersistentOrderedMap::clear(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(true);
+  try {
+    _impl->clear();
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to clear");
+  }
+  return Napi::Value();
+}
+
+Napi::Value PersistentOrderedMap::size(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  return Napi::Number::New(env, _impl->size());
+}
+
+// _range(lo, hi, limit, lo_exclusive) returns [key0, value0, key1, ...] for
+// the keys in [lo, hi), lo or hi may be undefined for no bound.
+Napi::Value PersistentOrderedMap::range(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  std::string lo_holder, hi_holder;
+  internal::PMKey lo, hi;
+  bool has_lo = !info[0].IsUndefined();
+  bool has_hi = !info[1].IsUndefined();
+  if (has_lo) lo = toKey(env, info[0], lo_holder);
+  if (has_hi) hi = toKey(env, info[1], hi_holder);
+  uint64_t limit = info[2].As<Napi::Number>().Int64Value();
+  bool lo_exclusive = info[3].ToBoolean().Value();
+  Napi::Array result = Napi::Array::New(env);
+  try {
+    std::vector<internal::PMBTreeEntry> entries =
+        _impl->range(has_lo ? &lo : nullptr, lo_exclusive,
+                     has_hi ? &hi : nullptr, limit);
+    uint32_t index = 0;
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+      result.Set(index++,
+                 _pool->resurrect(env, std::make_shared<PPtr>(it->first)));
+      result.Set(index++,
+                 _pool->resurrect(env, std::make_shared<PPtr>(it->second)));
+    }
+    return result;
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to get range");
+  }
+}
+
+Napi::Value PersistentOrderedMap::floor(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  std::string holder;
+  internal::PMKey key = toKey(env, info[0], holder);
+  try {
+    internal::PMBTreeEntry entry;
+    bool found = _impl->floor(key, &entry);
+    return toEntry(env, found, entry);
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to get floor");
+  }
+}
+
+Napi::Value PersistentOrderedMap::ceil(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  std::string holder;
+  internal::PMKey key = toKey(env, info[0], holder);
+  try {
+    internal::PMBTreeEntry entry;
+    bool found = _impl->ceil(key, &entry);
+    return toEntry(env, found, entry);
+  } catch (const char* errmsg) {
+    _pool->tx_abort_context(env);
+    throw Napi::Error::New(env, "failed to get ceil");
+  }
+}
+
+Napi::Value PersistentOrderedMap::first(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  try {
+    internal::PMBTreeEntry entry;
+    bool found = _impl->first(&entry);
+    return toEntry(env, found, entry);
+  } catch (const char* errmsg) {
+    throw Napi::Error::New(env, "failed to get first entry");
+  }
+}
+
+Napi::Value PersistentOrderedMap::last(const Napi::CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  LOCK_HANDLE(false);
+  try {
+    internal::PMBTreeEntry entry;
+    bool found = _impl->last(&entry);
+    return toEntry(env, found, entry);
+  } catch (const char* errmsg) {
+    throw Napi::Error::New(env, "failed to get last entry");
+  }
+}
@@ -0,0 +1,54 @@
+#ifndef PERSISTENTORDEREDMAP_H
+#define PERSISTENTORDEREDMAP_H
+
+#include <napi.h>
+#include <memory>
+#include <string>
+
+#include "internal/pmbtree.h"
+#include "persistentobjectpool.h"
+
+class PersistentOrderedMap : public Napi::ObjectWrap<PersistentOrderedMap> {
+ public:
+  static void init(Napi::Env env);
+  static Napi::Object newInstance(Napi::Env env, PersistentObjectPool* pool,
+                                  const Napi::Value value);
+  static Napi::Object newInstance(Napi::Env env, PersistentObjectPool* pool,
+                                  const void* data);
+  static bool isInstance(const Napi::Value value);
+
+ public:
+  PersistentOrderedMap(const Napi::CallbackInfo& info);
+  PersistentOrderedMap(const PersistentOrderedMap& other) = delete;
+  PersistentOrderedMap& operator=(const PersistentOrderedMap& other) = delete;
+  ~PersistentOrderedMap();
+  std::shared_ptr<const void> getPPtr(Napi::Env env);
+
+ private:
+  static thread_local Napi::FunctionReference constructor;
+
+ private:
+  internal::PMKey toKey(Napi::Env env, const Napi::Value key,
+                        std::string& holder);
+  Napi::Value toEntry(Napi::Env env, bool found,
+                      const internal::PMBTreeEntry& entry);
+
+  Napi::Value get(const Napi::CallbackInfo& info);
+  Napi::Value has(const Napi::CallbackInfo& info);
+  Napi::Value set(const Napi::CallbackInfo& info);
+  Napi::Value del(const Napi::CallbackInfo& info);
+  Napi::Value clear(const Napi::CallbackInfo& info);
+  Napi::Value size(const Napi::CallbackInfo& info);
+  Napi::Value range(const Napi::CallbackInfo& info);
+  Napi::Value floor(const Napi::CallbackInfo& info);
+  Napi::Value ceil(const Napi::CallbackInfo& info);
+  Napi::Value first(const Napi::CallbackInfo& info);
+  Napi::Value last(const Napi::CallbackInfo& info);
+
+  internal::PMBTree* _impl;
+  PersistentObjectPool* _pool;
+  // the defrag generation of the pool when the handle was made
+  uint64_t _generation;
+};
+
+#endif
@@ -14,6 +14,15 @@ enum PERSISTENT_TYPE {
   PERSISTENT_TYPE_UNDEFINED,
   PERSISTENT_TYPE_OBJECT,
   PERSISTENT_TYPE_ARRAYBUFFER,
+  PERSISTENT_TYPE_MAP,
+  PERSISTENT_TYPE_DEQUE,
+  PERSISTENT_TYPE_BTREE,
+  PERSISTENT_TYPE_INDEX,
+  PERSISTENT_TYPE_DATE,
+  // data -> int64_t
+  PERSISTENT_TYPE_BIGINT64,
+  // data -> PBigIntObject
+  PERSISTENT_TYPE_BIGINT,
   PERSISTENT_TYPE_UNSUPPORTED
 };
 
@@ -31,4 +40,25 @@ struct PERSISTENT_VALUE {
 #define ASSERT_NOT_EXCEPTION_PENDING(cond) \
   {}
 
+// Holds the lock of the pool for the rest of the scope, exclusively for
+// writes, which join the open group if group commit is on. Needs env.
+#define LOCK_POOL(pool, exclusive)                                      \
+  internal::PoolLock pool_lock((pool)->getMemoryManager(), exclusive); \
+  if (!pool_lock.held()) {                                              \
+    throw Napi::Error::New(env, "failed to lock pool");                 \
+  }                                                                     \
+  if (exclusive) (pool)->joinGroup(env);
+
+// Throws if defrag() has run since the handle was made, the objects it points
+// to may have moved. Needs env, _pool and _generation.
+#define CHECK_HANDLE()                                          \
+  if (_generation != _pool->generation()) {                     \
+    throw Napi::Error::New(env, "stale handle, read it again"); \
+  }
+
+// LOCK_POOL for the bindings of a handle of a persistent object
+#define LOCK_HANDLE(exclusive) \
+  LOCK_POOL(_pool, exclusive)  \
+  CHECK_HANDLE()
+
 #endif
\ No newline at end of file
@@ -31,6 +31,522 @@ describe('persistent object', () => {
     assert(pobj[0] == 'abc');
   });
 
+  it('should keep remaining properties after deleting most keys', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    var pobj = pool.create_object({});
+    for (var i = 0; i < 100; ++i) pobj['k' + i] = i;
+    for (var i = 0; i < 100; ++i) {
+      if (i % 10 != 0) delete pobj['k' + i];
+    }
+    for (var i = 0; i < 100; ++i) {
+      assert(pobj['k' + i] == ((i % 10 == 0) ? i : undefined));
+    }
+    assert(Object.getOwnPropertyNames(pobj).length == 10);
+    pool.close();
+  });
+
+  // Every set and delete moves only a few slots of a resized key table, the
+  // stride keeps the indexes of numdict sparse enough to stay a dictionary.
+  it('should grow and shrink dictionaries across several resizes', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    pool.root = {dict: {}, numdict: []};
+    var dict = pool.root.dict;
+    var numdict = pool.root.numdict;
+    for (var i = 0; i < 3000; ++i) {
+      dict['k' + i] = i;
+      numdict[i * 2048] = i;
+      assert(dict['k' + (i >> 1)] == i >> 1);
+      assert(numdict[(i >> 1) * 2048] == i >> 1);
+    }
+    for (var i = 0; i < 3000; ++i) {
+      if (i % 100 == 0) continue;
+      delete dict['k' + i];
+      delete numdict[i * 2048];
+      assert(dict['k' + (i - i % 100)] == i - i % 100);
+      assert(numdict[(i - i % 100) * 2048] == i - i % 100);
+    }
+    for (var i = 0; i < 3000; ++i) {
+      assert(dict['k' + i] == ((i % 100 == 0) ? i : undefined));
+      assert(numdict[i * 2048] == ((i % 100 == 0) ? i : undefined));
+    }
+    assert(Object.getOwnPropertyNames(dict).length == 30);
+    pool.close();
+  });
 
+  it('should list and delete keys while a dictionary resize migrates', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    var pobj = pool.create_object({});
+    var expected = new Set();
+    for (var i = 0; i < 1200; ++i) {
+      pobj['k' + i] = i;
+      expected.add('k' + i);
+      if (i % 3 == 0 && i >= 2) {
+        delete pobj['k' + (i - 2)];
+        expected.delete('k' + (i - 2));
+      }
+      if (i % 5 == 0) {
+        var names = Object.getOwnPropertyNames(pobj);
+        assert(names.length == expected.size);
+        for (var name of names) assert(expected.has(name));
+      }
+    }
+    for (var i = 0; i < 1200; ++i) {
+      assert(pobj['k' + i] == (expected.has('k' + i) ? i : undefined));
+    }
+    pool.close();
+  });
 
+  it('should not find keys deleted while a dictionary resize migrates', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    var pobj = pool.create_object({});
+    for (var i = 0; i < 600; ++i) pobj['k' + i] = 'v' + i;
+    for (var i = 0; i < 600; ++i) {
+      delete pobj['k' + i];
+      assert(pobj['k' + i] === undefined);
+      assert(!Object.prototype.hasOwnProperty.call(pobj, 'k' + i));
+    }
+    assert(Object.getOwnPropertyNames(pobj).length == 0);
+    pool.close();
+  });
+
+  it('should keep the keys of a migrating dictionary across gc()', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    pool.root = {dict: {}, numdict: []};
+    var dict = pool.root.dict;
+    var numdict = pool.root.numdict;
+    for (var i = 0; i < 2000; ++i) {
+      dict['k' + i] = 'v' + i;
+      numdict[i * 2048] = 'v' + i;
+      if (i % 101 == 0) pool.gc();
+    }
+    for (var i = 0; i < 2000; i += 2) {
+      delete dict['k' + i];
+      delete numdict[i * 2048];
+      if (i % 101 == 0) pool.gc();
+    }
+    pool.gc();
+    for (var i = 0; i < 2000; ++i) {
+      assert(dict['k' + i] === ((i % 2) ? 'v' + i : undefined));
+      assert(numdict[i * 2048] === ((i % 2) ? 'v' + i : undefined));
+    }
+    pool.close();
+  });
+
+  it('should keep every key of a dictionary reopened mid-migration', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    pool.root = {dict: {}, numdict: []};
+    for (var i = 0; i < 1500; ++i) {
+      pool.root.dict['k' + i] = 'v' + i;
+      pool.root.numdict[i * 2048] = 'v' + i;
+      if (i % 50 != 0) continue;
+      pool.close();
+      pool.open();
+      var dict = pool.root.dict;
+      var numdict = pool.root.numdict;
+      for (var j = 0; j <= i; ++j) {
+        assert(dict['k' + j] === 'v' + j);
+        assert(numdict[j * 2048] === 'v' + j);
+      }
+      assert(Object.getOwnPropertyNames(dict).length == i + 1);
+    }
+    pool.close();
+  });
+
+  it('should push and pop across array chunk boundaries', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    var parr = pool.create_object([]);
+    for (var i = 0; i < 2000; ++i) parr.push(i);
+    assert(parr.length == 2000);
+    for (var i = 1999; i >= 300; --i) assert(parr.pop() == i);
+    assert(parr.length == 300);
+    parr.length = 100;
+    parr.push(-1);
+    for (var i = 0; i < 100; ++i) assert(parr[i] == i);
+    assert(parr[100] == -1);
+    pool.close();
+  });
+
+  it('should keep the items of a sparse array that becomes dense again',
+     () => {
+       var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+       pool.create();
+       pool.root = {sparse: []};
+       var sparse = pool.root.sparse;
+       // far past the end, the items move to a dictionary
+       sparse[5000] = 'last';
+       // filled back, they move to chunks again
+       for (var i = 0; i < 5000; ++i) sparse[i] = 's' + i;
+       pool.close();
+       pool.open();
+       sparse = pool.root.sparse;
+       assert(sparse.length == 5001 && sparse[5000] === 'last');
+       for (var i = 0; i < 5000; ++i) assert(sparse[i] === 's' + i);
+       pool.close();
+     });
+
+  it('should create a persistent typed array through pool.create_typed_array()',
+     () => {
+       var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+       pool.create();
+       var ta = pool.create_typed_array(Float64Array, 100);
+       assert(ta instanceof Float64Array && ta.length == 100);
+       for (var i = 0; i < 100; ++i) ta[i] = i;
+       ta.persist();
+       assert(ta.sum() == 4950);
+       assert(ta.min(10) == 10 && ta.max(0, -1) == 98);
+       assert(ta.mean(0, 4) == 1.5);
+       assert(ta.dot(ta, 0, 3) == 5);
+       ta.fill(1, 50).copyWithin(0, 90);
+       assert(ta[0] == 1 && ta[10] == 10 && ta.sum(50) == 50);
+       pool.root = {series: ta};
+       pool.close();
+       pool.open();
+       var series = pool.root.series;
+       assert(series instanceof Float64Array && series[10] == 10);
+       pool.close();
+     });
+
+  it('should store Map and Set in the pool', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    var pmap = pool.create_map([['a', 1], [2, 'b']]);
+    pmap.set(-0, {c: 3}).set(NaN, null).set('', true);
+    assert(pmap.size == 5 && pmap.get(0).c == 3 && pmap.get(NaN) === null);
+    assert(pmap.has('') && !pmap.has('2') && pmap.get('x') === undefined);
+    assert(pmap.delete('a') && !pmap.delete('a'));
+    for (var i = 0; i < 100; ++i) pmap.set('k' + i, i);
+    for (var i = 0; i < 100; i += 2) pmap.delete('k' + i);
+    assert(pmap.size == 54);
+    pool.root = {map: pmap, set: new Set([1, 'one', 1])};
+    pool.gc();
+    pool.close();
+    pool.open();
+    var keys = Array.from(pool.root.map.keys());
+    assert(keys.length == 54 && keys[0] == 2 && keys[53] == 'k99');
+    assert(pool.root.map.get(0).c == 3);
+    var pset = pool.root.set;
+    assert(pset.size == 2 && pset.has('one') && !pset.has(2));
+    pset.add(2);
+    assert(Array.from(pset).join() == '1,one,2');
+    pool.close();
+  });
+
+  it('should store Date and BigInt values', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    var date = new Date(2020, 1, 29);
+    var big = -(2n ** 100n) + 7n;
+    pool.root = {date: date, small: -5n, min: -(2n ** 63n), big: big};
+    pool.close();
+    pool.open();
+    var root = pool.root;
+    assert(root.date instanceof Date && root.date.getTime() == date.getTime());
+    assert(root.small === -5n && root.min === -(2n ** 63n));
+    assert(root.big === big);
+    pool.gc();
+    assert(pool.root.big === big);
+    pool.close();
+  });
+
+  it('should push, pop, shift and unshift a persistent deque', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    var pdq = pool.create_deque([1, 2]);
+    assert(pdq.unshift(-1, 0) == 4 && pdq.push(3) == 5);
+    assert(pdq.peek_front() == -1 && pdq.peek_back() == 3 && pdq.at(-2) == 2);
+    assert(pdq.shift() == -1 && pdq.pop() == 3);
+    for (var i = 0; i < 300; ++i) {
+      pdq.push(i);
+      pdq.unshift({i: i});
+    }
+    for (var i = 0; i < 100; ++i) assert(pdq.shift().i == 299 - i);
+    assert(pdq.length == 503);
+    pool.root = {jobs: pdq};
+    pool.gc();
+    pool.close();
+    pool.open();
+    var jobs = pool.root.jobs;
+    assert(jobs.length == 503 && jobs.peek_front().i == 199);
+    assert(jobs.at(200) == 0 && jobs.pop() == 299);
+    assert(Array.from(jobs).length == 502);
+    jobs.clear();
+    assert(jobs.length == 0 && jobs.pop() === undefined);
+    pool.close();
+  });
+
+  it('should keep the keys of a persistent ordered map in order', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    var events = pool.create_ordered_map([['b', 1], [3, 'c']]);
+    for (var i = 999; i >= 0; --i) events.set(i * 2, {t: i * 2});
+    for (var i = 0; i < 500; ++i) events.delete(i * 4);
+    events.set('a', 2).set(-0, 'zero');
+    assert(events.size == 504 && events.get(0) == 'zero');
+    assert.deepEqual(events.range(5, 14).map((e) => e[0]), [6, 10]);
+    assert(events.floor(9)[0] == 6 && events.ceil(1995)[1].t == 1998);
+    assert(events.first()[0] == 0 && events.last()[0] == 'b');
+    pool.root = {events: events};
+    pool.gc();
+    pool.close();
+    pool.open();
+    var keys = Array.from(pool.root.events.keys());
+    assert(keys.length == 504 && keys[1] == 2 && keys[2] == 3);
+    assert.deepEqual(keys.slice(-3), [1998, 'a', 'b']);
+    // strings come after all numbers
+    assert(pool.root.events.ceil(1999)[0] == 'a');
+    pool.close();
+  });
+
+  it('should shrink an ordered map back to a single node', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    var pmap = pool.create_ordered_map();
+    for (var i = 0; i < 3000; ++i) pmap.set(i, 'v' + i);
+    // empty the leaves from both ends towards the middle
+    var size = 3000;
+    for (var i = 0; i < 3000; ++i) {
+      var key = (i % 2) ? 2999 - (i >> 1) : (i >> 1);
+      if (key % 1000 == 500) continue;
+      assert(pmap.delete(key) && pmap.size == --size);
+      if (i % 97 == 0) assert(pmap.first()[0] == Math.min((i >> 1) + 1, 500));
+    }
+    assert.deepEqual(Array.from(pmap.keys()), [500, 1500, 2500]);
+    pool.root = {pmap: pmap};
+    pool.gc();
+    pool.close();
+    pool.open();
+    pmap = pool.root.pmap;
+    assert.deepEqual(Array.from(pmap.keys()), [500, 1500, 2500]);
+    assert(pmap.floor(1499)[1] == 'v500' && pmap.ceil(1501)[1] == 'v2500');
+    // the last leaf left becomes the root again
+    assert(pmap.delete(500) && pmap.delete(2500));
+    pmap.set(1, 'one');
+    pool.close();
+    pool.open();
+    pmap = pool.root.pmap;
+    assert.deepEqual(Array.from(pmap.keys()), [1, 1500]);
+    assert(pmap.first()[1] == 'one' && pmap.last()[1] == 'v1500');
+    pool.close();
+  });
+
+  it('should write through a pmem-backed ArrayBuffer and detach it on close',
+     () => {
+       var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+       pool.create();
+       var pab = pool.create_arraybuffer(64);
+       assert(pab instanceof ArrayBuffer && pab.byteLength == 64);
+       new Uint8Array(pab)[3] = 7;
+       pab.persist(3, 1);
+       pool.root = {pab: pab};
+       assert(new Uint8Array(pool.root.pab)[3] == 7);
+       pool.close();
+       assert(pab.byteLength == 0);
+       pool.open();
+       assert(new Uint8Array(pool.root.pab)[3] == 7);
+       pool.close();
+     });
+
+  it('should copy ArrayBuffers into the pool and persist several ranges',
+     () => {
+       var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+       pool.create();
+       // outside a transaction, the copy is made with non-temporal stores
+       var buffer = new ArrayBuffer(100000);
+       var bytes = new Uint8Array(buffer);
+       for (var i = 0; i < bytes.length; ++i) bytes[i] = i % 251;
+       var pab = pool.create_arraybuffer(buffer);
+       var ta = pool.create_typed_array(Int32Array, 1000);
+       assert(pab.byteLength == 100000 && ta.every((x) => x == 0));
+       var pbytes = new Uint8Array(pab);
+       pbytes[0] = 255;
+       pbytes[50000] = 255;
+       pab.persist_ranges([[0, 1], [50000, 16]]);
+       ta[1] = 1;
+       ta[999] = 999;
+       ta.persist_ranges([[0, 2], [-1]]);
+       pool.root = {pab: pab, ta: ta};
+       pool.close();
+       pool.open();
+       pbytes = new Uint8Array(pool.root.pab);
+       for (var i = 0; i < bytes.length; ++i) {
+         var expected = (i == 0 || i == 50000) ? 255 : i % 251;
+         assert(pbytes[i] == expected);
+       }
+       ta = pool.root.ta;
+       assert(ta[1] == 1 && ta[999] == 999 && ta.sum() == 1000);
+       pool.close();
+     });
+
+  it('should run Array methods natively on a persistent array', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    pool.root = [5, 'b', 1, undefined, 'a', 10];
+    var parr = pool.root;
+    assert(parr.indexOf('a') == 4 && parr.indexOf(7) == -1);
+    assert(parr.includes(undefined) && !parr.includes({}));
+    parr.sort();
+    assert.deepEqual(parr.slice(), [1, 10, 5, 'a', 'b', undefined]);
+    assert.deepEqual(parr.splice(1, 2, 'x', 'y', 'z'), [10, 5]);
+    assert(parr.length == 7 && parr[3] == 'z' && parr[4] == 'a');
+    parr.length = 4;
+    parr.sort((a, b) => String(b).localeCompare(String(a))).reverse();
+    assert.deepEqual(parr.slice(-3), ['x', 'y', 'z']);
+    parr.fill(0, 1);
+    assert.deepEqual(parr.concat([2], 3), [1, 0, 0, 0, 2, 3]);
+    pool.close();
+  });
+
+  it('should keep secondary indexes in sync with a persistent array', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    pool.root = {users: [{id: 1, city: 'a'}, {id: 2, city: 'b'}]};
+    var users = pool.root.users;
+    var by_id = pool.create_index(users, 'id', {unique: true, ordered: true});
+    var by_city = pool.create_index(users, 'city');
+    users.push({id: 3, city: 'a'}, {id: 4, city: 'c'});
+    assert(pool.lookup(by_id, 3)[0].city == 'a');
+    assert.deepEqual(by_city.lookup('a').map((u) => u.id).sort(), [1, 3]);
+    assert.throws(() => users.push({id: 2}));
+    assert(users.length == 4 && by_id.lookup(2).length == 1);
+    users.splice(0, 1);
+    users[0].city = 'c';
+    users[0] = users[0];
+    assert(by_id.lookup(1).length == 0 && by_city.lookup('b').length == 0);
+    assert.deepEqual(by_id.range(2, 4).map((u) => u.id), [2, 3]);
+    pool.gc();
+    pool.close();
+    pool.open();
+    users = pool.root.users;
+    users.pop();
+    by_city = pool.create_index(users, 'city');
+    assert.deepEqual(by_city.lookup('c').map((u) => u.id), [2]);
+    pool.drop_index(by_city);
+    users.push({id: 5, city: 'c'});
+    assert(by_city.lookup('c').length == 1);
+    pool.close();
+  });
+
+  it('should publish objects built outside a transaction when linked', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    pool.root = {list: [], queue: pool.create_deque()};
+    for (var i = 0; i < 100; ++i) {
+      pool.root.list.push({id: i, tags: ['a', 'b'], meta: {n: 'x' + i}});
+    }
+    pool.root.queue.push({id: 100});
+    assert.throws(() => pool.root.list.push({f: function() {}}));
+    pool.root.list.push({id: 101});
+    pool.gc();
+    pool.close();
+    pool.open();
+    var list = pool.root.list;
+    assert(list.length == 101 && list[99].meta.n == 'x99');
+    assert(list[100].id == 101 && pool.root.queue.shift().id == 100);
+    pool.close();
+  });
+
+  it('should move properties between the object and its overflow', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    pool.root = {records: [{a: 1, b: 'x'}, {}]};
+    var small = pool.root.records[0];
+    for (var i = 0; i < 8; ++i) small['k' + i] = i;
+    delete small.a;
+    delete small.k6;
+    small.c = 'y';
+    small.b = 'z';
+    var expected = {b: 'z', c: 'y'};
+    [0, 1, 2, 3, 4, 5, 7].forEach((i) => expected['k' + i] = i);
+    pool.gc();
+    pool.close();
+    pool.open();
+    small = pool.root.records[0];
+    assert.deepEqual(Object.keys(small).sort(), Object.keys(expected).sort());
+    for (var key in expected) assert(small[key] === expected[key]);
+    var empty = pool.root.records[1];
+    assert(Object.keys(empty).length == 0 && empty.a === undefined);
+    pool.close();
+  });
+
+  it('should reduce number arrays and convert them on other items', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    pool.root = {nums: [], mixed: [1, 2]};
+    var nums = pool.root.nums;
+    for (var i = 0; i < 1000; ++i) nums.push(i % 7 - 3 + 0.5);
+    nums.splice(10, 0, -0, 100);
+    assert(nums.sum() == 597 && nums.max() == 100);
+    assert(nums.min(5, 8) == -2.5 && nums.sum(0, 0) == 0);
+    nums[5] = NaN;
+    assert(Number.isNaN(nums.min()) && Number.isNaN(nums[5]));
+    var mixed = pool.root.mixed;
+    mixed[4] = 3;
+    assert(mixed.length == 5 && !(2 in mixed));
+    assert.throws(() => mixed.sum());
+    mixed.push('x');
+    pool.gc();
+    pool.close();
+    pool.open();
+    assert(pool.root.nums.length == 1002 && pool.root.nums[11] === 100);
+    assert.deepEqual(pool.root.mixed.slice(3), [undefined, 3, 'x']);
+    pool.close();
+  });
+
+  it('should clone objects and arrays shallow and deep', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    pool.root = {doc: {s: 'x', nums: [1.5, 2], child: {a: 1}}};
+    var doc = pool.root.doc;
+    doc.self = doc;
+    doc.twice = [doc.child, doc.child];
+    pool.root.shallow = pool.clone(doc);
+    pool.root.deep = pool.clone(doc, {deep: true});
+    pool.root.shallow.child.b = 2;
+    assert(doc.child.b === 2);
+    var deep = pool.root.deep;
+    deep.child.a = 3;
+    deep.nums.push(4);
+    delete deep.s;
+    assert(doc.child.a === 1 && doc.nums.length == 2 && doc.s === 'x');
+    deep.twice[1].c = 4;
+    deep.self.mark = 5;
+    assert(deep.twice[0].c === 4 && deep.mark === 5 && doc.mark === undefined);
+    doc.map = new Map();
+    assert.throws(() => pool.clone(doc, {deep: true}));
+    pool.gc();
+    pool.close();
+    pool.open();
+    deep = pool.root.deep;
+    assert(deep.child.a === 3 && deep.nums.sum() == 7.5);
+    assert(deep.s === undefined && deep.self.mark === 5);
+    assert(pool.root.doc.child.a === 1 && pool.root.shallow.s === 'x');
+    pool.close();
+  });
+
+  it('should keep the children of a shallow clone deleted from it', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    // the first child is an inline property, the last one is past them
+    pool.root = {
+      doc: {first: {a: 1}, b: 2, c: 3, d: 4, e: 5, last: [1, 2]}
+    };
+    var doc = pool.root.doc;
+    var copy = pool.clone(doc);
+    delete copy.first;
+    delete copy.last;
+    pool.root.copy = copy;
+    // what a freed child left would be taken by these
+    pool.root.junk = Array.from({length: 100}, (_, i) => ({a: -i}));
+    assert(doc.first.a === 1 && doc.last[1] === 2);
+    pool.gc();
+    assert(doc.first.a === 1 && doc.last.length == 2);
+    pool.close();
+  });
 });
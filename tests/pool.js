@@ -1,4 +1,5 @@
 const assert = require('assert');
+const {Worker} = require('worker_threads');
 const common = require('./common');
 const jspmdk = require('../src/jspmdk');
 const constants = jspmdk.constants;
@@ -146,6 +147,41 @@ describe('pool object', () => {
     }
   });
 
+  it('should apply the pool options and ctl entries', function() {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create({prefault: true, tx_cache_size: 1 << 20, stats: true});
+    assert(pool.ctl_get('tx.cache.size') == 1 << 20);
+    assert(pool.ctl_get('stats.enabled') == constants.STATS_ENABLED_TRANSIENT);
+    var allocated = pool.ctl_get('stats.heap.curr_allocated');
+    pool.root = {a: 'a'.repeat(1024)};
+    assert(pool.ctl_get('stats.heap.curr_allocated') > allocated);
+    pool.ctl_set('tx.cache.size', 1 << 16);
+    assert(pool.ctl_get('tx.cache.size') == 1 << 16);
+    assert.throws(() => pool.ctl_get('tx.unknown'), /unsupported ctl/);
+    assert.throws(() => pool.ctl_set('stats.heap.curr_allocated', 0));
+    pool.close();
+    // the options are not stored in the pool
+    pool.open({stats: false});
+    assert(pool.ctl_get('stats.enabled') == constants.STATS_DISABLED);
+    pool.close();
+  });
+
+  it('should allocate empty objects from exact allocation classes', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    pool.close();
+    var bytes = (alloc_classes) => {
+      pool.open({stats: true, alloc_classes: alloc_classes});
+      var before = pool.ctl_get('stats.heap.curr_allocated');
+      pool.root = Array.from({length: 100}, () => ({}));
+      var used = pool.ctl_get('stats.heap.curr_allocated') - before;
+      pool.root = undefined;
+      pool.close();
+      return used;
+    };
+    assert(bytes(true) < bytes(false));
+  });
+
 });
 
 describe('transaction', () => {
@@ -195,6 +231,227 @@ describe('transaction', () => {
     assert(pool.root == undefined);
   });
 
+  it('should roll back nested transactions together on throw', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    pool.root = {items: [1, 2]};
+    assert.throws(() => pool.transaction(() => {
+      pool.root.items.push(3);
+      pool.transaction(() => {
+        pool.root.items[0] = 0;
+        throw new Error('stop');
+      });
+    }), /stop/);
+    assert(pool.tx_stage() == constants.TX_STAGE_NONE);
+    assert.deepEqual(pool.root.items.slice(), [1, 2]);
+    pool.transaction(() => {
+      pool.transaction(() => pool.root.items.push(3));
+    });
+    assert(pool.root.items.length == 3);
+    pool.close();
+  });
+
+  it('should share an open pool with worker threads', async () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    pool.root = {items: [1, 2, 3], done: 0};
+    var source = `
+      const {parentPort, workerData} = require('worker_threads');
+      const jspmdk = require(workerData.module);
+      var pool = jspmdk.new_pool(workerData.path, 0);
+      pool.open();
+      var sum = pool.root.items.reduce((a, b) => a + b, 0);
+      pool.transaction(() => {
+        pool.root.items.push(sum);
+        pool.root.done += 1;
+      });
+      pool.close();
+      parentPort.postMessage(sum);`;
+    var workers = [0, 1].map(() => new Promise((resolve, reject) => {
+      var worker = new Worker(source, {
+        eval: true,
+        workerData: {module: require.resolve('../src/jspmdk'), path: valid_path}
+      });
+      worker.on('message', resolve);
+      worker.on('error', reject);
+    }));
+    var sums = await Promise.all(workers);
+    assert(pool.root.done == 2 && pool.root.items.length == 5);
+    assert(sums.every((sum) => sum == 6 || sum == 12));
+    pool.close();
+  });
+
+  it('should give each thread opening the pool an arena', async () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    var stats = pool.arena_stats();
+    assert(stats.arena > 0 && stats.arenas.length >= stats.arena);
+    var source = `
+      const {parentPort, workerData} = require('worker_threads');
+      const jspmdk = require(workerData.module);
+      var pool = jspmdk.new_pool(workerData.path, 0);
+      pool.open();
+      pool.create_object({a: 1});
+      parentPort.postMessage(pool.arena_stats());
+      pool.close();`;
+    // resolves with the stats once the worker has closed the pool
+    var runWorker = () => new Promise((resolve, reject) => {
+      var worker = new Worker(source, {
+        eval: true,
+        workerData: {module: require.resolve('../src/jspmdk'), path: valid_path}
+      });
+      var worker_stats;
+      worker.on('message', (message) => worker_stats = message);
+      worker.on('error', reject);
+      worker.on('exit', () => resolve(worker_stats));
+    });
+    var worker_stats = await runWorker();
+    assert(worker_stats.arena > 0 && worker_stats.arena != stats.arena);
+    assert(worker_stats.arenas[worker_stats.arena - 1].size > 0);
+    // the first worker closed the pool, its arena goes to the next one
+    var next_stats = await runWorker();
+    assert(next_stats.arena == worker_stats.arena);
+    assert(next_stats.arenas.length == worker_stats.arenas.length);
+    pool.close();
+  });
+
+  it('should apply a batch of mutations in a transaction on a worker',
+     async () => {
+       var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+       pool.create();
+       pool.root = {records: [], count: 0, stale: true};
+       var records = pool.root.records;
+       var mutations = [];
+       for (var i = 0; i < 100; ++i) {
+         var record = {id: i, name: 'record' + i, tags: [i]};
+         mutations.push({op: 'push', target: records, value: record});
+       }
+       mutations.push({op: 'set', target: pool.root, key: 'count', value: 100});
+       mutations.push({op: 'del', target: pool.root, key: 'stale'});
+       var done = pool.transaction_async(mutations);
+       assert.throws(() => pool.close(), /pending/);
+       await done;
+       assert(records.length == 100 && pool.root.count == 100);
+       assert(pool.root.stale === undefined);
+       assert.deepEqual(records[42].tags.slice(), [42]);
+       assert(records[99].name == 'record99');
+       // a batch with an unsupported value is rejected as a whole
+       await assert.rejects(pool.transaction_async([
+         {op: 'set', target: pool.root, key: 'count', value: 0},
+         {op: 'set', target: pool.root, key: 'bad', value: new Map()},
+       ]));
+       assert(pool.root.count == 100);
+       // the worker would wait for the transaction of the caller
+       pool.tx_begin();
+       await assert.rejects(pool.transaction_async([
+         {op: 'set', target: pool.root, key: 'count', value: 0},
+       ]), /inside a transaction/);
+       pool.tx_end();
+       assert(pool.root.count == 100);
+       pool.close();
+     });
+
+  it('should group the writes outside a transaction', async () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    pool.root = {a: 0, b: 0};
+    pool.group_commit({operations: 3});
+    pool.root.a = 1;
+    assert(pool.tx_stage() == constants.TX_STAGE_WORK);
+    pool.root.b = 1;
+    pool.flush();
+    assert(pool.tx_stage() == constants.TX_STAGE_NONE);
+    // an unsupported value fails alone, the group keeps the earlier writes
+    pool.root.a = 5;
+    assert.throws(() => {
+      pool.root.c = {nested: () => 1};
+    }, /unsupported type/);
+    assert(pool.tx_stage() == constants.TX_STAGE_WORK);
+    pool.flush();
+    assert(pool.root.a == 5 && pool.root.c === undefined);
+    assert.throws(() => pool.group_commit({delay: 5000}), /invalid delay/);
+    // committed at the end of the turn
+    pool.root.a = 2;
+    await new Promise((resolve) => setImmediate(resolve));
+    assert(pool.tx_stage() == constants.TX_STAGE_NONE);
+    // a transaction commits the open group before it begins
+    pool.root.b = 2;
+    assert.throws(() => pool.transaction(() => {
+      pool.root.a = 3;
+      throw new Error('stop');
+    }), /stop/);
+    assert(pool.root.a == 2 && pool.root.b == 2);
+    pool.group_commit(false);
+    pool.root.a = 4;
+    assert(pool.tx_stage() == constants.TX_STAGE_NONE);
+    pool.close();
+    pool.open();
+    assert(pool.root.a == 4 && pool.root.b == 2);
+    pool.close();
+  });
+
+  it('should defrag the pool in slices and keep every reference', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create({stats: true});
+    pool.root = {records: [], names: new Map()};
+    var records = pool.root.records;
+    for (var i = 0; i < 6000; ++i) {
+      records.push({id: i, name: 'r' + i});
+      pool.create_object({junk: 'x'.repeat(i % 50)});
+    }
+    pool.create_index(records, 'id', {unique: true});
+    pool.root.names.set('last', records[5999]);
+    pool.root.pab = pool.create_arraybuffer(64);
+    var view = new Uint8Array(pool.root.pab);
+    assert.throws(() => pool.transaction(() => pool.defrag()), /transaction/);
+    var report, calls = 0;
+    do {
+      report = pool.defrag({budget: 1});
+      ++calls;
+    } while (!report.done);
+    assert(calls > 1 && report.fragmentation_after >= 0);
+    // the handles read before point to where the objects used to be
+    assert.throws(() => records.length, /stale/);
+    assert.throws(() => pool.root.names.set('first', records), /stale/);
+    records = pool.root.records;
+    assert(records.length == 6000 && records[4321].name === 'r4321');
+    assert(pool.root.names.get('last').id === 5999);
+    // the ArrayBuffers stay in place, with the views over them
+    view[3] = 7;
+    assert(new Uint8Array(pool.root.pab)[3] == 7);
+    // the existing index, read again like the records
+    var index = pool.create_index(records, 'id', {unique: true});
+    records.pop();
+    assert(pool.lookup(index, 5999).length == 0);
+    assert(pool.lookup(index, 42)[0].name === 'r42');
+    pool.close();
+    pool.open();
+    assert(pool.root.records[5998].name === 'r5998');
+    pool.close();
+  });
+
+  it('should see the stores made between two defrag calls', () => {
+    var pool = jspmdk.new_pool(valid_path, constants.MIN_POOL_SIZE);
+    pool.create();
+    pool.root = {records: []};
+    var records = pool.root.records;
+    for (var i = 0; i < 1000; ++i) {
+      records.push({id: i});
+      pool.create_object({junk: i});
+    }
+    // the gc(), then the search of the references, one step per call
+    pool.defrag({budget: 1e-6});
+    pool.defrag({budget: 1e-6});
+    // outside a transaction, a store of an object over another one
+    records = pool.root.records;
+    records[0] = records[1];
+    while (!pool.defrag({budget: 1e-6}).done);
+    records = pool.root.records;
+    assert(records[0].id === 1 && records[1].id === 1);
+    assert(records[999].id === 999);
+    pool.close();
+  });
+
 });
 
 // TODO: test GC
\ No newline at end of file